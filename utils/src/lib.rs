@@ -1 +1,3 @@
+pub mod metrics;
+pub mod sharded_map;
 pub mod state_flow;
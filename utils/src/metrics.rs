@@ -0,0 +1,253 @@
+use std::{
+  collections::BTreeMap,
+  fmt::Write,
+  sync::{atomic::{AtomicU64, Ordering}, Arc, Mutex, OnceLock},
+  time::Duration
+};
+
+/// Buckets for per-packet processing times, from 1 µs to 10 ms.
+pub const PROCESSING_BUCKETS: &[Duration] = &[
+  Duration::from_micros(1),
+  Duration::from_micros(5),
+  Duration::from_micros(10),
+  Duration::from_micros(25),
+  Duration::from_micros(50),
+  Duration::from_micros(100),
+  Duration::from_micros(250),
+  Duration::from_micros(500),
+  Duration::from_millis(1),
+  Duration::from_millis(2),
+  Duration::from_millis(5),
+  Duration::from_millis(10)
+];
+
+/// Buckets for network and I/O waits, from 1 ms to 10 s.
+pub const IO_BUCKETS: &[Duration] = &[
+  Duration::from_millis(1),
+  Duration::from_millis(5),
+  Duration::from_millis(10),
+  Duration::from_millis(25),
+  Duration::from_millis(50),
+  Duration::from_millis(100),
+  Duration::from_millis(250),
+  Duration::from_millis(500),
+  Duration::from_secs(1),
+  Duration::from_secs(2),
+  Duration::from_secs(5),
+  Duration::from_secs(10)
+];
+
+#[derive(Debug, Default)]
+pub struct Counter {
+  value: AtomicU64
+}
+
+impl Counter {
+  pub fn inc(&self) {
+    self.add(1);
+  }
+
+  pub fn add(&self, value: u64) {
+    self.value.fetch_add(value, Ordering::Relaxed);
+  }
+
+  pub fn get(&self) -> u64 {
+    self.value.load(Ordering::Relaxed)
+  }
+}
+
+#[derive(Debug, Default)]
+pub struct Gauge {
+  bits: AtomicU64
+}
+
+impl Gauge {
+  pub fn set(&self, value: f64) {
+    self.bits.store(value.to_bits(), Ordering::Relaxed);
+  }
+
+  pub fn get(&self) -> f64 {
+    f64::from_bits(self.bits.load(Ordering::Relaxed))
+  }
+}
+
+/// Histogram of durations, exported in seconds.
+#[derive(Debug)]
+pub struct Histogram {
+  bounds: &'static [Duration],
+  /// One more than `bounds`, the last bucket is unbounded.
+  buckets: Box<[AtomicU64]>,
+  sum_ns: AtomicU64,
+  count: AtomicU64
+}
+
+impl Histogram {
+  pub fn new(bounds: &'static [Duration]) -> Self {
+    Self {
+      bounds,
+      buckets: (0..=bounds.len()).map(|_| AtomicU64::new(0)).collect(),
+      sum_ns: AtomicU64::new(0),
+      count: AtomicU64::new(0)
+    }
+  }
+
+  pub fn observe(&self, value: Duration) {
+    let bucket = self.bounds.partition_point(|&bound| bound < value);
+    self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+    self.sum_ns.fetch_add(value.as_nanos() as u64, Ordering::Relaxed);
+    self.count.fetch_add(1, Ordering::Relaxed);
+  }
+
+  pub fn count(&self) -> u64 {
+    self.count.load(Ordering::Relaxed)
+  }
+
+  pub fn sum(&self) -> Duration {
+    Duration::from_nanos(self.sum_ns.load(Ordering::Relaxed))
+  }
+
+  /// Returns the upper bound of the bucket containing quantile `q`, `None` for the unbounded bucket.
+  pub fn quantile(&self, q: f64) -> Option<Duration> {
+    let target = (self.count() as f64 * q).ceil() as u64;
+    let mut seen = 0;
+    for (index, bucket) in self.buckets.iter().enumerate() {
+      seen += bucket.load(Ordering::Relaxed);
+      if seen >= target.max(1) {
+        return self.bounds.get(index).copied();
+      }
+    }
+    None
+  }
+}
+
+#[derive(Debug, Clone)]
+enum Metric {
+  Counter(Arc<Counter>),
+  Gauge(Arc<Gauge>),
+  Histogram(Arc<Histogram>)
+}
+
+impl Metric {
+  fn kind(&self) -> &'static str {
+    match self {
+      Metric::Counter(_) => "counter",
+      Metric::Gauge(_) => "gauge",
+      Metric::Histogram(_) => "histogram"
+    }
+  }
+}
+
+type Labels = Vec<(&'static str, String)>;
+
+struct Family {
+  help: &'static str,
+  series: Vec<(Labels, Metric)>
+}
+
+/// Process-wide set of metrics, exported in the Prometheus text format.
+///
+/// Handles are created once per stage (or per connection) and updated with plain atomics,
+/// the registry is only locked to create handles and to export.
+#[derive(Default)]
+pub struct Registry {
+  families: Mutex<BTreeMap<&'static str, Family>>
+}
+
+impl Registry {
+  pub fn global() -> &'static Registry {
+    static REGISTRY: OnceLock<Registry> = OnceLock::new();
+    REGISTRY.get_or_init(Default::default)
+  }
+
+  pub fn counter(&self, name: &'static str, help: &'static str, labels: &[(&'static str, &str)]) -> Arc<Counter> {
+    match self.get_or_insert(name, help, labels, || Metric::Counter(Default::default())) {
+      Metric::Counter(it) => it,
+      other => panic!("metric {} is a {}", name, other.kind())
+    }
+  }
+
+  pub fn gauge(&self, name: &'static str, help: &'static str, labels: &[(&'static str, &str)]) -> Arc<Gauge> {
+    match self.get_or_insert(name, help, labels, || Metric::Gauge(Default::default())) {
+      Metric::Gauge(it) => it,
+      other => panic!("metric {} is a {}", name, other.kind())
+    }
+  }
+
+  pub fn histogram(&self, name: &'static str, help: &'static str, bounds: &'static [Duration], labels: &[(&'static str, &str)]) -> Arc<Histogram> {
+    match self.get_or_insert(name, help, labels, || Metric::Histogram(Arc::new(Histogram::new(bounds)))) {
+      Metric::Histogram(it) => it,
+      other => panic!("metric {} is a {}", name, other.kind())
+    }
+  }
+
+  fn get_or_insert(&self, name: &'static str, help: &'static str, labels: &[(&'static str, &str)], create: impl FnOnce() -> Metric) -> Metric {
+    let labels = labels.iter().map(|&(key, value)| (key, value.to_owned())).collect::<Labels>();
+
+    let mut families = self.families.lock().unwrap();
+    let family = families.entry(name).or_insert_with(|| Family {
+      help,
+      series: Vec::new()
+    });
+    if let Some((_, metric)) = family.series.iter().find(|(it, _)| *it == labels) {
+      return metric.clone();
+    }
+
+    let metric = create();
+    family.series.push((labels, metric.clone()));
+    metric
+  }
+
+  /// Removes every series labelled `key="value"`, e.g. all metrics of a guild that left.
+  pub fn remove(&self, key: &str, value: &str) {
+    let mut families = self.families.lock().unwrap();
+    for family in families.values_mut() {
+      family.series.retain(|(labels, _)| !labels.iter().any(|(k, v)| *k == key && v == value));
+    }
+  }
+
+  pub fn encode(&self) -> String {
+    let mut out = String::new();
+    let families = self.families.lock().unwrap();
+    for (name, family) in families.iter() {
+      let Some((_, first)) = family.series.first() else {
+        continue;
+      };
+      _ = writeln!(out, "# HELP {} {}", name, family.help);
+      _ = writeln!(out, "# TYPE {} {}", name, first.kind());
+
+      for (labels, metric) in &family.series {
+        match metric {
+          Metric::Counter(counter) => _ = writeln!(out, "{}{} {}", name, format_labels(labels, None), counter.get()),
+          Metric::Gauge(gauge) => _ = writeln!(out, "{}{} {}", name, format_labels(labels, None), gauge.get()),
+          Metric::Histogram(histogram) => {
+            let mut cumulative = 0;
+            for (index, bucket) in histogram.buckets.iter().enumerate() {
+              cumulative += bucket.load(Ordering::Relaxed);
+              let bound = histogram.bounds.get(index).map_or("+Inf".to_owned(), |it| it.as_secs_f64().to_string());
+              _ = writeln!(out, "{}_bucket{} {}", name, format_labels(labels, Some(&bound)), cumulative);
+            }
+            let sum = histogram.sum_ns.load(Ordering::Relaxed) as f64 / 1e9;
+            _ = writeln!(out, "{}_sum{} {}", name, format_labels(labels, None), sum);
+            _ = writeln!(out, "{}_count{} {}", name, format_labels(labels, None), histogram.count());
+          }
+        }
+      }
+    }
+    out
+  }
+}
+
+fn format_labels(labels: &Labels, bucket: Option<&str>) -> String {
+  if labels.is_empty() && bucket.is_none() {
+    return String::new();
+  }
+
+  let mut parts = labels
+    .iter()
+    .map(|(key, value)| format!("{}=\"{}\"", key, value.replace('\\', "\\\\").replace('"', "\\\"")))
+    .collect::<Vec<_>>();
+  if let Some(bound) = bucket {
+    parts.push(format!("le=\"{}\"", bound));
+  }
+  format!("{{{}}}", parts.join(","))
+}
@@ -0,0 +1,167 @@
+use std::{
+  collections::{hash_map::RandomState, HashMap},
+  hash::{BuildHasher, Hash, Hasher},
+  sync::RwLock,
+  thread
+};
+
+/// Concurrent hash map split into independently locked shards by key hash,
+/// so operations on different keys rarely contend.
+///
+/// Values are returned cloned, the locks are never held outside of a method call.
+pub struct ShardedMap<K, V> {
+  shards: Box<[RwLock<HashMap<K, V>>]>,
+  hasher: RandomState
+}
+
+impl<K: Hash + Eq, V: Clone> ShardedMap<K, V> {
+  /// Creates a map with 4 shards per CPU, rounded up to a power of two.
+  pub fn new() -> Self {
+    let cpus = thread::available_parallelism().map_or(1, |it| it.get());
+    Self::with_shards(cpus * 4)
+  }
+
+  pub fn with_shards(count: usize) -> Self {
+    Self {
+      shards: (0..count.max(1).next_power_of_two()).map(|_| RwLock::new(HashMap::new())).collect(),
+      hasher: RandomState::new()
+    }
+  }
+
+  fn shard(&self, key: &K) -> &RwLock<HashMap<K, V>> {
+    let mut hasher = self.hasher.build_hasher();
+    key.hash(&mut hasher);
+    &self.shards[hasher.finish() as usize & (self.shards.len() - 1)]
+  }
+
+  pub fn get(&self, key: &K) -> Option<V> {
+    self.shard(key).read().unwrap().get(key).cloned()
+  }
+
+  pub fn contains_key(&self, key: &K) -> bool {
+    self.shard(key).read().unwrap().contains_key(key)
+  }
+
+  /// Returns the value of `key`, inserting the one returned by `create` if there is none.
+  pub fn get_or_insert_with(&self, key: K, create: impl FnOnce() -> V) -> V {
+    if let Some(value) = self.get(&key) {
+      return value;
+    }
+    self.shard(&key).write().unwrap().entry(key).or_insert_with(create).clone()
+  }
+
+  pub fn insert(&self, key: K, value: V) -> Option<V> {
+    self.shard(&key).write().unwrap().insert(key, value)
+  }
+
+  pub fn remove(&self, key: &K) -> Option<V> {
+    self.shard(key).write().unwrap().remove(key)
+  }
+
+  pub fn len(&self) -> usize {
+    self.shards.iter().map(|it| it.read().unwrap().len()).sum()
+  }
+
+  pub fn is_empty(&self) -> bool {
+    self.len() == 0
+  }
+
+  /// Returns a snapshot of all keys, locking one shard at a time.
+  pub fn keys(&self) -> Vec<K> where K: Clone {
+    self.shards.iter().flat_map(|it| it.read().unwrap().keys().cloned().collect::<Vec<_>>()).collect()
+  }
+
+  /// Returns a snapshot of all values, locking one shard at a time.
+  pub fn values(&self) -> Vec<V> {
+    self.shards.iter().flat_map(|it| it.read().unwrap().values().cloned().collect::<Vec<_>>()).collect()
+  }
+}
+
+impl<K: Hash + Eq, V: Clone> Default for ShardedMap<K, V> {
+  fn default() -> Self {
+    Self::new()
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::sync::{atomic::{AtomicUsize, Ordering}, Arc};
+  use super::*;
+
+  #[test]
+  fn shard_count_is_power_of_two() {
+    assert_eq!(ShardedMap::<u64, u64>::with_shards(0).shards.len(), 1);
+    assert_eq!(ShardedMap::<u64, u64>::with_shards(6).shards.len(), 8);
+    assert!(ShardedMap::<u64, u64>::new().shards.len().is_power_of_two());
+  }
+
+  #[test]
+  fn insert_get_remove() {
+    let map = ShardedMap::with_shards(4);
+    assert!(map.is_empty());
+    assert_eq!(map.insert(1, "one"), None);
+    assert_eq!(map.insert(1, "uno"), Some("one"));
+    assert_eq!(map.insert(2, "two"), None);
+
+    assert_eq!(map.get(&1), Some("uno"));
+    assert!(map.contains_key(&2));
+    assert_eq!(map.len(), 2);
+
+    assert_eq!(map.remove(&1), Some("uno"));
+    assert_eq!(map.remove(&1), None);
+    assert_eq!(map.get(&1), None);
+    assert_eq!(map.len(), 1);
+  }
+
+  #[test]
+  fn snapshots_cover_all_shards() {
+    let map = ShardedMap::with_shards(8);
+    for key in 0..100u64 {
+      map.insert(key, key * 2);
+    }
+
+    let mut keys = map.keys();
+    keys.sort_unstable();
+    assert_eq!(keys, (0..100).collect::<Vec<_>>());
+
+    let mut values = map.values();
+    values.sort_unstable();
+    assert_eq!(values, (0..100).map(|it| it * 2).collect::<Vec<_>>());
+  }
+
+  #[test]
+  fn get_or_insert_keeps_existing_value() {
+    let map = ShardedMap::with_shards(2);
+    assert_eq!(map.get_or_insert_with(1, || 10), 10);
+    assert_eq!(map.get_or_insert_with(1, || panic!("value is already present")), 10);
+  }
+
+  #[test]
+  fn concurrent_get_or_insert_creates_once() {
+    let map = Arc::new(ShardedMap::with_shards(4));
+    let created = Arc::new(AtomicUsize::new(0));
+
+    let threads = (0..8)
+      .map(|_| {
+        let map = map.clone();
+        let created = created.clone();
+        thread::spawn(move || {
+          for key in 0..1000u64 {
+            let value = map.get_or_insert_with(key, || {
+              created.fetch_add(1, Ordering::Relaxed);
+              key + 1
+            });
+            assert_eq!(value, key + 1);
+          }
+        })
+      })
+      .collect::<Vec<_>>();
+    for thread in threads {
+      thread.join().unwrap();
+    }
+
+    // Racing inserts of one key all end up under the write lock, only the first creates a value
+    assert_eq!(created.load(Ordering::Relaxed), 1000);
+    assert_eq!(map.len(), 1000);
+  }
+}
@@ -0,0 +1,143 @@
+use std::time::{Duration, Instant};
+use tracing::debug;
+
+use crate::rtcp::ReceiverReport;
+
+/// Lowest bitrate the controller goes down to, music stays listenable above it.
+pub const MIN_BITRATE: u32 = 24_000;
+/// Bitrate libopus picks by itself for 20 ms stereo frames at 48 kHz, cuts start from it when the channel bitrate is unknown.
+pub const AUTO_BITRATE: u32 = 60 * 48_000 / 960 + 48_000 * 2;
+
+/// Loss above which the bitrate is lowered.
+const LOSS_HIGH: f32 = 0.1;
+/// Loss below which the bitrate is raised again.
+const LOSS_LOW: f32 = 0.02;
+/// Weight of the latest report in the smoothed loss.
+const LOSS_SMOOTHING: f32 = 0.3;
+const INCREASE_FACTOR: f32 = 1.08;
+/// Minimum time between two bitrate increases, so the path has time to show congestion.
+const INCREASE_INTERVAL: Duration = Duration::from_secs(5);
+/// Upper bound of the expected loss given to the encoder, more only wastes bits on redundancy.
+const MAX_LOSS_PERCENT: i32 = 30;
+
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub struct EncoderSettings {
+  /// `None` leaves the bitrate to libopus.
+  pub bitrate: Option<u32>,
+  /// Expected packet loss in percent, in-band FEC is enabled if it is not 0.
+  pub packet_loss_percent: i32
+}
+
+/// Loss-based bitrate and FEC control from RTCP receiver reports.
+///
+/// Loss above [`LOSS_HIGH`] cuts the bitrate in proportion to the loss, loss below [`LOSS_LOW`]
+/// raises it again slowly, up to the channel bitrate. Without a channel bitrate, libopus picks
+/// the bitrate until loss shows up, and again once the bitrate is back at [`AUTO_BITRATE`].
+#[derive(Debug)]
+pub struct BitrateController {
+  max: Option<u32>,
+  min: u32,
+  settings: EncoderSettings,
+  loss: f32,
+  last_increase: Instant
+}
+
+impl BitrateController {
+  pub fn new(max: Option<u32>) -> Self {
+    Self {
+      max,
+      min: MIN_BITRATE.min(max.unwrap_or(AUTO_BITRATE)),
+      settings: EncoderSettings {
+        bitrate: max,
+        packet_loss_percent: 0
+      },
+      loss: 0.0,
+      last_increase: Instant::now()
+    }
+  }
+
+  pub fn settings(&self) -> EncoderSettings {
+    self.settings
+  }
+
+  /// Returns new encoder settings if they changed.
+  pub fn on_report(&mut self, report: &ReceiverReport) -> Option<EncoderSettings> {
+    self.loss += (report.fraction_lost - self.loss) * LOSS_SMOOTHING;
+
+    let ceiling = self.max.unwrap_or(AUTO_BITRATE);
+    let mut bitrate = self.settings.bitrate.unwrap_or(ceiling);
+    if self.loss > LOSS_HIGH {
+      bitrate = (bitrate as f32 * (1.0 - self.loss / 2.0)) as u32;
+      self.last_increase = Instant::now();
+    } else if self.loss < LOSS_LOW && self.last_increase.elapsed() >= INCREASE_INTERVAL {
+      bitrate = (bitrate as f32 * INCREASE_FACTOR) as u32;
+      self.last_increase = Instant::now();
+    }
+
+    let bitrate = bitrate.clamp(self.min, ceiling);
+    let settings = EncoderSettings {
+      bitrate: (self.max.is_some() || bitrate < ceiling).then_some(bitrate),
+      packet_loss_percent: ((self.loss * 100.0).round() as i32).min(MAX_LOSS_PERCENT)
+    };
+    if settings == self.settings {
+      return None;
+    }
+
+    debug!("loss {:.1}%, encoder settings {:?} -> {:?}", self.loss * 100.0, self.settings, settings);
+    self.settings = settings;
+    Some(settings)
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  fn report(fraction_lost: f32) -> ReceiverReport {
+    ReceiverReport {
+      ssrc: 1,
+      fraction_lost,
+      cumulative_lost: 0,
+      highest_sequence: 0,
+      jitter: Duration::ZERO,
+      rtt: None
+    }
+  }
+
+  #[test]
+  fn starts_at_channel_bitrate() {
+    assert_eq!(BitrateController::new(Some(96_000)).settings().bitrate, Some(96_000));
+    assert_eq!(BitrateController::new(None).settings().bitrate, None);
+  }
+
+  #[test]
+  fn loss_lowers_bitrate_within_bounds() {
+    let mut controller = BitrateController::new(Some(64_000));
+    for _ in 0..50 {
+      controller.on_report(&report(0.5));
+    }
+
+    let settings = controller.settings();
+    assert_eq!(settings.bitrate, Some(MIN_BITRATE));
+    assert_eq!(settings.packet_loss_percent, MAX_LOSS_PERCENT);
+  }
+
+  #[test]
+  fn automatic_bitrate_is_only_replaced_under_loss() {
+    let mut controller = BitrateController::new(None);
+    assert_eq!(controller.on_report(&report(0.0)), None);
+
+    let settings = controller.on_report(&report(0.5)).unwrap();
+    assert!(settings.bitrate.unwrap() < AUTO_BITRATE);
+
+    for _ in 0..20 {
+      controller.on_report(&report(0.0));
+    }
+    // Loss is gone, but increases wait for INCREASE_INTERVAL
+    assert!(controller.settings().bitrate.is_some());
+
+    controller.last_increase -= INCREASE_INTERVAL;
+    controller.settings.bitrate = Some(AUTO_BITRATE - 1);
+    assert_eq!(controller.on_report(&report(0.0)).map(|it| it.bitrate), Some(None));
+  }
+}
@@ -4,3 +4,6 @@ pub const CHANNEL_COUNT: usize = 2;
 pub const SAMPLE_RATE: usize = 48000;
 pub const CHUNK_DURATION: Duration = Duration::from_millis(20);
 pub const TIMESTAMP_STEP: usize = SAMPLE_RATE / (1000 / CHUNK_DURATION.as_millis() as usize);
+pub const MAX_OPUS_PACKET_SIZE: usize = 1275;
+/// Opus frame Discord expects a few of before a stream goes quiet.
+pub const SILENCE_FRAME: [u8; 3] = [0xF8, 0xFF, 0xFE];
@@ -0,0 +1,348 @@
+use aes_gcm::Aes256Gcm;
+use anyhow::{Result, Context, anyhow};
+use chacha20poly1305::XChaCha20Poly1305;
+use rand::random;
+use tracing::debug;
+use xsalsa20poly1305::{aead::{generic_array::GenericArray, AeadInPlace, KeyInit}, XSalsa20Poly1305};
+
+pub const TAG_SIZE: usize = 16;
+/// Header and sender SSRC of an RTCP packet, sent unencrypted.
+pub const RTCP_HEADER_SIZE: usize = 8;
+const NONCE_SIZE: usize = 24;
+
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+#[non_exhaustive]
+pub enum VoiceCipherMode {
+  /// AES-256-GCM, the RTP header is authenticated but sent in plain text.
+  AeadAes256GcmRtpSize,
+  /// XChaCha20-Poly1305, laid out the same way as [`VoiceCipherMode::AeadAes256GcmRtpSize`].
+  AeadXChaCha20Poly1305RtpSize,
+  Lite,
+  Suffix,
+  Normal
+}
+
+impl VoiceCipherMode {
+  pub const ALL: [VoiceCipherMode; 5] = [
+    VoiceCipherMode::AeadAes256GcmRtpSize,
+    VoiceCipherMode::AeadXChaCha20Poly1305RtpSize,
+    VoiceCipherMode::Lite,
+    VoiceCipherMode::Suffix,
+    VoiceCipherMode::Normal
+  ];
+
+  /// Name of the mode in the voice gateway protocol.
+  pub fn name(&self) -> &'static str {
+    match self {
+      VoiceCipherMode::AeadAes256GcmRtpSize => "aead_aes256_gcm_rtpsize",
+      VoiceCipherMode::AeadXChaCha20Poly1305RtpSize => "aead_xchacha20_poly1305_rtpsize",
+      VoiceCipherMode::Lite => "xsalsa20_poly1305_lite",
+      VoiceCipherMode::Suffix => "xsalsa20_poly1305_suffix",
+      VoiceCipherMode::Normal => "xsalsa20_poly1305"
+    }
+  }
+
+  pub fn from_name(name: &str) -> Option<Self> {
+    Self::ALL.into_iter().find(|mode| mode.name() == name)
+  }
+
+  /// Picks the fastest of `modes` advertised by the voice server.
+  ///
+  /// AES-GCM is only preferred with hardware AES and carry-less multiplication,
+  /// XChaCha20 is faster in software.
+  pub fn negotiate(modes: &[String]) -> Option<Self> {
+    let mut preference = Self::ALL;
+    if !has_hardware_aes() {
+      preference.swap(0, 1);
+    }
+
+    let mode = preference.into_iter().find(|mode| modes.iter().any(|it| it == mode.name()));
+    debug!("negotiated encryption mode {:?} from {:?}", mode, modes);
+    mode
+  }
+
+  /// Whether the tag follows the payload and the header is authenticated, as opposed to the `secretbox` layout.
+  fn is_aead(&self) -> bool {
+    matches!(self, VoiceCipherMode::AeadAes256GcmRtpSize | VoiceCipherMode::AeadXChaCha20Poly1305RtpSize)
+  }
+
+  fn nonce_size(&self) -> usize {
+    match self {
+      VoiceCipherMode::AeadAes256GcmRtpSize => 12,
+      _ => NONCE_SIZE
+    }
+  }
+
+  /// Number of nonce bytes appended to every packet.
+  fn suffix_size(&self) -> usize {
+    match self {
+      VoiceCipherMode::AeadAes256GcmRtpSize | VoiceCipherMode::AeadXChaCha20Poly1305RtpSize | VoiceCipherMode::Lite => 4,
+      VoiceCipherMode::Suffix => NONCE_SIZE,
+      VoiceCipherMode::Normal => 0
+    }
+  }
+}
+
+#[cfg(target_arch = "x86_64")]
+fn has_hardware_aes() -> bool {
+  std::arch::is_x86_feature_detected!("aes") && std::arch::is_x86_feature_detected!("pclmulqdq")
+}
+
+#[cfg(target_arch = "aarch64")]
+fn has_hardware_aes() -> bool {
+  std::arch::is_aarch64_feature_detected!("aes") && std::arch::is_aarch64_feature_detected!("pmull")
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+fn has_hardware_aes() -> bool {
+  false
+}
+
+enum Cipher {
+  XSalsa20(XSalsa20Poly1305),
+  XChaCha20(XChaCha20Poly1305),
+  Aes256Gcm(Aes256Gcm)
+}
+
+/// Encrypts outgoing RTP and decrypts incoming RTCP packets of one voice connection.
+pub struct VoiceCrypto {
+  mode: VoiceCipherMode,
+  cipher: Cipher,
+  /// Nonce of the next packet in modes with a counter nonce.
+  nonce: u32
+}
+
+impl VoiceCrypto {
+  pub fn new(mode: VoiceCipherMode, secret_key: &[u8]) -> Result<Self> {
+    let invalid_key = || anyhow!("invalid secret key length {}", secret_key.len());
+    let cipher = match mode {
+      VoiceCipherMode::AeadAes256GcmRtpSize => Cipher::Aes256Gcm(Aes256Gcm::new_from_slice(secret_key).map_err(|_| invalid_key())?),
+      VoiceCipherMode::AeadXChaCha20Poly1305RtpSize => Cipher::XChaCha20(XChaCha20Poly1305::new_from_slice(secret_key).map_err(|_| invalid_key())?),
+      VoiceCipherMode::Lite | VoiceCipherMode::Suffix | VoiceCipherMode::Normal => {
+        Cipher::XSalsa20(XSalsa20Poly1305::new_from_slice(secret_key).map_err(|_| invalid_key())?)
+      }
+    };
+
+    Ok(Self {
+      mode,
+      cipher,
+      nonce: random()
+    })
+  }
+
+  pub fn mode(&self) -> VoiceCipherMode {
+    self.mode
+  }
+
+  /// Offset of the plain text payload from the end of the header.
+  pub fn payload_offset(&self) -> usize {
+    if self.mode.is_aead() { 0 } else { TAG_SIZE }
+  }
+
+  /// Bytes added to a packet after the payload.
+  pub fn trailer_size(&self) -> usize {
+    let tag = if self.mode.is_aead() { TAG_SIZE } else { 0 };
+    tag + self.mode.suffix_size()
+  }
+
+  /// Encrypts a packet in place, returns its full size.
+  ///
+  /// `packet` starts with a `header_size` bytes header, followed by a `size` bytes payload written at
+  /// [`VoiceCrypto::payload_offset`], and must have room for [`VoiceCrypto::trailer_size`] more bytes.
+  pub fn seal(&mut self, packet: &mut [u8], header_size: usize, size: usize) -> Result<usize> {
+    let counter = self.nonce;
+    self.nonce = self.nonce.wrapping_add(1);
+
+    let suffix = self.mode.suffix_size();
+    let mut nonce = [0; NONCE_SIZE];
+    match self.mode {
+      VoiceCipherMode::Normal => nonce[..header_size].copy_from_slice(&packet[..header_size]),
+      VoiceCipherMode::Suffix => nonce = random(),
+      _ => nonce[..4].copy_from_slice(&counter.to_be_bytes())
+    }
+
+    let (header, body) = packet.split_at_mut(header_size);
+    let length = if self.mode.is_aead() {
+      let tag = self.encrypt(&nonce, header, &mut body[..size])?;
+      body[size..size + TAG_SIZE].copy_from_slice(&tag);
+      size + TAG_SIZE
+    } else {
+      let tag = self.encrypt(&nonce, b"", &mut body[TAG_SIZE..TAG_SIZE + size])?;
+      body[..TAG_SIZE].copy_from_slice(&tag);
+      TAG_SIZE + size
+    };
+    body[length..length + suffix].copy_from_slice(&nonce[..suffix]);
+
+    Ok(header_size + length + suffix)
+  }
+
+  /// Decrypts an RTCP packet in place, returns the decrypted payload.
+  pub fn open_rtcp<'a>(&self, buffer: &'a mut [u8]) -> Result<&'a [u8]> {
+    let suffix = self.mode.suffix_size();
+    let length = buffer.len().saturating_sub(suffix);
+    if length < RTCP_HEADER_SIZE + TAG_SIZE {
+      return Err(anyhow!("RTCP packet too short"));
+    }
+
+    let mut nonce = [0; NONCE_SIZE];
+    match self.mode {
+      VoiceCipherMode::Normal => nonce[..RTCP_HEADER_SIZE].copy_from_slice(&buffer[..RTCP_HEADER_SIZE]),
+      _ => nonce[..suffix].copy_from_slice(&buffer[length..])
+    }
+
+    let (header, body) = buffer[..length].split_at_mut(RTCP_HEADER_SIZE);
+    if self.mode.is_aead() {
+      let (data, tag) = body.split_at_mut(body.len() - TAG_SIZE);
+      self.decrypt(&nonce, header, data, tag)?;
+      Ok(data)
+    } else {
+      let (tag, data) = body.split_at_mut(TAG_SIZE);
+      self.decrypt(&nonce, b"", data, tag)?;
+      Ok(data)
+    }
+  }
+
+  fn encrypt(&self, nonce: &[u8; NONCE_SIZE], aad: &[u8], data: &mut [u8]) -> Result<[u8; TAG_SIZE]> {
+    let nonce = &nonce[..self.mode.nonce_size()];
+    let tag = match &self.cipher {
+      Cipher::XSalsa20(cipher) => cipher.encrypt_in_place_detached(GenericArray::from_slice(nonce), aad, data),
+      Cipher::XChaCha20(cipher) => cipher.encrypt_in_place_detached(GenericArray::from_slice(nonce), aad, data),
+      Cipher::Aes256Gcm(cipher) => cipher.encrypt_in_place_detached(GenericArray::from_slice(nonce), aad, data)
+    }.map_err(|error| anyhow!(error))?;
+    Ok(tag.into())
+  }
+
+  fn decrypt(&self, nonce: &[u8; NONCE_SIZE], aad: &[u8], data: &mut [u8], tag: &[u8]) -> Result<()> {
+    let nonce = &nonce[..self.mode.nonce_size()];
+    let tag = GenericArray::from_slice(tag);
+    match &self.cipher {
+      Cipher::XSalsa20(cipher) => cipher.decrypt_in_place_detached(GenericArray::from_slice(nonce), aad, data, tag),
+      Cipher::XChaCha20(cipher) => cipher.decrypt_in_place_detached(GenericArray::from_slice(nonce), aad, data, tag),
+      Cipher::Aes256Gcm(cipher) => cipher.decrypt_in_place_detached(GenericArray::from_slice(nonce), aad, data, tag)
+    }.map_err(|error| anyhow!(error)).context("failed to decrypt packet")
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  const KEY: [u8; 32] = {
+    let mut key = [0; 32];
+    let mut index = 0;
+    while index < key.len() {
+      key[index] = index as u8;
+      index += 1;
+    }
+    key
+  };
+  const RTP_HEADER: [u8; 12] = [0x80, 0x78, 0x00, 0x01, 0x00, 0x00, 0x03, 0xc0, 0x00, 0x00, 0x00, 0x2a];
+
+  fn hex(value: &str) -> Vec<u8> {
+    (0..value.len()).step_by(2).map(|it| u8::from_str_radix(&value[it..it + 2], 16).unwrap()).collect()
+  }
+
+  fn seal(crypto: &mut VoiceCrypto, header: &[u8], payload: &[u8]) -> Vec<u8> {
+    let mut packet = vec![0; header.len() + crypto.payload_offset() + payload.len() + crypto.trailer_size()];
+    packet[..header.len()].copy_from_slice(header);
+    let offset = header.len() + crypto.payload_offset();
+    packet[offset..offset + payload.len()].copy_from_slice(payload);
+
+    let length = crypto.seal(&mut packet, header.len(), payload.len()).unwrap();
+    assert_eq!(length, packet.len());
+    packet
+  }
+
+  #[test]
+  fn seal_matches_reference() {
+    // Generated with libsodium from the same key, header, payload and counter nonce
+    let cases = [
+      (VoiceCipherMode::AeadAes256GcmRtpSize, "80780001000003c00000002a2959becb6531050b7203aca8ceffed7211bfce639fa600000001"),
+      (VoiceCipherMode::AeadXChaCha20Poly1305RtpSize, "80780001000003c00000002a64c82241066b986c603339a5bb716823160c9373333400000001"),
+      (VoiceCipherMode::Lite, "80780001000003c00000002a64d737f7552a6c4e27317279ff90b52ca3c4a61f2eda00000001"),
+      (VoiceCipherMode::Normal, "80780001000003c00000002a0269a03f6651599140006a974eaa883d584f325a83c7")
+    ];
+
+    for (mode, expected) in cases {
+      let mut crypto = VoiceCrypto::new(mode, &KEY).unwrap();
+      crypto.nonce = 1;
+      assert_eq!(seal(&mut crypto, &RTP_HEADER, b"mosaik"), hex(expected), "{:?}", mode);
+      assert_eq!(crypto.nonce, 2);
+    }
+  }
+
+  #[test]
+  fn aes_gcm_known_vectors() {
+    // McGrew and Viega, The Galois/Counter Mode of Operation, test cases 13 and 14
+    let crypto = VoiceCrypto::new(VoiceCipherMode::AeadAes256GcmRtpSize, &[0; 32]).unwrap();
+    let nonce = [0; NONCE_SIZE];
+
+    assert_eq!(crypto.encrypt(&nonce, b"", &mut []).unwrap().to_vec(), hex("530f8afbc74536b9a963b4f1c4cb738b"));
+
+    let mut data = [0; 16];
+    let tag = crypto.encrypt(&nonce, b"", &mut data).unwrap();
+    assert_eq!(data.to_vec(), hex("cea7403d4d606b6e074ec5d3baf39d18"));
+    assert_eq!(tag.to_vec(), hex("d0d1c8a799996bf0265b98b5d48ab919"));
+  }
+
+  #[test]
+  fn sealed_rtcp_round_trips() {
+    let header = &RTP_HEADER[..RTCP_HEADER_SIZE];
+    for mode in VoiceCipherMode::ALL {
+      let mut crypto = VoiceCrypto::new(mode, &KEY).unwrap();
+      let mut packet = seal(&mut crypto, header, b"receiver report");
+      assert_eq!(&packet[..RTCP_HEADER_SIZE], header, "{:?}", mode);
+      assert_eq!(crypto.open_rtcp(&mut packet).unwrap(), b"receiver report", "{:?}", mode);
+    }
+  }
+
+  #[test]
+  fn tampered_rtcp_is_rejected() {
+    for mode in VoiceCipherMode::ALL {
+      let mut crypto = VoiceCrypto::new(mode, &KEY).unwrap();
+      let sealed = seal(&mut crypto, &RTP_HEADER[..RTCP_HEADER_SIZE], b"receiver report");
+
+      // The header is only authenticated as associated data or as the nonce
+      let header = if mode.is_aead() || mode == VoiceCipherMode::Normal { 1 } else { RTCP_HEADER_SIZE };
+      for index in [header, RTCP_HEADER_SIZE, RTCP_HEADER_SIZE + TAG_SIZE, sealed.len() - 1] {
+        let mut packet = sealed.clone();
+        packet[index] ^= 1;
+        assert!(crypto.open_rtcp(&mut packet).is_err(), "{:?} accepted a flipped byte {}", mode, index);
+      }
+    }
+
+    let crypto = VoiceCrypto::new(VoiceCipherMode::Lite, &KEY).unwrap();
+    assert!(crypto.open_rtcp(&mut [0; RTCP_HEADER_SIZE + TAG_SIZE]).is_err());
+  }
+
+  #[test]
+  fn suffix_nonce_is_random() {
+    let mut crypto = VoiceCrypto::new(VoiceCipherMode::Suffix, &KEY).unwrap();
+    let first = seal(&mut crypto, &RTP_HEADER, b"mosaik");
+    let second = seal(&mut crypto, &RTP_HEADER, b"mosaik");
+    assert_ne!(first[first.len() - NONCE_SIZE..], second[second.len() - NONCE_SIZE..]);
+  }
+
+  #[test]
+  fn invalid_key_is_rejected() {
+    for mode in VoiceCipherMode::ALL {
+      assert!(VoiceCrypto::new(mode, &KEY[..16]).is_err(), "{:?}", mode);
+    }
+  }
+
+  #[test]
+  fn modes_are_negotiated_by_name() {
+    for mode in VoiceCipherMode::ALL {
+      assert_eq!(VoiceCipherMode::from_name(mode.name()), Some(mode));
+    }
+    assert_eq!(VoiceCipherMode::from_name("plain"), None);
+
+    let modes = ["xsalsa20_poly1305".to_owned(), "xsalsa20_poly1305_lite".to_owned()];
+    assert_eq!(VoiceCipherMode::negotiate(&modes), Some(VoiceCipherMode::Lite));
+    assert_eq!(VoiceCipherMode::negotiate(&["plain".to_owned()]), None);
+
+    let modes = VoiceCipherMode::ALL.map(|it| it.name().to_owned());
+    let expected = if has_hardware_aes() { VoiceCipherMode::AeadAes256GcmRtpSize } else { VoiceCipherMode::AeadXChaCha20Poly1305RtpSize };
+    assert_eq!(VoiceCipherMode::negotiate(&modes), Some(expected));
+  }
+}
@@ -0,0 +1,548 @@
+use std::{
+  cmp::Ordering as CmpOrdering,
+  collections::BinaryHeap,
+  panic::{catch_unwind, AssertUnwindSafe},
+  sync::{atomic::{AtomicU64, AtomicU8, AtomicUsize, Ordering}, Arc, Condvar, Mutex, OnceLock},
+  task::{Wake, Waker},
+  thread,
+  time::{Duration, Instant}
+};
+use anyhow::Result;
+use tracing::{debug, warn};
+
+use crate::frame_queue::QueueLevel;
+
+/// A step running longer than this is assumed to block on I/O (e.g. a network source waiting for data).
+const BLOCKED_AFTER: Duration = Duration::from_millis(10);
+const MONITOR_INTERVAL: Duration = Duration::from_millis(5);
+/// Spare workers exit after being idle for this long.
+const SPARE_IDLE: Duration = Duration::from_secs(1);
+
+/// Result of one [`DecodeTask::step`].
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum DecodeStep {
+  /// More can be decoded right away.
+  Progress,
+  /// Nothing can be done until the waker passed to the step is woken.
+  Pending,
+  Done
+}
+
+/// Decoding of one stream, run a frame-sized quantum at a time.
+pub trait DecodeTask: Send {
+  fn step(&mut self, waker: &Waker) -> DecodeStep;
+}
+
+const IDLE: u8 = 0;
+const SCHEDULED: u8 = 1;
+const RUNNING: u8 = 2;
+/// Woken while running, scheduled again after the step.
+const NOTIFIED: u8 = 3;
+const DONE: u8 = 4;
+
+struct Job {
+  task: Mutex<Option<Box<dyn DecodeTask>>>,
+  level: QueueLevel,
+  state: AtomicU8,
+  pool: Arc<Shared>
+}
+
+impl Job {
+  fn run(self: Arc<Self>) {
+    self.state.store(RUNNING, Ordering::Release);
+    let waker = Waker::from(self.clone());
+
+    let mut task = self.task.lock().unwrap();
+    let step = match task.as_mut() {
+      Some(it) => catch_unwind(AssertUnwindSafe(|| it.step(&waker))).unwrap_or_else(|_| {
+        warn!("decode task panicked");
+        DecodeStep::Done
+      }),
+      None => DecodeStep::Done
+    };
+
+    match step {
+      DecodeStep::Progress => {
+        drop(task);
+        self.state.store(SCHEDULED, Ordering::Release);
+        self.pool.push(self.clone());
+      },
+      DecodeStep::Pending => {
+        drop(task);
+        if self.state.compare_exchange(RUNNING, IDLE, Ordering::AcqRel, Ordering::Acquire).is_err() {
+          self.state.store(SCHEDULED, Ordering::Release);
+          self.pool.push(self.clone());
+        }
+      },
+      DecodeStep::Done => {
+        // Wakers stored elsewhere keep the job alive, the task is dropped right away
+        task.take();
+        self.state.store(DONE, Ordering::Release);
+      }
+    }
+  }
+}
+
+impl Wake for Job {
+  fn wake(self: Arc<Self>) {
+    self.wake_by_ref();
+  }
+
+  fn wake_by_ref(self: &Arc<Self>) {
+    let mut state = self.state.load(Ordering::Acquire);
+    loop {
+      let next = match state {
+        IDLE => SCHEDULED,
+        RUNNING => NOTIFIED,
+        _ => return
+      };
+      match self.state.compare_exchange_weak(state, next, Ordering::AcqRel, Ordering::Acquire) {
+        Ok(_) => {
+          if next == SCHEDULED {
+            self.pool.push(self.clone());
+          }
+          return;
+        },
+        Err(actual) => state = actual
+      }
+    }
+  }
+}
+
+/// Run queue entry, the job with the fewest frames queued for playback comes first.
+struct Entry {
+  level: usize,
+  order: u64,
+  job: Arc<Job>
+}
+
+impl Ord for Entry {
+  fn cmp(&self, other: &Self) -> CmpOrdering {
+    (other.level, other.order).cmp(&(self.level, self.order))
+  }
+}
+
+impl PartialOrd for Entry {
+  fn partial_cmp(&self, other: &Self) -> Option<CmpOrdering> {
+    Some(self.cmp(other))
+  }
+}
+
+impl PartialEq for Entry {
+  fn eq(&self, other: &Self) -> bool {
+    self.cmp(other) == CmpOrdering::Equal
+  }
+}
+
+impl Eq for Entry {}
+
+#[derive(Default)]
+struct RunQueue {
+  jobs: BinaryHeap<Entry>,
+  next_order: u64
+}
+
+/// Start of the step a worker is running, in microseconds since [`Shared::epoch`], `0` if idle.
+type WorkerSlot = Arc<AtomicU64>;
+
+struct Shared {
+  queue: Mutex<RunQueue>,
+  ready: Condvar,
+  /// Wakes the monitor, which waits on it while the run queue is empty.
+  queued: Condvar,
+  epoch: Instant,
+  workers: Mutex<Vec<WorkerSlot>>,
+  spares: AtomicUsize,
+  core_workers: usize,
+  max_spares: usize
+}
+
+impl Shared {
+  fn push(&self, job: Arc<Job>) {
+    let level = job.level.get();
+    let mut queue = self.queue.lock().unwrap();
+    let order = queue.next_order;
+    queue.next_order += 1;
+    queue.jobs.push(Entry { level, order, job });
+    drop(queue);
+    self.ready.notify_one();
+    self.queued.notify_one();
+  }
+
+  fn now(&self) -> u64 {
+    (self.epoch.elapsed().as_micros() as u64).max(1)
+  }
+}
+
+/// Fixed set of decode threads, one per core, shared by all voice connections.
+///
+/// Every stream is a [`DecodeTask`] stepped one packet at a time. The runnable task whose frame queue
+/// is closest to draining runs first, tasks with a full queue wait for their consumer without holding
+/// a thread. Sources report when their input would block (see [`SampleProvider::poll_ready`](crate::provider::SampleProvider::poll_ready))
+/// and wait the same way. A step that still blocks on I/O for longer than [`BLOCKED_AFTER`] makes a temporary
+/// spare worker take over the rest of the queue, so one stalled source does not hold up the others.
+pub struct DecodePool {
+  shared: Arc<Shared>
+}
+
+impl DecodePool {
+  pub fn new(threads: usize) -> Result<Self> {
+    let threads = threads.max(1);
+    let shared = Arc::new(Shared {
+      queue: Default::default(),
+      ready: Condvar::new(),
+      queued: Condvar::new(),
+      epoch: Instant::now(),
+      workers: Default::default(),
+      spares: AtomicUsize::new(0),
+      core_workers: threads,
+      max_spares: threads * 2
+    });
+
+    let cpus = allowed_cpus();
+    for index in 0..threads {
+      let cpu = (!cpus.is_empty()).then(|| cpus[index % cpus.len()]);
+      spawn_worker(&shared, format!("voice-decode-{}", index), cpu, false)?;
+    }
+
+    let monitor = shared.clone();
+    thread::Builder::new()
+      .name("voice-decode-monitor".to_owned())
+      .spawn(move || run_monitor(monitor))?;
+    debug!("started decode pool with {} threads", threads);
+
+    Ok(Self {
+      shared
+    })
+  }
+
+  /// Returns the shared pool, starting it on first use.
+  pub fn global() -> &'static DecodePool {
+    static POOL: OnceLock<DecodePool> = OnceLock::new();
+    POOL.get_or_init(|| {
+      let threads = thread::available_parallelism().map_or(1, |it| it.get());
+      DecodePool::new(threads).expect("failed to start decode pool")
+    })
+  }
+
+  /// Schedules `task` until it returns [`DecodeStep::Done`], `level` of its frame queue orders it against other tasks.
+  pub fn spawn<T: DecodeTask + 'static>(&self, level: QueueLevel, task: T) {
+    let job = Arc::new(Job {
+      task: Mutex::new(Some(Box::new(task))),
+      level,
+      state: AtomicU8::new(SCHEDULED),
+      pool: self.shared.clone()
+    });
+    self.shared.push(job);
+  }
+
+  /// Returns number of runnable tasks waiting for a worker.
+  pub fn backlog(&self) -> usize {
+    self.shared.queue.lock().unwrap().jobs.len()
+  }
+}
+
+fn spawn_worker(shared: &Arc<Shared>, name: String, cpu: Option<usize>, spare: bool) -> Result<()> {
+  let slot: WorkerSlot = Default::default();
+  shared.workers.lock().unwrap().push(slot.clone());
+
+  let shared = shared.clone();
+  thread::Builder::new().name(name).spawn(move || {
+    if let Some(cpu) = cpu {
+      pin_to_cpu(cpu);
+    }
+    run_worker(&shared, &slot, spare);
+    shared.workers.lock().unwrap().retain(|it| !Arc::ptr_eq(it, &slot));
+  })?;
+  Ok(())
+}
+
+fn run_worker(shared: &Shared, slot: &AtomicU64, spare: bool) {
+  loop {
+    let job = {
+      let mut queue = shared.queue.lock().unwrap();
+      loop {
+        if let Some(entry) = queue.jobs.pop() {
+          break entry.job;
+        }
+
+        if spare {
+          let (guard, result) = shared.ready.wait_timeout(queue, SPARE_IDLE).unwrap();
+          queue = guard;
+          if result.timed_out() && queue.jobs.is_empty() {
+            shared.spares.fetch_sub(1, Ordering::Relaxed);
+            return;
+          }
+        } else {
+          queue = shared.ready.wait(queue).unwrap();
+        }
+      }
+    };
+
+    slot.store(shared.now(), Ordering::Relaxed);
+    job.run();
+    slot.store(0, Ordering::Relaxed);
+  }
+}
+
+/// Starts a spare worker when tasks are waiting and blocked steps leave fewer than one free worker per core.
+///
+/// Sleeps on [`Shared::queued`] while no task is waiting, so an idle pool does not wake up every [`MONITOR_INTERVAL`].
+fn run_monitor(shared: Arc<Shared>) {
+  let blocked_after = BLOCKED_AFTER.as_micros() as u64;
+  loop {
+    {
+      let mut queue = shared.queue.lock().unwrap();
+      while queue.jobs.is_empty() {
+        queue = shared.queued.wait(queue).unwrap();
+      }
+    }
+
+    thread::sleep(MONITOR_INTERVAL);
+    if shared.queue.lock().unwrap().jobs.is_empty() {
+      continue;
+    }
+
+    let now = shared.now();
+    let (workers, blocked) = {
+      let workers = shared.workers.lock().unwrap();
+      let blocked = workers.iter().filter(|it| {
+        let started = it.load(Ordering::Relaxed);
+        started != 0 && now.saturating_sub(started) > blocked_after
+      }).count();
+      (workers.len(), blocked)
+    };
+
+    let spares = shared.spares.load(Ordering::Relaxed);
+    if workers - blocked < shared.core_workers && spares < shared.max_spares {
+      shared.spares.fetch_add(1, Ordering::Relaxed);
+      debug!("{} decode workers blocked, starting spare worker", blocked);
+      if let Err(error) = spawn_worker(&shared, "voice-decode-spare".to_owned(), None, true) {
+        shared.spares.fetch_sub(1, Ordering::Relaxed);
+        warn!("failed to start spare decode worker: {:?}", error);
+      }
+    }
+  }
+}
+
+/// Returns CPUs this process may run on.
+#[cfg(target_os = "linux")]
+fn allowed_cpus() -> Vec<usize> {
+  unsafe {
+    let mut set: libc::cpu_set_t = std::mem::zeroed();
+    if libc::sched_getaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &mut set) != 0 {
+      return Vec::new();
+    }
+    (0..libc::CPU_SETSIZE as usize).filter(|&cpu| libc::CPU_ISSET(cpu, &set)).collect()
+  }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn allowed_cpus() -> Vec<usize> {
+  Vec::new()
+}
+
+#[cfg(target_os = "linux")]
+fn pin_to_cpu(cpu: usize) {
+  unsafe {
+    let mut set: libc::cpu_set_t = std::mem::zeroed();
+    libc::CPU_SET(cpu, &mut set);
+    if libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) != 0 {
+      debug!("failed to pin decode worker to CPU {}: {}", cpu, std::io::Error::last_os_error());
+    }
+  }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin_to_cpu(_cpu: usize) {}
+
+#[cfg(test)]
+mod tests {
+  use std::sync::{atomic::AtomicBool, mpsc};
+  use crate::frame_queue::frame_queue;
+  use super::*;
+
+  struct FnTask<F>(F);
+
+  impl<F: FnMut(&Waker) -> DecodeStep + Send> DecodeTask for FnTask<F> {
+    fn step(&mut self, waker: &Waker) -> DecodeStep {
+      (self.0)(waker)
+    }
+  }
+
+  /// Sets the flag once dropped, along with the task owning it.
+  struct DropFlag(Arc<AtomicBool>);
+
+  impl Drop for DropFlag {
+    fn drop(&mut self) {
+      self.0.store(true, Ordering::Release);
+    }
+  }
+
+  /// Pool state without workers, jobs are popped and run by the test itself.
+  fn shared() -> Arc<Shared> {
+    Arc::new(Shared {
+      queue: Default::default(),
+      ready: Condvar::new(),
+      queued: Condvar::new(),
+      epoch: Instant::now(),
+      workers: Default::default(),
+      spares: AtomicUsize::new(0),
+      core_workers: 1,
+      max_spares: 0
+    })
+  }
+
+  fn level(frames: usize) -> QueueLevel {
+    let (mut producer, consumer) = frame_queue(8);
+    for _ in 0..frames {
+      assert!(producer.push_packet(&[0xf8]));
+    }
+    let level = producer.level();
+    // The level stays readable after both ends are gone
+    drop((producer, consumer));
+    level
+  }
+
+  fn job(shared: &Arc<Shared>, level: QueueLevel, task: impl DecodeTask + 'static) -> Arc<Job> {
+    Arc::new(Job {
+      task: Mutex::new(Some(Box::new(task))),
+      level,
+      state: AtomicU8::new(IDLE),
+      pool: shared.clone()
+    })
+  }
+
+  fn pop(shared: &Shared) -> Option<Arc<Job>> {
+    shared.queue.lock().unwrap().jobs.pop().map(|it| it.job)
+  }
+
+  #[test]
+  fn progress_is_rescheduled() {
+    let shared = shared();
+    let job = job(&shared, level(0), FnTask(|_: &Waker| DecodeStep::Progress));
+
+    job.clone().run();
+    assert_eq!(job.state.load(Ordering::Acquire), SCHEDULED);
+    assert!(Arc::ptr_eq(&pop(&shared).unwrap(), &job));
+    assert!(pop(&shared).is_none());
+  }
+
+  #[test]
+  fn pending_waits_for_wake() {
+    let shared = shared();
+    let stored = Arc::new(Mutex::new(None::<Waker>));
+    let job = job(&shared, level(0), FnTask({
+      let stored = stored.clone();
+      move |waker: &Waker| {
+        *stored.lock().unwrap() = Some(waker.clone());
+        DecodeStep::Pending
+      }
+    }));
+
+    job.clone().run();
+    assert_eq!(job.state.load(Ordering::Acquire), IDLE);
+    assert!(pop(&shared).is_none());
+
+    // Only the first wake queues the job
+    let waker = stored.lock().unwrap().take().unwrap();
+    waker.wake_by_ref();
+    waker.wake_by_ref();
+    assert_eq!(job.state.load(Ordering::Acquire), SCHEDULED);
+    assert!(Arc::ptr_eq(&pop(&shared).unwrap(), &job));
+    assert!(pop(&shared).is_none());
+  }
+
+  #[test]
+  fn wake_while_running_reschedules() {
+    let shared = shared();
+    let job = job(&shared, level(0), FnTask(|waker: &Waker| {
+      waker.wake_by_ref();
+      DecodeStep::Pending
+    }));
+
+    job.clone().run();
+    assert_eq!(job.state.load(Ordering::Acquire), SCHEDULED);
+    assert!(Arc::ptr_eq(&pop(&shared).unwrap(), &job));
+    assert!(pop(&shared).is_none());
+  }
+
+  #[test]
+  fn done_drops_task() {
+    let shared = shared();
+    let dropped = Arc::new(AtomicBool::new(false));
+    let stored = Arc::new(Mutex::new(None::<Waker>));
+    let job = job(&shared, level(0), FnTask({
+      let flag = DropFlag(dropped.clone());
+      let stored = stored.clone();
+      move |waker: &Waker| {
+        assert!(!flag.0.load(Ordering::Acquire));
+        *stored.lock().unwrap() = Some(waker.clone());
+        DecodeStep::Done
+      }
+    }));
+
+    job.clone().run();
+    assert_eq!(job.state.load(Ordering::Acquire), DONE);
+    assert!(dropped.load(Ordering::Acquire));
+
+    // A waker outliving the task does not queue the job again
+    stored.lock().unwrap().take().unwrap().wake();
+    assert!(pop(&shared).is_none());
+  }
+
+  #[test]
+  fn panicking_task_is_done() {
+    let shared = shared();
+    let job = job(&shared, level(0), FnTask(|_: &Waker| -> DecodeStep { panic!("decoder failed") }));
+
+    job.clone().run();
+    assert_eq!(job.state.load(Ordering::Acquire), DONE);
+    assert!(job.task.lock().unwrap().is_none());
+    assert!(pop(&shared).is_none());
+  }
+
+  #[test]
+  fn emptiest_queue_runs_first() {
+    let shared = shared();
+    let jobs = [3, 0, 1, 0].map(|frames| job(&shared, level(frames), FnTask(|_: &Waker| DecodeStep::Done)));
+    for job in &jobs {
+      shared.push(job.clone());
+    }
+
+    // Ties are broken by scheduling order
+    for index in [1, 3, 2, 0] {
+      assert!(Arc::ptr_eq(&pop(&shared).unwrap(), &jobs[index]), "expected job {}", index);
+    }
+    assert!(pop(&shared).is_none());
+  }
+
+  #[test]
+  fn pool_runs_task_to_completion() {
+    let pool = DecodePool::new(2).unwrap();
+    let (wakers, pending) = mpsc::channel();
+    let (done, finished) = mpsc::channel();
+
+    let mut steps = 0;
+    pool.spawn(level(0), FnTask(move |waker: &Waker| {
+      steps += 1;
+      match steps {
+        1 | 2 => DecodeStep::Progress,
+        3 => {
+          wakers.send(waker.clone()).unwrap();
+          DecodeStep::Pending
+        },
+        _ => {
+          done.send(steps).unwrap();
+          DecodeStep::Done
+        }
+      }
+    }));
+
+    let waker = pending.recv_timeout(Duration::from_secs(5)).unwrap();
+    assert!(finished.try_recv().is_err());
+    waker.wake();
+    assert_eq!(finished.recv_timeout(Duration::from_secs(5)).unwrap(), 4);
+    assert_eq!(pool.backlog(), 0);
+  }
+}
@@ -0,0 +1,62 @@
+/// Kernels work on chunks of this many samples, so they are vectorized for the baseline of every target.
+const LANES: usize = 8;
+
+/// Adds `source * gain` to `target`.
+pub fn mix(target: &mut [f32], source: &[f32], gain: f32) {
+  let length = target.len().min(source.len());
+  let (target, source) = (&mut target[..length], &source[..length]);
+
+  let mut target_chunks = target.chunks_exact_mut(LANES);
+  let mut source_chunks = source.chunks_exact(LANES);
+  for (target, source) in (&mut target_chunks).zip(&mut source_chunks) {
+    for lane in 0..LANES {
+      target[lane] += source[lane] * gain;
+    }
+  }
+  for (target, source) in target_chunks.into_remainder().iter_mut().zip(source_chunks.remainder()) {
+    *target += source * gain;
+  }
+}
+
+/// Multiplies `samples` by `gain` in place.
+pub fn scale(samples: &mut [f32], gain: f32) {
+  let mut chunks = samples.chunks_exact_mut(LANES);
+  for chunk in &mut chunks {
+    for lane in 0..LANES {
+      chunk[lane] *= gain;
+    }
+  }
+  for sample in chunks.into_remainder() {
+    *sample *= gain;
+  }
+}
+
+/// Adds interleaved stereo `source` to `target`, with gain changing linearly by `step` per frame starting at `gain`.
+///
+/// Returns gain after the last frame.
+pub fn mix_ramp(target: &mut [f32], source: &[f32], gain: f32, step: f32) -> f32 {
+  let length = target.len().min(source.len());
+  let mut gain = gain;
+  for (target, source) in target[..length].chunks_exact_mut(2).zip(source[..length].chunks_exact(2)) {
+    target[0] += source[0] * gain;
+    target[1] += source[1] * gain;
+    gain += step;
+  }
+  gain
+}
+
+/// Returns peak absolute value of `samples`.
+pub fn peak(samples: &[f32]) -> f32 {
+  let mut peaks = [0f32; LANES];
+  let chunks = samples.chunks_exact(LANES);
+  for (peak, sample) in peaks.iter_mut().zip(chunks.remainder()) {
+    *peak = sample.abs();
+  }
+  for chunk in chunks {
+    for lane in 0..LANES {
+      peaks[lane] = peaks[lane].max(chunk[lane].abs());
+    }
+  }
+
+  peaks.iter().fold(0f32, |peak, &it| peak.max(it))
+}
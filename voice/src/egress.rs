@@ -0,0 +1,242 @@
+use std::{io, net::{SocketAddr, UdpSocket}};
+
+/// Sends a batch of datagrams through one socket with as few syscalls as possible.
+///
+/// On Linux the whole batch goes out in a single `sendmmsg` call (retried only on partial
+/// sends), elsewhere it falls back to one `send_to` per datagram. Scratch buffers are kept
+/// between calls, so a sender should live as long as the thread using it.
+#[derive(Default)]
+pub struct BatchSender {
+  /// Outcome of every datagram of the last batch, in order.
+  outcomes: Vec<SendOutcome>,
+  #[cfg(target_os = "linux")]
+  headers: Vec<libc::mmsghdr>,
+  #[cfg(target_os = "linux")]
+  iovecs: Vec<libc::iovec>,
+  #[cfg(target_os = "linux")]
+  addresses: Vec<libc::sockaddr_storage>
+}
+
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum SendOutcome {
+  Sent,
+  /// The socket buffer was full, nothing is wrong with the route.
+  Dropped,
+  /// Rejected by the kernel, e.g. the destination is unreachable.
+  Failed
+}
+
+#[derive(Debug, Default, Clone, Copy)]
+pub struct BatchResult {
+  pub sent: usize,
+  pub failed: usize,
+  pub syscalls: usize
+}
+
+impl BatchSender {
+  pub fn new() -> Self {
+    Self::default()
+  }
+
+  /// Returns the outcome of every datagram of the last [`BatchSender::send`], in order.
+  pub fn outcomes(&self) -> &[SendOutcome] {
+    &self.outcomes
+  }
+
+  #[cfg(target_os = "linux")]
+  pub fn send<'a, I>(&mut self, socket: &UdpSocket, packets: I) -> BatchResult where I: IntoIterator<Item = (SocketAddr, &'a [u8])> {
+    use std::{mem, os::fd::AsRawFd};
+
+    self.headers.clear();
+    self.iovecs.clear();
+    self.addresses.clear();
+    self.outcomes.clear();
+
+    let mut total = 0;
+    for (address, packet) in packets {
+      let mut storage: libc::sockaddr_storage = unsafe { mem::zeroed() };
+      write_address(&address, &mut storage);
+      self.addresses.push(storage);
+      self.iovecs.push(libc::iovec {
+        iov_base: packet.as_ptr() as *mut libc::c_void,
+        iov_len: packet.len()
+      });
+      self.outcomes.push(SendOutcome::Sent);
+      total += 1;
+    }
+
+    // Pointers are taken only after both vectors stopped growing
+    for index in 0..total {
+      let address = &mut self.addresses[index];
+      let mut header: libc::mmsghdr = unsafe { mem::zeroed() };
+      header.msg_hdr.msg_name = address as *mut libc::sockaddr_storage as *mut libc::c_void;
+      header.msg_hdr.msg_namelen = address_length(address);
+      header.msg_hdr.msg_iov = &mut self.iovecs[index] as *mut libc::iovec;
+      header.msg_hdr.msg_iovlen = 1;
+      self.headers.push(header);
+    }
+
+    let mut result = BatchResult::default();
+    while result.sent + result.failed < total {
+      let offset = result.sent + result.failed;
+      let count = unsafe {
+        libc::sendmmsg(
+          socket.as_raw_fd(),
+          self.headers.as_mut_ptr().add(offset),
+          (total - offset) as _,
+          0
+        )
+      };
+      result.syscalls += 1;
+
+      if count >= 0 {
+        result.sent += count as usize;
+        continue;
+      }
+
+      match io::Error::last_os_error().kind() {
+        io::ErrorKind::Interrupted => continue,
+        // Socket buffer is full, the rest of this tick is dropped
+        io::ErrorKind::WouldBlock => {
+          self.outcomes[offset..].fill(SendOutcome::Dropped);
+          result.failed = total - result.sent;
+        },
+        // The datagram at the head of the batch was rejected, skip it
+        _ => {
+          self.outcomes[offset] = SendOutcome::Failed;
+          result.failed += 1;
+        }
+      }
+    }
+
+    result
+  }
+
+  #[cfg(not(target_os = "linux"))]
+  pub fn send<'a, I>(&mut self, socket: &UdpSocket, packets: I) -> BatchResult where I: IntoIterator<Item = (SocketAddr, &'a [u8])> {
+    self.outcomes.clear();
+    let mut result = BatchResult::default();
+    for (address, packet) in packets {
+      let outcome = match socket.send_to(packet, address) {
+        Ok(_) => SendOutcome::Sent,
+        Err(error) if error.kind() == io::ErrorKind::WouldBlock => SendOutcome::Dropped,
+        Err(_) => SendOutcome::Failed
+      };
+      match outcome {
+        SendOutcome::Sent => result.sent += 1,
+        _ => result.failed += 1
+      }
+      self.outcomes.push(outcome);
+      result.syscalls += 1;
+    }
+
+    result
+  }
+}
+
+#[cfg(target_os = "linux")]
+fn write_address(address: &SocketAddr, storage: &mut libc::sockaddr_storage) {
+  match address {
+    SocketAddr::V4(address) => {
+      let raw = unsafe { &mut *(storage as *mut libc::sockaddr_storage as *mut libc::sockaddr_in) };
+      raw.sin_family = libc::AF_INET as libc::sa_family_t;
+      raw.sin_port = address.port().to_be();
+      raw.sin_addr = libc::in_addr {
+        s_addr: u32::from_ne_bytes(address.ip().octets())
+      };
+    },
+    SocketAddr::V6(address) => {
+      let raw = unsafe { &mut *(storage as *mut libc::sockaddr_storage as *mut libc::sockaddr_in6) };
+      raw.sin6_family = libc::AF_INET6 as libc::sa_family_t;
+      raw.sin6_port = address.port().to_be();
+      raw.sin6_flowinfo = address.flowinfo();
+      raw.sin6_addr = libc::in6_addr {
+        s6_addr: address.ip().octets()
+      };
+      raw.sin6_scope_id = address.scope_id();
+    }
+  }
+}
+
+#[cfg(target_os = "linux")]
+fn address_length(storage: &libc::sockaddr_storage) -> libc::socklen_t {
+  let length = if storage.ss_family == libc::AF_INET6 as libc::sa_family_t {
+    std::mem::size_of::<libc::sockaddr_in6>()
+  } else {
+    std::mem::size_of::<libc::sockaddr_in>()
+  };
+
+  length as libc::socklen_t
+}
+
+#[cfg(test)]
+mod tests {
+  use std::{net::{Ipv4Addr, Ipv6Addr, ToSocketAddrs}, time::Duration};
+  use super::*;
+
+  fn receiver(address: impl ToSocketAddrs) -> (UdpSocket, SocketAddr) {
+    let socket = UdpSocket::bind(address).unwrap();
+    socket.set_read_timeout(Some(Duration::from_secs(5))).unwrap();
+    let address = socket.local_addr().unwrap();
+    (socket, address)
+  }
+
+  fn receive(socket: &UdpSocket) -> Vec<u8> {
+    let mut buffer = [0; 64];
+    let length = socket.recv(&mut buffer).unwrap();
+    buffer[..length].to_vec()
+  }
+
+  #[cfg(target_os = "linux")]
+  #[test]
+  fn batch_reaches_ipv4_and_ipv6_destinations() {
+    // A dual-stack socket takes both address families in one batch
+    let socket = UdpSocket::bind((Ipv6Addr::UNSPECIFIED, 0)).unwrap();
+    let (v4, v4_address) = receiver((Ipv4Addr::LOCALHOST, 0));
+    let (v6, v6_address) = receiver((Ipv6Addr::LOCALHOST, 0));
+
+    let mut sender = BatchSender::new();
+    let packets: [(SocketAddr, &[u8]); 3] = [(v4_address, b"first"), (v6_address, b"second"), (v4_address, b"third")];
+    let result = sender.send(&socket, packets);
+    assert_eq!((result.sent, result.failed, result.syscalls), (3, 0, 1));
+    assert_eq!(sender.outcomes(), [SendOutcome::Sent; 3]);
+
+    assert_eq!(receive(&v4), b"first");
+    assert_eq!(receive(&v6), b"second");
+    assert_eq!(receive(&v4), b"third");
+  }
+
+  #[test]
+  fn rejected_datagram_is_skipped() {
+    // An IPv4 socket cannot send to the IPv6 destination in the middle of the batch
+    let socket = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0)).unwrap();
+    let (v4, v4_address) = receiver((Ipv4Addr::LOCALHOST, 0));
+    let v6_address = SocketAddr::from((Ipv6Addr::LOCALHOST, v4_address.port()));
+
+    let mut sender = BatchSender::new();
+    let packets: [(SocketAddr, &[u8]); 3] = [(v4_address, b"first"), (v6_address, b"second"), (v4_address, b"third")];
+    let result = sender.send(&socket, packets);
+    assert_eq!((result.sent, result.failed), (2, 1));
+    assert_eq!(sender.outcomes(), [SendOutcome::Sent, SendOutcome::Failed, SendOutcome::Sent]);
+    #[cfg(target_os = "linux")]
+    assert_eq!(result.syscalls, 3);
+
+    assert_eq!(receive(&v4), b"first");
+    assert_eq!(receive(&v4), b"third");
+
+    // Scratch buffers of the larger batch are reused
+    let result = sender.send(&socket, [(v4_address, &b"fourth"[..])]);
+    assert_eq!((result.sent, result.failed), (1, 0));
+    assert_eq!(sender.outcomes(), [SendOutcome::Sent]);
+    assert_eq!(receive(&v4), b"fourth");
+  }
+
+  #[test]
+  fn empty_batch_does_nothing() {
+    let socket = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0)).unwrap();
+    let mut sender = BatchSender::new();
+    let result = sender.send(&socket, []);
+    assert_eq!((result.sent, result.failed, result.syscalls), (0, 0, 0));
+    assert!(sender.outcomes().is_empty());
+  }
+}
@@ -1,8 +1,12 @@
-use std::net::IpAddr;
-use anyhow::{Result, Context};
-use serde::{Serialize, Deserialize};
+use std::{fmt, net::IpAddr};
+use serde::{
+  de::{self, DeserializeSeed, IgnoredAny, MapAccess, Visitor},
+  ser::SerializeStruct,
+  Deserialize, Deserializer, Serialize, Serializer
+};
+use serde_json::Value;
 
-use super::{opcode::GatewayOpcode, GatewayPacket};
+use super::opcode::GatewayOpcode;
 
 #[derive(Clone, Debug)]
 pub enum GatewayEvent {
@@ -13,7 +17,9 @@ pub enum GatewayEvent {
   SessionDescription(SessionDescription),
   Speaking(Speaking),
   HeartbeatAck(u64),
-  Hello(Hello)
+  Resume(Resume),
+  Hello(Hello),
+  Resumed
 }
 
 #[derive(Clone, Debug, Serialize, Deserialize)]
@@ -24,6 +30,14 @@ pub struct Identify {
   pub token: String
 }
 
+/// Continues the session of an [`Identify`] on a new gateway connection.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct Resume {
+  pub server_id: u64,
+  pub session_id: String,
+  pub token: String
+}
+
 #[derive(Clone, Debug, Serialize, Deserialize)]
 pub struct SelectProtocol {
   pub protocol: String,
@@ -54,6 +68,8 @@ pub struct SessionDescription {
 #[derive(Clone, Debug, Serialize, Deserialize)]
 pub struct Speaking {
   pub speaking: u8,
+  /// Not sent in speaking updates of other users.
+  #[serde(default)]
   pub delay: u32,
   pub ssrc: u32
 }
@@ -74,7 +90,9 @@ impl From<&GatewayEvent> for GatewayOpcode {
       SessionDescription(_) => GatewayOpcode::SessionDescription,
       Speaking(_) => GatewayOpcode::Speaking,
       HeartbeatAck(_) => GatewayOpcode::HeartbeatAck,
-      Hello(_) => GatewayOpcode::Hello
+      Resume(_) => GatewayOpcode::Resume,
+      Hello(_) => GatewayOpcode::Hello,
+      Resumed => GatewayOpcode::Resumed
     }
   }
 }
@@ -85,41 +103,104 @@ impl From<GatewayEvent> for GatewayOpcode {
   }
 }
 
-impl TryFrom<GatewayPacket> for GatewayEvent {
-  type Error = anyhow::Error; // TODO
-
-  fn try_from(packet: GatewayPacket) -> Result<GatewayEvent, Self::Error> {
-    match packet.opcode {
-      GatewayOpcode::Identify => Ok(GatewayEvent::Identify(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::SelectProtocol => Ok(GatewayEvent::SelectProtocol(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::Ready => Ok(GatewayEvent::Ready(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::Heartbeat => Ok(GatewayEvent::Heartbeat(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::SessionDescription => Ok(GatewayEvent::SessionDescription(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::Speaking => Ok(GatewayEvent::Speaking(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::HeartbeatAck => Ok(GatewayEvent::HeartbeatAck(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      GatewayOpcode::Hello => Ok(GatewayEvent::Hello(serde_json::from_value(packet.data.context("no packet data")?)?)),
-      _ => Err(anyhow::anyhow!("Unsupported opcode: {}", packet.opcode))
+/// Packets are `{"op": <opcode>, "d": <data>}`, the data is (de)serialized directly as the type of the opcode.
+impl Serialize for GatewayEvent {
+  fn serialize<S>(&self, serializer: S) -> Result<S::Ok, S::Error> where S: Serializer {
+    use GatewayEvent::*;
+    let mut packet = serializer.serialize_struct("GatewayPacket", 2)?;
+    packet.serialize_field("op", &GatewayOpcode::from(self))?;
+    match self {
+      Identify(identify) => packet.serialize_field("d", identify)?,
+      SelectProtocol(select_protocol) => packet.serialize_field("d", select_protocol)?,
+      Ready(ready) => packet.serialize_field("d", ready)?,
+      Heartbeat(nonce) => packet.serialize_field("d", nonce)?,
+      SessionDescription(session_description) => packet.serialize_field("d", session_description)?,
+      Speaking(speaking) => packet.serialize_field("d", speaking)?,
+      HeartbeatAck(nonce) => packet.serialize_field("d", nonce)?,
+      Resume(resume) => packet.serialize_field("d", resume)?,
+      Hello(hello) => packet.serialize_field("d", hello)?,
+      Resumed => packet.serialize_field("d", &())?
     }
+    packet.end()
+  }
+}
+
+impl<'de> Deserialize<'de> for GatewayEvent {
+  fn deserialize<D>(deserializer: D) -> Result<Self, D::Error> where D: Deserializer<'de> {
+    deserializer.deserialize_map(PacketVisitor)
   }
 }
 
-impl TryFrom<GatewayEvent> for GatewayPacket {
-  type Error = anyhow::Error; // TODO
+#[derive(Deserialize)]
+#[serde(field_identifier)]
+enum PacketField {
+  #[serde(rename = "op")]
+  Opcode,
+  #[serde(rename = "d")]
+  Data,
+  #[serde(other)]
+  Other
+}
 
-  fn try_from(event: GatewayEvent) -> Result<GatewayPacket, Self::Error> {
-    use GatewayEvent::*;
-    Ok(GatewayPacket {
-      opcode: (&event).into(),
-      data: match event {
-        Identify(identify) => Some(serde_json::to_value(identify)?),
-        SelectProtocol(select_protocol) => Some(serde_json::to_value(select_protocol)?),
-        Ready(ready) => Some(serde_json::to_value(ready)?),
-        Heartbeat(nonce) => Some(serde_json::to_value(nonce)?),
-        SessionDescription(session_description) => Some(serde_json::to_value(session_description)?),
-        Speaking(speaking) => Some(serde_json::to_value(speaking)?),
-        HeartbeatAck(nonce) => Some(serde_json::to_value(nonce)?),
-        Hello(hello) => Some(serde_json::to_value(hello)?)
+struct PacketVisitor;
+
+impl<'de> Visitor<'de> for PacketVisitor {
+  type Value = GatewayEvent;
+
+  fn expecting(&self, formatter: &mut fmt::Formatter) -> fmt::Result {
+    formatter.write_str("a voice gateway packet")
+  }
+
+  fn visit_map<A>(self, mut map: A) -> Result<GatewayEvent, A::Error> where A: MapAccess<'de> {
+    let mut opcode = None;
+    // Discord sends the opcode first, the data is only buffered if it comes before it
+    let mut buffered: Option<Value> = None;
+
+    while let Some(field) = map.next_key()? {
+      match field {
+        PacketField::Opcode => opcode = Some(map.next_value::<GatewayOpcode>()?),
+        PacketField::Data => match opcode {
+          Some(opcode) => {
+            let event = map.next_value_seed(DataSeed(opcode))?;
+            while map.next_entry::<IgnoredAny, IgnoredAny>()?.is_some() {}
+            return Ok(event);
+          },
+          None => buffered = Some(map.next_value()?)
+        },
+        PacketField::Other => {
+          map.next_value::<IgnoredAny>()?;
+        }
       }
+    }
+
+    let opcode = opcode.ok_or_else(|| de::Error::missing_field("op"))?;
+    let data = buffered.ok_or_else(|| de::Error::missing_field("d"))?;
+    DataSeed(opcode).deserialize(data).map_err(de::Error::custom)
+  }
+}
+
+/// Deserializes packet data as the type of its opcode.
+struct DataSeed(GatewayOpcode);
+
+impl<'de> DeserializeSeed<'de> for DataSeed {
+  type Value = GatewayEvent;
+
+  fn deserialize<D>(self, data: D) -> Result<GatewayEvent, D::Error> where D: Deserializer<'de> {
+    Ok(match self.0 {
+      GatewayOpcode::Identify => GatewayEvent::Identify(Deserialize::deserialize(data)?),
+      GatewayOpcode::SelectProtocol => GatewayEvent::SelectProtocol(Deserialize::deserialize(data)?),
+      GatewayOpcode::Ready => GatewayEvent::Ready(Deserialize::deserialize(data)?),
+      GatewayOpcode::Heartbeat => GatewayEvent::Heartbeat(Deserialize::deserialize(data)?),
+      GatewayOpcode::SessionDescription => GatewayEvent::SessionDescription(Deserialize::deserialize(data)?),
+      GatewayOpcode::Speaking => GatewayEvent::Speaking(Deserialize::deserialize(data)?),
+      GatewayOpcode::HeartbeatAck => GatewayEvent::HeartbeatAck(Deserialize::deserialize(data)?),
+      GatewayOpcode::Resume => GatewayEvent::Resume(Deserialize::deserialize(data)?),
+      GatewayOpcode::Hello => GatewayEvent::Hello(Deserialize::deserialize(data)?),
+      GatewayOpcode::Resumed => {
+        IgnoredAny::deserialize(data)?;
+        GatewayEvent::Resumed
+      },
+      opcode => return Err(de::Error::custom(format_args!("unsupported opcode: {}", opcode)))
     })
   }
 }
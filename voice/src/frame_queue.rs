@@ -0,0 +1,526 @@
+use std::{
+  cell::UnsafeCell,
+  sync::{atomic::{AtomicBool, AtomicUsize, Ordering}, Arc, Mutex},
+  task::Waker
+};
+use tokio::sync::Notify;
+
+use crate::constants::{CHANNEL_COUNT, MAX_OPUS_PACKET_SIZE, TIMESTAMP_STEP};
+
+/// Number of interleaved samples in one [`CHUNK_DURATION`](crate::constants::CHUNK_DURATION) frame.
+pub const FRAME_SAMPLES: usize = TIMESTAMP_STEP * CHANNEL_COUNT;
+
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+enum FrameKind {
+  Pcm,
+  Opus
+}
+
+/// A fixed-size queue slot, holding either one PCM frame or one Opus packet.
+pub struct Frame {
+  kind: FrameKind,
+  track_start: bool,
+  epoch: u64,
+  opus_len: usize,
+  pcm: [f32; FRAME_SAMPLES],
+  opus: [u8; MAX_OPUS_PACKET_SIZE]
+}
+
+pub enum FrameData<'a> {
+  Pcm(&'a [f32]),
+  Opus(&'a [u8])
+}
+
+impl Frame {
+  const EMPTY: Frame = Frame {
+    kind: FrameKind::Pcm,
+    track_start: false,
+    epoch: 0,
+    opus_len: 0,
+    pcm: [0.0; FRAME_SAMPLES],
+    opus: [0; MAX_OPUS_PACKET_SIZE]
+  };
+
+  pub fn data(&self) -> FrameData<'_> {
+    match self.kind {
+      FrameKind::Pcm => FrameData::Pcm(&self.pcm),
+      FrameKind::Opus => FrameData::Opus(&self.opus[..self.opus_len])
+    }
+  }
+
+  /// Returns `true` if the first sample of a spliced track is in this frame.
+  pub fn is_track_start(&self) -> bool {
+    self.track_start
+  }
+
+  /// Returns the epoch set by [`FrameProducer::set_epoch`] when this frame was written.
+  pub fn epoch(&self) -> u64 {
+    self.epoch
+  }
+}
+
+struct Shared {
+  slots: Box<[UnsafeCell<Frame>]>,
+  /// Index of the next frame to read, written only by the consumer.
+  head: AtomicUsize,
+  /// Index of the next frame to write, written only by the producer.
+  tail: AtomicUsize,
+  finished: AtomicBool,
+  dropped: AtomicBool,
+  readable: Notify,
+  producer_parked: AtomicBool,
+  producer: Mutex<Option<Waker>>
+}
+
+// Slots in head..tail are only accessed by the consumer, all others only by the producer.
+unsafe impl Sync for Shared {}
+
+impl Shared {
+  fn slot(&self, index: usize) -> *mut Frame {
+    self.slots[index % self.slots.len()].get()
+  }
+
+  fn len(&self) -> usize {
+    // Head first, so the tail read after it is never behind
+    let head = self.head.load(Ordering::Acquire);
+    self.tail.load(Ordering::Acquire).saturating_sub(head)
+  }
+
+  fn wake_producer(&self) {
+    if self.producer_parked.swap(false, Ordering::SeqCst) {
+      if let Some(waker) = self.producer.lock().unwrap().take() {
+        waker.wake();
+      }
+    }
+  }
+}
+
+/// Creates a single-producer/single-consumer queue of `capacity` frames.
+///
+/// The producer is a [`DecodePool`](crate::decode_pool::DecodePool) task woken through a [`Waker`] once
+/// a frame is consumed, the consumer is async and is woken through a [`Notify`]. No allocations happen after creation.
+pub fn frame_queue(capacity: usize) -> (FrameProducer, FrameConsumer) {
+  let shared = Arc::new(Shared {
+    slots: (0..capacity.max(1)).map(|_| UnsafeCell::new(Frame::EMPTY)).collect(),
+    head: AtomicUsize::new(0),
+    tail: AtomicUsize::new(0),
+    finished: AtomicBool::new(false),
+    dropped: AtomicBool::new(false),
+    readable: Notify::new(),
+    producer_parked: AtomicBool::new(false),
+    producer: Mutex::new(None)
+  });
+
+  (
+    FrameProducer {
+      shared: shared.clone(),
+      fill: 0,
+      track_start: false,
+      epoch: 0
+    },
+    FrameConsumer {
+      shared
+    }
+  )
+}
+
+pub struct FrameProducer {
+  shared: Arc<Shared>,
+  /// Number of samples already written to the unpublished PCM frame at `tail`.
+  fill: usize,
+  /// Marks the next written frame as [`Frame::is_track_start`].
+  track_start: bool,
+  epoch: u64
+}
+
+impl FrameProducer {
+  pub fn capacity(&self) -> usize {
+    self.shared.slots.len()
+  }
+
+  /// Returns number of free frame slots.
+  pub fn free_len(&self) -> usize {
+    let head = self.shared.head.load(Ordering::SeqCst);
+    let tail = self.shared.tail.load(Ordering::Relaxed);
+    self.capacity() - (tail - head)
+  }
+
+  /// Marks the frame receiving the next written sample or packet as the start of a new track.
+  pub fn start_track(&mut self) {
+    self.track_start = true;
+  }
+
+  /// Stamps frames written from now on with `epoch`, e.g. to tell frames written before and after a seek apart.
+  ///
+  /// A partially written PCM frame is published first, so no frame mixes two epochs.
+  pub fn set_epoch(&mut self, epoch: u64) {
+    self.flush();
+    self.epoch = epoch;
+  }
+
+  /// Prepares the slot at `tail` for writing, clearing flags left from its previous use.
+  fn begin_frame(&mut self, frame: &mut Frame) {
+    if self.fill == 0 {
+      frame.track_start = false;
+      frame.epoch = self.epoch;
+    }
+    if self.track_start {
+      frame.track_start = true;
+      self.track_start = false;
+    }
+  }
+
+  fn publish(&mut self) {
+    let tail = self.shared.tail.load(Ordering::Relaxed);
+    self.shared.tail.store(tail + 1, Ordering::Release);
+    self.shared.readable.notify_one();
+  }
+
+  /// Appends interleaved samples, returns how many of them fit into the queue.
+  pub fn push_samples(&mut self, mut samples: &[f32]) -> usize {
+    let mut written = 0;
+    while !samples.is_empty() && self.free_len() > 0 {
+      let tail = self.shared.tail.load(Ordering::Relaxed);
+      let frame = unsafe { &mut *self.shared.slot(tail) };
+
+      let count = (FRAME_SAMPLES - self.fill).min(samples.len());
+      self.begin_frame(frame);
+      frame.kind = FrameKind::Pcm;
+      frame.pcm[self.fill..self.fill + count].copy_from_slice(&samples[..count]);
+
+      self.fill += count;
+      written += count;
+      samples = &samples[count..];
+
+      if self.fill == FRAME_SAMPLES {
+        self.fill = 0;
+        self.publish();
+      }
+    }
+
+    written
+  }
+
+  /// Appends an Opus packet as a frame of its own, returns `false` if the queue is full.
+  pub fn push_packet(&mut self, packet: &[u8]) -> bool {
+    self.flush();
+    if self.fill > 0 || self.free_len() == 0 {
+      return false;
+    }
+
+    let tail = self.shared.tail.load(Ordering::Relaxed);
+    let frame = unsafe { &mut *self.shared.slot(tail) };
+    self.begin_frame(frame);
+    frame.kind = FrameKind::Opus;
+    frame.opus_len = packet.len();
+    frame.opus[..packet.len()].copy_from_slice(packet);
+
+    self.publish();
+    true
+  }
+
+  /// Pads a partially written PCM frame with silence and publishes it.
+  pub fn flush(&mut self) {
+    if self.fill == 0 || self.free_len() == 0 {
+      return;
+    }
+
+    let tail = self.shared.tail.load(Ordering::Relaxed);
+    let frame = unsafe { &mut *self.shared.slot(tail) };
+    frame.pcm[self.fill..].fill(0.0);
+
+    self.fill = 0;
+    self.publish();
+  }
+
+  /// Returns number of published frames not yet consumed.
+  pub fn queued(&self) -> usize {
+    self.capacity() - self.free_len()
+  }
+
+  /// Returns a handle reading [`FrameProducer::queued`] from anywhere.
+  pub fn level(&self) -> QueueLevel {
+    QueueLevel(self.shared.clone())
+  }
+
+  /// Returns `true` if the consumer was dropped.
+  pub fn is_closed(&self) -> bool {
+    self.shared.dropped.load(Ordering::Acquire)
+  }
+
+  /// Wakes `waker` once the consumer pops a frame or is dropped.
+  pub fn wake_on_pop(&self, waker: &Waker) {
+    *self.shared.producer.lock().unwrap() = Some(waker.clone());
+    self.shared.producer_parked.store(true, Ordering::SeqCst);
+  }
+
+  /// Returns `true` if a slot is free or the consumer was dropped, otherwise `waker` is woken once either happens.
+  pub fn poll_space(&self, waker: &Waker) -> bool {
+    if self.free_len() > 0 || self.is_closed() {
+      return true;
+    }
+
+    self.wake_on_pop(waker);
+    // Re-check, the consumer could have popped before seeing the parked flag
+    if self.free_len() > 0 || self.is_closed() {
+      self.shared.producer_parked.store(false, Ordering::SeqCst);
+      return true;
+    }
+    false
+  }
+
+  /// Flushes the last frame and marks the end of the stream.
+  pub fn finish(&mut self) {
+    self.flush();
+    self.shared.finished.store(true, Ordering::Release);
+    self.shared.readable.notify_one();
+  }
+}
+
+/// Number of frames queued in a frame queue, see [`FrameProducer::level`].
+#[derive(Clone)]
+pub struct QueueLevel(Arc<Shared>);
+
+impl QueueLevel {
+  pub fn get(&self) -> usize {
+    self.0.len()
+  }
+}
+
+impl Drop for FrameProducer {
+  fn drop(&mut self) {
+    self.finish();
+  }
+}
+
+pub struct FrameConsumer {
+  shared: Arc<Shared>
+}
+
+impl FrameConsumer {
+  pub fn capacity(&self) -> usize {
+    self.shared.slots.len()
+  }
+
+  /// Returns number of frames ready to be read.
+  pub fn len(&self) -> usize {
+    let tail = self.shared.tail.load(Ordering::Acquire);
+    let head = self.shared.head.load(Ordering::Relaxed);
+    tail - head
+  }
+
+  pub fn is_empty(&self) -> bool {
+    self.len() == 0
+  }
+
+  /// Returns `true` if the producer finished and every frame was read.
+  pub fn is_finished(&self) -> bool {
+    self.shared.finished.load(Ordering::Acquire) && self.is_empty()
+  }
+
+  /// Waits until at least `frames` frames are queued or the producer finished.
+  ///
+  /// Returns `false` if the producer finished and there is nothing left to read.
+  pub async fn wait_for(&self, frames: usize) -> bool {
+    loop {
+      let notified = self.shared.readable.notified();
+      if self.len() >= frames.min(self.capacity()) {
+        return true;
+      }
+      if self.shared.finished.load(Ordering::Acquire) {
+        return !self.is_empty();
+      }
+
+      notified.await;
+    }
+  }
+
+  /// Returns the oldest queued frame.
+  pub fn front(&self) -> Option<&Frame> {
+    if self.is_empty() {
+      return None;
+    }
+
+    let head = self.shared.head.load(Ordering::Relaxed);
+    Some(unsafe { &*self.shared.slot(head) })
+  }
+
+  /// Releases the frame returned by [`FrameConsumer::front`].
+  pub fn pop(&mut self) {
+    if self.is_empty() {
+      return;
+    }
+
+    let head = self.shared.head.load(Ordering::Relaxed);
+    self.shared.head.store(head + 1, Ordering::SeqCst);
+    self.shared.wake_producer();
+  }
+}
+
+impl Drop for FrameConsumer {
+  fn drop(&mut self) {
+    self.shared.dropped.store(true, Ordering::SeqCst);
+    self.shared.producer_parked.store(true, Ordering::SeqCst);
+    self.shared.wake_producer();
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::{sync::atomic::AtomicUsize, task::Wake, thread};
+  use super::*;
+
+  #[derive(Default)]
+  struct CountingWaker(AtomicUsize);
+
+  impl Wake for CountingWaker {
+    fn wake(self: Arc<Self>) {
+      self.0.fetch_add(1, Ordering::SeqCst);
+    }
+  }
+
+  fn pcm(frame: &Frame) -> &[f32] {
+    match frame.data() {
+      FrameData::Pcm(samples) => samples,
+      FrameData::Opus(_) => panic!("expected a PCM frame")
+    }
+  }
+
+  #[test]
+  fn samples_are_published_per_frame() {
+    let (mut producer, mut consumer) = frame_queue(4);
+    let samples = vec![0.5; FRAME_SAMPLES + FRAME_SAMPLES / 2];
+    assert_eq!(producer.push_samples(&samples), samples.len());
+    assert_eq!(consumer.len(), 1);
+
+    consumer.pop();
+    producer.flush();
+    let frame = pcm(consumer.front().unwrap());
+    assert!(frame[..FRAME_SAMPLES / 2].iter().all(|&it| it == 0.5));
+    assert!(frame[FRAME_SAMPLES / 2..].iter().all(|&it| it == 0.0));
+  }
+
+  #[test]
+  fn full_queue_wakes_producer_on_pop() {
+    let (mut producer, mut consumer) = frame_queue(2);
+    let samples = vec![1.0; FRAME_SAMPLES * 3];
+    assert_eq!(producer.push_samples(&samples), FRAME_SAMPLES * 2);
+
+    let counter = Arc::new(CountingWaker::default());
+    let waker = Waker::from(counter.clone());
+    assert!(!producer.poll_space(&waker));
+    assert_eq!(counter.0.load(Ordering::SeqCst), 0);
+
+    consumer.pop();
+    assert_eq!(counter.0.load(Ordering::SeqCst), 1);
+    assert!(producer.poll_space(&waker));
+  }
+
+  #[test]
+  fn dropped_consumer_closes_queue() {
+    let (producer, consumer) = frame_queue(1);
+    let counter = Arc::new(CountingWaker::default());
+    producer.wake_on_pop(&Waker::from(counter.clone()));
+
+    drop(consumer);
+    assert!(producer.is_closed());
+    assert_eq!(counter.0.load(Ordering::SeqCst), 1);
+  }
+
+  #[test]
+  fn packets_keep_flags_and_epochs() {
+    let (mut producer, mut consumer) = frame_queue(4);
+    producer.push_samples(&[0.25; 4]);
+    producer.start_track();
+    producer.set_epoch(7);
+    assert!(producer.push_packet(&[1, 2, 3]));
+
+    // The partial PCM frame is published before the epoch changes
+    let frame = consumer.front().unwrap();
+    assert_eq!((frame.epoch(), frame.is_track_start()), (0, false));
+    assert_eq!(&pcm(frame)[..4], &[0.25; 4]);
+    consumer.pop();
+
+    let frame = consumer.front().unwrap();
+    assert_eq!((frame.epoch(), frame.is_track_start()), (7, true));
+    assert!(matches!(frame.data(), FrameData::Opus(&[1, 2, 3])));
+    consumer.pop();
+
+    producer.finish();
+    assert!(consumer.is_finished());
+  }
+
+  #[test]
+  fn track_start_marks_one_frame() {
+    let (mut producer, mut consumer) = frame_queue(1);
+    producer.push_samples(&[0.0; FRAME_SAMPLES / 2]);
+    producer.start_track();
+    producer.push_samples(&[0.0; FRAME_SAMPLES / 2]);
+
+    // The frame holding the first sample of the track is marked, even if it started before
+    assert!(consumer.front().unwrap().is_track_start());
+    consumer.pop();
+
+    // The flag is not left over in the reused slot
+    assert!(producer.push_packet(&[1]));
+    assert!(!consumer.front().unwrap().is_track_start());
+  }
+
+  #[test]
+  fn packet_is_refused_when_full() {
+    let (mut producer, mut consumer) = frame_queue(1);
+    assert!(producer.push_packet(&[1]));
+    assert!(!producer.push_packet(&[2]));
+
+    consumer.pop();
+    assert!(producer.push_packet(&[2]));
+    assert!(matches!(consumer.front().unwrap().data(), FrameData::Opus(&[2])));
+  }
+
+  #[test]
+  fn frames_arrive_in_order_across_threads() {
+    const FRAMES: usize = 10_000;
+    let (mut producer, mut consumer) = frame_queue(8);
+    let writer = thread::spawn(move || {
+      for index in 0..FRAMES {
+        let frame = [index as f32; FRAME_SAMPLES];
+        let mut written = 0;
+        while written < frame.len() {
+          written += producer.push_samples(&frame[written..]);
+          thread::yield_now();
+        }
+      }
+      producer.finish();
+    });
+
+    let mut expected = 0;
+    while !consumer.is_finished() {
+      let Some(frame) = consumer.front() else {
+        thread::yield_now();
+        continue;
+      };
+      let samples = pcm(frame);
+      assert!(samples.iter().all(|&it| it == expected as f32));
+      expected += 1;
+      consumer.pop();
+    }
+
+    writer.join().unwrap();
+    assert_eq!(expected, FRAMES);
+  }
+
+  #[tokio::test]
+  async fn wait_for_returns_on_finish() {
+    let (mut producer, consumer) = frame_queue(4);
+    producer.push_samples(&[0.0; FRAME_SAMPLES]);
+    assert!(consumer.wait_for(1).await);
+
+    producer.finish();
+    assert!(consumer.wait_for(3).await);
+    drop(producer);
+
+    let (producer, consumer) = frame_queue(4);
+    drop(producer);
+    assert!(!consumer.wait_for(1).await);
+  }
+}
@@ -0,0 +1,221 @@
+use std::{io, net::{SocketAddr, UdpSocket}};
+
+/// Largest datagram kept, voice and RTCP packets are far smaller.
+pub const DATAGRAM_SIZE: usize = 2048;
+/// Datagrams received by one call.
+pub const BATCH_SIZE: usize = 32;
+
+/// Receives a batch of datagrams from one socket with as few syscalls as possible.
+///
+/// On Linux a single `recvmmsg` call drains up to [`BATCH_SIZE`] datagrams, elsewhere
+/// it falls back to one `recv_from`. Buffers are allocated once and reused by every call.
+pub struct BatchReceiver {
+  buffers: Box<[[u8; DATAGRAM_SIZE]]>,
+  lengths: [usize; BATCH_SIZE],
+  sources: [Option<SocketAddr>; BATCH_SIZE],
+  #[cfg(target_os = "linux")]
+  headers: Vec<libc::mmsghdr>,
+  #[cfg(target_os = "linux")]
+  iovecs: Vec<libc::iovec>,
+  #[cfg(target_os = "linux")]
+  addresses: Vec<libc::sockaddr_storage>
+}
+
+// Raw pointers in the headers only point into the receiver itself
+unsafe impl Send for BatchReceiver {}
+
+impl BatchReceiver {
+  pub fn new() -> Self {
+    Self {
+      buffers: vec![[0; DATAGRAM_SIZE]; BATCH_SIZE].into_boxed_slice(),
+      lengths: [0; BATCH_SIZE],
+      sources: [None; BATCH_SIZE],
+      #[cfg(target_os = "linux")]
+      headers: Vec::with_capacity(BATCH_SIZE),
+      #[cfg(target_os = "linux")]
+      iovecs: Vec::with_capacity(BATCH_SIZE),
+      #[cfg(target_os = "linux")]
+      addresses: Vec::with_capacity(BATCH_SIZE)
+    }
+  }
+
+  /// Receives datagrams from a non-blocking `socket`, returns how many are available with [`BatchReceiver::get`].
+  ///
+  /// Fails with [`io::ErrorKind::WouldBlock`] if there is nothing to receive.
+  #[cfg(target_os = "linux")]
+  pub fn recv(&mut self, socket: &UdpSocket) -> io::Result<usize> {
+    use std::{mem, os::fd::AsRawFd};
+
+    self.headers.clear();
+    self.iovecs.clear();
+    self.addresses.clear();
+    for buffer in self.buffers.iter_mut() {
+      self.iovecs.push(libc::iovec {
+        iov_base: buffer.as_mut_ptr() as *mut libc::c_void,
+        iov_len: DATAGRAM_SIZE
+      });
+      self.addresses.push(unsafe { mem::zeroed() });
+    }
+
+    // Pointers are taken only after both vectors stopped growing
+    for index in 0..BATCH_SIZE {
+      let mut header: libc::mmsghdr = unsafe { mem::zeroed() };
+      header.msg_hdr.msg_name = &mut self.addresses[index] as *mut libc::sockaddr_storage as *mut libc::c_void;
+      header.msg_hdr.msg_namelen = mem::size_of::<libc::sockaddr_storage>() as libc::socklen_t;
+      header.msg_hdr.msg_iov = &mut self.iovecs[index] as *mut libc::iovec;
+      header.msg_hdr.msg_iovlen = 1;
+      self.headers.push(header);
+    }
+
+    let count = loop {
+      let count = unsafe {
+        libc::recvmmsg(
+          socket.as_raw_fd(),
+          self.headers.as_mut_ptr(),
+          BATCH_SIZE as _,
+          libc::MSG_DONTWAIT,
+          std::ptr::null_mut()
+        )
+      };
+      if count >= 0 {
+        break count as usize;
+      }
+
+      let error = io::Error::last_os_error();
+      if error.kind() != io::ErrorKind::Interrupted {
+        return Err(error);
+      }
+    };
+
+    for index in 0..count {
+      // Truncated datagrams are not voice traffic
+      self.lengths[index] = if self.headers[index].msg_hdr.msg_flags & libc::MSG_TRUNC != 0 {
+        0
+      } else {
+        self.headers[index].msg_len as usize
+      };
+      self.sources[index] = read_address(&self.addresses[index]);
+    }
+    Ok(count)
+  }
+
+  #[cfg(not(target_os = "linux"))]
+  pub fn recv(&mut self, socket: &UdpSocket) -> io::Result<usize> {
+    let (length, address) = socket.recv_from(&mut self.buffers[0])?;
+    self.lengths[0] = length;
+    self.sources[0] = Some(address);
+    Ok(1)
+  }
+
+  /// Returns source address and contents of a datagram of the last [`BatchReceiver::recv`].
+  pub fn get(&self, index: usize) -> Option<(SocketAddr, &[u8])> {
+    let address = self.sources[index]?;
+    Some((address, &self.buffers[index][..self.lengths[index]]))
+  }
+}
+
+impl Default for BatchReceiver {
+  fn default() -> Self {
+    Self::new()
+  }
+}
+
+#[cfg(target_os = "linux")]
+fn read_address(storage: &libc::sockaddr_storage) -> Option<SocketAddr> {
+  use std::net::{Ipv4Addr, Ipv6Addr, SocketAddrV4, SocketAddrV6};
+
+  match storage.ss_family as libc::c_int {
+    libc::AF_INET => {
+      let raw = unsafe { &*(storage as *const libc::sockaddr_storage as *const libc::sockaddr_in) };
+      let ip = Ipv4Addr::from(raw.sin_addr.s_addr.to_ne_bytes());
+      Some(SocketAddr::V4(SocketAddrV4::new(ip, u16::from_be(raw.sin_port))))
+    },
+    libc::AF_INET6 => {
+      let raw = unsafe { &*(storage as *const libc::sockaddr_storage as *const libc::sockaddr_in6) };
+      let ip = Ipv6Addr::from(raw.sin6_addr.s6_addr);
+      Some(SocketAddr::V6(SocketAddrV6::new(ip, u16::from_be(raw.sin6_port), raw.sin6_flowinfo, raw.sin6_scope_id)))
+    },
+    _ => None
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::net::{IpAddr, Ipv4Addr, Ipv6Addr};
+  use super::*;
+
+  fn bind(address: IpAddr) -> UdpSocket {
+    let socket = UdpSocket::bind((address, 0)).unwrap();
+    socket.set_nonblocking(true).unwrap();
+    socket
+  }
+
+  /// Returns the address with IPv4-mapped IPv6 addresses of a dual-stack socket turned back into IPv4.
+  fn canonical(address: SocketAddr) -> SocketAddr {
+    match address.ip() {
+      IpAddr::V6(ip) => ip.to_ipv4_mapped().map_or(address, |ip| SocketAddr::new(IpAddr::V4(ip), address.port())),
+      IpAddr::V4(_) => address
+    }
+  }
+
+  #[cfg(target_os = "linux")]
+  #[test]
+  fn batch_keeps_sources_of_both_families() {
+    let socket = bind(IpAddr::V6(Ipv6Addr::UNSPECIFIED));
+    let port = socket.local_addr().unwrap().port();
+    let v4 = bind(IpAddr::V4(Ipv4Addr::LOCALHOST));
+    let v6 = bind(IpAddr::V6(Ipv6Addr::LOCALHOST));
+
+    v4.send_to(b"first", (Ipv4Addr::LOCALHOST, port)).unwrap();
+    v6.send_to(b"second", (Ipv6Addr::LOCALHOST, port)).unwrap();
+    v4.send_to(b"third", (Ipv4Addr::LOCALHOST, port)).unwrap();
+
+    let mut receiver = BatchReceiver::new();
+    assert_eq!(receiver.recv(&socket).unwrap(), 3);
+    let received = (0..3)
+      .map(|index| receiver.get(index).map(|(address, packet)| (canonical(address), packet.to_vec())).unwrap())
+      .collect::<Vec<_>>();
+    assert_eq!(received, [
+      (v4.local_addr().unwrap(), b"first".to_vec()),
+      (v6.local_addr().unwrap(), b"second".to_vec()),
+      (v4.local_addr().unwrap(), b"third".to_vec())
+    ]);
+  }
+
+  #[cfg(target_os = "linux")]
+  #[test]
+  fn large_backlog_takes_several_batches() {
+    let socket = bind(IpAddr::V4(Ipv4Addr::LOCALHOST));
+    let sender = bind(IpAddr::V4(Ipv4Addr::LOCALHOST));
+    for index in 0..BATCH_SIZE + 8 {
+      sender.send_to(&[index as u8], socket.local_addr().unwrap()).unwrap();
+    }
+
+    let mut receiver = BatchReceiver::new();
+    assert_eq!(receiver.recv(&socket).unwrap(), BATCH_SIZE);
+    assert_eq!(receiver.get(BATCH_SIZE - 1).unwrap().1, &[BATCH_SIZE as u8 - 1]);
+    assert_eq!(receiver.recv(&socket).unwrap(), 8);
+    assert_eq!(receiver.get(7).unwrap().1, &[BATCH_SIZE as u8 + 7]);
+  }
+
+  #[cfg(target_os = "linux")]
+  #[test]
+  fn truncated_datagram_is_emptied() {
+    let socket = bind(IpAddr::V4(Ipv4Addr::LOCALHOST));
+    let sender = bind(IpAddr::V4(Ipv4Addr::LOCALHOST));
+    sender.send_to(&[1; DATAGRAM_SIZE + 1], socket.local_addr().unwrap()).unwrap();
+    sender.send_to(&[2; DATAGRAM_SIZE], socket.local_addr().unwrap()).unwrap();
+
+    let mut receiver = BatchReceiver::new();
+    assert_eq!(receiver.recv(&socket).unwrap(), 2);
+    assert!(receiver.get(0).unwrap().1.is_empty());
+    assert_eq!(receiver.get(1).unwrap().1, &[2; DATAGRAM_SIZE]);
+  }
+
+  #[test]
+  fn empty_socket_would_block() {
+    let socket = bind(IpAddr::V4(Ipv4Addr::LOCALHOST));
+    let error = BatchReceiver::new().recv(&socket).unwrap_err();
+    assert_eq!(error.kind(), io::ErrorKind::WouldBlock);
+  }
+}
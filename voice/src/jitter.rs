@@ -0,0 +1,218 @@
+use std::{
+  sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+  time::Duration
+};
+use tracing::debug;
+
+use crate::constants::CHUNK_DURATION;
+
+#[derive(Debug, Clone)]
+pub struct JitterBufferOptions {
+  /// Buffered audio required before playback starts.
+  pub target: Duration,
+  /// Lower bound the target may shrink to.
+  pub min: Duration,
+  /// Upper bound the target may grow to, also the size of the frame queue.
+  pub max: Duration,
+  /// Added to the target after every underrun or source stall.
+  pub step: Duration,
+  /// Playback time without underruns or stalls after which the target shrinks by `step`.
+  pub decay_after: Duration
+}
+
+impl Default for JitterBufferOptions {
+  fn default() -> Self {
+    Self {
+      target: Duration::from_millis(100),
+      min: Duration::from_millis(60),
+      max: Duration::from_secs(2),
+      step: Duration::from_millis(100),
+      decay_after: Duration::from_secs(30)
+    }
+  }
+}
+
+fn to_frames(duration: Duration) -> usize {
+  ((duration.as_nanos() + CHUNK_DURATION.as_nanos() - 1) / CHUNK_DURATION.as_nanos()) as usize
+}
+
+/// Adaptive depth of the frame queue between the decoder and the send loop.
+///
+/// The target starts at the configured depth (or the source's hint) for every track,
+/// grows on underruns and source stalls and slowly shrinks back while playback is stable.
+/// All state is atomic, so the decoder thread and the send loop never take a lock.
+#[derive(Debug, Default)]
+pub struct JitterBuffer {
+  base_frames: AtomicUsize,
+  min_frames: AtomicUsize,
+  max_frames: AtomicUsize,
+  step_frames: AtomicUsize,
+  decay_frames: AtomicUsize,
+
+  target_frames: AtomicUsize,
+  stable_frames: AtomicUsize,
+  pub underruns: AtomicU64,
+  pub stalls: AtomicU64
+}
+
+impl JitterBuffer {
+  pub fn new(options: JitterBufferOptions) -> Self {
+    let buffer = Self::default();
+    buffer.configure(&options);
+    buffer
+  }
+
+  pub fn configure(&self, options: &JitterBufferOptions) {
+    let max = to_frames(options.max).max(1);
+    let min = to_frames(options.min).min(max);
+
+    self.min_frames.store(min, Ordering::Relaxed);
+    self.max_frames.store(max, Ordering::Relaxed);
+    self.base_frames.store(to_frames(options.target).clamp(min, max), Ordering::Relaxed);
+    self.step_frames.store(to_frames(options.step).max(1), Ordering::Relaxed);
+    self.decay_frames.store(to_frames(options.decay_after).max(1), Ordering::Relaxed);
+    self.reset(None);
+  }
+
+  /// Resets the target for a new track, `hint` is the depth preferred by the source.
+  pub fn reset(&self, hint: Option<Duration>) {
+    let base = self.base_frames.load(Ordering::Relaxed);
+    let target = hint.map_or(base, |it| to_frames(it).max(base));
+
+    self.target_frames.store(target.min(self.max_frames.load(Ordering::Relaxed)), Ordering::Relaxed);
+    self.stable_frames.store(0, Ordering::Relaxed);
+  }
+
+  /// Returns number of frames to buffer before (re)starting playback.
+  pub fn target_frames(&self) -> usize {
+    self.target_frames.load(Ordering::Relaxed)
+  }
+
+  /// Returns size of the frame queue.
+  pub fn capacity_frames(&self) -> usize {
+    self.max_frames.load(Ordering::Relaxed)
+  }
+
+  fn grow(&self) {
+    let max = self.max_frames.load(Ordering::Relaxed);
+    let step = self.step_frames.load(Ordering::Relaxed);
+
+    let target = (self.target_frames() + step).min(max);
+    self.target_frames.store(target, Ordering::Relaxed);
+    self.stable_frames.store(0, Ordering::Relaxed);
+    debug!("jitter buffer target grown to {} frames", target);
+  }
+
+  /// The send loop found no frame to send.
+  pub fn on_underrun(&self) {
+    self.underruns.fetch_add(1, Ordering::Relaxed);
+    self.grow();
+  }
+
+  /// The source had to wait for data, e.g. a network stall.
+  pub fn on_stall(&self) {
+    self.stalls.fetch_add(1, Ordering::Relaxed);
+    self.grow();
+  }
+
+  /// A frame was sent, shrinks the target after a long enough stable run.
+  pub fn on_frame(&self) {
+    let stable = self.stable_frames.fetch_add(1, Ordering::Relaxed) + 1;
+    if stable < self.decay_frames.load(Ordering::Relaxed) {
+      return;
+    }
+
+    let min = self.min_frames.load(Ordering::Relaxed);
+    let step = self.step_frames.load(Ordering::Relaxed);
+    let target = self.target_frames().saturating_sub(step).max(min);
+    self.target_frames.store(target, Ordering::Relaxed);
+    self.stable_frames.store(0, Ordering::Relaxed);
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  fn options() -> JitterBufferOptions {
+    JitterBufferOptions {
+      target: Duration::from_millis(100),
+      min: Duration::from_millis(60),
+      max: Duration::from_millis(300),
+      step: Duration::from_millis(100),
+      decay_after: Duration::from_millis(200)
+    }
+  }
+
+  #[test]
+  fn durations_round_up_to_frames() {
+    assert_eq!(to_frames(Duration::ZERO), 0);
+    assert_eq!(to_frames(Duration::from_millis(1)), 1);
+    assert_eq!(to_frames(Duration::from_millis(20)), 1);
+    assert_eq!(to_frames(Duration::from_millis(21)), 2);
+  }
+
+  #[test]
+  fn target_grows_up_to_max() {
+    let buffer = JitterBuffer::new(options());
+    assert_eq!((buffer.target_frames(), buffer.capacity_frames()), (5, 15));
+
+    buffer.on_underrun();
+    assert_eq!(buffer.target_frames(), 10);
+    buffer.on_stall();
+    buffer.on_underrun();
+    assert_eq!(buffer.target_frames(), 15);
+    assert_eq!((buffer.underruns.load(Ordering::Relaxed), buffer.stalls.load(Ordering::Relaxed)), (2, 1));
+  }
+
+  #[test]
+  fn stable_playback_shrinks_target_to_min() {
+    let buffer = JitterBuffer::new(options());
+    buffer.on_underrun();
+
+    // Every 10 stable frames take one step off, an underrun restarts the count
+    for _ in 0..9 {
+      buffer.on_frame();
+    }
+    buffer.on_underrun();
+    for _ in 0..9 {
+      buffer.on_frame();
+    }
+    assert_eq!(buffer.target_frames(), 15);
+    buffer.on_frame();
+    assert_eq!(buffer.target_frames(), 10);
+
+    for _ in 0..20 {
+      buffer.on_frame();
+    }
+    assert_eq!(buffer.target_frames(), 3);
+  }
+
+  #[test]
+  fn reset_applies_source_hint() {
+    let buffer = JitterBuffer::new(options());
+    buffer.on_underrun();
+    buffer.reset(None);
+    assert_eq!(buffer.target_frames(), 5);
+
+    // Hints only deepen the configured target and stay within the queue
+    buffer.reset(Some(Duration::from_millis(200)));
+    assert_eq!(buffer.target_frames(), 10);
+    buffer.reset(Some(Duration::from_millis(40)));
+    assert_eq!(buffer.target_frames(), 5);
+    buffer.reset(Some(Duration::from_secs(5)));
+    assert_eq!(buffer.target_frames(), 15);
+  }
+
+  #[test]
+  fn invalid_options_are_clamped() {
+    let buffer = JitterBuffer::new(JitterBufferOptions {
+      target: Duration::from_secs(10),
+      min: Duration::from_secs(20),
+      max: Duration::ZERO,
+      step: Duration::ZERO,
+      decay_after: Duration::ZERO
+    });
+    assert_eq!((buffer.target_frames(), buffer.capacity_frames()), (1, 1));
+  }
+}
@@ -4,74 +4,111 @@ pub mod event;
 pub mod provider;
 pub mod ws;
 pub mod udp;
-
-use tokio::{sync::Mutex, select, time::{interval, Interval}};
+pub mod scheduler;
+pub mod egress;
+pub mod frame_queue;
+pub mod jitter;
+pub mod dsp;
+pub mod mixer;
+pub mod silence;
+pub mod ingress;
+pub mod receiver;
+pub mod metrics;
+pub mod crypto;
+pub mod rtcp;
+pub mod bitrate;
+pub mod sender;
+pub mod decode_pool;
+
+use tokio::{sync::{Mutex, Notify}, select, task::JoinHandle, time::{interval, sleep, timeout, Interval}};
 use tracing::*;
 use std::{
-  io,
   fmt::Debug,
   net::IpAddr,
+  ops::{Deref, DerefMut, Range},
   str::FromStr,
-  sync::{Arc, Weak},
+  sync::{atomic::{AtomicBool, AtomicU64, Ordering}, Arc, Weak},
+  task::Waker,
   time::{Duration, Instant}
 };
-use opus::{Encoder, Bitrate, Channels, Application};
 use anyhow::{Result, anyhow, Context};
-use discortp::{
-  MutablePacket,
-  discord::{IpDiscoveryPacket, MutableIpDiscoveryPacket, IpDiscoveryType},
-  rtp::{MutableRtpPacket, RtpType},
-  rtcp::report::{MutableReceiverReportPacket, ReportBlockPacket}
-};
-use flume::RecvError;
-use rand::random;
-use ringbuf::HeapRb;
-use serde::{Deserialize, Serialize};
-use serde_json::Value;
+use discortp::discord::{IpDiscoveryPacket, MutableIpDiscoveryPacket, IpDiscoveryType};
+use flume::{Receiver, Sender};
 use tokio_tungstenite::{tungstenite::protocol::{CloseFrame, frame::coding::CloseCode}};
-use xsalsa20poly1305::{aead::generic_array::GenericArray, TAG_SIZE, XSalsa20Poly1305, KeyInit, Key, AeadInPlace};
 
 pub use opcode::*;
 pub use event::*;
 
 use utils::state_flow::StateFlow;
 use self::{
-  constants::{SAMPLE_RATE, CHANNEL_COUNT, CHUNK_DURATION, TIMESTAMP_STEP},
-  provider::SampleProvider,
-  ws::WebSocketVoiceConnection,
+  constants::{CHANNEL_COUNT, CHUNK_DURATION, SAMPLE_RATE, TIMESTAMP_STEP, MAX_OPUS_PACKET_SIZE, SILENCE_FRAME},
+  provider::{AudioSource, SampleProvider, PacketProvider, SeekMode},
+  frame_queue::{frame_queue, FrameData, FrameProducer, FRAME_SAMPLES},
+  decode_pool::{DecodePool, DecodeStep, DecodeTask},
+  jitter::{JitterBuffer, JitterBufferOptions},
+  mixer::{Mixer, MixerHandle},
+  silence::{SilenceAction, SilenceDetector},
+  bitrate::{BitrateController, EncoderSettings},
+  crypto::{VoiceCipherMode, VoiceCrypto},
+  metrics::ConnectionMetrics,
+  receiver::{EncoderControl, RtcpReceiver},
+  rtcp::ReceiverReport,
+  sender::VoiceSender,
+  ws::{GatewayClosed, WebSocketVoiceConnection},
   udp::UdpVoiceConnection
 };
 
-#[derive(Debug, Serialize, Deserialize)]
-pub struct GatewayPacket {
-  #[serde(rename = "op")]
-  opcode: GatewayOpcode,
-  #[serde(rename = "d")]
-  data: Option<Value>
+/// A [`VoiceSender`] taken out of its connection, put back when dropped.
+struct SenderLease<'a> {
+  slot: &'a std::sync::Mutex<Option<VoiceSender>>,
+  sender: Option<VoiceSender>
 }
 
-impl GatewayPacket {
-  pub fn new<T>(opcode: GatewayOpcode, data: T) -> Self where T: Into<Option<Value>> {
-    Self {
-      opcode,
-      data: data.into()
-    }
+impl<'a> SenderLease<'a> {
+  fn take(slot: &'a std::sync::Mutex<Option<VoiceSender>>) -> Result<Self> {
+    let sender = slot.lock().unwrap().take().context("no voice sender")?;
+    Ok(Self { slot, sender: Some(sender) })
   }
 }
 
-#[derive(Debug, Eq, PartialEq)]
-#[non_exhaustive]
-enum VoiceCipherMode {
-  Normal,
-  Suffix,
-  Lite
+impl Deref for SenderLease<'_> {
+  type Target = VoiceSender;
+
+  fn deref(&self) -> &VoiceSender {
+    self.sender.as_ref().unwrap()
+  }
 }
 
+impl DerefMut for SenderLease<'_> {
+  fn deref_mut(&mut self) -> &mut VoiceSender {
+    self.sender.as_mut().unwrap()
+  }
+}
+
+impl Drop for SenderLease<'_> {
+  fn drop(&mut self) {
+    *self.slot.lock().unwrap() = self.sender.take();
+  }
+}
+
+/// How long before the end of a track [`PlaybackEvent::TrackNearEnd`] is emitted.
+pub const TRACK_NEAR_END: Duration = Duration::from_secs(10);
+
+/// Attempts to resume the gateway session or to move the stream to a new UDP route.
+const RESUME_ATTEMPTS: u32 = 5;
+/// Delay before the second attempt, doubled after every failed one. The first is immediate.
+const RESUME_BACKOFF: Duration = Duration::from_millis(100);
+/// Limit for one reconnect, or for the voice server to answer IP discovery or a renegotiation of UDP.
+const RECOVERY_TIMEOUT: Duration = Duration::from_secs(5);
+/// A route the voice server sent receiver reports on is considered dead after this long without one while sending.
+const REPORT_TIMEOUT: Duration = Duration::from_secs(15);
+
 #[derive(Debug, Clone)]
 pub struct VoiceConnectionOptions {
   pub user_id: u64,
   pub guild_id: u64,
   pub bitrate: Option<u32>,
+  pub jitter_buffer: JitterBufferOptions,
 
   pub endpoint: String,
   pub token: String,
@@ -83,73 +120,125 @@ struct IpDiscoveryResult {
   pub port: u16
 }
 
+/// A UDP route accepted by the voice server, with ciphers for the sender and the RTCP receiver.
+struct NegotiatedRoute {
+  udp: UdpVoiceConnection,
+  ip: IpDiscoveryResult,
+  crypto: [VoiceCrypto; 2]
+}
+
 pub enum VoiceConnectionState {
   Disconnected,
   Connected,
   Playing
 }
 
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum PlaybackEvent {
+  /// The current track is about to end, the next one should be queued with [`VoiceConnection::set_next_source`].
+  TrackNearEnd,
+  /// The first frame of a spliced track was sent.
+  TrackStarted,
+  /// The last queued track ended or playback was stopped.
+  Finished
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ConnectionStats {
+  /// The latest receiver report about our stream.
+  pub report: Option<ReceiverReport>,
+  /// When [`ConnectionStats::report`] was received.
+  pub received_at: Option<Instant>,
+  pub encoder: Option<EncoderSettings>
+}
+
 pub struct VoiceConnection {
   pub ws: Mutex<Option<WebSocketVoiceConnection>>,
-  ws_heartbeat_interval: Mutex<Option<Interval>>,
+  /// Options of the last [`VoiceConnection::connect`], used to resume the session.
+  options: std::sync::Mutex<Option<VoiceConnectionOptions>>,
+  /// Last speaking state sent, restored after a resume.
+  speaking: AtomicBool,
+  /// Session descriptions received by [`VoiceConnection::run_ws_loop`], answers to a renegotiation of UDP.
+  descriptions: (Sender<SessionDescription>, Receiver<SessionDescription>),
   pub udp: Mutex<Option<UdpVoiceConnection>>,
-  cipher: Mutex<Option<XSalsa20Poly1305>>,
-  cipher_mode: VoiceCipherMode,
-  opus_encoder: Mutex<Encoder>,
-  pub sample_provider: Mutex<Option<Box<dyn SampleProvider>>>,
+  /// RTCP receiver of the current UDP route, returns once the route is dropped.
+  receiver: std::sync::Mutex<Option<JoinHandle<RtcpReceiver>>>,
+  /// Taken by [`VoiceConnection::run_udp_loop`] while playing.
+  sender: std::sync::Mutex<Option<VoiceSender>>,
+  stats: Arc<std::sync::Mutex<ConnectionStats>>,
+  pub source: Mutex<Option<AudioSource>>,
+  next_source: std::sync::Mutex<Option<AudioSource>>,
+  /// Wakes a producer waiting for [`VoiceConnection::set_next_source`] or for its input.
+  next_waker: std::sync::Mutex<Option<Waker>>,
+  seek_request: std::sync::Mutex<Option<(Duration, SeekMode, u64)>>,
+  seek_epoch: AtomicU64,
+  pub jitter: JitterBuffer,
+  /// Layers mixed over decoded sources, e.g. sound effects. Only locked by the producer.
+  overlay: std::sync::Mutex<Mixer>,
+  overlay_handle: MixerHandle,
+  stopping: AtomicBool,
+  stop: Notify,
   pub state: StateFlow<VoiceConnectionState>
 }
 
 impl VoiceConnection {
   pub fn new() -> Result<Self> {
+    let overlay = Mixer::new();
+    let overlay_handle = overlay.handle();
+
     Ok(Self {
       ws: Mutex::new(None),
-      ws_heartbeat_interval: Mutex::new(None),
+      options: std::sync::Mutex::new(None),
+      speaking: AtomicBool::new(false),
+      descriptions: flume::unbounded(),
       udp: Mutex::new(None),
-      cipher: Mutex::new(None),
-      cipher_mode: VoiceCipherMode::Suffix,
-      opus_encoder: Mutex::new(Encoder::new(48000, Channels::Stereo, Application::Audio)?),
-      sample_provider: Mutex::new(None),
+      receiver: std::sync::Mutex::new(None),
+      sender: std::sync::Mutex::new(None),
+      stats: Default::default(),
+      source: Mutex::new(None),
+      next_source: std::sync::Mutex::new(None),
+      next_waker: std::sync::Mutex::new(None),
+      seek_request: std::sync::Mutex::new(None),
+      seek_epoch: AtomicU64::new(0),
+      jitter: JitterBuffer::new(Default::default()),
+      overlay: std::sync::Mutex::new(overlay),
+      overlay_handle,
+      stopping: AtomicBool::new(false),
+      stop: Notify::new(),
       state: StateFlow::new(VoiceConnectionState::Disconnected)
     })
   }
 
   pub async fn connect(&self, options: VoiceConnectionOptions) -> Result<()> {
-    if let Some(bitrate) = options.bitrate {
-      self.opus_encoder.lock().await.set_bitrate(Bitrate::Bits(i32::try_from(bitrate)?))?;
-    }
+    self.jitter.configure(&options.jitter_buffer);
+    *self.options.lock().unwrap() = Some(options.clone());
 
     *self.ws.lock().await = Some(WebSocketVoiceConnection::new(options.clone()).await?);
 
     let mut ws_guard = self.ws.lock().await;
     let ws = ws_guard.as_mut().context("no voice gateway connection")?;
 
-    let hello = ws.hello.as_ref().context("no voice hello packet")?;
     let ready = ws.ready.as_ref().context("no voice ready packet")?;
 
-    *self.ws_heartbeat_interval.lock().await = Some(interval(Duration::from_millis(hello.heartbeat_interval.round() as u64)));
+    let udp = UdpVoiceConnection::new(ready).await?;
+    let ip = Self::discover_udp_ip(&udp, ready).await?;
+    let incoming = udp.incoming.clone();
+    *self.udp.lock().await = Some(udp);
 
-    *self.udp.lock().await = Some(UdpVoiceConnection::new(ready).await?);
+    let mode = VoiceCipherMode::negotiate(&ready.modes).context("no supported encryption mode")?;
 
-    let ip = self.discover_udp_ip(ready).await?;
-
-    ws.send(GatewayEvent::SelectProtocol(SelectProtocol {
+    ws.send(&GatewayEvent::SelectProtocol(SelectProtocol {
       protocol: "udp".to_owned(),
       data: SelectProtocolData {
         address: ip.address,
         port: ip.port,
-        mode: "xsalsa20_poly1305_suffix".to_owned()
+        mode: mode.name().to_owned()
       }
-    }).try_into()?).await?;
+    })).await?;
 
+    // Undocumented opcodes (e.g. 18) are dropped by the gateway reader
     let session_description = loop {
-      // Ignore undocumented opcode 18
-      let event: GatewayEvent = match ws.receive().await?.try_into() {
-        Ok(event) => event,
-        Err(_) => continue
-      };
-
-      match event {
+      match ws.receive().await? {
         GatewayEvent::SessionDescription(description) => break description,
         other => {
           warn!("Expected SessionDescription packet, got: {:?}", other);
@@ -158,8 +247,19 @@ impl VoiceConnection {
       }
     };
 
-    let key = Key::from_slice(&session_description.secret_key);
-    *self.cipher.lock().await = Some(XSalsa20Poly1305::new(&key));
+    let mode = VoiceCipherMode::from_name(&session_description.mode)
+      .with_context(|| format!("voice server selected unsupported mode {}", session_description.mode))?;
+    let secret_key = &session_description.secret_key;
+
+    let bitrate = BitrateController::new(options.bitrate);
+    let control = Arc::new(EncoderControl::new(bitrate.settings()));
+    let metrics = Arc::new(ConnectionMetrics::new(options.guild_id));
+    *self.sender.lock().unwrap() = Some(VoiceSender::new(ready.ssrc, secret_key, mode, control.clone(), metrics.clone())?);
+
+    // Started only after IP discovery, which reads the same route
+    *self.stats.lock().unwrap() = ConnectionStats::default();
+    let receiver = RtcpReceiver::new(ready.ssrc, VoiceCrypto::new(mode, secret_key)?, bitrate, control, self.stats.clone(), metrics);
+    *self.receiver.lock().unwrap() = Some(tokio::spawn(receiver.run(incoming)));
 
     self.state.set(VoiceConnectionState::Connected).await?;
 
@@ -167,8 +267,13 @@ impl VoiceConnection {
   }
 
   pub async fn disconnect(&self) -> Result<()> {
+    // Make the send loop release the UDP connection
+    self.stop();
     self.state.set(VoiceConnectionState::Disconnected).await?;
     *self.udp.lock().await = None;
+    if let Some(sender) = self.sender.lock().unwrap().take() {
+      sender.metrics().unregister();
+    }
 
     let mut ws_lock = self.ws.lock().await;
     if let Some(ref mut ws) = *ws_lock {
@@ -179,24 +284,21 @@ impl VoiceConnection {
       *ws_lock = None;
     }
 
-    self.opus_encoder.lock().await.reset_state()?;
-
     Ok(())
   }
 
-  async fn discover_udp_ip(&self, ready: &Ready) -> Result<IpDiscoveryResult> {
-    let mut udp_guard = self.udp.lock().await;
-    let udp = udp_guard.as_mut().context("no voice UDP socket")?;
-
+  async fn discover_udp_ip(udp: &UdpVoiceConnection, ready: &Ready) -> Result<IpDiscoveryResult> {
     let mut buffer = [0; IpDiscoveryPacket::const_packet_size()];
     let mut view = MutableIpDiscoveryPacket::new(&mut buffer).unwrap();
     view.set_pkt_type(IpDiscoveryType::Request);
     view.set_length(70);
     view.set_ssrc(ready.ssrc);
-    udp.socket.send(&buffer).await?;
+    udp.send(&buffer).await?;
 
-    let (length, _address) = udp.socket.recv_from(&mut buffer).await?;
-    let view = IpDiscoveryPacket::new(&buffer[..length]).unwrap();
+    let response = timeout(RECOVERY_TIMEOUT, udp.incoming.recv_async())
+      .await
+      .context("voice server did not answer IP discovery")??;
+    let view = IpDiscoveryPacket::new(&response).context("invalid IP discovery response")?;
     if view.get_pkt_type() != IpDiscoveryType::Response {
       return Err(anyhow!("Invalid response")); // TODO
     }
@@ -213,226 +315,717 @@ impl VoiceConnection {
     })
   }
 
-  pub async fn recv_rtcp_stats(&self, udp: &mut UdpVoiceConnection) -> Result<()> {
-    let mut buffer = [0; 4096];
-    let (length, _address) = match udp.socket.try_recv_from(&mut buffer) {
-      Ok((length, address)) => (length, address),
-      Err(error) if error.kind() == io::ErrorKind::WouldBlock => return Ok(()),
-      Err(error) => return Err(anyhow::anyhow!(error))
-    };
+  /// Returns reception statistics of the voice server and current encoder settings.
+  pub fn stats(&self) -> ConnectionStats {
+    *self.stats.lock().unwrap()
+  }
 
-    let mut nonce_bytes = [0; 24];
-    nonce_bytes.copy_from_slice(&buffer[length - 24..length]);
-    let nonce = GenericArray::from_slice(&nonce_bytes);
+  pub async fn set_speaking(&self, speaking: bool) -> Result<()> {
+    self.speaking.store(speaking, Ordering::Relaxed);
+    let ws = self.ws.lock().await;
+    ws.as_ref().context("no voice gateway connection")?.send_speaking(speaking).await
+  }
+
+  async fn send_heartbeat(&self) -> Result<()> {
+    let ws = self.ws.lock().await;
+    ws.as_ref().context("no voice gateway connection")?.send_heartbeat().await
+  }
 
-    let mut view = MutableReceiverReportPacket::new(&mut buffer[..length - 24]).unwrap();
+  /// Returns events of the current gateway connection and a timer for its heartbeats.
+  async fn gateway_events(&self) -> Result<(async_channel::Receiver<GatewayEvent>, Interval)> {
+    let ws = self.ws.lock().await;
+    let ws = ws.as_ref().context("no voice gateway connection")?;
+    let hello = ws.hello.as_ref().context("no voice hello packet")?;
+
+    Ok((ws.packets.clone(), interval(Duration::from_millis(hello.heartbeat_interval.round() as u64))))
+  }
 
-    let mut tag_bytes = [0; TAG_SIZE];
-    tag_bytes.copy_from_slice(&view.payload_mut()[..TAG_SIZE]);
-    let tag = GenericArray::from_slice(&tag_bytes);
+  /// Handles gateway events and heartbeats, resuming the session if the gateway connection fails
+  /// or stops acknowledging heartbeats. Playback continues over UDP meanwhile.
+  ///
+  /// Returns once the connection is dropped or disconnected, or with an error if the session could not be resumed,
+  /// in which case playback is stopped.
+  pub async fn run_ws_loop(me: Weak<Self>) -> Result<()> {
+    let (mut packets, mut heartbeat) = me.upgrade().context("voice connection dropped")?.gateway_events().await?;
+    let mut ack_pending = false;
 
-    let cipher_guard = self.cipher.lock().await;
-    let cipher = cipher_guard.as_ref().context("no voice cipher")?;
+    while let Some(me) = me.upgrade() {
+      let failure = select! {
+        event = packets.recv() => match event {
+          Ok(GatewayEvent::HeartbeatAck(_)) => {
+            ack_pending = false;
+            continue;
+          },
+          Ok(GatewayEvent::SessionDescription(description)) => {
+            _ = me.descriptions.0.send(description);
+            continue;
+          },
+          Ok(event) => {
+            debug!("<< {:?}", event);
+            continue;
+          },
+          Err(_) => anyhow!("voice gateway connection closed")
+        },
 
-    let data = &mut view.payload_mut()[TAG_SIZE..];
+        _ = heartbeat.tick() => {
+          if ack_pending {
+            anyhow!("voice gateway did not acknowledge the last heartbeat")
+          } else {
+            match me.send_heartbeat().await {
+              Ok(()) => {
+                ack_pending = true;
+                continue;
+              },
+              Err(error) => error
+            }
+          }
+        }
+      };
 
-    cipher.decrypt_in_place_detached(nonce, b"", data, tag).unwrap();
+      // Disconnecting closes the gateway on purpose
+      let close_code = match me.ws.lock().await.as_ref() {
+        Some(ws) => ws.close_code(),
+        None => break
+      };
+      warn!("{:?}, resuming voice session", failure);
 
-    // TODO(Assasans): Support view.rx_report_count != 1
-    let report = ReportBlockPacket::new(data).unwrap();
-    debug!("{report:?}");
+      if let Err(error) = me.resume(close_code.map(GatewayClosed)).await {
+        me.stop();
+        me.state.set(VoiceConnectionState::Disconnected).await?;
+        return Err(error.context("voice session lost"));
+      }
+      match me.gateway_events().await {
+        Ok(events) => (packets, heartbeat) = events,
+        Err(_) => break
+      }
+      ack_pending = false;
+    }
 
     Ok(())
   }
 
-  pub async fn send_voice_packet(&self, ready: &Ready, udp: &mut UdpVoiceConnection, input: &[f32]) -> Result<()> {
-    let cipher_guard = self.cipher.lock().await;
-    let cipher = cipher_guard.as_ref().context("no voice cipher")?;
-
-    let rtp_buffer_length = udp.rtp_buffer.len();
-    let mut view = MutableRtpPacket::new(&mut *udp.rtp_buffer).unwrap();
-    view.set_version(2);
-    view.set_payload_type(RtpType::Unassigned(0x78));
-
-    view.set_sequence(udp.sequence);
-    udp.sequence += 1;
+  /// Replaces the gateway connection with one resuming the same session, retrying with backoff.
+  async fn resume(&self, closed: Option<GatewayClosed>) -> Result<()> {
+    if let Some(closed) = closed.filter(|it| !it.is_resumable()) {
+      return Err(closed.into());
+    }
 
-    view.set_timestamp(udp.timestamp);
-    udp.timestamp += TIMESTAMP_STEP as u32;
+    let options = self.options.lock().unwrap().clone().context("voice connection was never connected")?;
+    let ready = self.ws.lock().await.as_ref().and_then(|it| it.ready.clone()).context("no voice ready packet")?;
+    let started = Instant::now();
+
+    let mut delay = RESUME_BACKOFF;
+    for attempt in 1..=RESUME_ATTEMPTS {
+      let error = match timeout(RECOVERY_TIMEOUT, WebSocketVoiceConnection::resume(&options, ready.clone())).await {
+        Ok(Ok(resumed)) => {
+          let mut ws = self.ws.lock().await;
+          // Disconnected while resuming
+          if ws.is_none() {
+            return Ok(());
+          }
 
-    view.set_ssrc(ready.ssrc);
+          // The session itself is resumed, losing it over the speaking state would be worse
+          if self.speaking.load(Ordering::Relaxed) {
+            if let Err(error) = resumed.send_speaking(true).await {
+              warn!("failed to restore speaking state after resume: {:?}", error);
+            }
+          }
+          *ws = Some(resumed);
+          info!("resumed voice session in {:?} after {} attempts", started.elapsed(), attempt);
+          return Ok(());
+        },
+        Ok(Err(error)) => error,
+        Err(_) => anyhow!("timed out")
+      };
 
-    let payload = view.payload_mut();
+      if error.downcast_ref::<GatewayClosed>().map_or(false, |it| !it.is_resumable()) {
+        return Err(error);
+      }
+      warn!("failed to resume voice session (attempt {} of {}): {:?}", attempt, RESUME_ATTEMPTS, error);
+      if attempt < RESUME_ATTEMPTS {
+        sleep(delay).await;
+        delay *= 2;
+      }
+    }
 
-    assert_eq!(self.cipher_mode, VoiceCipherMode::Suffix); // TODO: Implement rest
-    let nonce_bytes = random::<[u8; 24]>();
-    let nonce = GenericArray::from_slice(&nonce_bytes);
+    Err(anyhow!("voice session not resumed after {} attempts", RESUME_ATTEMPTS))
+  }
 
-    let size = self.opus_encoder.lock().await.encode_float(input, &mut payload[TAG_SIZE..TAG_SIZE + rtp_buffer_length - 12 - nonce_bytes.len()])?;
+  /// Moves the stream to a new UDP route after a send failure, retrying with backoff. The route is switched only once
+  /// the voice server accepted it, then `sender` and the RTCP receiver move to the key the server answered with.
+  /// The receiver is started even if none was running before.
+  ///
+  /// The RTP sequence and timestamp carry on and the frame queue is untouched, so playback continues where it stopped.
+  async fn recover_udp(&self, udp: &mut UdpVoiceConnection, sender: &mut VoiceSender, ready: &Ready) -> Result<()> {
+    let started = Instant::now();
+
+    let mut delay = RESUME_BACKOFF;
+    for attempt in 1..=RESUME_ATTEMPTS {
+      let error = match self.negotiate_udp(ready, sender.mode()).await {
+        Ok(route) => {
+          let ip = route.ip;
+          // Dropping the old route also stops its RTCP receiver
+          *udp = route.udp;
+          self.switch_route(udp, sender, ready, route.crypto).await;
+
+          // Keep the RTP clock in real time, receivers treat the gap like silence
+          for _ in 0..started.elapsed().as_millis() / CHUNK_DURATION.as_millis() {
+            sender.skip_frame();
+          }
+          info!("moved voice stream to {}:{} in {:?} after {} attempts", ip.address, ip.port, started.elapsed(), attempt);
+          return Ok(());
+        },
+        Err(error) => error
+      };
 
-    payload[TAG_SIZE + size..TAG_SIZE + size + nonce_bytes.len()].copy_from_slice(&nonce_bytes);
+      warn!("failed to move voice stream to a new route (attempt {} of {}): {:?}", attempt, RESUME_ATTEMPTS, error);
+      if attempt < RESUME_ATTEMPTS {
+        sleep(delay).await;
+        delay *= 2;
+      }
+    }
 
-    let tag = cipher.encrypt_in_place_detached(
-      nonce,
-      b"",
-      &mut payload[TAG_SIZE..TAG_SIZE + size]
-    );
-    match tag {
-      Ok(tag) => {
-        payload[..TAG_SIZE].copy_from_slice(tag.as_slice());
+    Err(anyhow!("voice UDP not recovered after {} attempts", RESUME_ATTEMPTS))
+  }
 
-        spin_sleep::sleep(udp.deadline - Instant::now());
-        let delta = Instant::now().saturating_duration_since(udp.deadline);
-        udp.deadline = Instant::now() + CHUNK_DURATION;
+  /// Opens a new UDP route, runs IP discovery on it and selects the protocol again. The current route is left as is.
+  async fn negotiate_udp(&self, ready: &Ready, mode: VoiceCipherMode) -> Result<NegotiatedRoute> {
+    let udp = UdpVoiceConnection::new(ready).await?;
+    let ip = Self::discover_udp_ip(&udp, ready).await?;
 
-        if delta > CHUNK_DURATION {
-          warn!("Voice packet deadline exceeded by {:?}", delta);
+    let descriptions = &self.descriptions.1;
+    while descriptions.try_recv().is_ok() {}
+    {
+      let ws = self.ws.lock().await;
+      ws.as_ref().context("no voice gateway connection")?.send(&GatewayEvent::SelectProtocol(SelectProtocol {
+        protocol: "udp".to_owned(),
+        data: SelectProtocolData {
+          address: ip.address,
+          port: ip.port,
+          mode: mode.name().to_owned()
         }
+      })).await?;
+    }
+    let description = timeout(RECOVERY_TIMEOUT, descriptions.recv_async())
+      .await
+      .context("voice server did not answer the UDP renegotiation")??;
+
+    let mode = VoiceCipherMode::from_name(&description.mode)
+      .with_context(|| format!("voice server selected unsupported mode {}", description.mode))?;
+    let crypto = [VoiceCrypto::new(mode, &description.secret_key)?, VoiceCrypto::new(mode, &description.secret_key)?];
+    Ok(NegotiatedRoute { udp, ip, crypto })
+  }
 
-        udp.socket.send(&udp.rtp_buffer[..12 + TAG_SIZE + size + nonce_bytes.len()]).await?;
+  /// Switches `sender` and the RTCP receiver to the negotiated keys, the receiver reads from `udp`.
+  async fn switch_route(&self, udp: &UdpVoiceConnection, sender: &mut VoiceSender, ready: &Ready, [sender_crypto, receiver_crypto]: [VoiceCrypto; 2]) {
+    sender.set_crypto(sender_crypto);
+
+    // Continue the previous receiver to keep the bitrate controller state, or start a new one if it is gone
+    let previous = self.receiver.lock().unwrap().take();
+    let previous = match previous {
+      Some(previous) => match previous.await {
+        Ok(receiver) => Some(receiver),
+        Err(error) => {
+          warn!("RTCP receiver failed: {:?}", error);
+          None
+        }
+      },
+      None => None
+    };
+    let receiver = match previous {
+      Some(mut receiver) => {
+        receiver.set_crypto(receiver_crypto);
+        receiver
       },
-      Err(error) => {
-        return Err(anyhow!(error));
+      None => {
+        let bitrate = self.options.lock().unwrap().as_ref().and_then(|it| it.bitrate);
+        RtcpReceiver::new(
+          ready.ssrc,
+          receiver_crypto,
+          BitrateController::new(bitrate),
+          sender.control().clone(),
+          self.stats.clone(),
+          sender.metrics().clone()
+        )
       }
-    }
+    };
+    *self.receiver.lock().unwrap() = Some(tokio::spawn(receiver.run(udp.incoming.clone())));
+  }
 
-    Ok(())
+  /// Returns `true` if the voice server sends receiver reports but none arrived for [`REPORT_TIMEOUT`] since `since`.
+  ///
+  /// Servers that never send reports are never considered dead.
+  fn reports_missing(&self, since: Instant) -> bool {
+    self.stats.lock().unwrap().received_at.map_or(false, |at| at.max(since).elapsed() > REPORT_TIMEOUT)
   }
 
-  pub async fn run_ws_loop(me: Weak<Self>) -> Result<()> {
-    let packets = {
-      let me = me.upgrade().context("voice connection dropped")?;
-      let mut ws_guard = me.ws.lock().await;
-      let ws = ws_guard.as_mut().context("no voice gateway connection")?;
+  /// Queues `source` to be spliced in right after the current one ends, without a gap.
+  pub fn set_next_source(&self, source: Option<AudioSource>) {
+    *self.next_source.lock().unwrap() = source;
+    self.wake_producer();
+  }
+
+  /// Makes a running [`VoiceConnection::run_udp_loop`] return as soon as possible.
+  pub fn stop(&self) {
+    self.stopping.store(true, Ordering::Relaxed);
+    self.stop.notify_waiters();
 
-      ws.packets.clone()
+    self.wake_producer();
+  }
+
+  fn wake_producer(&self) {
+    if let Some(waker) = self.next_waker.lock().unwrap().take() {
+      waker.wake();
+    }
+  }
+
+  /// Plays [`VoiceConnection::source`] and every source queued with [`VoiceConnection::set_next_source`] after it.
+  ///
+  /// Progress is reported to `events`, the loop returns once the last source is played or
+  /// [`VoiceConnection::stop`] is called.
+  pub async fn run_udp_loop(me: Arc<Self>, events: Sender<PlaybackEvent>) -> Result<()> {
+    let ready = {
+      let mut ws_lock = me.ws.lock().await;
+      let ws = ws_lock.as_mut().context("no voice gateway connection")?;
+      ws.ready.clone().context("no voice ready packet")?
     };
 
-    while let Some(me) = me.upgrade() {
-      let mut interval = me.ws_heartbeat_interval.lock().await;
-
-      select! {
-        event = packets.recv() => {
-          let event = event?;
-          match TryInto::<GatewayEvent>::try_into(event) {
-            Ok(event) => {
-              debug!("<< {:?}", event);
+    // Owned by the producer from now on
+    let source = me.source.lock().await.take();
+    me.jitter.reset(source.as_ref().and_then(AudioSource::buffer_hint));
+    *me.seek_request.lock().unwrap() = None;
+
+    let (producer, mut consumer) = frame_queue(me.jitter.capacity_frames());
+    me.stopping.store(false, Ordering::Relaxed);
+
+    let level = producer.level();
+    DecodePool::global().spawn(level, Producer::new(me.clone(), source, producer, events.clone()));
+
+    let target = me.jitter.target_frames();
+    debug!("waiting for jitter buffer to fill {} frames", target);
+    if !consumer.wait_for(target).await {
+      debug!("audio source is empty");
+      _ = events.send(PlaybackEvent::Finished);
+      return Ok(());
+    }
+    debug!("jitter buffer filled");
+
+    me.state.set(VoiceConnectionState::Playing).await?;
+
+    // A lost route ends playback like a stop, with the same cleanup
+    let mut result = Ok(());
+    {
+      let mut udp_lock = me.udp.lock().await;
+      let udp = udp_lock.as_mut().context("no voice UDP socket")?;
+      // Dropped before the UDP lock, so a disconnect waiting for it sees the sender returned
+      let mut sender = SenderLease::take(&me.sender)?;
+      let metrics = sender.metrics().clone();
+
+      let mut epoch = me.seek_epoch.load(Ordering::Acquire);
+      // Receiver reports are only expected while sending on the current route
+      let mut reports_since = Instant::now();
+      // Playback starts speaking, see Player::play
+      let mut silence = SilenceDetector::new(true);
+      let mut quiet_deadline: Option<Instant> = None;
+      while !me.stopping.load(Ordering::Relaxed) {
+        let seek_epoch = me.seek_epoch.load(Ordering::Acquire);
+        if epoch != seek_epoch {
+          // Drop frames decoded before the seek, then rebuffer from the new position
+          match consumer.front() {
+            Some(frame) if frame.epoch() != seek_epoch => {
+              if frame.is_track_start() {
+                _ = events.send(PlaybackEvent::TrackStarted);
+              }
+              consumer.pop();
+            },
+            Some(_) => {
+              epoch = seek_epoch;
+              // Encoder history belongs to the old position, it would smear it into the first frames
+              if let Err(error) = sender.reset_encoder() {
+                warn!("failed to reset encoder: {:?}", error);
+              }
+              select! {
+                readable = consumer.wait_for(me.jitter.target_frames()) => if !readable { break; },
+                _ = me.stop.notified() => break
+              }
+              reports_since = Instant::now();
+            },
+            None => {
+              if consumer.is_finished() {
+                break;
+              }
+              select! {
+                readable = consumer.wait_for(1) => if !readable { break; },
+                _ = me.stop.notified() => break
+              }
             }
+          }
+          continue;
+        }
+
+        let Some(frame) = consumer.front() else {
+          if consumer.is_finished() {
+            break;
+          }
+
+          // Rebuffer up to the (now deeper) target instead of sending every frame as it arrives
+          me.jitter.on_underrun();
+          metrics.underruns.inc();
+          let target = me.jitter.target_frames();
+          warn!("frame buffer drained, rebuffering {} frames...", target);
+          select! {
+            readable = consumer.wait_for(target) => if !readable { break; },
+            _ = me.stop.notified() => break
+          }
+          reports_since = Instant::now();
+          continue;
+        };
 
-            Err(error) => {
-              warn!("Failed to decode event: {}", error);
+        if frame.is_track_start() {
+          _ = events.send(PlaybackEvent::TrackStarted);
+        }
+
+        metrics.frames.inc();
+        metrics.queue_depth.set(consumer.len() as f64);
+        metrics.queue_target.set(me.jitter.target_frames() as f64);
+
+        let data = frame.data();
+        let action = silence.on_frame(SilenceDetector::is_silent(&data));
+        if let Some(speaking) = silence.take_speaking_change() {
+          debug!("speaking: {}", speaking);
+          // Restored once the gateway is resumed
+          if let Err(error) = me.set_speaking(speaking).await {
+            warn!("failed to update speaking state: {:?}", error);
+          }
+        }
+
+        let sent = match action {
+          SilenceAction::Send => {
+            quiet_deadline = None;
+            match data {
+              FrameData::Pcm(samples) => sender.send_pcm(udp, samples).await,
+              FrameData::Opus(packet) => sender.send_opus(udp, packet).await
             }
+          },
+          SilenceAction::SendSilenceFrame => sender.send_opus(udp, &SILENCE_FRAME).await,
+          SilenceAction::Skip => {
+            metrics.silent_frames.inc();
+            reports_since = Instant::now();
+            // Nothing is queued to pace the loop, keep the RTP clock running in real time
+            sender.skip_frame();
+            let deadline = quiet_deadline.unwrap_or_else(Instant::now) + CHUNK_DURATION;
+            quiet_deadline = Some(deadline);
+            tokio::time::sleep_until(deadline.into()).await;
+            Ok(())
           }
-        },
+        };
+        consumer.pop();
+        me.jitter.on_frame();
 
-        _ = async { interval.as_mut().unwrap().tick().await }, if interval.is_some() => {
-          let mut ws_guard = me.ws.lock().await;
-          let ws = ws_guard.as_mut().context("no voice gateway connection")?;
+        let sent = match sent {
+          Ok(()) if Instant::now() >= udp.heartbeat_time + Duration::from_millis(5000) => udp.send_keepalive(&ready).await,
+          Ok(()) if me.reports_missing(reports_since) => Err(anyhow!("no RTCP receiver report for {:?}", REPORT_TIMEOUT)),
+          sent => sent
+        };
+        // The producer keeps filling the frame queue meanwhile, so the stream resumes without rebuffering
+        if let Err(error) = sent {
+          warn!("voice UDP send failed, moving to a new route: {:?}", error);
+          if let Err(error) = me.recover_udp(udp, &mut *sender, &ready).await {
+            result = Err(error.context("failed to recover voice UDP"));
+            break;
+          }
+          reports_since = Instant::now();
+        }
+      }
 
-          ws.send_heartbeat().await?;
+      if silence.is_speaking() {
+        if let Err(error) = me.set_speaking(false).await {
+          warn!("failed to clear speaking state: {:?}", error);
         }
       }
     }
 
-    Ok(())
+    debug!("play loop finished");
+    me.state.set(VoiceConnectionState::Connected).await?;
+    _ = events.send(PlaybackEvent::Finished);
+    result
   }
 
-  pub async fn run_udp_loop(me: Arc<Self>) -> Result<()> {
-    let packet_size = TIMESTAMP_STEP * CHANNEL_COUNT;
-    let buffer = HeapRb::<f32>::new(SAMPLE_RATE * 2); // TODO(Assasans): Calculate buffer size
-    let (mut producer, mut consumer) = buffer.split();
-    let (stx, srx) = flume::bounded(0);
-    let (tx, rx) = flume::bounded(0);
-    let (dtx, drx) = flume::bounded(0);
+  /// Returns a handle to layers mixed over the playing source.
+  ///
+  /// Layers survive track changes and share the connection's encoder. They are paused
+  /// while an Opus source is passed through, as there are no samples to mix into.
+  pub fn overlay(&self) -> MixerHandle {
+    self.overlay_handle.clone()
+  }
 
-    let clone = me.clone();
+  /// Seeks the playing source, frames already queued are dropped by the send loop.
+  pub fn seek(&self, position: Duration, mode: SeekMode) {
+    let mut request = self.seek_request.lock().unwrap();
+    let epoch = self.seek_epoch.fetch_add(1, Ordering::AcqRel) + 1;
+    *request = Some((position, mode, epoch));
+    drop(request);
 
-    let ready = {
-      let mut ws_lock = me.ws.lock().await;
-      let ws = ws_lock.as_mut().context("no voice gateway connection")?;
-      ws.ready.clone().context("no voice ready packet")?
+    self.wake_producer();
+  }
+
+  fn take_seek(&self) -> Option<(Duration, SeekMode, u64)> {
+    self.seek_request.lock().unwrap().take()
+  }
+}
+
+/// Decodes the sources of one playback into its frame queue, one packet per [`DecodePool`] step,
+/// splicing in queued sources until none is left.
+struct Producer {
+  connection: Arc<VoiceConnection>,
+  source: Option<AudioSource>,
+  producer: FrameProducer,
+  progress: TrackProgress,
+  stalls: StallMonitor,
+  samples: Vec<f32>,
+  /// Decoded samples not pushed yet because the queue was full.
+  pending_samples: Range<usize>,
+  packet: [u8; MAX_OPUS_PACKET_SIZE],
+  /// Length of a decoded packet not pushed yet, `0` if none.
+  pending_packet: usize,
+  /// The source ended, waiting for the next one while audio is left to play.
+  ended: bool
+}
+
+impl Producer {
+  fn new(connection: Arc<VoiceConnection>, source: Option<AudioSource>, mut producer: FrameProducer, events: Sender<PlaybackEvent>) -> Self {
+    producer.set_epoch(connection.seek_epoch.load(Ordering::Acquire));
+    let mut me = Self {
+      connection,
+      source,
+      producer,
+      progress: TrackProgress::new(events),
+      stalls: StallMonitor::new(0),
+      samples: vec![0f32; FRAME_SAMPLES * 6],
+      pending_samples: 0..0,
+      packet: [0; MAX_OPUS_PACKET_SIZE],
+      pending_packet: 0,
+      ended: false
     };
+    me.start_source();
+    me
+  }
 
-    tokio::task::spawn_blocking(move || {
-      let mut data = vec![0f32; packet_size * 6];
+  fn start_source(&mut self) {
+    let (duration, stalls) = match &self.source {
+      Some(AudioSource::Pcm(provider)) => (provider.duration(), provider.stalls()),
+      Some(AudioSource::Opus(provider)) => (provider.duration(), provider.stalls()),
+      None => (None, 0)
+    };
+    self.progress.start(duration);
+    self.stalls = StallMonitor::new(stalls);
+  }
 
-      let mut sample_provider_lock = clone.sample_provider.blocking_lock();
-      let sample_provider = sample_provider_lock.as_mut().context("no sample provider set").unwrap();
+  /// Returns `false` if the queue filled up first.
+  fn push_pending(&mut self) -> bool {
+    if !self.pending_samples.is_empty() {
+      self.pending_samples.start += self.producer.push_samples(&self.samples[self.pending_samples.clone()]);
+      if !self.pending_samples.is_empty() {
+        return false;
+      }
+    }
 
-      'packet: loop {
-        if producer.len() >= producer.capacity() / 2 {
-          // Ready to play, filled
-          _ = stx.try_send(());
-        }
+    if self.pending_packet > 0 {
+      if !self.producer.push_packet(&self.packet[..self.pending_packet]) {
+        return false;
+      }
+      self.pending_packet = 0;
+    }
+    true
+  }
 
-        if producer.free_len() < data.len() {
-          // warn!("sample buffer filled, blocking...");
-          drx.recv().unwrap();
-          continue;
-        }
+  fn wait_for_space(&mut self, waker: &Waker) -> DecodeStep {
+    if self.producer.poll_space(waker) {
+      DecodeStep::Progress
+    } else {
+      DecodeStep::Pending
+    }
+  }
 
-        let size = sample_provider.get_samples(&mut data);
-        producer.push_slice(&data[..size]);
-        if producer.len() >= packet_size {
-          // debug!("wake sender");
-          _ = tx.try_send(());
-        }
-        // got += size;
+  fn end_source(&mut self, waker: &Waker) -> DecodeStep {
+    // Tracks of unknown duration are only known to end here
+    self.progress.near_end();
+    self.ended = true;
+    self.poll_next_source(waker)
+  }
+
+  /// Splices in a queued source, or waits for one until the queued audio is played.
+  fn poll_next_source(&mut self, waker: &Waker) -> DecodeStep {
+    // Registered before checking, so a source queued or a frame played meanwhile wakes the task
+    *self.connection.next_waker.lock().unwrap() = Some(waker.clone());
+    self.producer.wake_on_pop(waker);
+
+    let next = self.connection.next_source.lock().unwrap().take();
+    let Some(next) = next else {
+      return if self.producer.queued() == 0 {
+        DecodeStep::Done
+      } else {
+        DecodeStep::Pending
+      };
+    };
 
-        // debug!("got {} samples", size);
+    debug!("splicing next audio source");
+    self.connection.jitter.reset(next.buffer_hint());
+    self.source = Some(next);
+    self.producer.start_track();
+    self.start_source();
+    self.ended = false;
+    DecodeStep::Progress
+  }
+}
+
+impl DecodeTask for Producer {
+  fn step(&mut self, waker: &Waker) -> DecodeStep {
+    if self.producer.is_closed() || self.connection.stopping.load(Ordering::Relaxed) {
+      return DecodeStep::Done;
+    }
+    if !self.push_pending() {
+      return self.wait_for_space(waker);
+    }
+    if self.ended {
+      return self.poll_next_source(waker);
+    }
+
+    if let Some((position, mode, epoch)) = self.connection.take_seek() {
+      let result = match self.source.as_mut() {
+        Some(AudioSource::Pcm(provider)) => provider.seek(position, mode),
+        Some(AudioSource::Opus(provider)) => provider.seek(position, mode),
+        None => Ok(position)
+      };
+      match result {
+        Ok(actual) => self.progress.seek(actual),
+        Err(error) => warn!("failed to seek audio source: {:?}", error)
+      }
+      self.producer.set_epoch(epoch);
+    }
+
+    // Waiting on a slow input here would hold a pool worker
+    let ready = match self.source.as_ref() {
+      Some(AudioSource::Pcm(provider)) => provider.poll_ready(waker),
+      Some(AudioSource::Opus(provider)) => provider.poll_ready(waker),
+      None => true
+    };
+    if !ready {
+      // A seek or stop wakes the task too, checked again in case one came in before the waker was stored
+      *self.connection.next_waker.lock().unwrap() = Some(waker.clone());
+      let interrupted = self.connection.stopping.load(Ordering::Relaxed) || self.connection.seek_request.lock().unwrap().is_some();
+      return if interrupted { DecodeStep::Progress } else { DecodeStep::Pending };
+    }
+
+    match self.source.as_mut() {
+      Some(AudioSource::Pcm(provider)) => {
+        let size = provider.get_samples(&mut self.samples);
         if size == 0 {
-          break 'packet;
+          return self.end_source(waker);
         }
+        self.stalls.check(&self.connection.jitter, &self.producer, provider.stalls());
+        self.progress.advance(size / CHANNEL_COUNT);
+        self.connection.overlay.lock().unwrap().mix_into(&mut self.samples[..size]);
+        self.pending_samples = 0..size;
+      },
+      Some(AudioSource::Opus(provider)) => {
+        let size = provider.get_packet(&mut self.packet);
+        if size == 0 {
+          return self.end_source(waker);
+        }
+        self.stalls.check(&self.connection.jitter, &self.producer, provider.stalls());
+        self.progress.advance(TIMESTAMP_STEP);
+        self.pending_packet = size;
+      },
+      None => {
+        warn!("no audio source set");
+        return DecodeStep::Done;
       }
-    });
+    }
 
-    debug!("waiting for jitter buffer to fill halfway");
-    srx.recv_async().await?;
-    debug!("jitter buffer filled halfway");
+    if self.push_pending() {
+      DecodeStep::Progress
+    } else {
+      self.wait_for_space(waker)
+    }
+  }
+}
 
-    me.state.set(VoiceConnectionState::Playing).await?;
+/// Emits [`PlaybackEvent::TrackNearEnd`] once per track, [`TRACK_NEAR_END`] before its end.
+struct TrackProgress {
+  events: Sender<PlaybackEvent>,
+  /// Number of samples per channel decoded from the track.
+  position: u64,
+  /// Position at which the track is near its end.
+  near_end_at: Option<u64>,
+  near_end_sent: bool
+}
 
-    {
-      let mut udp_lock = me.udp.lock().await;
-      let udp = udp_lock.as_mut().context("no voice UDP socket")?;
-      udp.deadline = Instant::now();
+impl TrackProgress {
+  fn new(events: Sender<PlaybackEvent>) -> Self {
+    Self {
+      events,
+      position: 0,
+      near_end_at: None,
+      near_end_sent: false
     }
-    'packet: loop {
-      if consumer.len() < packet_size {
-        warn!("sample buffer drained, waiting... {} / {}", consumer.len(), packet_size);
-        match rx.recv_async().await {
-          Ok(()) => {},
-          Err(error) if error == RecvError::Disconnected => break,
-          Err(error) => return Err(anyhow::anyhow!(error))
-        };
-      }
+  }
 
-      while consumer.len() >= packet_size {
-        let mut udp_lock = me.udp.lock().await;
-        let udp = udp_lock.as_mut().context("no voice UDP socket")?;
+  /// Starts tracking a new track of `duration`.
+  fn start(&mut self, duration: Option<Duration>) {
+    self.position = 0;
+    self.near_end_sent = false;
+    self.near_end_at = duration.map(|it| it.saturating_sub(TRACK_NEAR_END).as_millis() as u64 * SAMPLE_RATE as u64 / 1000);
+  }
 
-        let mut data = vec![0f32; packet_size];
-        consumer.pop_slice(&mut data);
-        // debug!("sending {} samples", packet_size);
+  fn seek(&mut self, position: Duration) {
+    self.position = position.as_millis() as u64 * SAMPLE_RATE as u64 / 1000;
+  }
 
-        if consumer.free_len() >= packet_size * 6 {
-          // debug!("sample buffer drained");
-          _ = dtx.try_send(());
-        }
+  fn advance(&mut self, samples: usize) {
+    self.position += samples as u64;
+    if self.near_end_at.map_or(false, |it| self.position >= it) {
+      self.near_end();
+    }
+  }
 
-        me.send_voice_packet(&ready, udp, &data).await?;
-        me.recv_rtcp_stats(udp).await?;
-        // samples.copy_within(packet_size..got, 0);
-        // got -= packet_size;
+  fn near_end(&mut self) {
+    if !self.near_end_sent {
+      self.near_end_sent = true;
+      _ = self.events.send(PlaybackEvent::TrackNearEnd);
+    }
+  }
+}
 
-        if Instant::now() >= udp.heartbeat_time + Duration::from_millis(5000) {
-          udp.send_keepalive(&ready).await?;
-        }
-      }
+/// Reports source stalls to the [`JitterBuffer`] once the queue has first reached its target.
+///
+/// Stalls during the initial fill, or while the queue is deep enough, do not affect playback.
+struct StallMonitor {
+  seen: u64,
+  primed: bool
+}
+
+impl StallMonitor {
+  fn new(stalls: u64) -> Self {
+    Self {
+      seen: stalls,
+      primed: false
     }
+  }
 
-    debug!("play loop finished");
-    me.state.set(VoiceConnectionState::Connected).await?;
-    Ok(())
+  fn check(&mut self, jitter: &JitterBuffer, producer: &FrameProducer, stalls: u64) {
+    let queued = producer.capacity() - producer.free_len();
+    let target = jitter.target_frames();
+    if queued >= target {
+      self.primed = true;
+    }
+
+    if stalls > self.seen {
+      if self.primed && queued < target {
+        debug!("audio source stalled with {} frames queued", queued);
+        jitter.on_stall();
+      }
+      self.seen = stalls;
+    }
   }
 }
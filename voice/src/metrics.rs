@@ -0,0 +1,61 @@
+use std::sync::Arc;
+use utils::metrics::{Counter, Gauge, Histogram, Registry, PROCESSING_BUCKETS, IO_BUCKETS};
+
+use crate::{bitrate::EncoderSettings, rtcp::ReceiverReport};
+
+/// Metrics of one voice connection, labelled with its guild.
+pub struct ConnectionMetrics {
+  guild: String,
+  pub queue_depth: Arc<Gauge>,
+  pub queue_target: Arc<Gauge>,
+  pub underruns: Arc<Counter>,
+  pub frames: Arc<Counter>,
+  pub silent_frames: Arc<Counter>,
+  pub encode: Arc<Histogram>,
+  pub encrypt: Arc<Histogram>,
+  /// Time the send loop waited for room in the scheduler queue, the loop's pacing.
+  pub submit_wait: Arc<Histogram>,
+  /// Packets submitted while the scheduler had nothing queued for the stream, so they were likely late.
+  pub late_packets: Arc<Counter>,
+  pub fraction_lost: Arc<Gauge>,
+  pub cumulative_lost: Arc<Gauge>,
+  pub jitter: Arc<Gauge>,
+  pub bitrate: Arc<Gauge>
+}
+
+impl ConnectionMetrics {
+  pub fn new(guild_id: u64) -> Self {
+    let registry = Registry::global();
+    let guild = guild_id.to_string();
+    let labels = [("guild", guild.as_str())];
+
+    Self {
+      queue_depth: registry.gauge("mosaik_voice_queue_frames", "Frames decoded ahead of the send loop", &labels),
+      queue_target: registry.gauge("mosaik_voice_queue_target_frames", "Jitter buffer target depth", &labels),
+      underruns: registry.counter("mosaik_voice_underruns_total", "Times the frame queue ran dry during playback", &labels),
+      frames: registry.counter("mosaik_voice_frames_total", "Frames played", &labels),
+      silent_frames: registry.counter("mosaik_voice_silent_frames_total", "Frames not transmitted because of silence", &labels),
+      encode: registry.histogram("mosaik_voice_encode_seconds", "Opus encode time per frame", PROCESSING_BUCKETS, &labels),
+      encrypt: registry.histogram("mosaik_voice_encrypt_seconds", "Encryption time per packet", PROCESSING_BUCKETS, &labels),
+      submit_wait: registry.histogram("mosaik_voice_submit_wait_seconds", "Wait for room in the packet scheduler queue", IO_BUCKETS, &labels),
+      late_packets: registry.counter("mosaik_voice_late_packets_total", "Packets submitted to an empty scheduler queue", &labels),
+      fraction_lost: registry.gauge("mosaik_voice_rtcp_fraction_lost", "Fraction of packets lost in the latest receiver report", &labels),
+      cumulative_lost: registry.gauge("mosaik_voice_rtcp_cumulative_lost", "Packets lost in total, from receiver reports", &labels),
+      jitter: registry.gauge("mosaik_voice_rtcp_jitter_seconds", "Interarrival jitter from receiver reports", &labels),
+      bitrate: registry.gauge("mosaik_voice_bitrate", "Opus encoder bitrate in bits per second, 0 if picked by libopus", &labels),
+      guild
+    }
+  }
+
+  pub fn record_report(&self, report: &ReceiverReport, settings: EncoderSettings) {
+    self.fraction_lost.set(report.fraction_lost as f64);
+    self.cumulative_lost.set(report.cumulative_lost as f64);
+    self.jitter.set(report.jitter.as_secs_f64());
+    self.bitrate.set(settings.bitrate.unwrap_or(0) as f64);
+  }
+
+  /// Removes series of the guild from the registry, handles keep working but are no longer exported.
+  pub fn unregister(&self) {
+    Registry::global().remove("guild", &self.guild);
+  }
+}
@@ -0,0 +1,461 @@
+use std::{
+  ops::Range,
+  ptr,
+  sync::{atomic::{AtomicPtr, AtomicU64, Ordering}, Arc},
+  task::Waker,
+  time::Duration
+};
+use tracing::debug;
+
+use crate::{
+  constants::{CHANNEL_COUNT, SAMPLE_RATE},
+  decode_pool::{DecodePool, DecodeStep, DecodeTask},
+  dsp::{mix, mix_ramp},
+  frame_queue::{frame_queue, FrameConsumer, FrameData, FrameProducer, FRAME_SAMPLES},
+  provider::SampleProvider
+};
+
+pub type LayerId = u64;
+
+/// Frames each layer decodes ahead of the mixer.
+const LAYER_FRAMES: usize = 10;
+
+#[derive(Debug, Clone)]
+pub struct LayerOptions {
+  pub gain: f32,
+  /// Fades the layer in from silence.
+  pub fade_in: Duration
+}
+
+impl Default for LayerOptions {
+  fn default() -> Self {
+    Self {
+      gain: 1.0,
+      fade_in: Duration::ZERO
+    }
+  }
+}
+
+enum Command {
+  Add(LayerId, FrameConsumer, LayerOptions),
+  Fade {
+    id: LayerId,
+    gain: f32,
+    duration: Duration,
+    remove: bool
+  },
+  Clear
+}
+
+struct Node<T> {
+  value: T,
+  next: *mut Node<T>
+}
+
+/// Multi-producer, single-consumer queue that never blocks either side.
+///
+/// Producers push onto an atomic stack, the consumer takes the whole stack at once,
+/// so nodes are never popped one at a time and can not be reused under a reader.
+struct CommandQueue<T> {
+  head: AtomicPtr<Node<T>>
+}
+
+unsafe impl<T: Send> Send for CommandQueue<T> {}
+unsafe impl<T: Send> Sync for CommandQueue<T> {}
+
+impl<T> CommandQueue<T> {
+  fn new() -> Self {
+    Self {
+      head: AtomicPtr::new(ptr::null_mut())
+    }
+  }
+
+  fn push(&self, value: T) {
+    let node = Box::into_raw(Box::new(Node { value, next: ptr::null_mut() }));
+    let mut head = self.head.load(Ordering::Relaxed);
+    loop {
+      unsafe { (*node).next = head; }
+      match self.head.compare_exchange_weak(head, node, Ordering::Release, Ordering::Relaxed) {
+        Ok(_) => break,
+        Err(current) => head = current
+      }
+    }
+  }
+
+  /// Calls `f` with every queued value, in order of pushes.
+  fn drain(&self, mut f: impl FnMut(T)) {
+    let mut node = self.head.swap(ptr::null_mut(), Ordering::Acquire);
+    if node.is_null() {
+      return;
+    }
+
+    // The stack is newest first
+    let mut reversed = ptr::null_mut();
+    while !node.is_null() {
+      let next = unsafe { (*node).next };
+      unsafe { (*node).next = reversed; }
+      reversed = node;
+      node = next;
+    }
+
+    while !reversed.is_null() {
+      let node = unsafe { Box::from_raw(reversed) };
+      reversed = node.next;
+      f(node.value);
+    }
+  }
+}
+
+impl<T> Drop for CommandQueue<T> {
+  fn drop(&mut self) {
+    self.drain(drop);
+  }
+}
+
+fn duration_to_frames(duration: Duration) -> u64 {
+  (duration.as_micros() * SAMPLE_RATE as u128 / 1_000_000) as u64
+}
+
+/// Decodes a layer into its frame queue on the [`DecodePool`], so a slow source never holds up the mixer.
+struct LayerDecoder {
+  provider: Box<dyn SampleProvider>,
+  producer: FrameProducer,
+  samples: Vec<f32>,
+  /// Samples of the last read not yet pushed to the queue.
+  pending: Range<usize>
+}
+
+impl DecodeTask for LayerDecoder {
+  fn step(&mut self, waker: &Waker) -> DecodeStep {
+    if self.producer.is_closed() {
+      return DecodeStep::Done;
+    }
+
+    if !self.pending.is_empty() {
+      self.pending.start += self.producer.push_samples(&self.samples[self.pending.clone()]);
+      if !self.pending.is_empty() {
+        return if self.producer.poll_space(waker) { DecodeStep::Progress } else { DecodeStep::Pending };
+      }
+    }
+
+    if !self.provider.poll_ready(waker) {
+      return DecodeStep::Pending;
+    }
+
+    let size = self.provider.get_samples(&mut self.samples);
+    if size == 0 {
+      self.producer.finish();
+      return DecodeStep::Done;
+    }
+    self.pending = 0..size;
+    DecodeStep::Progress
+  }
+}
+
+struct Envelope {
+  gain: f32,
+  target_gain: f32,
+  /// Gain change per frame while fading.
+  step: f32,
+  /// Frames left until `target_gain` is reached.
+  fade_frames: u64,
+  remove_after_fade: bool
+}
+
+impl Envelope {
+  fn fade(&mut self, gain: f32, duration: Duration, remove: bool) {
+    self.target_gain = gain;
+    self.remove_after_fade = remove;
+    self.fade_frames = duration_to_frames(duration);
+    if self.fade_frames == 0 {
+      self.gain = gain;
+      self.step = 0.0;
+    } else {
+      self.step = (gain - self.gain) / self.fade_frames as f32;
+    }
+  }
+
+  /// Mixes `source` into `out` with the current gain, advancing the fade.
+  fn mix_into(&mut self, out: &mut [f32], source: &[f32]) {
+    let frames = (source.len() / CHANNEL_COUNT) as u64;
+    let ramp = frames.min(self.fade_frames);
+    if ramp > 0 {
+      let ramp_samples = ramp as usize * CHANNEL_COUNT;
+      self.gain = mix_ramp(&mut out[..ramp_samples], &source[..ramp_samples], self.gain, self.step);
+      self.fade_frames -= ramp;
+      if self.fade_frames == 0 {
+        self.gain = self.target_gain;
+      }
+    }
+
+    let rest = ramp as usize * CHANNEL_COUNT;
+    if self.gain != 0.0 && rest < source.len() {
+      mix(&mut out[rest..source.len()], &source[rest..], self.gain);
+    }
+  }
+
+  fn is_faded_out(&self) -> bool {
+    self.remove_after_fade && self.fade_frames == 0
+  }
+}
+
+struct Layer {
+  id: LayerId,
+  frames: FrameConsumer,
+  /// Samples of the front frame already mixed.
+  offset: usize,
+  envelope: Envelope
+}
+
+impl Layer {
+  /// Mixes samples the layer has already decoded into `out`, returns `false` if the layer is finished.
+  ///
+  /// A layer that has not decoded far enough is mixed only partially, it never makes the mixer wait.
+  fn mix_into(&mut self, out: &mut [f32]) -> bool {
+    let mut mixed = 0;
+    while mixed < out.len() {
+      let Some(frame) = self.frames.front() else {
+        break;
+      };
+      let FrameData::Pcm(samples) = frame.data() else {
+        unreachable!("layers are decoded to PCM");
+      };
+
+      let count = (samples.len() - self.offset).min(out.len() - mixed);
+      self.envelope.mix_into(&mut out[mixed..mixed + count], &samples[self.offset..self.offset + count]);
+      mixed += count;
+      self.offset += count;
+      if self.offset == samples.len() {
+        self.offset = 0;
+        self.frames.pop();
+      }
+    }
+
+    !self.frames.is_finished() && !self.envelope.is_faded_out()
+  }
+}
+
+/// Sums any number of [`SampleProvider`]s into one, each with its own gain and fade envelope.
+///
+/// Layers are added and removed through a [`MixerHandle`] without ever blocking the mixing thread.
+/// Each layer is decoded by its own [`DecodePool`] task, the mixer only sums what is already decoded.
+pub struct Mixer {
+  commands: Arc<CommandQueue<Command>>,
+  next_id: Arc<AtomicU64>,
+  layers: Vec<Layer>
+}
+
+impl Mixer {
+  pub fn new() -> Self {
+    Self {
+      commands: Arc::new(CommandQueue::new()),
+      next_id: Arc::new(AtomicU64::new(0)),
+      layers: Vec::new()
+    }
+  }
+
+  pub fn handle(&self) -> MixerHandle {
+    MixerHandle {
+      commands: self.commands.clone(),
+      next_id: self.next_id.clone()
+    }
+  }
+
+  pub fn is_empty(&self) -> bool {
+    self.layers.is_empty()
+  }
+
+  fn apply_commands(&mut self) {
+    let layers = &mut self.layers;
+    self.commands.drain(|command| match command {
+      Command::Add(id, frames, options) => {
+        let mut envelope = Envelope {
+          gain: 0.0,
+          target_gain: options.gain,
+          step: 0.0,
+          fade_frames: 0,
+          remove_after_fade: false
+        };
+        envelope.fade(options.gain, options.fade_in, false);
+        layers.push(Layer {
+          id,
+          frames,
+          offset: 0,
+          envelope
+        });
+      },
+      Command::Fade { id, gain, duration, remove } => {
+        if let Some(layer) = layers.iter_mut().find(|it| it.id == id) {
+          layer.envelope.fade(gain, duration, remove);
+        }
+      },
+      Command::Clear => layers.clear()
+    });
+  }
+
+  /// Adds every layer to interleaved stereo `out`, returns `false` if there are no layers.
+  pub fn mix_into(&mut self, out: &mut [f32]) -> bool {
+    self.apply_commands();
+    if self.layers.is_empty() {
+      return false;
+    }
+
+    self.layers.retain_mut(|layer| {
+      let playing = layer.mix_into(out);
+      if !playing {
+        debug!("mixer layer {} finished", layer.id);
+      }
+      playing
+    });
+    true
+  }
+}
+
+impl Default for Mixer {
+  fn default() -> Self {
+    Self::new()
+  }
+}
+
+impl SampleProvider for Mixer {
+  /// Returns silence while layers are fading, ends once the last layer is finished.
+  fn get_samples(&mut self, out: &mut [f32]) -> usize {
+    out.fill(0.0);
+    if self.mix_into(out) {
+      out.len()
+    } else {
+      0
+    }
+  }
+}
+
+/// Controls layers of a [`Mixer`] from any thread.
+#[derive(Clone)]
+pub struct MixerHandle {
+  commands: Arc<CommandQueue<Command>>,
+  next_id: Arc<AtomicU64>
+}
+
+impl MixerHandle {
+  /// Adds a layer, `provider` is decoded on the [`DecodePool`] ahead of the mixer.
+  pub fn add(&self, provider: Box<dyn SampleProvider>, options: LayerOptions) -> LayerId {
+    let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+    let (producer, consumer) = frame_queue(LAYER_FRAMES);
+    let level = producer.level();
+    DecodePool::global().spawn(level, LayerDecoder {
+      provider,
+      producer,
+      samples: vec![0.0; FRAME_SAMPLES],
+      pending: 0..0
+    });
+
+    self.commands.push(Command::Add(id, consumer, options));
+    id
+  }
+
+  /// Changes gain of a layer linearly over `duration`.
+  pub fn set_gain(&self, id: LayerId, gain: f32, duration: Duration) {
+    self.commands.push(Command::Fade { id, gain, duration, remove: false });
+  }
+
+  /// Fades a layer out over `duration` and removes it.
+  pub fn remove(&self, id: LayerId, fade_out: Duration) {
+    self.commands.push(Command::Fade { id, gain: 0.0, duration: fade_out, remove: true });
+  }
+
+  /// Fades `from` out while `provider` fades in, returns ID of the new layer.
+  pub fn crossfade(&self, from: LayerId, provider: Box<dyn SampleProvider>, duration: Duration) -> LayerId {
+    self.remove(from, duration);
+    self.add(provider, LayerOptions {
+      gain: 1.0,
+      fade_in: duration
+    })
+  }
+
+  pub fn clear(&self) {
+    self.commands.push(Command::Clear);
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::{thread, time::Instant};
+  use super::*;
+
+  struct Constant {
+    value: f32,
+    left: usize
+  }
+
+  impl SampleProvider for Constant {
+    fn get_samples(&mut self, samples: &mut [f32]) -> usize {
+      let size = samples.len().min(self.left);
+      samples[..size].fill(self.value);
+      self.left -= size;
+      size
+    }
+  }
+
+  /// Mixes [`FRAME_SAMPLES`] at a time once every layer decoded a frame, until the mixer is empty.
+  fn mix_all(mixer: &mut Mixer) -> Vec<f32> {
+    let mut output = Vec::new();
+    let started = Instant::now();
+    loop {
+      mixer.apply_commands();
+      let ready = mixer.layers.iter().all(|it| !it.frames.is_empty() || it.frames.is_finished());
+      if !ready {
+        assert!(started.elapsed() < Duration::from_secs(5), "layers were not decoded");
+        thread::sleep(Duration::from_millis(1));
+        continue;
+      }
+
+      let mut out = vec![0.0; FRAME_SAMPLES];
+      if !mixer.mix_into(&mut out) {
+        return output;
+      }
+      output.extend_from_slice(&out);
+      if mixer.is_empty() {
+        return output;
+      }
+    }
+  }
+
+  #[test]
+  fn sums_layers_with_gain() {
+    let mut mixer = Mixer::new();
+    let handle = mixer.handle();
+    handle.add(Box::new(Constant { value: 1.0, left: FRAME_SAMPLES * 3 }), LayerOptions { gain: 0.5, fade_in: Duration::ZERO });
+    handle.add(Box::new(Constant { value: 0.25, left: FRAME_SAMPLES * 3 }), LayerOptions::default());
+
+    // A frame of silence may follow if the end of the layers is seen only after their last frame is mixed
+    let output = mix_all(&mut mixer);
+    assert!(output.len() >= FRAME_SAMPLES * 3);
+    assert!(output[..FRAME_SAMPLES * 3].iter().all(|&it| (it - 0.75).abs() < 1e-6));
+    assert!(output[FRAME_SAMPLES * 3..].iter().all(|&it| it == 0.0));
+  }
+
+  #[test]
+  fn fades_in() {
+    let mut mixer = Mixer::new();
+    mixer.handle().add(Box::new(Constant { value: 1.0, left: FRAME_SAMPLES * 4 }), LayerOptions {
+      gain: 1.0,
+      fade_in: Duration::from_millis(40)
+    });
+
+    let output = mix_all(&mut mixer);
+    assert!(output[0].abs() < 0.01);
+    assert!(output[FRAME_SAMPLES] > 0.4 && output[FRAME_SAMPLES] < 0.6);
+    assert!(output[FRAME_SAMPLES * 2..FRAME_SAMPLES * 4].iter().all(|&it| (it - 1.0).abs() < 1e-6));
+  }
+
+  #[test]
+  fn unbuffered_layer_never_blocks() {
+    let mut mixer = Mixer::new();
+    mixer.handle().add(Box::new(Constant { value: 1.0, left: FRAME_SAMPLES }), LayerOptions::default());
+    mixer.apply_commands();
+
+    // Nothing may be decoded yet, the call returns right away either way
+    let mut out = vec![0.0; FRAME_SAMPLES];
+    assert!(mixer.mix_into(&mut out));
+  }
+}
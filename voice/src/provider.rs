@@ -1,7 +1,97 @@
+use std::{task::Waker, time::Duration};
+use anyhow::{Result, anyhow};
+
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum SeekMode {
+  /// Seek to the nearest position the container can seek to without decoding, usually a packet or keyframe.
+  Coarse,
+  /// Seek to exactly the requested position, decoding and dropping samples before it.
+  Accurate
+}
+
 /// Audio sample provider for [`VoiceConnection`](crate::VoiceConnection).
 pub trait SampleProvider: Sync + Send {
   /// Returned samples are in 32-bit floating-point PCM format at 48 kHz sample rate.
   ///
   /// If no more samples are available, this function will return `0`.
   fn get_samples(&mut self, samples: &mut [f32]) -> usize;
+
+  /// Returns the jitter buffer depth this source prefers, e.g. deeper for network streams.
+  fn buffer_hint(&self) -> Option<Duration> {
+    None
+  }
+
+  /// Returns `false` if getting samples now would block on the input, `waker` is then woken once it would not.
+  ///
+  /// Lets the [`DecodePool`](crate::decode_pool::DecodePool) run other streams meanwhile instead of blocking a worker.
+  fn poll_ready(&self, _waker: &Waker) -> bool {
+    true
+  }
+
+  /// Returns how many times reading the underlying input had to wait for data.
+  fn stalls(&self) -> u64 {
+    0
+  }
+
+  /// Returns total duration of the track, if known.
+  fn duration(&self) -> Option<Duration> {
+    None
+  }
+
+  /// Moves playback to `position`, returns the position actually seeked to.
+  fn seek(&mut self, _position: Duration, _mode: SeekMode) -> Result<Duration> {
+    Err(anyhow!("seeking is not supported"))
+  }
+}
+
+/// Pre-encoded Opus packet provider for [`VoiceConnection`](crate::VoiceConnection).
+///
+/// Packets are sent as is, skipping the encoder entirely.
+pub trait PacketProvider: Sync + Send {
+  /// Writes the next Opus packet into `packet` and returns its size.
+  /// Every packet must contain exactly [`TIMESTAMP_STEP`](crate::constants::TIMESTAMP_STEP) samples
+  /// per channel at 48 kHz and be at most [`MAX_OPUS_PACKET_SIZE`](crate::constants::MAX_OPUS_PACKET_SIZE) bytes.
+  ///
+  /// If no more packets are available, this function will return `0`.
+  fn get_packet(&mut self, packet: &mut [u8]) -> usize;
+
+  /// See [`SampleProvider::buffer_hint`].
+  fn buffer_hint(&self) -> Option<Duration> {
+    None
+  }
+
+  /// See [`SampleProvider::poll_ready`].
+  fn poll_ready(&self, _waker: &Waker) -> bool {
+    true
+  }
+
+  /// See [`SampleProvider::stalls`].
+  fn stalls(&self) -> u64 {
+    0
+  }
+
+  /// See [`SampleProvider::duration`].
+  fn duration(&self) -> Option<Duration> {
+    None
+  }
+
+  /// See [`SampleProvider::seek`], packets are never split so [`SeekMode::Accurate`] is precise
+  /// to one packet.
+  fn seek(&mut self, _position: Duration, _mode: SeekMode) -> Result<Duration> {
+    Err(anyhow!("seeking is not supported"))
+  }
+}
+
+pub enum AudioSource {
+  Pcm(Box<dyn SampleProvider>),
+  Opus(Box<dyn PacketProvider>)
+}
+
+impl AudioSource {
+  pub fn buffer_hint(&self) -> Option<Duration> {
+    match self {
+      AudioSource::Pcm(provider) => provider.buffer_hint(),
+      AudioSource::Opus(provider) => provider.buffer_hint()
+    }
+  }
 }
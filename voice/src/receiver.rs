@@ -0,0 +1,119 @@
+use std::{sync::{atomic::{AtomicU64, Ordering}, Arc, Mutex}, time::Instant};
+use anyhow::{Result, Context};
+use flume::Receiver;
+use tracing::{debug, trace};
+
+use crate::{
+  ConnectionStats,
+  bitrate::{BitrateController, EncoderSettings},
+  crypto::{VoiceCrypto, RTCP_HEADER_SIZE},
+  metrics::ConnectionMetrics,
+  rtcp::{parse_reports, report_count}
+};
+
+/// Encoder settings published by the [`RtcpReceiver`] and picked up by the [`VoiceSender`](crate::sender::VoiceSender)
+/// between frames, with a single atomic load.
+#[derive(Debug)]
+pub struct EncoderControl {
+  /// Bitrate in the high half, `0` for the automatic bitrate, packet loss percent in the low half.
+  settings: AtomicU64
+}
+
+impl EncoderControl {
+  pub fn new(settings: EncoderSettings) -> Self {
+    Self {
+      settings: AtomicU64::new(Self::pack(settings))
+    }
+  }
+
+  pub fn load(&self) -> EncoderSettings {
+    let packed = self.settings.load(Ordering::Relaxed);
+    EncoderSettings {
+      bitrate: match (packed >> 32) as u32 {
+        0 => None,
+        bitrate => Some(bitrate)
+      },
+      packet_loss_percent: packed as u32 as i32
+    }
+  }
+
+  pub fn store(&self, settings: EncoderSettings) {
+    self.settings.store(Self::pack(settings), Ordering::Relaxed);
+  }
+
+  fn pack(settings: EncoderSettings) -> u64 {
+    (settings.bitrate.unwrap_or(0) as u64) << 32 | settings.packet_loss_percent as u32 as u64
+  }
+}
+
+/// Handles RTCP packets of one connection off the send path: decrypts receiver reports,
+/// records them in [`ConnectionStats`] and drives the [`BitrateController`].
+pub struct RtcpReceiver {
+  ssrc: u32,
+  crypto: VoiceCrypto,
+  bitrate: BitrateController,
+  control: Arc<EncoderControl>,
+  stats: Arc<Mutex<ConnectionStats>>,
+  metrics: Arc<ConnectionMetrics>
+}
+
+impl RtcpReceiver {
+  pub fn new(
+    ssrc: u32,
+    crypto: VoiceCrypto,
+    bitrate: BitrateController,
+    control: Arc<EncoderControl>,
+    stats: Arc<Mutex<ConnectionStats>>,
+    metrics: Arc<ConnectionMetrics>
+  ) -> Self {
+    Self {
+      ssrc,
+      crypto,
+      bitrate,
+      control,
+      stats,
+      metrics
+    }
+  }
+
+  /// Switches to the key of a renegotiated UDP connection.
+  pub fn set_crypto(&mut self, crypto: VoiceCrypto) {
+    self.crypto = crypto;
+  }
+
+  /// Runs until the route of `incoming` is removed, i.e. the UDP connection is dropped,
+  /// and returns the receiver so it can continue on a new route.
+  pub async fn run(mut self, incoming: Receiver<Vec<u8>>) -> Self {
+    while let Ok(mut packet) = incoming.recv_async().await {
+      if let Err(error) = self.handle(&mut packet) {
+        debug!("dropped RTCP packet: {:?}", error);
+      }
+    }
+    debug!("RTCP receiver for {} finished", self.ssrc);
+    self
+  }
+
+  fn handle(&mut self, packet: &mut [u8]) -> Result<()> {
+    let Some(count) = report_count(&packet[..packet.len().min(RTCP_HEADER_SIZE)]) else {
+      trace!("ignoring non-report packet of {} bytes", packet.len());
+      return Ok(());
+    };
+
+    let data = self.crypto.open_rtcp(packet).context("failed to open receiver report")?;
+    for report in parse_reports(data, count).filter(|it| it.ssrc == self.ssrc) {
+      debug!("{report:?}");
+      if let Some(settings) = self.bitrate.on_report(&report) {
+        self.control.store(settings);
+      }
+      self.metrics.record_report(&report, self.bitrate.settings());
+
+      *self.stats.lock().unwrap() = ConnectionStats {
+        report: Some(report),
+        received_at: Some(Instant::now()),
+        encoder: Some(self.bitrate.settings())
+      };
+    }
+
+    Ok(())
+  }
+}
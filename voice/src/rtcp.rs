@@ -0,0 +1,63 @@
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use crate::constants::SAMPLE_RATE;
+
+/// RTCP packet type of receiver reports.
+pub const RECEIVER_REPORT: u8 = 201;
+const REPORT_BLOCK_SIZE: usize = 24;
+/// Seconds between the NTP and Unix epochs.
+const NTP_UNIX_OFFSET: u64 = 2_208_988_800;
+
+/// Reception statistics of one of our streams, as reported by the voice server.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ReceiverReport {
+  pub ssrc: u32,
+  /// Fraction of packets lost since the previous report, from 0 to 1.
+  pub fraction_lost: f32,
+  pub cumulative_lost: i32,
+  pub highest_sequence: u32,
+  /// Interarrival jitter.
+  pub jitter: Duration,
+  /// Round trip time, only known if the server has received a sender report from us.
+  pub rtt: Option<Duration>
+}
+
+/// Returns number of report blocks of an RTCP receiver report, from its unencrypted header.
+pub fn report_count(header: &[u8]) -> Option<usize> {
+  match header {
+    [first, packet_type, ..] if first >> 6 == 2 && *packet_type == RECEIVER_REPORT => Some((first & 0x1f) as usize),
+    _ => None
+  }
+}
+
+/// Parses up to `count` report blocks from a decrypted receiver report payload.
+pub fn parse_reports(data: &[u8], count: usize) -> impl Iterator<Item = ReceiverReport> + '_ {
+  data.chunks_exact(REPORT_BLOCK_SIZE).take(count).map(|block| {
+    let word = |index: usize| u32::from_be_bytes(block[index..index + 4].try_into().unwrap());
+
+    // Cumulative loss is a signed 24 bit integer
+    let cumulative_lost = ((word(4) << 8) as i32) >> 8;
+    let last_sender_report = word(16);
+    let delay = word(20);
+
+    ReceiverReport {
+      ssrc: word(0),
+      fraction_lost: block[4] as f32 / 256.0,
+      cumulative_lost,
+      highest_sequence: word(8),
+      jitter: Duration::from_micros(word(12) as u64 * 1_000_000 / SAMPLE_RATE as u64),
+      rtt: (last_sender_report != 0).then(|| {
+        let rtt = ntp_middle(SystemTime::now()).wrapping_sub(last_sender_report).wrapping_sub(delay);
+        Duration::from_micros(rtt as u64 * 1_000_000 / 65536)
+      })
+    }
+  })
+}
+
+/// Middle 32 bits of an NTP timestamp, the clock that sender report timestamps in receiver reports use.
+pub fn ntp_middle(time: SystemTime) -> u32 {
+  let since_epoch = time.duration_since(UNIX_EPOCH).unwrap_or_default();
+  let seconds = since_epoch.as_secs() + NTP_UNIX_OFFSET;
+  let fraction = (since_epoch.subsec_nanos() as u64 * 65536 / 1_000_000_000) as u32;
+  ((seconds as u32) << 16) | fraction
+}
@@ -0,0 +1,281 @@
+use std::{
+  net::SocketAddr,
+  sync::{atomic::{AtomicU32, Ordering}, Arc, OnceLock, Weak},
+  thread,
+  time::{Duration, Instant}
+};
+use anyhow::{Result, anyhow};
+use flume::{Receiver, Sender, TryRecvError};
+use spin_sleep::SpinSleeper;
+use tracing::{debug, warn};
+use utils::metrics::{Counter, Histogram, Registry};
+
+use crate::{constants::CHUNK_DURATION, egress::{BatchSender, SendOutcome}, udp::SharedSocket};
+
+/// Number of slots [`CHUNK_DURATION`] is split into. Every stream is assigned to one slot
+/// and is served once per wheel revolution.
+pub const WHEEL_SLOTS: usize = 20;
+pub const TICK_DURATION: Duration = Duration::from_nanos((CHUNK_DURATION.as_nanos() / WHEEL_SLOTS as u128) as u64);
+
+/// Number of packets a stream may have queued ahead of its deadline.
+/// Submitting more blocks the connection's send loop, which paces it to real time.
+pub const STREAM_QUEUE_DEPTH: usize = 3;
+pub const PACKET_CAPACITY: usize = 1460;
+/// Consecutive packets of a stream the kernel rejected before [`StreamHandle::is_failing`] reports it, 100 ms of audio.
+pub const SEND_FAILURE_LIMIT: u32 = 5;
+
+/// Upper bounds of the tick lateness histogram buckets, the last bucket is unbounded.
+pub const LATENESS_BUCKETS: [Duration; 8] = [
+  Duration::from_micros(50),
+  Duration::from_micros(100),
+  Duration::from_micros(250),
+  Duration::from_micros(500),
+  Duration::from_millis(1),
+  Duration::from_millis(2),
+  Duration::from_millis(5),
+  CHUNK_DURATION
+];
+
+struct ScheduledStream {
+  socket: Arc<SharedSocket>,
+  remote: SocketAddr,
+  packets: Receiver<Vec<u8>>,
+  recycle: Sender<Vec<u8>>,
+  /// Packets rejected in a row, reset by every packet sent.
+  failures: AtomicU32
+}
+
+/// Connection side of a stream registered in the [`PacketScheduler`].
+///
+/// The stream is removed from the scheduler when the handle is dropped.
+pub struct StreamHandle {
+  stream: Arc<ScheduledStream>,
+  packets: Sender<Vec<u8>>,
+  recycle: Receiver<Vec<u8>>
+}
+
+impl StreamHandle {
+  /// Returns an empty packet buffer, reusing one already sent by the scheduler if possible.
+  pub fn buffer(&self) -> Vec<u8> {
+    match self.recycle.try_recv() {
+      Ok(mut buffer) => {
+        buffer.clear();
+        buffer
+      },
+      Err(_) => Vec::with_capacity(PACKET_CAPACITY)
+    }
+  }
+
+  /// Queues a ready-to-send packet, waiting if the stream is [`STREAM_QUEUE_DEPTH`] packets ahead.
+  pub async fn submit(&self, packet: Vec<u8>) -> Result<()> {
+    self.packets.send_async(packet).await.map_err(|_| anyhow!("packet scheduler stopped"))
+  }
+
+  /// Returns number of packets queued and not yet sent.
+  pub fn queued(&self) -> usize {
+    self.stream.packets.len()
+  }
+
+  /// Returns `true` if the last [`SEND_FAILURE_LIMIT`] packets were rejected, i.e. the route is probably gone.
+  pub fn is_failing(&self) -> bool {
+    self.stream.failures.load(Ordering::Relaxed) >= SEND_FAILURE_LIMIT
+  }
+}
+
+/// Scheduler counters, exported through the global metrics [`Registry`].
+#[derive(Debug)]
+pub struct SchedulerStats {
+  pub packets: Arc<Counter>,
+  pub syscalls: Arc<Counter>,
+  pub send_errors: Arc<Counter>,
+  /// How late every tick woke up, its count is the number of ticks.
+  pub lateness: Arc<Histogram>
+}
+
+impl SchedulerStats {
+  fn new() -> Self {
+    let registry = Registry::global();
+    Self {
+      packets: registry.counter("mosaik_scheduler_packets_total", "Voice packets sent", &[]),
+      syscalls: registry.counter("mosaik_scheduler_syscalls_total", "Send syscalls made", &[]),
+      send_errors: registry.counter("mosaik_scheduler_send_errors_total", "Voice packets that failed to send", &[]),
+      lateness: registry.histogram("mosaik_scheduler_tick_lateness_seconds", "Time between a tick deadline and the wakeup", &LATENESS_BUCKETS, &[])
+    }
+  }
+}
+
+struct Wheel {
+  slots: Vec<Vec<Weak<ScheduledStream>>>,
+  batch: Vec<(Arc<ScheduledStream>, Vec<u8>)>,
+  streams: Receiver<Weak<ScheduledStream>>,
+  stats: Arc<SchedulerStats>
+}
+
+impl Wheel {
+  fn insert(&mut self, stream: Weak<ScheduledStream>) {
+    let slot = self.slots
+      .iter_mut()
+      .min_by_key(|it| it.len())
+      .unwrap();
+    slot.push(stream);
+  }
+
+  /// Sends all packets due in this tick, one batch per shared socket.
+  fn send_batch(&mut self, sender: &mut BatchSender) {
+    if self.batch.is_empty() {
+      return;
+    }
+
+    self.batch.sort_unstable_by_key(|(stream, _)| Arc::as_ptr(&stream.socket) as usize);
+    for group in self.batch.chunk_by(|(a, _), (b, _)| Arc::ptr_eq(&a.socket, &b.socket)) {
+      let result = sender.send(
+        &group[0].0.socket.egress,
+        group.iter().map(|(stream, packet)| (stream.remote, packet.as_slice()))
+      );
+
+      self.stats.packets.add(result.sent as u64);
+      self.stats.send_errors.add(result.failed as u64);
+      self.stats.syscalls.add(result.syscalls as u64);
+
+      for ((stream, _), outcome) in group.iter().zip(sender.outcomes()) {
+        match outcome {
+          SendOutcome::Sent => stream.failures.store(0, Ordering::Relaxed),
+          SendOutcome::Failed => {
+            stream.failures.fetch_add(1, Ordering::Relaxed);
+          },
+          SendOutcome::Dropped => {}
+        }
+      }
+    }
+
+    for (stream, packet) in self.batch.drain(..) {
+      _ = stream.recycle.try_send(packet);
+    }
+  }
+
+  fn run(mut self) {
+    let sleeper = SpinSleeper::default();
+    let mut sender = BatchSender::new();
+    let mut tick = 0;
+    let mut deadline = Instant::now();
+
+    loop {
+      if self.slots.iter().all(Vec::is_empty) {
+        // Nothing to send, park until a stream is registered
+        match self.streams.recv() {
+          Ok(stream) => self.insert(stream),
+          Err(_) => break
+        }
+        deadline = Instant::now();
+      }
+
+      loop {
+        match self.streams.try_recv() {
+          Ok(stream) => self.insert(stream),
+          Err(TryRecvError::Empty) => break,
+          Err(TryRecvError::Disconnected) => return
+        }
+      }
+
+      sleeper.sleep(deadline.saturating_duration_since(Instant::now()));
+      let lateness = Instant::now().saturating_duration_since(deadline);
+      self.stats.lateness.observe(lateness);
+
+      let batch = &mut self.batch;
+      self.slots[tick % WHEEL_SLOTS].retain(|stream| match stream.upgrade() {
+        Some(stream) => {
+          if let Ok(packet) = stream.packets.try_recv() {
+            batch.push((stream, packet));
+          }
+          true
+        },
+        None => false
+      });
+      self.send_batch(&mut sender);
+
+      tick += 1;
+      deadline += TICK_DURATION;
+
+      if lateness > CHUNK_DURATION {
+        // Do not burst the missed ticks, skip them
+        warn!("Voice packet deadline exceeded by {:?}", lateness);
+        deadline = Instant::now() + TICK_DURATION;
+      }
+    }
+  }
+}
+
+/// Process-wide voice packet scheduler.
+///
+/// A small number of timing threads, each holding a timer wheel of registered streams.
+/// Connections hand over ready (encrypted) packets and every stream is sent one packet
+/// per [`CHUNK_DURATION`], so async tasks never have to sleep toward a deadline.
+/// Packets due in the same tick are sent with one [`BatchSender`] call per socket.
+pub struct PacketScheduler {
+  wheels: Vec<Sender<Weak<ScheduledStream>>>,
+  stats: Arc<SchedulerStats>
+}
+
+impl PacketScheduler {
+  pub fn new(threads: usize) -> Result<Self> {
+    let stats = Arc::new(SchedulerStats::new());
+    let mut wheels = Vec::with_capacity(threads);
+
+    for index in 0..threads.max(1) {
+      let (tx, rx) = flume::unbounded();
+      let wheel = Wheel {
+        slots: vec![Vec::new(); WHEEL_SLOTS],
+        batch: Vec::new(),
+        streams: rx,
+        stats: stats.clone()
+      };
+
+      thread::Builder::new()
+        .name(format!("voice-scheduler-{}", index))
+        .spawn(move || wheel.run())?;
+      wheels.push(tx);
+    }
+    debug!("started packet scheduler with {} threads", wheels.len());
+
+    Ok(Self {
+      wheels,
+      stats
+    })
+  }
+
+  /// Returns the shared scheduler, starting it on first use.
+  pub fn global() -> &'static PacketScheduler {
+    static SCHEDULER: OnceLock<PacketScheduler> = OnceLock::new();
+    SCHEDULER.get_or_init(|| {
+      let threads = thread::available_parallelism().map_or(1, |it| (it.get() / 8).clamp(1, 4));
+      PacketScheduler::new(threads).expect("failed to start packet scheduler")
+    })
+  }
+
+  /// Registers a stream, packets submitted to the returned handle are sent through `socket` to `remote`.
+  pub fn register(&self, socket: Arc<SharedSocket>, remote: SocketAddr) -> Result<StreamHandle> {
+    let (packets_tx, packets_rx) = flume::bounded(STREAM_QUEUE_DEPTH);
+    let (recycle_tx, recycle_rx) = flume::bounded(STREAM_QUEUE_DEPTH + 1);
+    let stream = Arc::new(ScheduledStream {
+      socket,
+      remote,
+      packets: packets_rx,
+      recycle: recycle_tx,
+      failures: AtomicU32::new(0)
+    });
+
+    // Keep all streams of a socket on one wheel so their packets can share batches
+    let index = stream.socket.id % self.wheels.len();
+    self.wheels[index].send(Arc::downgrade(&stream)).map_err(|_| anyhow!("packet scheduler stopped"))?;
+
+    Ok(StreamHandle {
+      stream,
+      packets: packets_tx,
+      recycle: recycle_rx
+    })
+  }
+
+  pub fn stats(&self) -> &SchedulerStats {
+    &self.stats
+  }
+}
@@ -0,0 +1,207 @@
+use std::{sync::Arc, time::Instant};
+use anyhow::{Result, Context, anyhow};
+use discortp::{
+  MutablePacket,
+  rtp::{MutableRtpPacket, RtpType},
+  wrap::{Wrap16, Wrap32}
+};
+use opus::{Application, Bitrate, Channels, Encoder};
+use rand::random;
+use tracing::warn;
+
+use crate::{
+  bitrate::EncoderSettings,
+  constants::{SAMPLE_RATE, TIMESTAMP_STEP},
+  crypto::{VoiceCipherMode, VoiceCrypto},
+  metrics::ConnectionMetrics,
+  scheduler::PACKET_CAPACITY,
+  receiver::EncoderControl,
+  udp::UdpVoiceConnection
+};
+
+const RTP_HEADER_SIZE: usize = 12;
+
+/// Everything needed to build voice packets of one connection: the Opus encoder, the cipher and the RTP state.
+///
+/// Owned by the send loop for the duration of playback, so nothing on the send path is shared or locked.
+pub struct VoiceSender {
+  ssrc: u32,
+  encoder: Encoder,
+  crypto: VoiceCrypto,
+  control: Arc<EncoderControl>,
+  /// Settings of `control` the encoder is configured with.
+  settings: EncoderSettings,
+  metrics: Arc<ConnectionMetrics>,
+  sequence: Wrap16,
+  timestamp: Wrap32
+}
+
+impl VoiceSender {
+  pub fn new(ssrc: u32, secret_key: &[u8], mode: VoiceCipherMode, control: Arc<EncoderControl>, metrics: Arc<ConnectionMetrics>) -> Result<Self> {
+    let settings = control.load();
+    let mut encoder = Encoder::new(SAMPLE_RATE as u32, Channels::Stereo, Application::Audio)?;
+    Self::configure_encoder(&mut encoder, settings)?;
+
+    Ok(Self {
+      ssrc,
+      encoder,
+      crypto: VoiceCrypto::new(mode, secret_key)?,
+      control,
+      settings,
+      metrics,
+      sequence: random::<u16>().into(),
+      timestamp: random::<u32>().into()
+    })
+  }
+
+  pub fn ssrc(&self) -> u32 {
+    self.ssrc
+  }
+
+  pub fn mode(&self) -> VoiceCipherMode {
+    self.crypto.mode()
+  }
+
+  pub fn metrics(&self) -> &Arc<ConnectionMetrics> {
+    &self.metrics
+  }
+
+  pub fn control(&self) -> &Arc<EncoderControl> {
+    &self.control
+  }
+
+  /// Applies settings published to the [`EncoderControl`] since the last frame.
+  fn update_encoder(&mut self) {
+    let settings = self.control.load();
+    if settings == self.settings {
+      return;
+    }
+
+    self.settings = settings;
+    if let Err(error) = Self::configure_encoder(&mut self.encoder, settings) {
+      warn!("failed to configure encoder: {:?}", error);
+    }
+  }
+
+  fn configure_encoder(encoder: &mut Encoder, settings: EncoderSettings) -> Result<()> {
+    encoder.set_bitrate(match settings.bitrate {
+      Some(bitrate) => Bitrate::Bits(i32::try_from(bitrate)?),
+      None => Bitrate::Auto
+    })?;
+    encoder.set_inband_fec(settings.packet_loss_percent > 0)?;
+    encoder.set_packet_loss_perc(settings.packet_loss_percent)?;
+    Ok(())
+  }
+
+  /// Encodes `input` and queues it in the [`PacketScheduler`](crate::scheduler::PacketScheduler).
+  ///
+  /// Returns once the packet is queued, which paces the caller to [`CHUNK_DURATION`](crate::constants::CHUNK_DURATION).
+  pub async fn send_pcm(&mut self, udp: &mut UdpVoiceConnection, input: &[f32]) -> Result<()> {
+    self.update_encoder();
+
+    let mut packet = udp.stream.buffer();
+    self.build_pcm_packet(input, &mut packet)?;
+    self.submit(udp, packet).await
+  }
+
+  /// Queues an already encoded Opus packet, see [`VoiceSender::send_pcm`].
+  pub async fn send_opus(&mut self, udp: &mut UdpVoiceConnection, opus: &[u8]) -> Result<()> {
+    let mut packet = udp.stream.buffer();
+    self.build_opus_packet(opus, &mut packet)?;
+    self.submit(udp, packet).await
+  }
+
+  /// Encodes `input` into a complete encrypted RTP packet in `packet` and advances the RTP state.
+  pub fn build_pcm_packet(&mut self, input: &[f32], packet: &mut Vec<u8>) -> Result<()> {
+    packet.resize(PACKET_CAPACITY, 0);
+
+    let encoder = &mut self.encoder;
+    let metrics = &self.metrics;
+    let size = Self::write_packet(&mut self.crypto, metrics, packet, (self.sequence, self.timestamp, self.ssrc), |payload| {
+      let started = Instant::now();
+      let size = encoder.encode_float(input, payload)?;
+      metrics.encode.observe(started.elapsed());
+      Ok(size)
+    })?;
+    self.advance();
+
+    packet.truncate(size);
+    Ok(())
+  }
+
+  /// Wraps an already encoded Opus packet, see [`VoiceSender::build_pcm_packet`].
+  pub fn build_opus_packet(&mut self, opus: &[u8], packet: &mut Vec<u8>) -> Result<()> {
+    packet.resize(PACKET_CAPACITY, 0);
+
+    let size = Self::write_packet(&mut self.crypto, &self.metrics, packet, (self.sequence, self.timestamp, self.ssrc), |payload| {
+      payload.get_mut(..opus.len()).context("Opus packet too large")?.copy_from_slice(opus);
+      Ok(opus.len())
+    })?;
+    self.advance();
+
+    packet.truncate(size);
+    Ok(())
+  }
+
+  async fn submit(&self, udp: &mut UdpVoiceConnection, packet: Vec<u8>) -> Result<()> {
+    if udp.stream.is_failing() {
+      return Err(anyhow!("voice packets are rejected by the network"));
+    }
+
+    // The send loop normally runs a few packets ahead of the scheduler
+    if udp.stream.queued() == 0 {
+      self.metrics.late_packets.inc();
+    }
+
+    let started = Instant::now();
+    udp.stream.submit(packet).await?;
+    self.metrics.submit_wait.observe(started.elapsed());
+    Ok(())
+  }
+
+  /// Switches to the key of a renegotiated UDP connection, the RTP sequence and timestamp carry on.
+  pub fn set_crypto(&mut self, crypto: VoiceCrypto) {
+    self.crypto = crypto;
+  }
+
+  /// Advances the RTP clock by one frame without sending anything.
+  pub fn skip_frame(&mut self) {
+    self.timestamp += TIMESTAMP_STEP as u32;
+  }
+
+  /// Forgets encoder history, e.g. after a seek.
+  pub fn reset_encoder(&mut self) -> Result<()> {
+    Ok(self.encoder.reset_state()?)
+  }
+
+  fn advance(&mut self) {
+    self.sequence += 1;
+    self.timestamp += TIMESTAMP_STEP as u32;
+  }
+
+  /// Writes a complete encrypted RTP packet into `packet`, returns its size.
+  fn write_packet<F>(
+    crypto: &mut VoiceCrypto,
+    metrics: &ConnectionMetrics,
+    packet: &mut [u8],
+    (sequence, timestamp, ssrc): (Wrap16, Wrap32, u32),
+    encode: F
+  ) -> Result<usize> where F: FnOnce(&mut [u8]) -> Result<usize> {
+    let mut view = MutableRtpPacket::new(packet).context("packet buffer too small")?;
+    view.set_version(2);
+    view.set_payload_type(RtpType::Unassigned(0x78));
+    view.set_sequence(sequence);
+    view.set_timestamp(timestamp);
+    view.set_ssrc(ssrc);
+
+    let offset = crypto.payload_offset();
+    let payload = view.payload_mut();
+    let capacity = payload.len() - crypto.trailer_size();
+    let size = encode(&mut payload[offset..capacity])?;
+
+    let started = Instant::now();
+    let size = crypto.seal(packet, RTP_HEADER_SIZE, size)?;
+    metrics.encrypt.observe(started.elapsed());
+    Ok(size)
+  }
+}
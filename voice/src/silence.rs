@@ -0,0 +1,137 @@
+use std::time::Duration;
+
+use crate::{constants::CHUNK_DURATION, dsp::peak, frame_queue::FrameData};
+
+/// Frames quieter than this (about -60 dBFS) are silent.
+pub const SILENCE_THRESHOLD: f32 = 0.001;
+/// Silence kept encoding as is before transmission stops, so short pauses are not cut.
+pub const SILENCE_HOLD: Duration = Duration::from_millis(200);
+/// Number of [`SILENCE_FRAME`](crate::constants::SILENCE_FRAME)s sent before transmission stops.
+pub const SILENCE_FRAME_COUNT: usize = 5;
+
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum SilenceAction {
+  Send,
+  SendSilenceFrame,
+  /// Send nothing, the stream is quiet.
+  Skip
+}
+
+/// Stops transmission during long runs of silence, the way Discord clients do.
+pub struct SilenceDetector {
+  silent_frames: usize,
+  hold_frames: usize,
+  speaking: bool,
+  speaking_changed: bool
+}
+
+impl SilenceDetector {
+  /// `speaking` is the speaking state already sent to the voice gateway.
+  pub fn new(speaking: bool) -> Self {
+    Self {
+      silent_frames: 0,
+      hold_frames: (SILENCE_HOLD.as_millis() / CHUNK_DURATION.as_millis()) as usize,
+      speaking,
+      speaking_changed: false
+    }
+  }
+
+  pub fn is_silent(frame: &FrameData) -> bool {
+    match frame {
+      FrameData::Pcm(samples) => peak(samples) < SILENCE_THRESHOLD,
+      // Packets this small only carry silence or comfort noise
+      FrameData::Opus(packet) => packet.len() <= 3
+    }
+  }
+
+  pub fn on_frame(&mut self, silent: bool) -> SilenceAction {
+    if !silent {
+      self.silent_frames = 0;
+      self.set_speaking(true);
+      return SilenceAction::Send;
+    }
+
+    self.silent_frames += 1;
+    if !self.speaking {
+      SilenceAction::Skip
+    } else if self.silent_frames <= self.hold_frames {
+      SilenceAction::Send
+    } else if self.silent_frames <= self.hold_frames + SILENCE_FRAME_COUNT {
+      SilenceAction::SendSilenceFrame
+    } else {
+      self.set_speaking(false);
+      SilenceAction::Skip
+    }
+  }
+
+  fn set_speaking(&mut self, speaking: bool) {
+    if self.speaking != speaking {
+      self.speaking = speaking;
+      self.speaking_changed = true;
+    }
+  }
+
+  pub fn is_speaking(&self) -> bool {
+    self.speaking
+  }
+
+  /// Returns the new speaking state if it changed since the last call.
+  pub fn take_speaking_change(&mut self) -> Option<bool> {
+    if self.speaking_changed {
+      self.speaking_changed = false;
+      Some(self.speaking)
+    } else {
+      None
+    }
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use crate::constants::SILENCE_FRAME;
+  use super::*;
+
+  fn run(detector: &mut SilenceDetector, silent: bool, frames: usize) -> Vec<SilenceAction> {
+    (0..frames).map(|_| detector.on_frame(silent)).collect()
+  }
+
+  #[test]
+  fn silence_is_held_then_ended_with_silence_frames() {
+    let mut detector = SilenceDetector::new(true);
+    let hold = (SILENCE_HOLD.as_millis() / CHUNK_DURATION.as_millis()) as usize;
+
+    assert!(run(&mut detector, true, hold).iter().all(|&it| it == SilenceAction::Send));
+    assert!(run(&mut detector, true, SILENCE_FRAME_COUNT).iter().all(|&it| it == SilenceAction::SendSilenceFrame));
+    assert_eq!(detector.take_speaking_change(), None);
+
+    assert_eq!(detector.on_frame(true), SilenceAction::Skip);
+    assert_eq!(detector.take_speaking_change(), Some(false));
+    assert!(!detector.is_speaking());
+    assert_eq!(detector.on_frame(true), SilenceAction::Skip);
+    assert_eq!(detector.take_speaking_change(), None);
+  }
+
+  #[test]
+  fn sound_resumes_speaking() {
+    let mut detector = SilenceDetector::new(false);
+    assert_eq!(detector.on_frame(true), SilenceAction::Skip);
+    assert_eq!(detector.take_speaking_change(), None);
+
+    assert_eq!(detector.on_frame(false), SilenceAction::Send);
+    assert_eq!(detector.take_speaking_change(), Some(true));
+
+    // A short pause does not stop transmission
+    assert_eq!(detector.on_frame(true), SilenceAction::Send);
+    assert_eq!(detector.on_frame(false), SilenceAction::Send);
+    assert_eq!(detector.take_speaking_change(), None);
+  }
+
+  #[test]
+  fn quiet_frames_are_silent() {
+    assert!(SilenceDetector::is_silent(&FrameData::Pcm(&[0.0, -0.0005, 0.0009])));
+    assert!(!SilenceDetector::is_silent(&FrameData::Pcm(&[0.0, -0.002, 0.0])));
+
+    assert!(SilenceDetector::is_silent(&FrameData::Opus(&SILENCE_FRAME)));
+    assert!(!SilenceDetector::is_silent(&FrameData::Opus(&[0x78, 0x01, 0x02, 0x03])));
+  }
+}
@@ -1,49 +1,214 @@
-use std::time::Instant;
-use anyhow::Result;
-use discortp::{wrap::{Wrap16, Wrap32}, discord::MutableKeepalivePacket};
-use rand::random;
-use tokio::net::UdpSocket;
-use tracing::debug;
+use std::{
+  collections::HashMap,
+  io,
+  net::SocketAddr,
+  sync::{atomic::{AtomicUsize, Ordering}, Arc, Mutex, OnceLock, Weak},
+  time::Instant
+};
+use anyhow::{Result, Context};
+use discortp::discord::MutableKeepalivePacket;
+use flume::{Receiver, Sender};
+use tokio::{io::Interest, net::UdpSocket, sync::oneshot, select};
+use tracing::{debug, warn};
 
-use super::Ready;
+use super::{Ready, ingress::BatchReceiver, scheduler::{PacketScheduler, StreamHandle}};
 
-#[derive(Debug)]
-pub struct UdpVoiceConnection {
-  pub socket: UdpSocket,
-  pub heartbeat_time: Instant,
+/// Maximum number of voice connections sharing one UDP socket.
+pub const MAX_ROUTES_PER_SOCKET: usize = 256;
+const ROUTE_QUEUE_DEPTH: usize = 32;
+
+type Routes = Arc<Mutex<HashMap<SocketAddr, Sender<Vec<u8>>>>>;
+
+/// An unconnected UDP socket shared by many voice connections.
+///
+/// Every connection on a socket talks to a different remote address, so incoming datagrams
+/// are routed by their source address and Discord still sees one stream per address pair.
+pub struct SharedSocket {
+  pub id: usize,
+  socket: Arc<UdpSocket>,
+  /// Duplicate of `socket`, used by the [`PacketScheduler`] threads for batched sends.
+  pub egress: std::net::UdpSocket,
+  routes: Routes,
+  _shutdown: oneshot::Sender<()>
+}
+
+impl SharedSocket {
+  fn bind() -> Result<Self> {
+    static NEXT_ID: AtomicUsize = AtomicUsize::new(0);
+
+    let socket = std::net::UdpSocket::bind("0.0.0.0:0")?;
+    socket.set_nonblocking(true)?;
+    let egress = socket.try_clone()?;
+    let ingress = socket.try_clone()?;
+    let socket = Arc::new(UdpSocket::from_std(socket)?);
+
+    let routes: Routes = Default::default();
+    let (shutdown_tx, shutdown_rx) = oneshot::channel();
+    tokio::spawn(Self::run_recv_loop(socket.clone(), ingress, routes.clone(), shutdown_rx));
+
+    Ok(Self {
+      id: NEXT_ID.fetch_add(1, Ordering::Relaxed),
+      socket,
+      egress,
+      routes,
+      _shutdown: shutdown_tx
+    })
+  }
+
+  /// Receives datagrams in batches through `ingress`, a duplicate of `socket` that is only read
+  /// once `socket` reports readiness, and hands everything but RTP voice packets to their route.
+  async fn run_recv_loop(socket: Arc<UdpSocket>, ingress: std::net::UdpSocket, routes: Routes, mut shutdown: oneshot::Receiver<()>) {
+    let mut batch = BatchReceiver::new();
+    loop {
+      select! {
+        result = socket.readable() => {
+          if let Err(error) = result {
+            warn!("Shared voice socket receive failed: {}", error);
+            break;
+          }
+
+          let count = match socket.try_io(Interest::READABLE, || batch.recv(&ingress)) {
+            Ok(count) => count,
+            Err(error) if error.kind() == io::ErrorKind::WouldBlock => continue,
+            // ICMP errors from a closed remote are reported on the next receive
+            Err(error) if error.kind() == io::ErrorKind::ConnectionRefused => continue,
+            Err(error) => {
+              warn!("Shared voice socket receive failed: {}", error);
+              break;
+            }
+          };
+
+          let routes = routes.lock().unwrap();
+          for (address, packet) in (0..count).filter_map(|index| batch.get(index)) {
+            // Voice of other users is not consumed, drop it before copying
+            if is_rtp(packet) {
+              continue;
+            }
+
+            if let Some(route) = routes.get(&address) {
+              _ = route.try_send(packet.to_vec());
+            }
+          }
+        },
+        _ = &mut shutdown => break
+      }
+    }
+  }
+
+  fn has_route(&self, remote: &SocketAddr) -> bool {
+    self.routes.lock().unwrap().contains_key(remote)
+  }
+
+  fn route_count(&self) -> usize {
+    self.routes.lock().unwrap().len()
+  }
+
+  fn add_route(&self, remote: SocketAddr) -> Receiver<Vec<u8>> {
+    let (tx, rx) = flume::bounded(ROUTE_QUEUE_DEPTH);
+    self.routes.lock().unwrap().insert(remote, tx);
+    rx
+  }
+
+  fn remove_route(&self, remote: &SocketAddr) {
+    self.routes.lock().unwrap().remove(remote);
+  }
+
+  pub async fn send_to(&self, buffer: &[u8], remote: SocketAddr) -> io::Result<usize> {
+    self.socket.send_to(buffer, remote).await
+  }
+}
+
+/// RTP packets share the version bits with RTCP, but never use the RTCP payload types 200-204.
+fn is_rtp(packet: &[u8]) -> bool {
+  match packet {
+    [first, second, ..] => first >> 6 == 2 && !(200..=204).contains(second),
+    _ => false
+  }
+}
+
+/// Hands out [`SharedSocket`]s, binding a new one only when none can take the remote address.
+#[derive(Default)]
+pub struct SocketPool {
+  sockets: Mutex<Vec<Weak<SharedSocket>>>
+}
+
+impl SocketPool {
+  pub fn global() -> &'static SocketPool {
+    static POOL: OnceLock<SocketPool> = OnceLock::new();
+    POOL.get_or_init(Default::default)
+  }
+
+  pub fn acquire(&self, remote: SocketAddr) -> Result<(Arc<SharedSocket>, Receiver<Vec<u8>>)> {
+    let mut sockets = self.sockets.lock().unwrap();
+    sockets.retain(|it| it.strong_count() > 0);
 
-  pub sequence: Wrap16,
-  pub timestamp: Wrap32,
-  pub deadline: Instant,
+    let socket = sockets
+      .iter()
+      .filter_map(Weak::upgrade)
+      .find(|it| !it.has_route(&remote) && it.route_count() < MAX_ROUTES_PER_SOCKET);
+    let socket = match socket {
+      Some(socket) => socket,
+      None => {
+        let socket = Arc::new(SharedSocket::bind()?);
+        sockets.push(Arc::downgrade(&socket));
+        debug!("bound shared voice socket, {} total", sockets.len());
+        socket
+      }
+    };
 
-  pub rtp_buffer: Vec<u8>
+    let incoming = socket.add_route(remote);
+    Ok((socket, incoming))
+  }
+}
+
+pub struct UdpVoiceConnection {
+  pub socket: Arc<SharedSocket>,
+  pub remote: SocketAddr,
+  /// Datagrams received from `remote`.
+  pub incoming: Receiver<Vec<u8>>,
+  pub stream: StreamHandle,
+  pub heartbeat_time: Instant
 }
 
 impl UdpVoiceConnection {
   pub async fn new(ready: &Ready) -> Result<Self> {
-    let socket = UdpSocket::bind("0.0.0.0:0").await?;
-    socket.connect((ready.ip.clone(), ready.port)).await?;
+    let remote = tokio::net::lookup_host((ready.ip.as_str(), ready.port))
+      .await?
+      .find(SocketAddr::is_ipv4)
+      .context("no IPv4 address for voice server")?;
+
+    let (socket, incoming) = SocketPool::global().acquire(remote)?;
+    let stream = PacketScheduler::global().register(socket.clone(), remote)?;
 
     Ok(Self {
       socket,
-      sequence: random::<u16>().into(),
-      timestamp: random::<u32>().into(),
-      heartbeat_time: Instant::now(),
-      deadline: Instant::now(),
-
-      rtp_buffer: vec![0; 1460]
+      remote,
+      incoming,
+      stream,
+      heartbeat_time: Instant::now()
     })
   }
 
+  pub async fn send(&self, buffer: &[u8]) -> Result<()> {
+    self.socket.send_to(buffer, self.remote).await?;
+    Ok(())
+  }
+
   pub async fn send_keepalive(&mut self, ready: &Ready) -> Result<()> {
     let mut buffer = [0; MutableKeepalivePacket::minimum_packet_size()];
     let mut view = MutableKeepalivePacket::new(&mut buffer).unwrap();
     view.set_ssrc(ready.ssrc);
 
     self.heartbeat_time = Instant::now();
-    self.socket.send(&buffer).await?;
+    self.send(&buffer).await?;
     debug!("Sent UDP keepalive");
 
     Ok(())
   }
 }
+
+impl Drop for UdpVoiceConnection {
+  fn drop(&mut self) {
+    self.socket.remove_route(&self.remote);
+  }
+}
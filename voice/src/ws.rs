@@ -1,72 +1,145 @@
-use std::{time::SystemTime, sync::Arc};
+use std::{fmt, net::IpAddr, sync::{Arc, OnceLock}, time::SystemTime};
 use anyhow::{Result, Context, anyhow};
 use async_channel::Receiver;
-use futures_util::{stream::{SplitStream, SplitSink}, SinkExt, StreamExt};
-use tokio::{net::TcpStream, sync::Mutex};
+use futures_util::{stream::SplitSink, SinkExt, StreamExt};
+use tokio::{net::TcpStream, sync::Mutex, task::JoinHandle};
 use tokio_tungstenite::{WebSocketStream, MaybeTlsStream, connect_async, tungstenite::{Message, protocol::CloseFrame}};
 use tracing::{debug, warn};
 
-use super::{Hello, Ready, VoiceConnectionOptions, Speaking, GatewayPacket, GatewayEvent, Identify};
+use super::{Hello, Ready, VoiceConnectionOptions, Speaking, GatewayEvent, Identify, Resume};
+
+/// Returns `true` if `host` (without a port) is this machine.
+fn is_loopback(host: &str) -> bool {
+  let host = host.trim_start_matches('[').trim_end_matches(']');
+  host == "localhost" || host.parse::<IpAddr>().map_or(false, |it| it.is_loopback())
+}
+
+/// Discord sends bare `host:port` endpoints, which are always dialed over TLS.
+///
+/// Endpoints with a scheme must be `wss://`, plaintext `ws://` is only accepted for loopback
+/// addresses (e.g. a local mock gateway), so session credentials never leave the machine unencrypted.
+fn gateway_url(endpoint: &str) -> Result<String> {
+  let endpoint = endpoint.trim_end_matches('/');
+  match endpoint.split_once("://") {
+    None => Ok(format!("wss://{}/?v=4", endpoint)),
+    Some(("wss", _)) => Ok(format!("{}/?v=4", endpoint)),
+    Some(("ws", address)) => {
+      let host = address.rsplit_once(':').map_or(address, |(host, _)| host);
+      if !is_loopback(host) {
+        return Err(anyhow!("refusing plaintext voice gateway {}", endpoint));
+      }
+      Ok(format!("{}/?v=4", endpoint))
+    },
+    Some((scheme, _)) => Err(anyhow!("unsupported voice gateway scheme {}", scheme))
+  }
+}
+
+/// The voice gateway closed the connection with the given close code.
+#[derive(Debug, Clone, Copy)]
+pub struct GatewayClosed(pub u16);
+
+impl GatewayClosed {
+  /// Rejected authentication, an invalidated session and being disconnected from the channel end the session for good.
+  pub fn is_resumable(&self) -> bool {
+    !matches!(self.0, 4004 | 4006 | 4009 | 4011 | 4012 | 4014 | 4016)
+  }
+}
+
+impl fmt::Display for GatewayClosed {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    write!(f, "voice gateway closed with code {}", self.0)
+  }
+}
+
+impl std::error::Error for GatewayClosed {}
+
+struct GatewayWriter {
+  sink: SplitSink<WebSocketStream<MaybeTlsStream<TcpStream>>, Message>,
+  /// Reused to serialize outgoing packets.
+  buffer: Vec<u8>
+}
 
 pub struct WebSocketVoiceConnection {
-  pub read: Arc<Mutex<Option<SplitStream<WebSocketStream<MaybeTlsStream<TcpStream>>>>>>,
-  pub write: Arc<Mutex<Option<SplitSink<WebSocketStream<MaybeTlsStream<TcpStream>>, Message>>>>,
+  write: Mutex<Option<GatewayWriter>>,
+  reader: JoinHandle<()>,
+  close_code: Arc<OnceLock<u16>>,
 
-  pub packets: Receiver<GatewayPacket>,
+  pub packets: Receiver<GatewayEvent>,
 
   pub hello: Option<Hello>,
   pub ready: Option<Ready>
 }
 
 impl WebSocketVoiceConnection {
-  pub async fn new(options: VoiceConnectionOptions) -> Result<Self> {
-    let (socket, _) = connect_async(format!("wss://{}/?v=4", options.endpoint)).await?;
+  async fn open(endpoint: &str) -> Result<Self> {
+    let (socket, _) = connect_async(gateway_url(endpoint)?).await?;
     debug!("voice gateway connected");
 
     let (sender, receiver) = async_channel::unbounded();
-    let (write, read) = socket.split();
-
-    let read = Arc::new(Mutex::new(Some(read)));
+    let (write, mut read) = socket.split();
 
-    let read_weak = Arc::downgrade(&read);
-    tokio::spawn(async move {
-      while let Some(read) = read_weak.upgrade() {
-        let mut lock = read.try_lock().unwrap();
-        match lock.as_mut().unwrap().next().await {
-          Some(message) => {
-            let message = message.unwrap();
-            let json = message.into_text().unwrap();
-            debug!("< {}", json);
+    let close_code = Arc::new(OnceLock::new());
+    let reader_close_code = close_code.clone();
+    let reader = tokio::spawn(async move {
+      while let Some(message) = read.next().await {
+        let mut data = match message {
+          Ok(Message::Text(text)) => text.into_bytes(),
+          Ok(Message::Close(frame)) => {
+            debug!("voice gateway closed: {:?}", frame);
+            if let Some(frame) = frame {
+              _ = reader_close_code.set(frame.code.into());
+            }
+            break;
+          },
+          Ok(_) => continue,
+          Err(error) => {
+            warn!("voice gateway read failed: {:?}", error);
+            break;
+          }
+        };
+        debug!("< {}", String::from_utf8_lossy(&data));
 
-            sender.send(serde_json::from_str(&json).unwrap()).await.unwrap();
+        // Parsed in place, straight into the event type of the opcode
+        match simd_json::serde::from_slice::<GatewayEvent>(&mut data) {
+          Ok(event) => {
+            if sender.send(event).await.is_err() {
+              break;
+            }
           },
-          None => break
+          Err(error) => debug!("ignored voice gateway packet: {}", error)
         }
       }
     });
 
-    let mut me = Self {
-      read: read,
-      write: Arc::new(Mutex::new(Some(write))),
+    Ok(Self {
+      write: Mutex::new(Some(GatewayWriter {
+        sink: write,
+        buffer: Vec::with_capacity(256)
+      })),
+      reader,
+      close_code,
 
       packets: receiver,
 
       hello: None,
       ready: None
-    };
+    })
+  }
+
+  pub async fn new(options: VoiceConnectionOptions) -> Result<Self> {
+    let mut me = Self::open(&options.endpoint).await?;
 
-    me.send(GatewayEvent::Identify(Identify {
+    me.send(&GatewayEvent::Identify(Identify {
       server_id: options.guild_id,
       user_id: options.user_id,
       session_id: options.session_id,
       token: options.token
-    }).try_into()?).await?;
+    })).await?;
 
     let mut hello = None;
     let mut ready = None;
     loop {
-      let event: GatewayEvent = me.receive().await?.try_into()?;
-      match event {
+      match me.receive().await? {
         GatewayEvent::Ready(it) => {
           ready = Some(it);
           if hello.is_some() {
@@ -92,14 +165,44 @@ impl WebSocketVoiceConnection {
     Ok(me)
   }
 
+  /// Continues the session of `options` on a new gateway connection.
+  ///
+  /// The server does not send [`Ready`] again, `ready` of the previous connection is carried over.
+  pub async fn resume(options: &VoiceConnectionOptions, ready: Ready) -> Result<Self> {
+    let mut me = Self::open(&options.endpoint).await?;
+
+    me.send(&GatewayEvent::Resume(Resume {
+      server_id: options.guild_id,
+      session_id: options.session_id.clone(),
+      token: options.token.clone()
+    })).await?;
+
+    let mut resumed = false;
+    while me.hello.is_none() || !resumed {
+      match me.receive().await? {
+        GatewayEvent::Hello(hello) => me.hello = Some(hello),
+        GatewayEvent::Resumed => resumed = true,
+        other => debug!("ignored {:?} while resuming", other)
+      }
+    }
+    me.ready = Some(ready);
+
+    Ok(me)
+  }
+
+  /// Returns the close code sent by the server, if it closed the connection.
+  pub fn close_code(&self) -> Option<u16> {
+    self.close_code.get().copied()
+  }
+
   pub async fn send_speaking(&self, speaking: bool) -> Result<()> {
     let ready = self.ready.as_ref().context("no voice ready packet")?;
 
-    self.send(GatewayEvent::Speaking(Speaking {
+    self.send(&GatewayEvent::Speaking(Speaking {
       speaking: if speaking { 1 } else { 0 },
       delay: 0,
       ssrc: ready.ssrc
-    }).try_into()?).await?;
+    })).await?;
 
     Ok(())
   }
@@ -107,36 +210,67 @@ impl WebSocketVoiceConnection {
   pub async fn send_heartbeat(&self) -> Result<()> {
     let nonce = u64::try_from(SystemTime::now().duration_since(SystemTime::UNIX_EPOCH)?.as_millis())?;
 
-    self.send(GatewayEvent::Heartbeat(nonce).try_into()?).await?;
+    self.send(&GatewayEvent::Heartbeat(nonce)).await?;
     debug!("Sent gateway heartbeat");
 
     Ok(())
   }
 
-  pub async fn send(&self, packet: GatewayPacket) -> Result<()> {
-    let json = serde_json::to_string(&packet)?;
-    debug!("> {}", json);
-
+  pub async fn send(&self, event: &GatewayEvent) -> Result<()> {
     let mut lock = self.write.lock().await;
-    let write = lock.as_mut().unwrap();
+    let writer = lock.as_mut().context("voice gateway closed")?;
 
-    write.send(Message::Text(json)).await?;
-    write.flush().await?;
+    writer.buffer.clear();
+    serde_json::to_writer(&mut writer.buffer, event)?;
+    let json = std::str::from_utf8(&writer.buffer)?;
+    debug!("> {}", json);
+
+    // Tungstenite takes ownership of the payload, so one exact-size copy is left per packet
+    writer.sink.send(Message::Text(json.to_owned())).await?;
 
     Ok(())
   }
 
-  pub async fn receive(&self) -> Result<GatewayPacket> {
-    Ok(self.packets.recv().await?)
+  /// Fails with [`GatewayClosed`] if the server closed the connection with a close code.
+  pub async fn receive(&self) -> Result<GatewayEvent> {
+    self.packets.recv().await.map_err(|_| match self.close_code() {
+      Some(code) => GatewayClosed(code).into(),
+      None => anyhow!("voice gateway connection closed")
+    })
   }
 
+  /// Sends a close frame, the reader stops once the server acknowledges it.
   pub async fn close(&self, frame: CloseFrame<'_>) -> Result<()> {
-    let read = self.read.lock().await.take().unwrap();
-    let write = self.write.lock().await.take().unwrap();
-
-    let mut socket = write.reunite(read)?;
-    socket.close(Some(frame)).await?;
+    let mut writer = self.write.lock().await.take().context("voice gateway closed")?;
+    writer.sink.send(Message::Close(Some(frame.into_owned()))).await?;
 
     Ok(())
   }
 }
+
+impl Drop for WebSocketVoiceConnection {
+  fn drop(&mut self) {
+    self.reader.abort();
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  #[test]
+  fn gateway_url_forces_tls() {
+    assert_eq!(gateway_url("c-fra01.discord.media:443").unwrap(), "wss://c-fra01.discord.media:443/?v=4");
+    assert_eq!(gateway_url("wss://c-fra01.discord.media/").unwrap(), "wss://c-fra01.discord.media/?v=4");
+    assert!(gateway_url("ws://c-fra01.discord.media:80").is_err());
+    assert!(gateway_url("http://c-fra01.discord.media").is_err());
+  }
+
+  #[test]
+  fn gateway_url_allows_plaintext_on_loopback() {
+    assert_eq!(gateway_url("ws://127.0.0.1:4000").unwrap(), "ws://127.0.0.1:4000/?v=4");
+    assert!(gateway_url("ws://[::1]:4000").is_ok());
+    assert!(gateway_url("ws://localhost:4000").is_ok());
+    assert!(gateway_url("ws://127.0.0.1.example.com:4000").is_err());
+  }
+}
@@ -0,0 +1,96 @@
+use std::{env, f32::consts::TAU, fs, path::Path, sync::Arc};
+use symphonia::core::probe::Hint;
+use voice::{
+  bitrate::BitrateController,
+  crypto::VoiceCipherMode,
+  metrics::ConnectionMetrics,
+  receiver::EncoderControl,
+  sender::VoiceSender
+};
+
+pub struct Fixture {
+  pub name: String,
+  pub data: Vec<u8>,
+  pub hint: Hint
+}
+
+/// Returns a 16-bit PCM WAV file of a stereo sine sweep.
+pub fn wav(rate: u32, seconds: u32) -> Vec<u8> {
+  let channels = 2u16;
+  let frames = rate * seconds;
+  let data_size = frames * channels as u32 * 2;
+
+  let mut out = Vec::with_capacity(44 + data_size as usize);
+  out.extend_from_slice(b"RIFF");
+  out.extend_from_slice(&(36 + data_size).to_le_bytes());
+  out.extend_from_slice(b"WAVEfmt ");
+  out.extend_from_slice(&16u32.to_le_bytes());
+  out.extend_from_slice(&1u16.to_le_bytes());
+  out.extend_from_slice(&channels.to_le_bytes());
+  out.extend_from_slice(&rate.to_le_bytes());
+  out.extend_from_slice(&(rate * channels as u32 * 2).to_le_bytes());
+  out.extend_from_slice(&(channels * 2).to_le_bytes());
+  out.extend_from_slice(&16u16.to_le_bytes());
+  out.extend_from_slice(b"data");
+  out.extend_from_slice(&data_size.to_le_bytes());
+
+  for frame in 0..frames {
+    let time = frame as f32 / rate as f32;
+    let frequency = 220.0 + 660.0 * time / seconds as f32;
+    let sample = ((time * frequency * TAU).sin() * i16::MAX as f32 * 0.5) as i16;
+    out.extend_from_slice(&sample.to_le_bytes());
+    out.extend_from_slice(&(-sample).to_le_bytes());
+  }
+  out
+}
+
+/// Generated WAV files at 44.1 and 48 kHz, plus every file in `MOSAIK_BENCH_FIXTURES`
+/// (e.g. MP3, FLAC, Opus and AAC encodes of the same track).
+pub fn fixtures() -> Vec<Fixture> {
+  let mut fixtures = [44100, 48000]
+    .into_iter()
+    .map(|rate| {
+      let mut hint = Hint::new();
+      hint.with_extension("wav");
+      Fixture {
+        name: format!("wav-{}", rate),
+        data: wav(rate, 10),
+        hint
+      }
+    })
+    .collect::<Vec<_>>();
+
+  if let Ok(directory) = env::var("MOSAIK_BENCH_FIXTURES") {
+    let mut entries = fs::read_dir(&directory)
+      .unwrap_or_else(|error| panic!("failed to read {}: {}", directory, error))
+      .filter_map(Result::ok)
+      .map(|it| it.path())
+      .filter(|it| it.is_file())
+      .collect::<Vec<_>>();
+    entries.sort();
+
+    for path in entries {
+      fixtures.push(load(&path));
+    }
+  }
+  fixtures
+}
+
+fn load(path: &Path) -> Fixture {
+  let mut hint = Hint::new();
+  if let Some(extension) = path.extension().and_then(|it| it.to_str()) {
+    hint.with_extension(extension);
+  }
+
+  Fixture {
+    name: path.file_name().unwrap().to_string_lossy().into_owned(),
+    data: fs::read(path).unwrap(),
+    hint
+  }
+}
+
+pub fn voice_sender(guild_id: u64, mode: VoiceCipherMode) -> VoiceSender {
+  let control = Arc::new(EncoderControl::new(BitrateController::new(None).settings()));
+  let metrics = Arc::new(ConnectionMetrics::new(guild_id));
+  VoiceSender::new(guild_id as u32, &[7; 32], mode, control, metrics).unwrap()
+}
@@ -0,0 +1,193 @@
+mod common;
+
+use std::{io::{Cursor, Read}, net::{SocketAddr, UdpSocket}, sync::Arc};
+use criterion::{criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput};
+use tokio::{io::{AsyncReadExt, AsyncWriteExt}, net::TcpListener, runtime::Runtime};
+use voice::{crypto::VoiceCipherMode, frame_queue::FRAME_SAMPLES, provider::AudioSource, scheduler::PACKET_CAPACITY};
+use worker::{
+  providers::{HttpRequest, MediaHttpClient, MediaHttpOptions},
+  voice::{interleave::interleave, open_source, resample::{ResampleStage, ResamplerQuality}, SourceBuffering}
+};
+
+use common::{fixtures, voice_sender, wav};
+
+/// Drains a whole decoded and resampled track, as the frame queue would.
+fn drain(source: AudioSource) -> usize {
+  let mut total = 0;
+  match source {
+    AudioSource::Pcm(mut provider) => {
+      let mut samples = vec![0.0; FRAME_SAMPLES];
+      loop {
+        let read = provider.get_samples(&mut samples);
+        if read == 0 {
+          break;
+        }
+        total += read;
+      }
+    },
+    AudioSource::Opus(mut provider) => {
+      let mut packet = vec![0; PACKET_CAPACITY];
+      loop {
+        let read = provider.get_packet(&mut packet);
+        if read == 0 {
+          break;
+        }
+        total += read;
+      }
+    }
+  }
+  total
+}
+
+fn decode(c: &mut Criterion) {
+  let mut group = c.benchmark_group("decode");
+  group.sample_size(10);
+
+  for fixture in fixtures() {
+    group.throughput(Throughput::Bytes(fixture.data.len() as u64));
+    group.bench_function(BenchmarkId::from_parameter(&fixture.name), |b| {
+      b.iter_batched(
+        || Box::new(Cursor::new(fixture.data.clone())),
+        |input| drain(open_source(input, fixture.hint.clone(), SourceBuffering::default()).unwrap()),
+        BatchSize::LargeInput
+      )
+    });
+  }
+  group.finish();
+}
+
+fn interleaving(c: &mut Criterion) {
+  const FRAMES: usize = 1152;
+
+  let mut group = c.benchmark_group("interleave");
+  for channels in [2, 6] {
+    let planar = (0..channels)
+      .map(|channel| (0..FRAMES).map(|frame| (frame * channel) as f32 / FRAMES as f32).collect::<Vec<_>>())
+      .collect::<Vec<_>>();
+    let mut out = vec![0.0; FRAMES * channels];
+
+    group.throughput(Throughput::Elements((FRAMES * channels) as u64));
+    group.bench_function(BenchmarkId::from_parameter(channels), |b| {
+      b.iter(|| interleave(&planar, 0, FRAMES, &mut out))
+    });
+  }
+  group.finish();
+}
+
+fn resampling(c: &mut Criterion) {
+  const RATE: usize = 44100;
+  const FRAMES: usize = 1152;
+
+  let planar = (0..2)
+    .map(|_| (0..FRAMES).map(|frame| (frame as f32 * 0.05).sin()).collect::<Vec<_>>())
+    .collect::<Vec<_>>();
+
+  let mut group = c.benchmark_group("resample");
+  group.throughput(Throughput::Elements(FRAMES as u64));
+  for (name, quality) in [("fft", ResamplerQuality::Fft), ("sinc", ResamplerQuality::Sinc), ("linear", ResamplerQuality::Linear)] {
+    let mut stage = ResampleStage::new(quality, RATE, 2).unwrap();
+    group.bench_function(BenchmarkId::new(name, RATE), |b| {
+      b.iter(|| {
+        stage.push(&planar, 0, FRAMES);
+        let mut frames = 0;
+        while let Some(produced) = stage.process() {
+          frames += produced;
+        }
+        frames
+      })
+    });
+  }
+  group.finish();
+}
+
+fn sending(c: &mut Criterion) {
+  let receiver = UdpSocket::bind("127.0.0.1:0").unwrap();
+  let remote = receiver.local_addr().unwrap();
+  let socket = UdpSocket::bind("127.0.0.1:0").unwrap();
+  socket.set_nonblocking(true).unwrap();
+  receiver.set_nonblocking(true).unwrap();
+
+  let input = (0..FRAME_SAMPLES).map(|it| (it as f32 * 0.01).sin() * 0.5).collect::<Vec<_>>();
+  let mut drained = vec![0; PACKET_CAPACITY];
+
+  let mut group = c.benchmark_group("send");
+  for mode in VoiceCipherMode::ALL {
+    let mut sender = voice_sender(0, mode);
+    let mut packet = Vec::with_capacity(PACKET_CAPACITY);
+
+    group.bench_function(BenchmarkId::new("build", mode.name()), |b| {
+      b.iter(|| {
+        sender.build_pcm_packet(&input, &mut packet).unwrap();
+        packet.len()
+      })
+    });
+    group.bench_function(BenchmarkId::new("build+send", mode.name()), |b| {
+      b.iter(|| {
+        sender.build_pcm_packet(&input, &mut packet).unwrap();
+        _ = socket.send_to(&packet, remote);
+        // Keep the receive buffer from filling up and dropping packets
+        while receiver.recv(&mut drained).is_ok() {}
+      })
+    });
+  }
+  group.finish();
+}
+
+/// Serves `body` to every request, like a CDN without range support.
+async fn serve(listener: TcpListener, body: Arc<Vec<u8>>) {
+  loop {
+    let Ok((mut stream, _)) = listener.accept().await else {
+      return;
+    };
+    let body = body.clone();
+    tokio::spawn(async move {
+      let mut request = [0; 4096];
+      _ = stream.read(&mut request).await;
+
+      let header = format!("HTTP/1.1 200 OK\r\nContent-Type: audio/wav\r\nContent-Length: {}\r\nConnection: close\r\n\r\n", body.len());
+      _ = stream.write_all(header.as_bytes()).await;
+      _ = stream.write_all(&body).await;
+      _ = stream.shutdown().await;
+    });
+  }
+}
+
+fn async_adapter(c: &mut Criterion) {
+  let runtime = Runtime::new().unwrap();
+  let body = Arc::new(wav(48000, 30));
+  let address: SocketAddr = runtime.block_on(async {
+    let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+    let address = listener.local_addr().unwrap();
+    tokio::spawn(serve(listener, body.clone()));
+    address
+  });
+  let client = MediaHttpClient::new(MediaHttpOptions::default()).unwrap();
+  let url = format!("http://{}/track.wav", address);
+
+  let mut group = c.benchmark_group("async_adapter");
+  group.sample_size(10);
+  group.throughput(Throughput::Bytes(body.len() as u64));
+  group.bench_function("read", |b| {
+    b.iter_batched(
+      || runtime.block_on(HttpRequest::new(client.clone(), url.clone()).create_async()).unwrap().input,
+      // Read from outside the runtime, like the decoder threads do
+      |mut input| {
+        let mut buffer = vec![0; 64 * 1024];
+        let mut total = 0;
+        loop {
+          let read = input.read(&mut buffer).unwrap();
+          if read == 0 {
+            break;
+          }
+          total += read;
+        }
+        total
+      },
+      BatchSize::PerIteration
+    )
+  });
+  group.finish();
+}
+
+criterion_group!(benches, decode, interleaving, resampling, sending, async_adapter);
+criterion_main!(benches);
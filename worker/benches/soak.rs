@@ -0,0 +1,165 @@
+mod common;
+
+use std::{env, io::{Cursor, ErrorKind}, net::UdpSocket, sync::Arc, thread, time::{Duration, Instant}};
+use anyhow::Result;
+use symphonia::core::probe::Hint;
+use utils::metrics::Histogram;
+use voice::{
+  constants::CHUNK_DURATION,
+  crypto::VoiceCipherMode,
+  frame_queue::FRAME_SAMPLES,
+  metrics::ConnectionMetrics,
+  provider::{AudioSource, SampleProvider},
+  scheduler::{PacketScheduler, LATENESS_BUCKETS},
+  udp::SocketPool
+};
+use worker::voice::{open_source, SourceBuffering};
+
+use common::{voice_sender, wav};
+
+fn env_or<T: std::str::FromStr>(name: &str, default: T) -> T {
+  env::var(name).ok().and_then(|it| it.parse().ok()).unwrap_or(default)
+}
+
+fn open(data: &[u8]) -> Result<Box<dyn SampleProvider>> {
+  let mut hint = Hint::new();
+  hint.with_extension("wav");
+  match open_source(Box::new(Cursor::new(data.to_vec())), hint, SourceBuffering::default())? {
+    AudioSource::Pcm(provider) => Ok(provider),
+    AudioSource::Opus(_) => unreachable!("WAV is always decoded")
+  }
+}
+
+/// A packet arriving later than this after its deadline is counted as late, half a frame.
+const LATE_AFTER: Duration = Duration::from_millis(10);
+
+/// Receives packets of one stream until `deadline` and returns their arrival times.
+fn receive(sink: UdpSocket, deadline: Instant) -> Result<Vec<Instant>> {
+  sink.set_read_timeout(Some(Duration::from_millis(100)))?;
+  let mut arrivals = Vec::new();
+  let mut buffer = [0; 2048];
+  loop {
+    match sink.recv(&mut buffer) {
+      Ok(_) => arrivals.push(Instant::now()),
+      Err(error) if matches!(error.kind(), ErrorKind::WouldBlock | ErrorKind::TimedOut) => {
+        if Instant::now() >= deadline {
+          return Ok(arrivals);
+        }
+      },
+      Err(error) => return Err(error.into())
+    }
+  }
+}
+
+/// Records how late every packet arrived against its own deadline into `lateness`, returns number of late packets.
+///
+/// Packet `n` of a stream is due [`CHUNK_DURATION`] after packet `n - 1`, starting from the earliest
+/// packet relative to that schedule, so a late first packet does not hide lateness of the others.
+fn record_lateness(arrivals: &[Instant], lateness: &Histogram) -> u64 {
+  let schedule = |index: usize| CHUNK_DURATION * index as u32;
+  let Some(start) = arrivals.iter().enumerate().map(|(index, &it)| it - schedule(index)).min() else {
+    return 0;
+  };
+
+  let mut late = 0;
+  for (index, &arrival) in arrivals.iter().enumerate() {
+    let value = arrival.saturating_duration_since(start + schedule(index));
+    lateness.observe(value);
+    if value > LATE_AFTER {
+      late += 1;
+    }
+  }
+  late
+}
+
+/// Plays `data` in a loop through the real [`PacketScheduler`] until `deadline`, returns arrival times of its packets.
+async fn run_stream(id: u64, data: Arc<Vec<u8>>, deadline: Instant) -> Result<Vec<Instant>> {
+  // Every stream gets its own remote, as every connection has its own address pair on Discord
+  let sink = UdpSocket::bind("127.0.0.1:0")?;
+  let remote = sink.local_addr()?;
+  // Timestamped on a thread of its own, a runtime wakeup would add its latency to every packet
+  let receiver = thread::spawn(move || receive(sink, deadline + Duration::from_millis(200)));
+
+  let (socket, _incoming) = SocketPool::global().acquire(remote)?;
+  let stream = PacketScheduler::global().register(socket, remote)?;
+
+  let mut sender = voice_sender(id, VoiceCipherMode::AeadXChaCha20Poly1305RtpSize);
+  let mut provider = open(&data)?;
+  let mut samples = vec![0.0; FRAME_SAMPLES];
+
+  while Instant::now() < deadline {
+    if provider.get_samples(&mut samples) == 0 {
+      provider = open(&data)?;
+      continue;
+    }
+
+    let mut packet = stream.buffer();
+    sender.build_pcm_packet(&samples, &mut packet)?;
+    if stream.queued() == 0 {
+      sender.metrics().late_packets.inc();
+    }
+    stream.submit(packet).await?;
+  }
+
+  tokio::task::spawn_blocking(move || receiver.join().expect("receiver panicked")).await?
+}
+
+fn format_quantile(value: Option<Duration>) -> String {
+  value.map_or("+Inf".to_owned(), |it| format!("{:?}", it))
+}
+
+/// Runs `MOSAIK_SOAK_STREAMS` concurrent streams for `MOSAIK_SOAK_SECONDS` and reports scheduler
+/// lateness, and how late each stream's packets arrived against its own 20 ms deadlines.
+#[tokio::main]
+async fn main() -> Result<()> {
+  let streams = env_or("MOSAIK_SOAK_STREAMS", 100u64);
+  let seconds = env_or("MOSAIK_SOAK_SECONDS", 10u64);
+  println!("soak: {} streams for {} s", streams, seconds);
+
+  let data = Arc::new(wav(48000, 10));
+  let deadline = Instant::now() + Duration::from_secs(seconds);
+  let metrics = (0..streams).map(|id| Arc::new(ConnectionMetrics::new(id))).collect::<Vec<_>>();
+
+  let tasks = (0..streams)
+    .map(|id| tokio::spawn(run_stream(id, data.clone(), deadline)))
+    .collect::<Vec<_>>();
+  // Receivers wait for the last queued packets to drain
+  let lateness = Histogram::new(&LATENESS_BUCKETS);
+  let mut late_streams = 0;
+  let mut late_packets = 0;
+  let mut worst_stream = Duration::ZERO;
+  for task in tasks {
+    let arrivals = task.await??;
+    let stream = Histogram::new(&LATENESS_BUCKETS);
+    let late = record_lateness(&arrivals, &stream);
+    record_lateness(&arrivals, &lateness);
+
+    late_packets += late;
+    late_streams += (late > 0) as u64;
+    worst_stream = worst_stream.max(stream.quantile(0.99).unwrap_or(Duration::MAX));
+  }
+
+  let stats = PacketScheduler::global().stats();
+  let expected = streams * seconds * 50;
+  let late_submits = metrics.iter().map(|it| it.late_packets.get()).sum::<u64>();
+  let encode_p99 = metrics.iter().filter_map(|it| it.encode.quantile(0.99)).max();
+
+  println!("packets: {} sent, {} expected, {} send errors", stats.packets.get(), expected, stats.send_errors.get());
+  println!("syscalls: {}", stats.syscalls.get());
+  println!(
+    "tick lateness: p50 {}, p99 {} over {} ticks",
+    format_quantile(stats.lateness.quantile(0.5)),
+    format_quantile(stats.lateness.quantile(0.99)),
+    stats.lateness.count()
+  );
+  println!(
+    "packet lateness against stream deadlines: p50 {}, p99 {}, worst stream p99 {}",
+    format_quantile(lateness.quantile(0.5)),
+    format_quantile(lateness.quantile(0.99)),
+    format_quantile(Some(worst_stream).filter(|&it| it != Duration::MAX))
+  );
+  println!("late packets (> {:?}): {} in {} of {} streams", LATE_AFTER, late_packets, late_streams, streams);
+  println!("submits to an empty queue: {}", late_submits);
+  println!("worst stream encode p99: {}", format_quantile(encode_p99));
+  Ok(())
+}
@@ -0,0 +1,308 @@
+mod mock;
+
+use std::{
+  env,
+  fs::{self, File},
+  io::{BufWriter, Cursor, Write},
+  path::PathBuf,
+  sync::Arc,
+  time::{Duration, Instant}
+};
+use anyhow::{Result, Context};
+use symphonia::core::probe::Hint;
+use tokio::{runtime::Builder, select, time::{sleep, sleep_until}};
+use tracing::warn;
+use tracing_subscriber::EnvFilter;
+use voice::{
+  metrics::ConnectionMetrics,
+  provider::AudioSource,
+  scheduler::PacketScheduler,
+  PlaybackEvent, VoiceConnection, VoiceConnectionOptions
+};
+use worker::{metrics::process_cpu_time, voice::{open_source, SourceBuffering}};
+
+use mock::{MockVoiceServer, StreamReport};
+
+struct Options {
+  streams: u64,
+  duration: Duration,
+  /// Delay between starting two connections.
+  ramp: Duration,
+  sockets: usize,
+  input: Option<PathBuf>,
+  csv: Option<PathBuf>
+}
+
+impl Options {
+  fn from_env() -> Self {
+    fn parse<T: std::str::FromStr>(name: &str, default: T) -> T {
+      env::var(name).ok().and_then(|it| it.parse().ok()).unwrap_or(default)
+    }
+
+    Self {
+      streams: parse("MOSAIK_LOADGEN_STREAMS", 1000),
+      duration: Duration::from_secs(parse("MOSAIK_LOADGEN_SECONDS", 60)),
+      ramp: Duration::from_millis(parse("MOSAIK_LOADGEN_RAMP_MS", 5)),
+      sockets: parse("MOSAIK_LOADGEN_SOCKETS", 8),
+      input: env::var_os("MOSAIK_LOADGEN_INPUT").map(PathBuf::from),
+      csv: env::var_os("MOSAIK_LOADGEN_CSV").map(PathBuf::from)
+    }
+  }
+}
+
+struct Shared(Arc<Vec<u8>>);
+
+impl AsRef<[u8]> for Shared {
+  fn as_ref(&self) -> &[u8] {
+    &self.0
+  }
+}
+
+/// Track every stream plays in a loop, read into memory once and shared by all streams.
+#[derive(Clone)]
+struct Track {
+  data: Arc<Vec<u8>>,
+  extension: Option<String>
+}
+
+impl Track {
+  fn load(input: Option<&PathBuf>) -> Result<Self> {
+    let Some(path) = input else {
+      return Ok(Self {
+        data: Arc::new(tone(10)),
+        extension: Some("wav".to_owned())
+      });
+    };
+
+    Ok(Self {
+      data: Arc::new(fs::read(path).with_context(|| format!("failed to read {}", path.display()))?),
+      extension: path.extension().and_then(|it| it.to_str()).map(ToOwned::to_owned)
+    })
+  }
+
+  fn open(&self) -> Result<AudioSource> {
+    let mut hint = Hint::new();
+    if let Some(extension) = &self.extension {
+      hint.with_extension(extension);
+    }
+    open_source(Box::new(Cursor::new(Shared(self.data.clone()))), hint, SourceBuffering::default())
+  }
+}
+
+/// Returns a 16-bit stereo 44.1 kHz WAV file of a 440 Hz tone, so streams are resampled like most real tracks.
+fn tone(seconds: u32) -> Vec<u8> {
+  const RATE: u32 = 44100;
+  let data_size = RATE * seconds * 4;
+
+  let mut out = Vec::with_capacity(44 + data_size as usize);
+  out.extend_from_slice(b"RIFF");
+  out.extend_from_slice(&(36 + data_size).to_le_bytes());
+  out.extend_from_slice(b"WAVEfmt ");
+  for value in [16u32.to_le_bytes(), [1, 0, 2, 0], RATE.to_le_bytes(), (RATE * 4).to_le_bytes(), [4, 0, 16, 0]] {
+    out.extend_from_slice(&value);
+  }
+  out.extend_from_slice(b"data");
+  out.extend_from_slice(&data_size.to_le_bytes());
+
+  for frame in 0..RATE * seconds {
+    let phase = frame as f32 / RATE as f32 * 440.0 * std::f32::consts::TAU;
+    let sample = (phase.sin() * i16::MAX as f32 * 0.3) as i16;
+    out.extend_from_slice(&sample.to_le_bytes());
+    out.extend_from_slice(&sample.to_le_bytes());
+  }
+  out
+}
+
+/// Connects to the mock server as `guild_id` and plays `track` in a loop until `deadline`.
+///
+/// The connection is returned still connected, so the mock sees no teardown traffic while it records.
+async fn run_stream(guild_id: u64, endpoint: String, track: Track, deadline: tokio::time::Instant) -> Result<Arc<VoiceConnection>> {
+  let connection = Arc::new(VoiceConnection::new()?);
+  connection.connect(VoiceConnectionOptions {
+    user_id: 1,
+    guild_id,
+    bitrate: None,
+    jitter_buffer: Default::default(),
+    endpoint,
+    token: "loadgen".to_owned(),
+    session_id: guild_id.to_string()
+  }).await?;
+
+  let connection_weak = Arc::downgrade(&connection);
+  tokio::spawn(async move {
+    if let Err(error) = VoiceConnection::run_ws_loop(connection_weak).await {
+      warn!("loadgen stream {} gateway loop failed: {:?}", guild_id, error);
+    }
+  });
+
+  *connection.source.lock().await = Some(track.open()?);
+  connection.set_speaking(true).await?;
+
+  let (events_tx, events_rx) = flume::unbounded();
+  let playback = tokio::spawn(VoiceConnection::run_udp_loop(connection.clone(), events_tx));
+
+  let stop = sleep_until(deadline);
+  tokio::pin!(stop);
+  loop {
+    select! {
+      event = events_rx.recv_async() => match event {
+        Ok(PlaybackEvent::TrackNearEnd) => connection.set_next_source(Some(track.open()?)),
+        Ok(PlaybackEvent::TrackStarted) => {},
+        Ok(PlaybackEvent::Finished) | Err(_) => break
+      },
+      _ = &mut stop => {
+        connection.stop();
+        break;
+      }
+    }
+  }
+  playback.await??;
+
+  Ok(connection)
+}
+
+fn percentile(sorted: &[Duration], q: f64) -> Duration {
+  if sorted.is_empty() {
+    return Duration::ZERO;
+  }
+  sorted[((sorted.len() - 1) as f64 * q).round() as usize]
+}
+
+fn per_frame(total: Duration, frames: u64) -> Duration {
+  total.checked_div(frames.max(1) as u32).unwrap_or_default()
+}
+
+async fn run(options: Options) -> Result<()> {
+  let track = Track::load(options.input.as_ref())?;
+  let server = MockVoiceServer::start(options.sockets).await?;
+  println!(
+    "loadgen: {} streams for {:?} each, started {:?} apart, {} mock sockets",
+    options.streams, options.duration, options.ramp, options.sockets
+  );
+
+  let started = Instant::now();
+  let cpu_started = process_cpu_time();
+
+  let mut tasks = Vec::with_capacity(options.streams as usize);
+  for guild_id in 1..=options.streams {
+    let deadline = tokio::time::Instant::now() + options.duration;
+    tasks.push((guild_id, tokio::spawn(run_stream(guild_id, server.endpoint.clone(), track.clone(), deadline))));
+    sleep(options.ramp).await;
+  }
+
+  let mut connections = Vec::with_capacity(tasks.len());
+  let mut failed = 0;
+  for (guild_id, task) in tasks {
+    match task.await? {
+      Ok(connection) => connections.push(connection),
+      Err(error) => {
+        warn!("loadgen stream {} failed: {:?}", guild_id, error);
+        failed += 1;
+      }
+    }
+  }
+
+  let elapsed = started.elapsed();
+  let cpu = process_cpu_time() - cpu_started;
+  // Let the last packets arrive before the mock stops counting
+  sleep(Duration::from_millis(100)).await;
+  let reports = server.finish().await;
+
+  let mut csv = match &options.csv {
+    Some(path) => {
+      let mut file = BufWriter::new(File::create(path)?);
+      writeln!(file, "guild,packets,bytes,lost,late,jitter_us,max_gap_us,encode_us_per_frame,encrypt_us_per_frame,underruns")?;
+      Some(file)
+    },
+    None => None
+  };
+
+  let mut jitters = Vec::with_capacity(reports.len());
+  let mut gaps = Vec::with_capacity(reports.len());
+  let (mut packets, mut lost, mut late, mut lossy) = (0, 0, 0, 0);
+  let (mut encode, mut encrypt, mut frames, mut underruns) = (Duration::ZERO, Duration::ZERO, 0, 0);
+  for guild_id in 1..=options.streams {
+    let report = reports.get(&(guild_id as u32)).cloned().unwrap_or_default();
+    // Same handles the connection recorded into
+    let metrics = ConnectionMetrics::new(guild_id);
+    let stream_frames = metrics.frames.get();
+
+    packets += report.packets;
+    lost += report.lost;
+    late += report.late;
+    if report.lost > 0 {
+      lossy += 1;
+    }
+    jitters.push(report.jitter);
+    gaps.push(report.max_gap);
+    encode += metrics.encode.sum();
+    encrypt += metrics.encrypt.sum();
+    frames += stream_frames;
+    underruns += metrics.underruns.get();
+
+    if let Some(csv) = &mut csv {
+      let StreamReport { packets, bytes, lost, late, jitter, max_gap } = report;
+      writeln!(
+        csv,
+        "{},{},{},{},{},{},{},{},{},{}",
+        guild_id, packets, bytes, lost, late, jitter.as_micros(), max_gap.as_micros(),
+        per_frame(metrics.encode.sum(), stream_frames).as_micros(),
+        per_frame(metrics.encrypt.sum(), stream_frames).as_micros(),
+        metrics.underruns.get()
+      )?;
+    }
+  }
+  if let Some(mut csv) = csv {
+    csv.flush()?;
+  }
+  jitters.sort();
+  gaps.sort();
+
+  let expected = options.streams * options.duration.as_millis() as u64 / 20;
+  let scheduler = PacketScheduler::global().stats();
+  println!("streams: {} ok, {} failed", connections.len(), failed);
+  println!(
+    "packets: {} received of {} expected, {} lost ({:.3}%) in {} streams, {} late",
+    packets, expected, lost, lost as f64 * 100.0 / (packets + lost).max(1) as f64, lossy, late
+  );
+  println!(
+    "jitter: p50 {:?}, p99 {:?}, max {:?}",
+    percentile(&jitters, 0.5), percentile(&jitters, 0.99), jitters.last().copied().unwrap_or_default()
+  );
+  println!(
+    "max gap: p50 {:?}, p99 {:?}, max {:?}",
+    percentile(&gaps, 0.5), percentile(&gaps, 0.99), gaps.last().copied().unwrap_or_default()
+  );
+  println!(
+    "scheduler tick lateness: p50 {:?}, p99 {:?}",
+    scheduler.lateness.quantile(0.5), scheduler.lateness.quantile(0.99)
+  );
+  println!("underruns: {}", underruns);
+  println!(
+    "cpu: {:?} over {:?}, {:.2}% of a core per stream (mock included); encode {:?}, encrypt {:?} per frame",
+    cpu, elapsed,
+    cpu.as_secs_f64() * 100.0 / elapsed.as_secs_f64() / options.streams.max(1) as f64,
+    per_frame(encode, frames), per_frame(encrypt, frames)
+  );
+
+  drop(connections);
+  Ok(())
+}
+
+/// Drives thousands of [`VoiceConnection`]s with real decoders against a local mock voice server,
+/// configured with `MOSAIK_LOADGEN_*` variables, see [`Options::from_env`].
+fn main() -> Result<()> {
+  tracing_subscriber::fmt()
+    .with_env_filter(EnvFilter::from_default_env())
+    .init();
+
+  let options = Options::from_env();
+  // Decoding runs on the voice decode pool, the runtime only drives sockets and timers
+  let runtime = Builder::new_multi_thread()
+    .enable_all()
+    .build()?;
+
+  let result = runtime.block_on(run(options));
+  runtime.shutdown_timeout(Duration::from_secs(1));
+  result
+}
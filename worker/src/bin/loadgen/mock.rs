@@ -0,0 +1,277 @@
+use std::{collections::HashMap, net::SocketAddr, os::fd::AsRawFd, sync::Arc, time::{Duration, Instant}};
+use anyhow::{Result, anyhow};
+use futures_util::{SinkExt, StreamExt};
+use tokio::{
+  net::{TcpListener, TcpStream, UdpSocket},
+  select,
+  sync::oneshot,
+  task::JoinHandle
+};
+use tokio_tungstenite::{accept_async, tungstenite::Message, WebSocketStream};
+use tracing::{debug, warn};
+use voice::{
+  constants::{CHUNK_DURATION, SAMPLE_RATE},
+  crypto::VoiceCipherMode,
+  GatewayEvent, Hello, Ready, SessionDescription
+};
+
+const IP_DISCOVERY_SIZE: usize = 74;
+const RTP_HEADER_SIZE: usize = 12;
+const RECEIVE_BUFFER_SIZE: libc::c_int = 4 * 1024 * 1024;
+
+/// What the mock voice server saw of one stream.
+#[derive(Debug, Clone, Default)]
+pub struct StreamReport {
+  pub packets: u64,
+  pub bytes: u64,
+  /// Packets missing from the received sequence number range.
+  pub lost: u64,
+  /// RFC 3550 interarrival jitter.
+  pub jitter: Duration,
+  pub max_gap: Duration,
+  /// Packets that arrived more than two frames after the previous one.
+  pub late: u64
+}
+
+struct StreamTracker {
+  report: StreamReport,
+  first_sequence: u64,
+  /// Extended highest sequence number.
+  sequence: u64,
+  timestamp: u32,
+  arrival: Instant,
+  /// In seconds.
+  jitter: f64
+}
+
+impl StreamTracker {
+  fn new(sequence: u16, timestamp: u32, size: usize) -> Self {
+    Self {
+      report: StreamReport {
+        packets: 1,
+        bytes: size as u64,
+        ..Default::default()
+      },
+      first_sequence: sequence as u64,
+      sequence: sequence as u64,
+      timestamp,
+      arrival: Instant::now(),
+      jitter: 0.0
+    }
+  }
+
+  fn on_packet(&mut self, sequence: u16, timestamp: u32, size: usize) {
+    let now = Instant::now();
+    self.report.packets += 1;
+    self.report.bytes += size as u64;
+
+    // Reordered and duplicate packets only count towards the totals
+    let delta = sequence.wrapping_sub(self.sequence as u16) as i16;
+    if delta <= 0 {
+      return;
+    }
+    self.sequence += delta as u64;
+
+    let gap = now - self.arrival;
+    let clock = timestamp.wrapping_sub(self.timestamp) as i32 as f64 / SAMPLE_RATE as f64;
+    self.jitter += ((gap.as_secs_f64() - clock).abs() - self.jitter) / 16.0;
+    self.report.max_gap = self.report.max_gap.max(gap);
+    if gap > CHUNK_DURATION * 2 {
+      self.report.late += 1;
+    }
+
+    self.arrival = now;
+    self.timestamp = timestamp;
+  }
+
+  fn finish(mut self) -> StreamReport {
+    let expected = self.sequence - self.first_sequence + 1;
+    self.report.lost = expected.saturating_sub(self.report.packets);
+    self.report.jitter = Duration::from_secs_f64(self.jitter);
+    self.report
+  }
+}
+
+/// A local stand-in for a Discord voice server: a plain `ws://` gateway that accepts every
+/// session, and UDP endpoints that answer IP discovery and record incoming RTP per SSRC.
+///
+/// The SSRC of a session is its guild ID.
+pub struct MockVoiceServer {
+  pub endpoint: String,
+  udp: Vec<(oneshot::Sender<()>, JoinHandle<HashMap<u32, StreamTracker>>)>
+}
+
+impl MockVoiceServer {
+  /// Starts the gateway and `sockets` UDP endpoints, sessions are spread over the endpoints by guild.
+  pub async fn start(sockets: usize) -> Result<Self> {
+    let mut udp = Vec::with_capacity(sockets);
+    let mut ports = Vec::with_capacity(sockets);
+    for _ in 0..sockets.max(1) {
+      let socket = std::net::UdpSocket::bind("127.0.0.1:0")?;
+      set_receive_buffer(&socket);
+      socket.set_nonblocking(true)?;
+      ports.push(socket.local_addr()?.port());
+
+      let (shutdown_tx, shutdown_rx) = oneshot::channel();
+      udp.push((shutdown_tx, tokio::spawn(run_udp(UdpSocket::from_std(socket)?, shutdown_rx))));
+    }
+
+    let listener = TcpListener::bind("127.0.0.1:0").await?;
+    let endpoint = format!("ws://{}", listener.local_addr()?);
+    tokio::spawn(run_gateway(listener, ports.into()));
+
+    Ok(Self {
+      endpoint,
+      udp
+    })
+  }
+
+  /// Stops receiving and returns reports of every stream seen, by SSRC.
+  ///
+  /// Gateway sessions stay open, so connections are not disconnected under the caller.
+  pub async fn finish(self) -> HashMap<u32, StreamReport> {
+    let mut reports = HashMap::new();
+    for (shutdown, task) in self.udp {
+      _ = shutdown.send(());
+      if let Ok(trackers) = task.await {
+        reports.extend(trackers.into_iter().map(|(ssrc, tracker)| (ssrc, tracker.finish())));
+      }
+    }
+    reports
+  }
+}
+
+/// Lets the mock absorb bursts of thousands of streams without the kernel dropping packets.
+fn set_receive_buffer(socket: &std::net::UdpSocket) {
+  let size = RECEIVE_BUFFER_SIZE;
+  let result = unsafe {
+    libc::setsockopt(
+      socket.as_raw_fd(),
+      libc::SOL_SOCKET,
+      libc::SO_RCVBUF,
+      &size as *const _ as *const libc::c_void,
+      std::mem::size_of_val(&size) as libc::socklen_t
+    )
+  };
+  if result != 0 {
+    warn!("failed to set mock receive buffer: {}", std::io::Error::last_os_error());
+  }
+}
+
+async fn run_udp(socket: UdpSocket, mut shutdown: oneshot::Receiver<()>) -> HashMap<u32, StreamTracker> {
+  let mut trackers = HashMap::new();
+  let mut buffer = [0; 2048];
+  loop {
+    let (size, remote) = select! {
+      result = socket.recv_from(&mut buffer) => match result {
+        Ok(it) => it,
+        Err(error) => {
+          warn!("mock UDP receive failed: {:?}", error);
+          continue;
+        }
+      },
+      _ = &mut shutdown => break
+    };
+
+    let packet = &buffer[..size];
+    if size == IP_DISCOVERY_SIZE && packet[..2] == [0, 1] {
+      if let Err(error) = answer_ip_discovery(&socket, packet, remote).await {
+        warn!("mock IP discovery failed: {:?}", error);
+      }
+    } else if size >= RTP_HEADER_SIZE && packet[0] >> 6 == 2 && packet[1] & 0x7f == 0x78 {
+      let sequence = u16::from_be_bytes([packet[2], packet[3]]);
+      let timestamp = u32::from_be_bytes(packet[4..8].try_into().unwrap());
+      let ssrc = u32::from_be_bytes(packet[8..12].try_into().unwrap());
+      trackers
+        .entry(ssrc)
+        .and_modify(|it: &mut StreamTracker| it.on_packet(sequence, timestamp, size))
+        .or_insert_with(|| StreamTracker::new(sequence, timestamp, size));
+    }
+  }
+  trackers
+}
+
+async fn answer_ip_discovery(socket: &UdpSocket, request: &[u8], remote: SocketAddr) -> Result<()> {
+  let mut response = [0; IP_DISCOVERY_SIZE];
+  response[..2].copy_from_slice(&2u16.to_be_bytes());
+  response[2..4].copy_from_slice(&70u16.to_be_bytes());
+  response[4..8].copy_from_slice(&request[4..8]);
+  let address = remote.ip().to_string();
+  response[8..8 + address.len()].copy_from_slice(address.as_bytes());
+  response[72..].copy_from_slice(&remote.port().to_be_bytes());
+
+  socket.send_to(&response, remote).await?;
+  Ok(())
+}
+
+async fn run_gateway(listener: TcpListener, ports: Arc<[u16]>) {
+  loop {
+    let stream = match listener.accept().await {
+      Ok((stream, _)) => stream,
+      Err(error) => {
+        warn!("mock gateway accept failed: {:?}", error);
+        continue;
+      }
+    };
+
+    let ports = ports.clone();
+    tokio::spawn(async move {
+      if let Err(error) = run_session(stream, ports).await {
+        debug!("mock gateway session failed: {:?}", error);
+      }
+    });
+  }
+}
+
+async fn run_session(stream: TcpStream, ports: Arc<[u16]>) -> Result<()> {
+  let mut socket = accept_async(stream).await?;
+
+  let identify = match receive(&mut socket).await? {
+    Some(GatewayEvent::Identify(identify)) => identify,
+    other => return Err(anyhow!("expected Identify, got {:?}", other))
+  };
+  let ssrc = identify.server_id as u32;
+  let mut secret_key = vec![0; 32];
+  secret_key[..8].copy_from_slice(&identify.server_id.to_le_bytes());
+
+  send(&mut socket, GatewayEvent::Hello(Hello {
+    heartbeat_interval: 13750.0
+  })).await?;
+  send(&mut socket, GatewayEvent::Ready(Ready {
+    ssrc,
+    ip: "127.0.0.1".to_owned(),
+    port: ports[identify.server_id as usize % ports.len()],
+    modes: VoiceCipherMode::ALL.iter().map(|it| it.name().to_owned()).collect()
+  })).await?;
+
+  while let Some(event) = receive(&mut socket).await? {
+    match event {
+      GatewayEvent::SelectProtocol(select) => {
+        send(&mut socket, GatewayEvent::SessionDescription(SessionDescription {
+          mode: select.data.mode,
+          secret_key: secret_key.clone()
+        })).await?;
+      },
+      GatewayEvent::Heartbeat(nonce) => send(&mut socket, GatewayEvent::HeartbeatAck(nonce)).await?,
+      GatewayEvent::Speaking(_) => {},
+      other => debug!("mock gateway ignored {:?}", other)
+    }
+  }
+  Ok(())
+}
+
+async fn receive(socket: &mut WebSocketStream<TcpStream>) -> Result<Option<GatewayEvent>> {
+  while let Some(message) = socket.next().await {
+    match message? {
+      Message::Text(json) => return Ok(Some(serde_json::from_str(&json)?)),
+      Message::Close(_) => break,
+      _ => {}
+    }
+  }
+  Ok(None)
+}
+
+async fn send(socket: &mut WebSocketStream<TcpStream>, event: GatewayEvent) -> Result<()> {
+  socket.send(Message::Text(serde_json::to_string(&event)?)).await?;
+  Ok(())
+}
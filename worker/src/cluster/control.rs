@@ -0,0 +1,302 @@
+use std::{
+  collections::HashMap,
+  future::Future,
+  net::SocketAddr,
+  sync::{atomic::{AtomicU64, Ordering}, Arc, Mutex},
+  time::Duration
+};
+use anyhow::{Result, Context, anyhow};
+use flume::Sender;
+use tokio::{net::{TcpListener, TcpStream, tcp::{OwnedReadHalf, OwnedWriteHalf}}, sync::{oneshot, watch}, time::timeout};
+use tracing::{debug, info, warn};
+use twilight_model::id::{Id, marker::GuildMarker};
+
+use super::rpc::{new_nonce, read_frame, sign_nonce, verify_nonce, write_frame, ControlMessage, NodeLoad, NodeMessage, Request, Response, Signer, VoiceSession};
+
+/// Connecting to a voice server can take a few seconds, anything longer means the node is stuck.
+const CALL_TIMEOUT: Duration = Duration::from_secs(30);
+const HANDSHAKE_TIMEOUT: Duration = Duration::from_secs(10);
+
+struct Node {
+  address: SocketAddr,
+  capacity: u32,
+  load: NodeLoad,
+  /// Sessions placed since the last load report, so a burst of joins is spread over nodes.
+  placed: u32,
+  messages: Sender<ControlMessage>,
+  pending: HashMap<u64, oneshot::Sender<Response>>
+}
+
+impl Node {
+  fn streams(&self) -> u32 {
+    self.load.streams + self.placed
+  }
+
+  /// Lower is less loaded.
+  fn score(&self) -> f32 {
+    self.load.cpu + self.streams() as f32 / self.capacity.max(1) as f32
+  }
+}
+
+struct Placement {
+  node: u64,
+  /// Tells placements apart, so a failed attempt never removes a newer one.
+  attempt: u64,
+  /// Becomes `true` once the node connected the voice session, closed without it if connecting failed.
+  connected: watch::Receiver<bool>
+}
+
+impl Placement {
+  fn is_connected(&self) -> bool {
+    *self.connected.borrow()
+  }
+}
+
+/// Result of [`Control::place`].
+enum Placed {
+  /// Connected, or being connected by another caller.
+  Existing(u64, watch::Receiver<bool>),
+  /// Placed just now, the caller connects it and reports back through the sender.
+  New(u64, u64, watch::Sender<bool>)
+}
+
+#[derive(Default)]
+struct ControlState {
+  nodes: HashMap<u64, Node>,
+  placements: HashMap<Id<GuildMarker>, Placement>
+}
+
+/// Control plane side of the cluster: tracks worker nodes and their load, and places
+/// the voice session of every guild on one of them.
+///
+/// Nodes must prove they know the cluster secret before they are registered. The connection itself
+/// is not encrypted, so it should only be exposed on a private network.
+pub struct Control {
+  secret: Vec<u8>,
+  state: Mutex<ControlState>,
+  next_node: AtomicU64,
+  next_request: AtomicU64,
+  next_attempt: AtomicU64
+}
+
+impl Control {
+  pub fn new(secret: Vec<u8>) -> Self {
+    Self {
+      secret,
+      state: Default::default(),
+      next_node: AtomicU64::new(0),
+      next_request: AtomicU64::new(0),
+      next_attempt: AtomicU64::new(0)
+    }
+  }
+
+  /// Accepts worker nodes on `address`.
+  pub async fn serve(self: Arc<Self>, address: SocketAddr) -> Result<()> {
+    let listener = TcpListener::bind(address).await?;
+    info!("control plane listening on {}", address);
+
+    loop {
+      let (stream, remote) = listener.accept().await?;
+      let me = self.clone();
+      tokio::spawn(async move {
+        if let Err(error) = me.run_node(stream, remote).await {
+          warn!("worker node {} failed: {:?}", remote, error);
+        }
+      });
+    }
+  }
+
+  async fn run_node(&self, stream: TcpStream, address: SocketAddr) -> Result<()> {
+    stream.set_nodelay(true)?;
+    let (mut read, mut write) = stream.into_split();
+    let mut buffer = Vec::new();
+
+    let (capacity, guilds) = timeout(HANDSHAKE_TIMEOUT, self.handshake(&mut read, &mut write, &mut buffer))
+      .await
+      .map_err(|_| anyhow!("worker node did not register in {:?}", HANDSHAKE_TIMEOUT))??;
+
+    let id = self.next_node.fetch_add(1, Ordering::Relaxed);
+    let (messages_tx, messages_rx) = flume::unbounded();
+    {
+      let mut state = self.state.lock().unwrap();
+      state.nodes.insert(id, Node {
+        address,
+        capacity,
+        load: NodeLoad::default(),
+        placed: 0,
+        messages: messages_tx,
+        pending: HashMap::new()
+      });
+      self.adopt(&mut state, id, &guilds);
+    }
+    info!("worker node {} at {} registered with capacity {} and {} voice sessions", id, address, capacity, guilds.len());
+
+    let writer = tokio::spawn(async move {
+      while let Ok(message) = messages_rx.recv_async().await {
+        if let Err(error) = write_frame(&mut write, &message).await {
+          debug!("failed to write to worker node: {:?}", error);
+          break;
+        }
+      }
+    });
+    let result = self.read_node(id, &mut read, &mut buffer).await;
+    writer.abort();
+
+    // Pending calls fail as their senders are dropped with the node
+    let mut state = self.state.lock().unwrap();
+    state.nodes.remove(&id);
+    let placed = state.placements.len();
+    state.placements.retain(|_, placement| placement.node != id);
+    warn!("worker node {} left, {} voice sessions lost", id, placed - state.placements.len());
+
+    result
+  }
+
+  /// Challenges a connecting node to prove it knows the cluster secret, returns its capacity and the guilds it still hosts.
+  async fn handshake(&self, read: &mut OwnedReadHalf, write: &mut OwnedWriteHalf, buffer: &mut Vec<u8>) -> Result<(u32, Vec<u64>)> {
+    let nonce = new_nonce()?;
+    write_frame(write, &ControlMessage::Challenge { nonce }).await?;
+
+    let (capacity, guilds, node_nonce, proof) = match read_frame(read, buffer).await? {
+      Some(NodeMessage::Register { capacity, guilds, nonce, proof }) => (capacity, guilds, nonce, proof),
+      Some(_) => return Err(anyhow!("expected Register")),
+      None => return Err(anyhow!("connection closed before Register"))
+    };
+    if !verify_nonce(&self.secret, Signer::Node, &nonce, &proof) {
+      return Err(anyhow!("worker node failed to prove the cluster secret"));
+    }
+
+    let proof = sign_nonce(&self.secret, Signer::Control, &node_nonce);
+    write_frame(write, &ControlMessage::Accepted { proof }).await?;
+    Ok((capacity, guilds))
+  }
+
+  /// Places sessions a reconnecting node kept playing back on it, unless they were placed elsewhere meanwhile.
+  fn adopt(&self, state: &mut ControlState, node: u64, guilds: &[u64]) {
+    for guild_id in guilds.iter().filter_map(|&it| Id::new_checked(it)) {
+      if let Some(placement) = state.placements.get(&guild_id) {
+        // The voice server closes the stale session once the new one connects
+        warn!("guild {} of worker node {} was placed on worker node {} meanwhile", guild_id, node, placement.node);
+        continue;
+      }
+
+      let (_, connected) = watch::channel(true);
+      let attempt = self.next_attempt.fetch_add(1, Ordering::Relaxed);
+      state.placements.insert(guild_id, Placement { node, attempt, connected });
+    }
+  }
+
+  async fn read_node(&self, id: u64, read: &mut OwnedReadHalf, buffer: &mut Vec<u8>) -> Result<()> {
+    while let Some(message) = read_frame(read, buffer).await? {
+      let mut state = self.state.lock().unwrap();
+      let node = state.nodes.get_mut(&id).context("worker node removed")?;
+      match message {
+        NodeMessage::Load(load) => {
+          node.load = load;
+          node.placed = 0;
+        },
+        NodeMessage::Response { id, response } => {
+          if let Some(sender) = node.pending.remove(&id) {
+            _ = sender.send(response);
+          }
+        },
+        NodeMessage::Register { .. } => warn!("worker node {} registered twice", id)
+      }
+    }
+    Ok(())
+  }
+
+  /// Returns the node hosting the connected voice session of `guild_id`, if any.
+  pub fn placement(&self, guild_id: Id<GuildMarker>) -> Option<u64> {
+    self.state.lock().unwrap().placements.get(&guild_id).filter(|it| it.is_connected()).map(|it| it.node)
+  }
+
+  /// Returns the node hosting the voice session of `guild_id`, placing it and connecting it with `session` if it has none.
+  ///
+  /// Concurrent callers for the same guild wait for the first one to connect it, and fail if it fails.
+  pub async fn connect(&self, guild_id: Id<GuildMarker>, session: impl Future<Output = Result<VoiceSession>>) -> Result<u64> {
+    match self.place(guild_id)? {
+      Placed::Existing(node, mut connected) => {
+        while !*connected.borrow() {
+          connected.changed().await.map_err(|_| anyhow!("voice session of guild {} failed to connect", guild_id))?;
+        }
+        Ok(node)
+      },
+      Placed::New(node, attempt, connected) => {
+        let result = async {
+          let session = session.await?;
+          self.call(node, Request::Connect { guild_id: guild_id.get(), session }).await
+        }.await;
+
+        match result {
+          Ok(_) => {
+            _ = connected.send(true);
+            Ok(node)
+          },
+          Err(error) => {
+            // Waiters are woken with an error as the sender is dropped
+            self.unplace(guild_id, attempt);
+            Err(error)
+          }
+        }
+      }
+    }
+  }
+
+  /// Returns the placement of `guild_id`, placing it on the least loaded node with spare capacity if it had none.
+  fn place(&self, guild_id: Id<GuildMarker>) -> Result<Placed> {
+    let mut state = self.state.lock().unwrap();
+    if let Some(placement) = state.placements.get(&guild_id) {
+      return Ok(Placed::Existing(placement.node, placement.connected.clone()));
+    }
+
+    let state = &mut *state;
+    let (&id, node) = state.nodes
+      .iter_mut()
+      .filter(|(_, node)| node.streams() < node.capacity)
+      .min_by(|(_, a), (_, b)| a.score().total_cmp(&b.score()))
+      .context("no worker node has spare capacity")?;
+    node.placed += 1;
+    debug!("placed guild {} on worker node {} at {} (score {:.2})", guild_id, id, node.address, node.score());
+
+    let (sender, connected) = watch::channel(false);
+    let attempt = self.next_attempt.fetch_add(1, Ordering::Relaxed);
+    state.placements.insert(guild_id, Placement { node: id, attempt, connected });
+    Ok(Placed::New(id, attempt, sender))
+  }
+
+  /// Forgets the placement of `guild_id` made by `attempt`, e.g. after the node failed to connect it.
+  fn unplace(&self, guild_id: Id<GuildMarker>, attempt: u64) {
+    let mut state = self.state.lock().unwrap();
+    if state.placements.get(&guild_id).map_or(false, |it| it.attempt == attempt) {
+      state.placements.remove(&guild_id);
+    }
+  }
+
+  /// Sends `request` to `node` and waits for its response, a [`Response::Error`] is returned as an error.
+  pub async fn call(&self, node: u64, request: Request) -> Result<Response> {
+    let id = self.next_request.fetch_add(1, Ordering::Relaxed);
+    let (sender, receiver) = oneshot::channel();
+    {
+      let mut state = self.state.lock().unwrap();
+      let node = state.nodes.get_mut(&node).context("worker node left")?;
+      node.pending.insert(id, sender);
+      node.messages.send(ControlMessage::Request { id, request }).map_err(|_| anyhow!("worker node left"))?;
+    }
+
+    let response = match timeout(CALL_TIMEOUT, receiver).await {
+      Ok(response) => response.map_err(|_| anyhow!("worker node left"))?,
+      Err(_) => {
+        if let Some(node) = self.state.lock().unwrap().nodes.get_mut(&node) {
+          node.pending.remove(&id);
+        }
+        return Err(anyhow!("worker node {} did not respond in {:?}", node, CALL_TIMEOUT));
+      }
+    };
+
+    match response {
+      Response::Error(error) => Err(anyhow!("worker node {} failed: {}", node, error)),
+      response => Ok(response)
+    }
+  }
+}
@@ -0,0 +1,39 @@
+pub mod rpc;
+pub mod control;
+pub mod node;
+
+use std::env;
+use anyhow::{Result, Context, anyhow};
+
+/// What this process does, set by `MOSAIK_ROLE`.
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum Role {
+  /// Gateway, interactions and voice in one process, the default.
+  Standalone,
+  /// Gateway and interactions only, voice sessions are placed on worker nodes.
+  Control,
+  /// Voice only, driven by the control plane at `MOSAIK_CONTROL_ADDR`.
+  Worker
+}
+
+impl Role {
+  pub fn from_env() -> Result<Self> {
+    match env::var("MOSAIK_ROLE").as_deref() {
+      Ok("standalone") | Err(_) => Ok(Role::Standalone),
+      Ok("control") => Ok(Role::Control),
+      Ok("worker") => Ok(Role::Worker),
+      Ok(other) => Err(anyhow!("unknown role {}", other))
+    }
+  }
+}
+
+/// Secret shared by the control plane and its worker nodes, set by `MOSAIK_CLUSTER_SECRET`.
+///
+/// Nodes prove they know it before they are placed any voice session, see [`rpc::sign_nonce`].
+pub fn cluster_secret() -> Result<Vec<u8>> {
+  let secret = env::var("MOSAIK_CLUSTER_SECRET").context("MOSAIK_CLUSTER_SECRET is required on control and worker nodes")?;
+  if secret.len() < 16 {
+    return Err(anyhow!("MOSAIK_CLUSTER_SECRET must be at least 16 bytes long"));
+  }
+  Ok(secret.into_bytes())
+}
@@ -0,0 +1,118 @@
+use std::time::{Duration, Instant};
+use anyhow::{Result, Context, anyhow};
+use flume::Sender;
+use tokio::{net::TcpStream, time::{interval, sleep}};
+use tracing::{info, warn};
+use twilight_model::id::Id;
+use voice::provider::SeekMode;
+
+use crate::{metrics::process_cpu_time, sessions::LocalSessions};
+use super::rpc::{new_nonce, read_frame, sign_nonce, verify_nonce, write_frame, ControlMessage, NodeLoad, NodeMessage, Request, Response, Signer};
+
+const LOAD_INTERVAL: Duration = Duration::from_secs(2);
+const RECONNECT_DELAY: Duration = Duration::from_secs(5);
+
+/// Runs this process as a worker node of the control plane at `address`, reconnecting if the connection drops.
+///
+/// Sessions keep playing while disconnected and are placed back on this node once it registers again.
+pub async fn run(address: String, capacity: u32, secret: Vec<u8>, sessions: LocalSessions) -> Result<()> {
+  loop {
+    match serve(&address, capacity, &secret, &sessions).await {
+      Ok(()) => warn!("control plane closed the connection"),
+      Err(error) => warn!("control plane connection failed: {:?}", error)
+    }
+    sleep(RECONNECT_DELAY).await;
+  }
+}
+
+async fn serve(address: &str, capacity: u32, secret: &[u8], sessions: &LocalSessions) -> Result<()> {
+  let stream = TcpStream::connect(address).await?;
+  stream.set_nodelay(true)?;
+  let (mut read, mut write) = stream.into_split();
+  let mut buffer = Vec::new();
+
+  let challenge = match read_frame(&mut read, &mut buffer).await? {
+    Some(ControlMessage::Challenge { nonce }) => nonce,
+    _ => return Err(anyhow!("expected Challenge"))
+  };
+  let nonce = new_nonce()?;
+  let proof = sign_nonce(secret, Signer::Node, &challenge);
+  let guilds = sessions.guilds().into_iter().map(|it| it.get()).collect();
+  write_frame(&mut write, &NodeMessage::Register { capacity, guilds, nonce, proof }).await?;
+
+  match read_frame(&mut read, &mut buffer).await? {
+    Some(ControlMessage::Accepted { proof }) if verify_nonce(secret, Signer::Control, &nonce, &proof) => {},
+    Some(ControlMessage::Accepted { .. }) => return Err(anyhow!("control plane failed to prove the cluster secret")),
+    _ => return Err(anyhow!("control plane did not accept the registration"))
+  }
+  info!("registered with control plane at {} with capacity {}", address, capacity);
+
+  let (messages_tx, messages_rx) = flume::unbounded();
+  let writer = tokio::spawn(async move {
+    while let Ok(message) = messages_rx.recv_async().await {
+      write_frame(&mut write, &message).await?;
+    }
+    anyhow::Ok(())
+  });
+  let load = tokio::spawn(report_load(sessions.clone(), messages_tx.clone()));
+
+  let result = async {
+    while let Some(message) = read_frame(&mut read, &mut buffer).await? {
+      let ControlMessage::Request { id, request } = message else {
+        warn!("unexpected handshake message from control plane");
+        continue;
+      };
+
+      let sessions = sessions.clone();
+      let messages = messages_tx.clone();
+      tokio::spawn(async move {
+        let response = handle(&sessions, request).await.unwrap_or_else(|error| Response::Error(format!("{:?}", error)));
+        _ = messages.send(NodeMessage::Response { id, response });
+      });
+    }
+    anyhow::Ok(())
+  }.await;
+
+  load.abort();
+  writer.abort();
+  result
+}
+
+async fn handle(sessions: &LocalSessions, request: Request) -> Result<Response> {
+  Ok(match request {
+    Request::Connect { guild_id, session } => {
+      sessions.connect(Id::new_checked(guild_id).context("invalid guild")?, session).await?;
+      Response::Connected
+    },
+    Request::Play { guild_id, source } => {
+      Response::Played(sessions.play(Id::new_checked(guild_id).context("invalid guild")?, &source).await?)
+    },
+    Request::Seek { guild_id, position_ms, accurate } => {
+      let mode = if accurate { SeekMode::Accurate } else { SeekMode::Coarse };
+      let position = Duration::from_millis(position_ms);
+      Response::Seeked(sessions.seek(Id::new_checked(guild_id).context("invalid guild")?, position, mode).await?)
+    }
+  })
+}
+
+async fn report_load(sessions: LocalSessions, messages: Sender<NodeMessage>) {
+  let cores = std::thread::available_parallelism().map_or(1, |it| it.get()) as f32;
+  let mut interval = interval(LOAD_INTERVAL);
+  let mut last = (Instant::now(), process_cpu_time());
+
+  loop {
+    interval.tick().await;
+    let now = (Instant::now(), process_cpu_time());
+    let wall = (now.0 - last.0).as_secs_f32().max(f32::EPSILON);
+    let cpu = (now.1 - last.1).as_secs_f32() / wall / cores;
+    last = now;
+
+    let load = NodeLoad {
+      streams: sessions.streams() as u32,
+      cpu
+    };
+    if messages.send(NodeMessage::Load(load)).is_err() {
+      break;
+    }
+  }
+}
@@ -0,0 +1,214 @@
+use anyhow::{Result, anyhow};
+use ring::{hmac, rand::{SecureRandom, SystemRandom}};
+use serde::{de::DeserializeOwned, Deserialize, Serialize};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+/// Frames larger than this are a protocol error, every message is a few hundred bytes.
+const MAX_FRAME_SIZE: usize = 1 << 20;
+pub const NONCE_SIZE: usize = 32;
+
+/// Everything a worker node needs to join the voice channel the control plane put the bot in.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct VoiceSession {
+  pub user_id: u64,
+  pub channel_id: u64,
+  pub bitrate: Option<u32>,
+  pub endpoint: String,
+  pub token: String,
+  pub session_id: String
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum Request {
+  Connect { guild_id: u64, session: VoiceSession },
+  /// Queues `source` (e.g. `http_seek:https://...`), playing it if nothing is playing.
+  Play { guild_id: u64, source: String },
+  Seek { guild_id: u64, position_ms: u64, accurate: bool }
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum Response {
+  Connected,
+  Played(PlayResult),
+  /// Whether the guild had a player to seek.
+  Seeked(bool),
+  Error(String)
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct PlayResult {
+  pub queued: bool,
+  pub provider: String,
+  pub metadata: Vec<String>
+}
+
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize)]
+pub struct NodeLoad {
+  pub streams: u32,
+  /// Fraction of all cores used since the previous report.
+  pub cpu: f32
+}
+
+/// Sent by the control plane to a worker node, starting with [`ControlMessage::Challenge`].
+#[derive(Debug, Serialize, Deserialize)]
+pub enum ControlMessage {
+  Challenge { nonce: [u8; NONCE_SIZE] },
+  /// The node is registered, `proof` signs the nonce it registered with.
+  Accepted { proof: Vec<u8> },
+  Request { id: u64, request: Request }
+}
+
+/// Sent by a worker node to the control plane, starting with [`NodeMessage::Register`] in reply to the challenge.
+#[derive(Debug, Serialize, Deserialize)]
+pub enum NodeMessage {
+  /// `proof` signs the challenge nonce, `nonce` is signed back by the control plane.
+  /// `guilds` are voice sessions the node kept playing from a previous connection.
+  Register { capacity: u32, guilds: Vec<u64>, nonce: [u8; NONCE_SIZE], proof: Vec<u8> },
+  Load(NodeLoad),
+  Response { id: u64, response: Response }
+}
+
+/// Which side of the handshake signs a nonce, so a signature of one side is never accepted from the other.
+#[derive(Debug, Clone, Copy)]
+pub enum Signer {
+  Control,
+  Node
+}
+
+pub fn new_nonce() -> Result<[u8; NONCE_SIZE]> {
+  let mut nonce = [0; NONCE_SIZE];
+  SystemRandom::new().fill(&mut nonce).map_err(|_| anyhow!("failed to generate nonce"))?;
+  Ok(nonce)
+}
+
+/// Returns HMAC-SHA256 of `nonce` under the cluster secret, proving knowledge of the secret without sending it.
+pub fn sign_nonce(secret: &[u8], signer: Signer, nonce: &[u8]) -> Vec<u8> {
+  let key = hmac::Key::new(hmac::HMAC_SHA256, secret);
+  let mut context = hmac::Context::with_key(&key);
+  context.update(signer_label(signer));
+  context.update(nonce);
+  context.sign().as_ref().to_vec()
+}
+
+/// Checks a signature made by [`sign_nonce`] in constant time.
+pub fn verify_nonce(secret: &[u8], signer: Signer, nonce: &[u8], proof: &[u8]) -> bool {
+  let key = hmac::Key::new(hmac::HMAC_SHA256, secret);
+  let message = [signer_label(signer), nonce].concat();
+  hmac::verify(&key, &message, proof).is_ok()
+}
+
+fn signer_label(signer: Signer) -> &'static [u8] {
+  match signer {
+    Signer::Control => b"mosaik-control:",
+    Signer::Node => b"mosaik-node:"
+  }
+}
+
+/// Writes `message` as a big-endian `u32` length followed by its bincode encoding.
+pub async fn write_frame<W: AsyncWrite + Unpin, T: Serialize>(writer: &mut W, message: &T) -> Result<()> {
+  let payload = bincode::serialize(message)?;
+  writer.write_u32(u32::try_from(payload.len())?).await?;
+  writer.write_all(&payload).await?;
+  Ok(())
+}
+
+/// Reads a frame written by [`write_frame`], returns `None` if the connection was closed between frames.
+pub async fn read_frame<R: AsyncRead + Unpin, T: DeserializeOwned>(reader: &mut R, buffer: &mut Vec<u8>) -> Result<Option<T>> {
+  let size = match reader.read_u32().await {
+    Ok(size) => size as usize,
+    Err(error) if error.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(None),
+    Err(error) => return Err(error.into())
+  };
+  if size > MAX_FRAME_SIZE {
+    return Err(anyhow!("frame of {} bytes is too large", size));
+  }
+
+  buffer.resize(size, 0);
+  reader.read_exact(buffer).await?;
+  Ok(Some(bincode::deserialize(buffer)?))
+}
+
+#[cfg(test)]
+mod tests {
+  use tokio::io::duplex;
+  use super::*;
+
+  fn play(guild_id: u64) -> ControlMessage {
+    ControlMessage::Request {
+      id: guild_id * 10,
+      request: Request::Play { guild_id, source: "file:/tmp/track.flac".to_owned() }
+    }
+  }
+
+  #[tokio::test]
+  async fn frames_round_trip() {
+    let (mut writer, mut reader) = duplex(256);
+    tokio::spawn(async move {
+      for guild_id in 1..=3 {
+        write_frame(&mut writer, &play(guild_id)).await.unwrap();
+      }
+      write_frame(&mut writer, &NodeMessage::Load(NodeLoad { streams: 7, cpu: 0.5 })).await.unwrap();
+    });
+
+    let mut buffer = Vec::new();
+    for guild_id in 1..=3 {
+      match read_frame(&mut reader, &mut buffer).await.unwrap() {
+        Some(ControlMessage::Request { id, request: Request::Play { guild_id: played, source } }) => {
+          assert_eq!((id, played), (guild_id * 10, guild_id));
+          assert_eq!(source, "file:/tmp/track.flac");
+        },
+        other => panic!("unexpected frame {:?}", other)
+      }
+    }
+    match read_frame(&mut reader, &mut buffer).await.unwrap() {
+      Some(NodeMessage::Load(load)) => assert_eq!((load.streams, load.cpu), (7, 0.5)),
+      other => panic!("unexpected frame {:?}", other)
+    }
+
+    // The writer is dropped between frames
+    assert!(read_frame::<_, NodeMessage>(&mut reader, &mut buffer).await.unwrap().is_none());
+  }
+
+  #[tokio::test]
+  async fn frame_is_length_prefixed() {
+    let message = Response::Seeked(true);
+    let mut frame = Vec::new();
+    write_frame(&mut frame, &message).await.unwrap();
+
+    let payload = bincode::serialize(&message).unwrap();
+    assert_eq!(frame[..4], (payload.len() as u32).to_be_bytes());
+    assert_eq!(frame[4..], payload);
+  }
+
+  #[tokio::test]
+  async fn oversized_frame_is_rejected() {
+    let mut frame = ((MAX_FRAME_SIZE + 1) as u32).to_be_bytes().to_vec();
+    frame.extend([0; 16]);
+
+    let mut buffer = Vec::new();
+    assert!(read_frame::<_, NodeMessage>(&mut frame.as_slice(), &mut buffer).await.is_err());
+    assert!(buffer.is_empty());
+  }
+
+  #[tokio::test]
+  async fn truncated_frame_is_an_error() {
+    let mut frame = Vec::new();
+    write_frame(&mut frame, &play(1)).await.unwrap();
+
+    let mut buffer = Vec::new();
+    assert!(read_frame::<_, ControlMessage>(&mut &frame[..frame.len() - 1], &mut buffer).await.is_err());
+  }
+
+  #[test]
+  fn nonce_signature_is_bound_to_signer_and_secret() {
+    let nonce = new_nonce().unwrap();
+    assert_ne!(nonce, new_nonce().unwrap());
+
+    let proof = sign_nonce(b"secret", Signer::Node, &nonce);
+    assert!(verify_nonce(b"secret", Signer::Node, &nonce, &proof));
+    assert!(!verify_nonce(b"secret", Signer::Control, &nonce, &proof));
+    assert!(!verify_nonce(b"other", Signer::Node, &nonce, &proof));
+    assert!(!verify_nonce(b"secret", Signer::Node, &new_nonce().unwrap(), &proof));
+    assert!(!verify_nonce(b"secret", Signer::Node, &nonce, &proof[..16]));
+  }
+}
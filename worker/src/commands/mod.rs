@@ -1,6 +1,8 @@
 mod play;
+mod seek;
 
 pub use play::*;
+pub use seek::*;
 
 use anyhow::Result;
 use async_trait::async_trait;
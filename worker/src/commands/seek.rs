@@ -0,0 +1,42 @@
+use std::time::Duration;
+
+use anyhow::{Result, Context};
+use async_trait::async_trait;
+use twilight_model::{gateway::payload::incoming::InteractionCreate, application::interaction::{application_command::CommandOptionValue, InteractionData}};
+use voice::provider::SeekMode;
+
+use crate::{try_unpack, State, interaction_response, get_option_as, reply};
+
+use super::CommandHandler;
+
+pub struct SeekCommand;
+
+#[async_trait]
+impl CommandHandler for SeekCommand {
+  async fn run(&self, state: State, interaction: Box<InteractionCreate>) -> Result<()> {
+    let command = try_unpack!(interaction.data.as_ref().context("no interaction data")?, InteractionData::ApplicationCommand)?;
+    let guild_id = interaction.guild_id.context("no guild")?;
+
+    let position = get_option_as!(command, "position", CommandOptionValue::Integer)
+      .map(|it| *it.unwrap())
+      .context("no position")?;
+    let position = Duration::from_secs(u64::try_from(position)?);
+    let mode = match get_option_as!(command, "accurate", CommandOptionValue::Boolean).map(|it| *it.unwrap()) {
+      Some(false) => SeekMode::Coarse,
+      _ => SeekMode::Accurate
+    };
+
+    let content = if state.sessions.seek(guild_id, position, mode).await? {
+      format!("Seeking to `{:?}`", position)
+    } else {
+      "Nothing is playing".to_owned()
+    };
+
+    reply!(state, interaction, &interaction_response!(
+      ChannelMessageWithSource,
+      content(content)
+    )).await?;
+
+    Ok(())
+  }
+}
@@ -0,0 +1,3 @@
+pub mod providers;
+pub mod voice;
+pub mod metrics;
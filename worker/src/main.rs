@@ -1,19 +1,23 @@
 pub mod util;
 pub mod commands;
-pub mod providers;
-pub mod voice;
 pub mod player;
+pub mod cluster;
+pub mod sessions;
+
+pub use worker::{metrics, providers, voice};
 
 use anyhow::Context;
-use commands::{CommandHandler, PlayCommand};
-use player::Player;
+use cluster::{control::Control, Role};
+use commands::{CommandHandler, PlayCommand, SeekCommand};
+use futures_util::StreamExt;
+use providers::{MediaHttpClient, MediaHttpOptions};
+use sessions::{LocalSessions, VoiceSessions};
 use tracing_subscriber::{layer::SubscriberExt, EnvFilter, util::SubscriberInitExt};
 use twilight_cache_inmemory::InMemoryCache;
-use twilight_util::builder::{command::{StringBuilder, ChannelBuilder}, InteractionResponseDataBuilder};
+use twilight_util::builder::{command::{StringBuilder, ChannelBuilder, IntegerBuilder, BooleanBuilder}, InteractionResponseDataBuilder};
 
-use std::{collections::HashMap, env, error::Error, future::Future, sync::Arc};
-use tokio::sync::RwLock;
-use twilight_gateway::{Shard, Event, Intents, ShardId, MessageSender};
+use std::{collections::HashMap, env, error::Error, future::Future, ops::Range, sync::Arc};
+use twilight_gateway::{stream::{self, ShardEventStream}, Config, Event, Intents, MessageSender};
 use twilight_http::Client as HttpClient;
 use twilight_model::{
   channel::{ChannelType},
@@ -24,12 +28,39 @@ use twilight_standby::Standby;
 pub type State = Arc<StateRef>;
 
 pub struct StateRef {
-  sender: MessageSender,
+  /// Senders of the shards run by this process, by shard number.
+  senders: HashMap<u64, MessageSender>,
+  shard_total: u64,
   http: HttpClient,
   cache: InMemoryCache,
   application_id: Id<ApplicationMarker>,
-  players: RwLock<HashMap<Id<GuildMarker>, Player>>,
   standby: Standby,
+  sessions: VoiceSessions,
+}
+
+impl StateRef {
+  /// Returns the sender of the shard receiving events of `guild_id`.
+  fn shard_sender(&self, guild_id: Id<GuildMarker>) -> anyhow::Result<&MessageSender> {
+    let shard = (guild_id.get() >> 22) % self.shard_total;
+    self.senders.get(&shard).with_context(|| format!("shard {} of guild {} is not run by this process", shard, guild_id))
+  }
+}
+
+/// Default number of streams a worker node accepts, override with `MOSAIK_WORKER_CAPACITY`.
+const DEFAULT_WORKER_CAPACITY: u32 = 500;
+
+/// Returns the shards this process runs, `MOSAIK_SHARD_RANGE` (e.g. `0..4`) or all of them.
+fn shard_range(total: u64) -> anyhow::Result<Range<u64>> {
+  let Ok(range) = env::var("MOSAIK_SHARD_RANGE") else {
+    return Ok(0..total);
+  };
+
+  let (start, end) = range.split_once("..").context("shard range must be start..end")?;
+  let range = start.parse()?..end.parse()?;
+  if range.is_empty() || range.end > total {
+    anyhow::bail!("shard range {:?} is not within 0..{}", range, total);
+  }
+  Ok(range)
 }
 
 fn spawn(
@@ -72,7 +103,25 @@ async fn main() -> Result<(), Box<dyn Error + Send + Sync + 'static>> {
       .init();
   }
 
-  let (mut shard, state) = {
+  if let Ok(address) = env::var("MOSAIK_METRICS_ADDR") {
+    let address = address.parse()?;
+    tokio::spawn(async move {
+      if let Err(error) = metrics::serve(address).await {
+        tracing::warn!("metrics exporter failed: {:?}", error);
+      }
+    });
+  }
+
+  let role = Role::from_env()?;
+  if role == Role::Worker {
+    let address = env::var("MOSAIK_CONTROL_ADDR").context("MOSAIK_CONTROL_ADDR is required on worker nodes")?;
+    let capacity = env::var("MOSAIK_WORKER_CAPACITY").ok().map(|it| it.parse()).transpose()?.unwrap_or(DEFAULT_WORKER_CAPACITY);
+    let sessions = LocalSessions::new(MediaHttpClient::new(MediaHttpOptions::from_env())?);
+    cluster::node::run(address, capacity, cluster::cluster_secret()?, sessions).await?;
+    return Ok(());
+  }
+
+  let (mut shards, state) = {
     let token = env::var("DISCORD_TOKEN")?;
 
     let http = HttpClient::new(token.clone());
@@ -100,29 +149,94 @@ async fn main() -> Result<(), Box<dyn Error + Send + Sync + 'static>> {
       ])?
       .await?;
 
+    interactions
+      .create_guild_command(Id::<GuildMarker>::new(686219466824089640))
+      .chat_input("seek", "Seek the current track")?
+      .description_localizations(&localizations! {
+        "ru" => "Перемотать текущий трек"
+      })?
+      .command_options(&[
+        argument!(
+          IntegerBuilder,
+          "position",
+          "Position in seconds",
+          required(true),
+          min_value(0),
+          description_localizations(&localizations! {
+            "ru" => "Позиция в секундах"
+          })
+        ),
+        argument!(
+          BooleanBuilder,
+          "accurate",
+          "Seek to the exact position instead of the nearest keyframe",
+          description_localizations(&localizations! {
+            "ru" => "Перемотать точно, а не к ближайшему ключевому кадру"
+          })
+        )
+      ])?
+      .await?;
+
+    let sessions = match role {
+      Role::Control => {
+        // Worker nodes on other hosts need it set to a private interface explicitly
+        let address = env::var("MOSAIK_CONTROL_LISTEN").unwrap_or_else(|_| "127.0.0.1:7400".to_owned()).parse()?;
+        let control = Arc::new(Control::new(cluster::cluster_secret()?));
+        let serving = control.clone();
+        tokio::spawn(async move {
+          if let Err(error) = serving.serve(address).await {
+            tracing::warn!("control plane failed: {:?}", error);
+          }
+        });
+        VoiceSessions::Remote(control)
+      },
+      _ => VoiceSessions::Local(LocalSessions::new(MediaHttpClient::new(MediaHttpOptions::from_env())?))
+    };
+
     let intents = Intents::GUILDS | Intents::GUILD_VOICE_STATES;
-    let mut shard = Shard::new(ShardId::ONE, token, intents);
+    let shard_total = match env::var("MOSAIK_SHARDS") {
+      Ok(total) => total.parse()?,
+      Err(_) => http.gateway().authed().await?.model().await?.shards
+    };
+    let range = shard_range(shard_total)?;
+    tracing::info!("running shards {:?} of {}", range, shard_total);
 
-    let sender = shard.sender();
+    let shards = stream::create_range(range, shard_total, Config::new(token, intents), |_, builder| builder.build()).collect::<Vec<_>>();
+    let senders = shards.iter().map(|shard| (shard.id().number(), shard.sender())).collect();
 
     (
-      shard,
+      shards,
       Arc::new(StateRef {
-        sender,
+        senders,
+        shard_total,
         http,
         cache,
         application_id,
-        players: Default::default(),
         standby: Standby::new(),
+        sessions,
       })
     )
   };
 
   let handlers: &mut HashMap<&'static str, Box<dyn CommandHandler>> = Box::leak(Box::new(HashMap::from([ // TODO(Assasans): Memory leak
-    ("play", Box::new(PlayCommand {}) as Box<dyn CommandHandler>)
+    ("play", Box::new(PlayCommand {}) as Box<dyn CommandHandler>),
+    ("seek", Box::new(SeekCommand {}) as Box<dyn CommandHandler>)
   ])));
 
-  while let Ok(event) = shard.next_event().await {
+  let mut events = ShardEventStream::new(shards.iter_mut());
+  while let Some((shard, event)) = events.next().await {
+    let event = match event {
+      Ok(event) => event,
+      Err(error) if error.is_fatal() => {
+        tracing::warn!("shard {} failed: {:?}", shard.id(), error);
+        break;
+      },
+      Err(error) => {
+        tracing::debug!("shard {} failed to receive an event: {:?}", shard.id(), error);
+        continue;
+      }
+    };
+
     state.standby.process(&event);
     state.cache.update(&event);
 
@@ -0,0 +1,73 @@
+use std::{net::SocketAddr, sync::{Arc, OnceLock}, time::Duration};
+use anyhow::Result;
+use tokio::{io::{AsyncReadExt, AsyncWriteExt}, net::{TcpListener, TcpStream}};
+use tracing::{debug, info};
+use utils::metrics::{Counter, Histogram, Registry, PROCESSING_BUCKETS, IO_BUCKETS};
+
+/// Process-wide metrics of the decoding pipeline, from the first byte of a source to interleaved samples.
+pub struct PipelineMetrics {
+  pub time_to_first_byte: Arc<Histogram>,
+  pub source_bytes: Arc<Counter>,
+  pub probe: Arc<Histogram>,
+  pub decode: Arc<Histogram>,
+  pub resample: Arc<Histogram>,
+  pub resample_errors: Arc<Counter>,
+  pub interleave: Arc<Histogram>
+}
+
+impl PipelineMetrics {
+  pub fn global() -> &'static PipelineMetrics {
+    static METRICS: OnceLock<PipelineMetrics> = OnceLock::new();
+    METRICS.get_or_init(|| {
+      let registry = Registry::global();
+      PipelineMetrics {
+        time_to_first_byte: registry.histogram("mosaik_source_first_byte_seconds", "Time until a source returns its first byte", IO_BUCKETS, &[]),
+        source_bytes: registry.counter("mosaik_source_bytes_total", "Bytes read from sources", &[]),
+        probe: registry.histogram("mosaik_probe_seconds", "Time to probe the format of a source", IO_BUCKETS, &[]),
+        decode: registry.histogram("mosaik_decode_seconds", "Decode time per packet", PROCESSING_BUCKETS, &[]),
+        resample: registry.histogram("mosaik_resample_seconds", "Channel mapping and resampling time per packet", PROCESSING_BUCKETS, &[]),
+        resample_errors: registry.counter("mosaik_resample_errors_total", "Chunks dropped because resampling failed", &[]),
+        interleave: registry.histogram("mosaik_interleave_seconds", "Interleaving time per packet", PROCESSING_BUCKETS, &[])
+      }
+    })
+  }
+}
+
+/// Returns user and system CPU time used by the process so far.
+pub fn process_cpu_time() -> Duration {
+  let mut usage = unsafe { std::mem::zeroed::<libc::rusage>() };
+  unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) };
+  let time = |it: libc::timeval| Duration::new(it.tv_sec as u64, it.tv_usec as u32 * 1000);
+  time(usage.ru_utime) + time(usage.ru_stime)
+}
+
+/// Serves the global metrics [`Registry`] in the Prometheus text format on every request to `address`.
+pub async fn serve(address: SocketAddr) -> Result<()> {
+  let listener = TcpListener::bind(address).await?;
+  info!("serving metrics on {}", address);
+
+  loop {
+    let (stream, remote) = listener.accept().await?;
+    tokio::spawn(async move {
+      if let Err(error) = respond(stream).await {
+        debug!("metrics request from {} failed: {:?}", remote, error);
+      }
+    });
+  }
+}
+
+async fn respond(mut stream: TcpStream) -> Result<()> {
+  // Any request gets the metrics, the request itself is not interesting
+  let mut request = [0; 1024];
+  _ = stream.read(&mut request).await?;
+
+  let body = Registry::global().encode();
+  let header = format!(
+    "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+    body.len()
+  );
+  stream.write_all(header.as_bytes()).await?;
+  stream.write_all(body.as_bytes()).await?;
+  stream.shutdown().await?;
+  Ok(())
+}
@@ -0,0 +1,141 @@
+use std::{
+  sync::{atomic::{AtomicBool, Ordering}, Arc},
+  time::Duration
+};
+use anyhow::{Result, anyhow};
+use flume::{Receiver, Sender};
+use tokio::{select, sync::oneshot};
+use tracing::debug;
+use twilight_model::id::{Id, marker::GuildMarker};
+use voice::{PlaybackEvent, provider::{AudioSource, SeekMode}};
+
+use crate::{cluster::rpc::VoiceSession, providers::MediaProvider};
+use super::{OpenRequest, Player, PlayerState, track::Track};
+
+/// Commands queued behind a slow one (e.g. connecting) wait here, senders block once it is full.
+const MAILBOX_SIZE: usize = 32;
+
+enum PlayerMessage {
+  Connect(VoiceSession, oneshot::Sender<Result<()>>),
+  /// Replies whether the track was queued rather than played right away.
+  Enqueue(Arc<dyn MediaProvider>, oneshot::Sender<Result<bool>>),
+  Seek(Duration, SeekMode, oneshot::Sender<Result<()>>),
+  /// Posted by the task opening a track for the player, see [`open`].
+  Opened(OpenRequest, Result<AudioSource>)
+}
+
+enum Step {
+  Message(Option<PlayerMessage>),
+  Event(PlaybackEvent)
+}
+
+/// Handle to the task owning the [`Player`] of one guild, commands of a guild are applied in order
+/// without locking out other guilds. The task stops once every handle is dropped.
+#[derive(Clone)]
+pub struct PlayerHandle {
+  guild_id: Id<GuildMarker>,
+  messages: Sender<PlayerMessage>,
+  playing: Arc<AtomicBool>
+}
+
+impl PlayerHandle {
+  pub fn spawn(guild_id: Id<GuildMarker>) -> Self {
+    let (messages_tx, messages_rx) = flume::bounded(MAILBOX_SIZE);
+    let playing = Arc::new(AtomicBool::new(false));
+    tokio::spawn(run(Player::new(guild_id), messages_rx, playing.clone()));
+
+    Self {
+      guild_id,
+      messages: messages_tx,
+      playing
+    }
+  }
+
+  /// Whether the player is playing, as of its last processed command or event.
+  pub fn is_playing(&self) -> bool {
+    self.playing.load(Ordering::Relaxed)
+  }
+
+  /// Joins the voice channel of `session`, does nothing if already connected.
+  pub async fn connect(&self, session: VoiceSession) -> Result<()> {
+    self.call(|reply| PlayerMessage::Connect(session, reply)).await
+  }
+
+  /// Queues `provider`, playing it right away if nothing is playing. Returns whether it was queued.
+  pub async fn enqueue(&self, provider: Arc<dyn MediaProvider>) -> Result<bool> {
+    self.call(|reply| PlayerMessage::Enqueue(provider, reply)).await
+  }
+
+  pub async fn seek(&self, position: Duration, mode: SeekMode) -> Result<()> {
+    self.call(|reply| PlayerMessage::Seek(position, mode, reply)).await
+  }
+
+  async fn call<T>(&self, message: impl FnOnce(oneshot::Sender<Result<T>>) -> PlayerMessage) -> Result<T> {
+    let (reply_tx, reply_rx) = oneshot::channel();
+    self.messages.send_async(message(reply_tx)).await.map_err(|_| anyhow!("player of guild {} stopped", self.guild_id))?;
+    reply_rx.await.map_err(|_| anyhow!("player of guild {} stopped", self.guild_id))?
+  }
+}
+
+async fn run(mut player: Player, messages: Receiver<PlayerMessage>, playing: Arc<AtomicBool>) {
+  // Kept apart from the mailbox, which closes once every handle is dropped
+  let (opened_tx, opened_rx) = flume::unbounded();
+  loop {
+    // Resolved before handling, the event future borrows the player
+    let step = select! {
+      message = messages.recv_async() => Step::Message(message.ok()),
+      Ok(message) = opened_rx.recv_async() => Step::Message(Some(message)),
+      event = player.next_event() => Step::Event(event)
+    };
+
+    match step {
+      Step::Message(Some(message)) => handle(&mut player, message).await,
+      Step::Message(None) => break,
+      Step::Event(event) => {
+        if let Some(request) = player.handle_event(event) {
+          open(&player, request, &opened_tx);
+        }
+      }
+    }
+    playing.store(matches!(player.player_state, PlayerState::Play), Ordering::Relaxed);
+  }
+
+  debug!("player of guild {} stopped", player.guild_id);
+}
+
+async fn handle(player: &mut Player, message: PlayerMessage) {
+  match message {
+    PlayerMessage::Connect(session, reply) => {
+      let result = if player.connection.is_some() {
+        Ok(())
+      } else {
+        debug!("connecting to voice in guild {}", player.guild_id);
+        player.connect(session).await
+      };
+      _ = reply.send(result);
+    },
+    PlayerMessage::Enqueue(provider, reply) => {
+      player.tracks.push(Track::new(provider));
+      let result = if matches!(player.player_state, PlayerState::Stop) {
+        player.play(player.tracks.len() - 1).await.map(|_| false)
+      } else {
+        Ok(true)
+      };
+      _ = reply.send(result);
+    },
+    PlayerMessage::Seek(position, mode, reply) => {
+      _ = reply.send(player.seek(position, mode));
+    },
+    PlayerMessage::Opened(request, source) => player.handle_opened(request, source).await
+  }
+}
+
+/// Opens the track of `request` in its own task, commands to the player are handled meanwhile.
+fn open(player: &Player, request: OpenRequest, opened: &Sender<PlayerMessage>) {
+  let provider = player.tracks[request.index].provider.clone();
+  let opened = opened.clone();
+  tokio::spawn(async move {
+    let source = provider.get_audio_source().await;
+    _ = opened.send(PlayerMessage::Opened(request, source));
+  });
+}
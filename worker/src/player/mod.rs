@@ -1,16 +1,17 @@
 pub mod track;
+pub mod actor;
 
-use std::sync::Arc;
+use std::{future::pending, sync::Arc, time::Duration};
 
 use anyhow::{Result, Context};
-use futures_util::StreamExt;
+use flume::Receiver;
 use symphonia::core::probe::Hint;
-use tracing::debug;
-use twilight_gateway::{Event, EventType};
-use twilight_model::{id::{Id, marker::{GuildMarker, ChannelMarker}}, gateway::payload::outgoing::UpdateVoiceState};
+use tokio::task::JoinHandle;
+use tracing::{debug, warn};
+use twilight_model::id::{Id, marker::{GuildMarker, ChannelMarker}};
 
-use voice::{VoiceConnectionOptions, VoiceConnection};
-use crate::{State, voice::SymphoniaSampleProvider};
+use voice::{VoiceConnectionOptions, VoiceConnection, PlaybackEvent, provider::{AudioSource, SeekMode}};
+use crate::{cluster::rpc::VoiceSession, voice::SymphoniaSampleProvider};
 use self::track::Track;
 
 #[derive(Debug)]
@@ -27,8 +28,18 @@ pub enum PlayerState {
   Play
 }
 
+/// A track [`Player::handle_event`] needs opened. Opening probes the source, so the [`actor`] does it
+/// in a separate task and hands the result to [`Player::handle_opened`].
+#[derive(Debug, Clone, Copy)]
+pub struct OpenRequest {
+  pub index: usize,
+  /// Spliced in after the current track, otherwise played right away.
+  pub prefetch: bool,
+  epoch: u64
+}
+
+/// Queue and voice connection of one guild, owned by its [`actor`].
 pub struct Player {
-  pub state: State,
   pub connection: Option<Arc<VoiceConnection>>,
 
   pub guild_id: Id<GuildMarker>,
@@ -38,13 +49,20 @@ pub struct Player {
   pub repeat_type: RepeatType,
 
   pub tracks: Vec<Track>,
-  pub current: usize
+  pub current: usize,
+
+  playback: Option<JoinHandle<()>>,
+  /// Events of the running send loop.
+  events: Option<Receiver<PlaybackEvent>>,
+  /// Track spliced in at the next [`PlaybackEvent::TrackStarted`].
+  prefetched: Option<usize>,
+  /// Incremented whenever playback is started or finishes, opens requested before are dropped.
+  epoch: u64
 }
 
 impl Player {
-  pub fn new(state: State, guild_id: Id<GuildMarker>) -> Self {
+  pub fn new(guild_id: Id<GuildMarker>) -> Self {
     Self {
-      state,
       connection: None,
 
       guild_id,
@@ -54,7 +72,12 @@ impl Player {
       repeat_type: RepeatType::None,
 
       tracks: Vec::new(),
-      current: 0
+      current: 0,
+
+      playback: None,
+      events: None,
+      prefetched: None,
+      epoch: 0
     }
   }
 
@@ -62,53 +85,28 @@ impl Player {
     self.channel_id = Some(channel_id);
   }
 
-  pub async fn connect(&mut self) -> Result<()> {
-    let channel_id = self.channel_id.context("no voice channel")?;
-
-    self.state.sender.command(&UpdateVoiceState::new(self.guild_id, channel_id, true, false))?;
-
-    let mut voice_state = None;
-    let mut voice_server = None;
-
-    let mut stream = self.state.standby.wait_for_stream(self.guild_id, |event: &Event| match event.kind() {
-      EventType::VoiceStateUpdate => true,
-      EventType::VoiceServerUpdate => true,
-      _ => false
-    });
-
-    while let Some(event) = stream.next().await {
-      match event {
-        Event::VoiceStateUpdate(vs) => voice_state = Some(vs),
-        Event::VoiceServerUpdate(vs) => voice_server = Some(vs),
-        _ => {}
-      }
-
-      if voice_state.is_some() && voice_server.is_some() {
-        break;
-      }
-    };
-    let voice_state = voice_state.unwrap();
-    let voice_server = voice_server.unwrap();
-
-    debug!(?voice_state, ?voice_server, "got connection info");
-
-    let user = self.state.cache.current_user().context("no current user")?;
-    let channel = self.state.cache.channel(channel_id).context("no channel cached")?;
+  /// Joins the voice channel of `session`, obtained by whoever holds the gateway shard, see [`crate::sessions::voice_session`].
+  pub async fn connect(&mut self, session: VoiceSession) -> Result<()> {
+    self.set_channel(Id::new(session.channel_id));
 
     let options = VoiceConnectionOptions {
-      user_id: user.id.get(),
+      user_id: session.user_id,
       guild_id: self.guild_id.get(),
-      bitrate: channel.bitrate,
-      endpoint: voice_server.endpoint.context("no voice endpoint")?.to_owned(),
-      token: voice_server.token.to_owned(),
-      session_id: voice_state.session_id.to_owned()
+      bitrate: session.bitrate,
+      jitter_buffer: Default::default(),
+      endpoint: session.endpoint,
+      token: session.token,
+      session_id: session.session_id
     };
     let connection = Arc::new(VoiceConnection::new()?);
     connection.connect(options).await?;
 
     let connection_weak = Arc::downgrade(&connection);
+    let guild_id = self.guild_id;
     tokio::spawn(async move {
-      VoiceConnection::run_ws_loop(connection_weak).await.unwrap()
+      if let Err(error) = VoiceConnection::run_ws_loop(connection_weak).await {
+        warn!("voice connection of guild {} failed: {:?}", guild_id, error);
+      }
     });
 
     self.connection = Some(connection);
@@ -116,31 +114,148 @@ impl Player {
     Ok(())
   }
 
+  /// Starts playing the track at `index`, stopping the current one.
+  ///
+  /// Following tracks are prefetched near the end of the current one and spliced in without a gap.
   pub async fn play(&mut self, index: usize) -> Result<&Track> {
-    todo!();
-    let track = self.tracks.get(index).context("no track")?;
+    let connection = self.connection.clone().context("player is not connected")?;
+    let provider = self.tracks.get(index).context("no track")?.provider.clone();
+
+    // Events of the stopped send loop are dropped unread
+    self.events = None;
+    self.prefetched = None;
+    self.epoch += 1;
+    if let Some(playback) = self.playback.take() {
+      connection.stop();
+      _ = playback.await;
+    }
+    connection.set_next_source(None);
+
+    // Opened before locking, the send loop must not wait on the source lock while the track is probed
+    let source = provider.get_audio_source().await?;
+    *connection.source.lock().await = Some(source);
     self.current = index;
+    self.player_state = PlayerState::Play;
+
+    connection.set_speaking(true).await?;
+
+    let (playback, events) = Self::spawn_playback(&connection);
+    self.playback = Some(playback);
+    self.events = Some(events);
+
+    Ok(&self.tracks[index])
+  }
 
-    Ok(track)
+  /// Seeks the current track, takes effect within one frame.
+  pub fn seek(&self, position: Duration, mode: SeekMode) -> Result<()> {
+    let connection = self.connection.as_ref().context("player is not connected")?;
+    connection.seek(position, mode);
+    Ok(())
+  }
+
+  /// Spawns the send loop for the source already set on `connection`.
+  fn spawn_playback(connection: &Arc<VoiceConnection>) -> (JoinHandle<()>, Receiver<PlaybackEvent>) {
+    let (events_tx, events_rx) = flume::unbounded();
+    let clone = connection.clone();
+    let playback = tokio::spawn(async move {
+      if let Err(error) = VoiceConnection::run_udp_loop(clone, events_tx).await {
+        warn!("voice playback failed: {:?}", error);
+      }
+    });
+
+    (playback, events_rx)
+  }
+
+  /// Waits for the next event of the send loop, forever if nothing is playing.
+  ///
+  /// A send loop that ended without [`PlaybackEvent::Finished`], e.g. because of an error, is reported as finished.
+  pub async fn next_event(&self) -> PlaybackEvent {
+    match &self.events {
+      Some(events) => events.recv_async().await.unwrap_or(PlaybackEvent::Finished),
+      None => pending().await
+    }
+  }
+
+  /// Follows [`PlaybackEvent`]s of the send loop started by [`Player::play`], prefetching and advancing the queue.
+  ///
+  /// Returns the track to open next, if any.
+  pub fn handle_event(&mut self, event: PlaybackEvent) -> Option<OpenRequest> {
+    let connection = self.connection.clone()?;
+
+    match event {
+      PlaybackEvent::TrackNearEnd => {
+        let index = self.get_next_index()?;
+        debug!("prefetching track {}", index);
+        Some(OpenRequest { index, prefetch: true, epoch: self.epoch })
+      },
+      PlaybackEvent::TrackStarted => {
+        if let Some(index) = self.prefetched.take() {
+          self.current = index;
+          debug!("playing track {}", index);
+        }
+        None
+      },
+      PlaybackEvent::Finished => {
+        // A track queued after the prefetch point (or one that failed to prefetch) is started the slow way
+        self.prefetched = None;
+        self.events = None;
+        self.epoch += 1;
+        connection.set_next_source(None);
+
+        match self.get_next_index() {
+          Some(index) => Some(OpenRequest { index, prefetch: false, epoch: self.epoch }),
+          None => {
+            debug!("playback finished: no next track");
+            self.player_state = PlayerState::Stop;
+            None
+          }
+        }
+      }
+    }
+  }
+
+  /// Uses a track opened for `request`, unless playback was restarted or finished since it was requested.
+  pub async fn handle_opened(&mut self, request: OpenRequest, source: Result<AudioSource>) {
+    if request.epoch != self.epoch {
+      debug!("dropping track {} opened for a previous playback", request.index);
+      return;
+    }
+    let Some(connection) = self.connection.clone() else {
+      return;
+    };
+
+    match source {
+      Ok(source) if request.prefetch => {
+        self.prefetched = Some(request.index);
+        connection.set_next_source(Some(source));
+      },
+      Ok(source) => {
+        *connection.source.lock().await = Some(source);
+        let (playback, events) = Self::spawn_playback(&connection);
+        self.playback = Some(playback);
+        self.events = Some(events);
+        self.current = request.index;
+        debug!("playing track {}", request.index);
+      },
+      Err(error) if request.prefetch => warn!("failed to prefetch track {}: {:?}", request.index, error),
+      Err(error) => {
+        warn!("failed to open track {}, playback finished: {:?}", request.index, error);
+        self.player_state = PlayerState::Stop;
+      }
+    }
   }
 
   pub fn get_current_track(&self) -> Option<&Track> {
     self.tracks.get(self.current)
   }
 
-  pub fn get_next_track(&self) -> Option<&Track> {
+  pub fn get_next_index(&self) -> Option<usize> {
     match self.repeat_type {
-      RepeatType::None => self.tracks.get(self.current + 1),
-      RepeatType::Track => self.get_current_track(),
+      RepeatType::None => Some(self.current + 1).filter(|&it| it < self.tracks.len()),
+      RepeatType::Track => Some(self.current).filter(|&it| it < self.tracks.len()),
       RepeatType::Player => {
         if !self.tracks.is_empty() {
-          let index = if self.current == self.tracks.len() - 1 {
-            0
-          } else {
-            self.current
-          };
-
-          self.tracks.get(index + 1)
+          Some((self.current + 1) % self.tracks.len())
         } else {
           None
         }
@@ -148,6 +263,10 @@ impl Player {
     }
   }
 
+  pub fn get_next_track(&self) -> Option<&Track> {
+    self.tracks.get(self.get_next_index()?)
+  }
+
   pub fn get_previous_track(&self) -> Option<&Track> {
     match self.repeat_type {
       RepeatType::Player => {
@@ -1,14 +1,15 @@
+use std::sync::Arc;
 use twilight_model::id::{Id, marker::{GuildMarker, ChannelMarker}};
 
 use crate::providers::MediaProvider;
 
 #[derive(Debug)]
 pub struct Track {
-  pub provider: Box<dyn MediaProvider>
+  pub provider: Arc<dyn MediaProvider>
 }
 
 impl Track {
-  pub fn new(provider: Box<dyn MediaProvider>) -> Self {
+  pub fn new(provider: Arc<dyn MediaProvider>) -> Self {
     Self {
       provider
     }
@@ -8,11 +8,12 @@ use ringbuf::*;
 use std::{
   io::{self, Read, Seek, SeekFrom, Write},
   sync::{
-    atomic::{AtomicBool, Ordering},
-    Arc
+    atomic::{AtomicBool, AtomicI64, AtomicU64, Ordering},
+    Arc, Mutex
   },
   error::Error,
-  time::Duration
+  task::Waker,
+  time::{Duration, Instant}
 };
 use symphonia::core::io::MediaSource;
 use tokio::{
@@ -21,6 +22,8 @@ use tokio::{
 };
 use tracing::error;
 
+use crate::metrics::PipelineMetrics;
+
 #[non_exhaustive]
 #[derive(Debug)]
 pub enum AudioStreamError {
@@ -35,12 +38,72 @@ pub enum AudioStreamError {
   Unsupported
 }
 
+/// Bytes buffered ahead of a reader that make its input ready, more than one packet of a typical stream.
+pub const READY_BYTES: u64 = 8 * 1024;
+
+/// Tells whether reading a blocking input would have to wait for data.
+pub trait InputReadiness: Send + Sync {
+  /// Returns `true` if the next read is not expected to block, otherwise `waker` is woken once it is.
+  fn poll_ready(&self, waker: &Waker) -> bool;
+}
+
+/// [`InputReadiness`] of an [`AsyncAdapterStream`], updated by both halves.
+#[derive(Default)]
+struct AdapterReadiness {
+  /// Bytes in the ring buffer, briefly negative if the reader takes bytes before the writer counted them.
+  buffered: AtomicI64,
+  /// The async half reached the end of the stream or stopped.
+  finished: AtomicBool,
+  waker: Mutex<Option<Waker>>
+}
+
+impl AdapterReadiness {
+  fn produced(&self, count: usize) {
+    self.buffered.fetch_add(count as i64, Ordering::SeqCst);
+    self.wake();
+  }
+
+  fn consumed(&self, count: usize) {
+    self.buffered.fetch_sub(count as i64, Ordering::SeqCst);
+  }
+
+  fn set_finished(&self, finished: bool) {
+    self.finished.store(finished, Ordering::SeqCst);
+    if finished {
+      self.wake();
+    }
+  }
+
+  fn wake(&self) {
+    if let Some(waker) = self.waker.lock().unwrap().take() {
+      waker.wake();
+    }
+  }
+
+  fn is_ready(&self) -> bool {
+    self.finished.load(Ordering::SeqCst) || self.buffered.load(Ordering::SeqCst) >= READY_BYTES as i64
+  }
+}
+
+impl InputReadiness for AdapterReadiness {
+  fn poll_ready(&self, waker: &Waker) -> bool {
+    if self.is_ready() {
+      return true;
+    }
+
+    *self.waker.lock().unwrap() = Some(waker.clone());
+    // Checked again, the async half may have written before the waker was stored
+    self.is_ready()
+  }
+}
+
 struct AsyncAdapterSink {
   bytes_in: HeapProducer<u8>,
   req_rx: Receiver<AdapterRequest>,
   resp_tx: Sender<AdapterResponse>,
   stream: Box<dyn AsyncMediaSource>,
-  notify_rx: Arc<Notify>
+  notify_rx: Arc<Notify>,
+  readiness: Arc<AdapterReadiness>
 }
 
 impl AsyncAdapterSink {
@@ -52,6 +115,9 @@ impl AsyncAdapterSink {
     let mut pause_buf_moves = false;
     let mut seek_res = None;
     let mut seen_bytes = 0;
+    let metrics = PipelineMetrics::global();
+    let started = Instant::now();
+    let mut first_byte = true;
 
     loop {
       // if read_region is empty, refill from src.
@@ -63,8 +129,14 @@ impl AsyncAdapterSink {
         if !hit_end && read_region.is_empty() {
           if let Ok(n) = self.stream.read(&mut inner_buf).await {
             read_region = 0..n;
+            if n > 0 && first_byte {
+              metrics.time_to_first_byte.observe(started.elapsed());
+              first_byte = false;
+            }
+            metrics.source_bytes.add(n as u64);
             if n == 0 {
               drop(self.resp_tx.send_async(AdapterResponse::ReadZero).await);
+              self.readiness.set_finished(true);
               hit_end = true;
             }
             seen_bytes += n as u64;
@@ -84,6 +156,7 @@ impl AsyncAdapterSink {
             .write(&inner_buf[read_region.start..read_region.end])
           {
             read_region.start += n_moved;
+            self.readiness.produced(n_moved);
             drop(self.resp_tx.send_async(AdapterResponse::ReadOccurred).await);
           } else {
             blocked = true;
@@ -123,7 +196,16 @@ impl AsyncAdapterSink {
         AdapterRequest::Seek(pos) => {
           pause_buf_moves = true;
           drop(self.resp_tx.send_async(AdapterResponse::SeekClear).await);
-          seek_res = Some(self.stream.seek(pos).await);
+
+          let res = self.stream.seek(pos).await;
+          if let Ok(offset) = res {
+            // Bytes read before the seek are stale
+            read_region = 0..0;
+            hit_end = false;
+            self.readiness.set_finished(false);
+            seen_bytes = offset;
+          }
+          seek_res = Some(res);
         }
         AdapterRequest::SeekCleared => {
           if let Some(res) = seek_res.take() {
@@ -137,6 +219,9 @@ impl AsyncAdapterSink {
         }
       }
     }
+
+    // Reads fail from now on instead of waiting
+    self.readiness.set_finished(true);
   }
 }
 
@@ -153,6 +238,10 @@ pub struct AsyncAdapterStream {
   // check_messages to take &self rather than &mut.
   finalised: AtomicBool,
   bytes_known_present: AtomicBool,
+  stalls: Arc<AtomicU64>,
+  readiness: Arc<AdapterReadiness>,
+  /// Offset of the next byte returned by `read`.
+  position: u64,
   req_tx: Sender<AdapterRequest>,
   resp_rx: Receiver<AdapterResponse>,
   notify_tx: Arc<Notify>
@@ -169,19 +258,24 @@ impl AsyncAdapterStream {
     let can_seek = stream.is_seekable();
     let notify_rx = Arc::new(Notify::new());
     let notify_tx = notify_rx.clone();
+    let readiness = Arc::new(AdapterReadiness::default());
 
     let sink = AsyncAdapterSink {
       bytes_in,
       req_rx,
       resp_tx,
       stream,
-      notify_rx
+      notify_rx,
+      readiness: readiness.clone()
     };
     let stream = AsyncAdapterStream {
       bytes_out,
       can_seek,
       finalised: false.into(),
       bytes_known_present: false.into(),
+      stalls: Default::default(),
+      readiness,
+      position: 0,
       req_tx,
       resp_rx,
       notify_tx
@@ -194,6 +288,16 @@ impl AsyncAdapterStream {
     stream
   }
 
+  /// Returns a counter of reads that found the buffer empty and had to wait for the async half.
+  pub fn stalls(&self) -> Arc<AtomicU64> {
+    self.stalls.clone()
+  }
+
+  /// Returns a handle telling whether [`READY_BYTES`] are buffered, so a reader can wait without blocking.
+  pub fn readiness(&self) -> Arc<dyn InputReadiness> {
+    self.readiness.clone()
+  }
+
   fn handle_messages(&self, op: Operation) -> Option<AdapterResponse> {
     loop {
       let msg = if op.will_block() {
@@ -239,6 +343,7 @@ impl AsyncAdapterStream {
 
 impl Read for AsyncAdapterStream {
   fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+    let mut stalled = false;
     loop {
       let block = !(self.bytes_known_present.load(Ordering::Relaxed)
         || self.finalised.load(Ordering::Relaxed));
@@ -246,7 +351,9 @@ impl Read for AsyncAdapterStream {
 
       match self.bytes_out.read(buf) {
         Ok(n) => {
+          self.readiness.consumed(n);
           self.notify_tx.notify_one();
+          self.position += n as u64;
           return Ok(n);
         }
         Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
@@ -257,6 +364,10 @@ impl Read for AsyncAdapterStream {
           }
           self.bytes_known_present.store(false, Ordering::Relaxed);
           self.check_dropped()?;
+          if !stalled {
+            stalled = true;
+            self.stalls.fetch_add(1, Ordering::Relaxed);
+          }
         }
         Err(e) => {
           error!("other error: {e:?}");
@@ -269,6 +380,22 @@ impl Read for AsyncAdapterStream {
 
 impl Seek for AsyncAdapterStream {
   fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+    let invalid = || io::Error::new(io::ErrorKind::InvalidInput, "invalid seek position");
+    let target = match pos {
+      SeekFrom::Start(offset) => offset,
+      SeekFrom::Current(delta) => self.position.checked_add_signed(delta).ok_or_else(invalid)?,
+      SeekFrom::End(delta) => self.byte_len().and_then(|len| len.checked_add_signed(delta)).ok_or_else(invalid)?
+    };
+
+    // Forward seeks into bytes already buffered are served from the ring, no reconnect needed
+    if target >= self.position && target - self.position <= self.bytes_out.len() as u64 {
+      let skipped = self.bytes_out.skip((target - self.position) as usize);
+      self.readiness.consumed(skipped);
+      self.notify_tx.notify_one();
+      self.position = target;
+      return Ok(target);
+    }
+
     if !self.can_seek {
       return Err(io::Error::new(
         io::ErrorKind::Unsupported,
@@ -278,26 +405,33 @@ impl Seek for AsyncAdapterStream {
 
     self.check_dropped()?;
 
-    _ = self.req_tx.send(AdapterRequest::Seek(pos));
+    // The async half is ahead of the reader, so relative positions are resolved here
+    _ = self.req_tx.send(AdapterRequest::Seek(SeekFrom::Start(target)));
 
     // wait for async to tell us that it has stopped writing,
     // then clear buf and allow async to write again.
-    self.finalised.store(false, Ordering::Relaxed);
     match self.handle_messages(Operation::Seek) {
       Some(AdapterResponse::SeekClear) => {}
       None => self.check_dropped().map(|_| unreachable!())?,
       _ => unreachable!()
     }
+    // Reset only now, a stale ReadZero could have been handled while waiting
+    self.finalised.store(false, Ordering::Relaxed);
 
-    self.bytes_out.skip(self.bytes_out.capacity());
+    let skipped = self.bytes_out.skip(self.bytes_out.capacity());
+    self.readiness.consumed(skipped);
 
     _ = self.req_tx.send(AdapterRequest::SeekCleared);
 
-    match self.handle_messages(Operation::Seek) {
+    let result = match self.handle_messages(Operation::Seek) {
       Some(AdapterResponse::SeekResult(a)) => a,
       None => self.check_dropped().map(|_| unreachable!()),
       _ => unreachable!()
+    };
+    if let Ok(offset) = result {
+      self.position = offset;
     }
+    result
   }
 }
 
@@ -0,0 +1,522 @@
+mod segments;
+mod opus;
+
+pub use segments::*;
+pub use opus::*;
+
+use std::{
+  collections::HashMap,
+  env,
+  fmt::{Display, Formatter},
+  fs,
+  path::{Path, PathBuf},
+  sync::{Arc, Mutex, OnceLock}
+};
+use anyhow::{Result, Context, anyhow};
+use tokio::sync::watch;
+use tracing::{debug, warn};
+
+use crate::providers::{async_adapter::AsyncMediaSource, MediaMetadata};
+
+/// Default size cap of the cache directory, in bytes.
+pub const DEFAULT_CACHE_SIZE: u64 = 2 * 1024 * 1024 * 1024;
+
+/// Identifies a cached source, the 64-bit FNV-1a hash of its URL.
+#[derive(Debug, Clone, Copy, Eq, PartialEq, Hash)]
+pub struct CacheKey(u64);
+
+impl CacheKey {
+  pub fn from_url(url: &str) -> Self {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for byte in url.bytes() {
+      hash ^= byte as u64;
+      hash = hash.wrapping_mul(0x100000001b3);
+    }
+
+    Self(hash)
+  }
+}
+
+impl Display for CacheKey {
+  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
+    write!(formatter, "{:016x}", self.0)
+  }
+}
+
+enum CacheEntry {
+  /// Reserved by a caller about to fetch the source, see [`MediaCache::open_or_reserve`].
+  Pending(watch::Receiver<()>),
+  /// Source bytes, possibly still being fetched.
+  Segments(Arc<SegmentFile>),
+  /// Encoded Opus frames of a fully played track, and the metadata probed from its source.
+  Opus(PathBuf, Arc<[MediaMetadata]>)
+}
+
+struct IndexEntry {
+  entry: CacheEntry,
+  size: u64,
+  last_used: u64
+}
+
+impl IndexEntry {
+  /// Entries with open readers or a running fetch are never evicted.
+  fn is_evictable(&self) -> bool {
+    match &self.entry {
+      CacheEntry::Pending(_) => false,
+      CacheEntry::Segments(file) => Arc::strong_count(file) == 1,
+      // Readers keep their own mapping of the file, it survives the unlink
+      CacheEntry::Opus(..) => true
+    }
+  }
+
+  fn path(&self) -> Option<&Path> {
+    match &self.entry {
+      CacheEntry::Pending(_) => None,
+      CacheEntry::Segments(file) => Some(file.path()),
+      CacheEntry::Opus(path, _) => Some(path)
+    }
+  }
+
+  fn remove_file(&self) {
+    if let Some(path) = self.path() {
+      _ = fs::remove_file(path);
+    }
+  }
+}
+
+#[derive(Default)]
+struct CacheIndex {
+  entries: HashMap<(CacheKey, &'static str), IndexEntry>,
+  used: u64,
+  tick: u64
+}
+
+/// Disk-backed cache of HTTP sources, shared by every guild.
+///
+/// Sources are stored as sparse files split into [`SEGMENT_SIZE`] segments, filled by a single
+/// fetch per source no matter how many readers there are. Readers map the file and are served
+/// from the page cache. Tracks played to the end can also be stored as encoded Opus frames,
+/// so replays skip decoding and encoding entirely.
+///
+/// The index lives in memory only, files left by a previous run are removed on startup.
+pub struct MediaCache {
+  directory: PathBuf,
+  capacity: u64,
+  index: Mutex<CacheIndex>
+}
+
+const SEGMENTS_KIND: &str = "data";
+const OPUS_KIND: &str = "opus";
+/// Marks a directory as owned by the cache, other directories are never cleared.
+const MARKER: &str = ".mosaik-cache";
+
+/// Returns `true` for files named like [`MediaCache::entry_path`], including unfinished recordings.
+fn is_entry_file(path: &Path) -> bool {
+  let Some((key, kind)) = path.file_name().and_then(|it| it.to_str()).and_then(|it| it.split_once('.')) else {
+    return false;
+  };
+  key.len() == 16 && key.bytes().all(|it| it.is_ascii_hexdigit()) && matches!(kind, SEGMENTS_KIND | OPUS_KIND | "opus.part")
+}
+
+/// Removes entries left by a previous run, refusing to use a non-empty directory without the marker.
+fn prepare_directory(directory: &Path) -> Result<()> {
+  fs::create_dir_all(directory).context("failed to create media cache")?;
+  let marker = directory.join(MARKER);
+  if !marker.exists() {
+    if fs::read_dir(directory)?.next().is_some() {
+      return Err(anyhow!("media cache directory {:?} is not empty and not owned by the cache", directory));
+    }
+    fs::write(&marker, b"").context("failed to mark media cache directory")?;
+    return Ok(());
+  }
+
+  for entry in fs::read_dir(directory)? {
+    let path = entry?.path();
+    if is_entry_file(&path) {
+      fs::remove_file(&path).with_context(|| format!("failed to remove stale cache entry {:?}", path))?;
+    }
+  }
+  Ok(())
+}
+
+impl MediaCache {
+  pub fn new(directory: PathBuf, capacity: u64) -> Result<Self> {
+    prepare_directory(&directory)?;
+
+    Ok(Self {
+      directory,
+      capacity,
+      index: Default::default()
+    })
+  }
+
+  /// Returns the shared cache, configured by `MOSAIK_CACHE_DIR` and `MOSAIK_CACHE_SIZE_MB`.
+  pub fn global() -> &'static MediaCache {
+    static CACHE: OnceLock<MediaCache> = OnceLock::new();
+    CACHE.get_or_init(|| {
+      let directory = env::var_os("MOSAIK_CACHE_DIR")
+        .map(PathBuf::from)
+        .unwrap_or_else(|| env::temp_dir().join("mosaik-cache"));
+      let capacity = env::var("MOSAIK_CACHE_SIZE_MB")
+        .ok()
+        .and_then(|it| it.parse::<u64>().ok())
+        .map_or(DEFAULT_CACHE_SIZE, |it| it * 1024 * 1024);
+
+      MediaCache::new(directory, capacity).expect("failed to open media cache")
+    })
+  }
+
+  fn entry_path(&self, key: CacheKey, kind: &str) -> PathBuf {
+    self.directory.join(format!("{}.{}", key, kind))
+  }
+
+  /// Returns a reader of the cached source if it is cached or being fetched, otherwise reserves it for the caller to fetch.
+  ///
+  /// Checking and reserving happen under one lock, so concurrent callers for the same key
+  /// wait for the first one to either fill or drop its reservation.
+  pub async fn open_or_reserve(&self, key: CacheKey) -> CacheLookup<'_> {
+    loop {
+      let mut reserved = {
+        let mut index = self.index.lock().unwrap();
+        index.tick += 1;
+        let tick = index.tick;
+
+        match index.entries.get_mut(&(key, SEGMENTS_KIND)) {
+          Some(IndexEntry { entry: CacheEntry::Segments(file), last_used, .. }) if !file.is_failed() => {
+            *last_used = tick;
+            return CacheLookup::Hit(CachedStream::new(file.clone()));
+          },
+          Some(IndexEntry { entry: CacheEntry::Pending(reserved), .. }) => reserved.clone(),
+          _ => {
+            // A failed fetch is replaced by the new one
+            let (sender, receiver) = watch::channel(());
+            let entry = IndexEntry { entry: CacheEntry::Pending(receiver), size: 0, last_used: tick };
+            if let Some(old) = index.entries.insert((key, SEGMENTS_KIND), entry) {
+              index.used -= old.size;
+            }
+            return CacheLookup::Miss(Reservation { cache: self, key, filled: false, _sender: sender });
+          }
+        }
+      };
+
+      // Closed once the reservation is filled or dropped
+      _ = reserved.changed().await;
+    }
+  }
+
+  /// Opens encoded Opus frames stored by [`MediaCache::record_opus`], along with the metadata recorded with them.
+  pub fn open_opus(&self, key: CacheKey) -> Option<(CachedOpusProvider, Arc<[MediaMetadata]>)> {
+    let (path, metadata) = {
+      let mut index = self.index.lock().unwrap();
+      index.tick += 1;
+      let tick = index.tick;
+
+      let entry = index.entries.get_mut(&(key, OPUS_KIND))?;
+      entry.last_used = tick;
+      match &entry.entry {
+        CacheEntry::Opus(path, metadata) => (path.clone(), metadata.clone()),
+        _ => return None
+      }
+    };
+
+    match CachedOpusProvider::open(&path) {
+      Ok(provider) => Some((provider, metadata)),
+      Err(error) => {
+        warn!("failed to open cached Opus frames {}: {:?}", key, error);
+        self.remove(key, OPUS_KIND);
+        None
+      }
+    }
+  }
+
+  /// Returns metadata of a source with stored Opus frames, without opening them.
+  pub fn opus_metadata(&self, key: CacheKey) -> Option<Arc<[MediaMetadata]>> {
+    match &self.index.lock().unwrap().entries.get(&(key, OPUS_KIND))?.entry {
+      CacheEntry::Opus(_, metadata) => Some(metadata.clone()),
+      _ => None
+    }
+  }
+
+  /// Returns a writer storing encoded Opus frames under `key`, unless they are already stored.
+  ///
+  /// `metadata` is stored with the frames, replays do not probe the source.
+  pub fn record_opus(&self, key: CacheKey, metadata: Vec<MediaMetadata>) -> Option<OpusFrameWriter> {
+    if self.index.lock().unwrap().entries.contains_key(&(key, OPUS_KIND)) {
+      return None;
+    }
+
+    match OpusFrameWriter::create(key, self.entry_path(key, OPUS_KIND), metadata.into()) {
+      Ok(writer) => Some(writer),
+      Err(error) => {
+        warn!("failed to record Opus frames {}: {:?}", key, error);
+        None
+      }
+    }
+  }
+
+  pub(super) fn commit_opus(&self, key: CacheKey, path: PathBuf, size: u64, metadata: Arc<[MediaMetadata]>) {
+    debug!("cached Opus frames of {} ({} bytes)", key, size);
+    self.add(key, OPUS_KIND, CacheEntry::Opus(path, metadata), size);
+  }
+
+  fn add(&self, key: CacheKey, kind: &'static str, entry: CacheEntry, size: u64) {
+    let mut index = self.index.lock().unwrap();
+    index.tick += 1;
+    let tick = index.tick;
+
+    if let Some(old) = index.entries.insert((key, kind), IndexEntry { entry, size, last_used: tick }) {
+      index.used -= old.size;
+    }
+    index.used += size;
+
+    while index.used > self.capacity {
+      let victim = index.entries
+        .iter()
+        .filter(|(id, entry)| **id != (key, kind) && entry.is_evictable())
+        .min_by_key(|(_, entry)| entry.last_used)
+        .map(|(id, _)| *id);
+      let Some(victim) = victim else {
+        warn!("media cache is over capacity, {} of {} bytes in use", index.used, self.capacity);
+        break;
+      };
+
+      let entry = index.entries.remove(&victim).unwrap();
+      index.used -= entry.size;
+      entry.remove_file();
+      debug!("evicted {}.{} from media cache", victim.0, victim.1);
+    }
+  }
+
+  fn remove(&self, key: CacheKey, kind: &'static str) {
+    let mut index = self.index.lock().unwrap();
+    if let Some(entry) = index.entries.remove(&(key, kind)) {
+      index.used -= entry.size;
+      entry.remove_file();
+    }
+  }
+}
+
+/// Result of [`MediaCache::open_or_reserve`].
+pub enum CacheLookup<'a> {
+  Hit(CachedStream),
+  /// Nobody is fetching the source, the caller should fetch it and [`Reservation::fill`] the cache.
+  Miss(Reservation<'a>)
+}
+
+/// Exclusive right to start fetching a source into the cache, dropping it unfilled lets the next caller try.
+pub struct Reservation<'a> {
+  cache: &'a MediaCache,
+  key: CacheKey,
+  filled: bool,
+  /// Dropped after the entry is replaced or removed, waking callers waiting for it.
+  _sender: watch::Sender<()>
+}
+
+impl Reservation<'_> {
+  /// Starts caching a source of `length` bytes, returns a reader of it. The source must be seekable.
+  pub fn fill(mut self, stream: Box<dyn AsyncMediaSource>, length: u64, mime_type: Option<String>) -> Result<CachedStream> {
+    let file = Arc::new(SegmentFile::create(self.cache.entry_path(self.key, SEGMENTS_KIND), length, mime_type)?);
+    tokio::spawn(run_fetch(file.clone(), stream));
+    debug!("caching {} ({} bytes)", self.key, length);
+
+    self.cache.add(self.key, SEGMENTS_KIND, CacheEntry::Segments(file.clone()), length);
+    self.filled = true;
+    Ok(CachedStream::new(file))
+  }
+}
+
+impl Drop for Reservation<'_> {
+  fn drop(&mut self) {
+    if self.filled {
+      return;
+    }
+
+    let mut index = self.cache.index.lock().unwrap();
+    if let Some(IndexEntry { entry: CacheEntry::Pending(_), .. }) = index.entries.get(&(self.key, SEGMENTS_KIND)) {
+      index.entries.remove(&(self.key, SEGMENTS_KIND));
+    }
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::{
+    io::{Cursor, Read, Seek, SeekFrom},
+    process
+  };
+  use async_trait::async_trait;
+  use voice::{constants::CHUNK_DURATION, provider::{PacketProvider, SeekMode}};
+  use super::*;
+
+  #[async_trait]
+  impl AsyncMediaSource for Cursor<Vec<u8>> {
+    fn is_seekable(&self) -> bool {
+      true
+    }
+
+    async fn byte_len(&self) -> Option<u64> {
+      Some(self.get_ref().len() as u64)
+    }
+  }
+
+  /// Returns an empty directory unique to the test.
+  fn test_directory(name: &str) -> PathBuf {
+    let directory = env::temp_dir().join(format!("mosaik-cache-test-{}-{}", process::id(), name));
+    _ = fs::remove_dir_all(&directory);
+    fs::create_dir_all(&directory).unwrap();
+    directory
+  }
+
+  fn source(length: usize) -> Vec<u8> {
+    (0..length).map(|it| (it * 31 % 251) as u8).collect()
+  }
+
+  fn record(cache: &MediaCache, key: CacheKey, packets: &[&[u8]]) {
+    let mut writer = cache.record_opus(key, vec![MediaMetadata::Title(key.to_string())]).unwrap();
+    for packet in packets {
+      writer.push(packet).unwrap();
+    }
+    writer.finish(cache).unwrap();
+  }
+
+  #[test]
+  fn key_is_fnv1a_of_url() {
+    assert_eq!(CacheKey::from_url("").to_string(), "cbf29ce484222325");
+    assert_eq!(CacheKey::from_url("a").to_string(), "af63dc4c8601ec8c");
+    assert_ne!(CacheKey::from_url("https://example.com/a"), CacheKey::from_url("https://example.com/b"));
+  }
+
+  #[test]
+  fn refuses_directory_it_does_not_own() {
+    let directory = test_directory("foreign");
+    fs::write(directory.join("notes.txt"), b"keep").unwrap();
+
+    assert!(MediaCache::new(directory.clone(), 1024).is_err());
+    assert!(directory.join("notes.txt").exists());
+    fs::remove_dir_all(&directory).unwrap();
+  }
+
+  #[test]
+  fn clears_only_its_own_entries() {
+    let directory = test_directory("owned");
+    MediaCache::new(directory.clone(), 1024).unwrap();
+    fs::write(directory.join("0123456789abcdef.data"), b"").unwrap();
+    fs::write(directory.join("0123456789abcdef.opus.part"), b"").unwrap();
+    fs::write(directory.join("notes.txt"), b"keep").unwrap();
+
+    MediaCache::new(directory.clone(), 1024).unwrap();
+    assert!(!directory.join("0123456789abcdef.data").exists());
+    assert!(!directory.join("0123456789abcdef.opus.part").exists());
+    assert!(directory.join("notes.txt").exists());
+    fs::remove_dir_all(&directory).unwrap();
+  }
+
+  #[tokio::test(flavor = "multi_thread")]
+  async fn concurrent_opens_share_one_fetch() {
+    let directory = test_directory("dedup");
+    let cache = MediaCache::new(directory.clone(), 64 * 1024 * 1024).unwrap();
+    let key = CacheKey::from_url("https://example.com/track");
+    let data = source(3 * SEGMENT_SIZE as usize + 1234);
+
+    let CacheLookup::Miss(reservation) = cache.open_or_reserve(key).await else {
+      panic!("empty cache returned a hit");
+    };
+    let fill = async {
+      tokio::task::yield_now().await;
+      reservation.fill(Box::new(Cursor::new(data.clone())), data.len() as u64, None).unwrap()
+    };
+    // Waits for the reservation instead of starting a fetch of its own
+    let (second, _first) = tokio::join!(cache.open_or_reserve(key), fill);
+    let CacheLookup::Hit(mut stream) = second else {
+      panic!("second open did not wait for the first fetch");
+    };
+
+    let expected = data.clone();
+    let read = tokio::task::spawn_blocking(move || {
+      // Far ahead of the fetch first, then everything from the start
+      let mut tail = vec![0; 1234];
+      stream.seek(SeekFrom::End(-1234)).unwrap();
+      stream.read_exact(&mut tail).unwrap();
+
+      let mut all = Vec::new();
+      stream.seek(SeekFrom::Start(0)).unwrap();
+      stream.read_to_end(&mut all).unwrap();
+      (tail, all)
+    }).await.unwrap();
+
+    assert_eq!(read.0, expected[expected.len() - 1234..]);
+    assert_eq!(read.1, expected);
+    fs::remove_dir_all(&directory).unwrap();
+  }
+
+  #[tokio::test]
+  async fn dropped_reservation_lets_next_caller_fetch() {
+    let directory = test_directory("reservation");
+    let cache = MediaCache::new(directory.clone(), 1024).unwrap();
+    let key = CacheKey::from_url("https://example.com/track");
+
+    let first = cache.open_or_reserve(key).await;
+    assert!(matches!(first, CacheLookup::Miss(_)));
+    drop(first);
+    assert!(matches!(cache.open_or_reserve(key).await, CacheLookup::Miss(_)));
+    fs::remove_dir_all(&directory).unwrap();
+  }
+
+  #[test]
+  fn recorded_opus_frames_replay() {
+    let directory = test_directory("opus");
+    let cache = MediaCache::new(directory.clone(), 1024).unwrap();
+    let key = CacheKey::from_url("https://example.com/track");
+
+    assert!(cache.open_opus(key).is_none());
+    record(&cache, key, &[&[1, 2, 3], &[4], &[5, 6]]);
+    // Recorded once only
+    assert!(cache.record_opus(key, Vec::new()).is_none());
+
+    let (mut provider, metadata) = cache.open_opus(key).unwrap();
+    assert!(matches!(&metadata[..], [MediaMetadata::Title(title)] if *title == key.to_string()));
+    assert_eq!(cache.opus_metadata(key).unwrap().len(), 1);
+    assert_eq!(provider.duration(), Some(CHUNK_DURATION * 3));
+    let mut packet = [0; 8];
+    assert_eq!(&packet[..provider.get_packet(&mut packet)], &[1, 2, 3]);
+
+    assert_eq!(provider.seek(CHUNK_DURATION * 2, SeekMode::Accurate).unwrap(), CHUNK_DURATION * 2);
+    assert_eq!(&packet[..provider.get_packet(&mut packet)], &[5, 6]);
+    assert_eq!(provider.get_packet(&mut packet), 0);
+    fs::remove_dir_all(&directory).unwrap();
+  }
+
+  #[test]
+  fn unfinished_recording_is_discarded() {
+    let directory = test_directory("unfinished");
+    let cache = MediaCache::new(directory.clone(), 1024).unwrap();
+    let key = CacheKey::from_url("https://example.com/track");
+
+    let mut writer = cache.record_opus(key, Vec::new()).unwrap();
+    writer.push(&[1, 2, 3]).unwrap();
+    drop(writer);
+
+    assert!(cache.open_opus(key).is_none());
+    assert!(fs::read_dir(&directory).unwrap().all(|it| !is_entry_file(&it.unwrap().path())));
+    fs::remove_dir_all(&directory).unwrap();
+  }
+
+  #[test]
+  fn least_recently_used_entry_is_evicted() {
+    let directory = test_directory("evict");
+    let cache = MediaCache::new(directory.clone(), 24).unwrap();
+    let [first, second, third] = ["a", "b", "c"].map(CacheKey::from_url);
+
+    // 10 bytes each, the third one does not fit next to both others
+    record(&cache, first, &[&[0; 8]]);
+    record(&cache, second, &[&[0; 8]]);
+    assert!(cache.open_opus(first).is_some());
+    record(&cache, third, &[&[0; 8]]);
+
+    assert!(cache.open_opus(second).is_none());
+    assert!(cache.open_opus(first).is_some());
+    assert!(cache.open_opus(third).is_some());
+    assert!(!cache.entry_path(second, OPUS_KIND).exists());
+    fs::remove_dir_all(&directory).unwrap();
+  }
+}
@@ -0,0 +1,273 @@
+use std::{
+  env,
+  fs::{self, File},
+  io::{self, BufWriter, Write},
+  ops::Range,
+  path::{Path, PathBuf},
+  sync::{Arc, Mutex, OnceLock},
+  task::Waker,
+  time::Duration
+};
+use anyhow::{Result, Context, anyhow};
+use memmap2::Mmap;
+use opus::{Application, Bitrate, Channels, Encoder};
+use tracing::{debug, warn};
+
+use voice::{
+  constants::{CHUNK_DURATION, MAX_OPUS_PACKET_SIZE, SAMPLE_RATE},
+  frame_queue::FRAME_SAMPLES,
+  provider::{PacketProvider, SampleProvider, SeekMode}
+};
+use crate::providers::MediaMetadata;
+use super::{CacheKey, MediaCache};
+
+/// Default bitrate of Opus frames encoded for the cache.
+pub const DEFAULT_RECORD_BITRATE: i32 = 128_000;
+
+/// Returns the bitrate recordings are encoded at, set by `MOSAIK_CACHE_OPUS_BITRATE` in bits per second.
+///
+/// A recording is shared by every guild replaying it, so it is encoded once at this fixed rate
+/// and replays ignore the channel bitrate and the adaptive bitrate of the connection. It should
+/// be at least the highest channel bitrate in use, Discord caps the received stream anyway.
+pub fn record_bitrate() -> i32 {
+  static BITRATE: OnceLock<i32> = OnceLock::new();
+  *BITRATE.get_or_init(|| {
+    env::var("MOSAIK_CACHE_OPUS_BITRATE")
+      .ok()
+      .and_then(|it| it.parse::<i32>().ok())
+      .map_or(DEFAULT_RECORD_BITRATE, |it| it.clamp(6_000, 510_000))
+  })
+}
+
+/// Writes encoded Opus frames as `[length: u16 LE][packet]` records, committed to the cache on [`OpusFrameWriter::finish`].
+pub struct OpusFrameWriter {
+  key: CacheKey,
+  metadata: Arc<[MediaMetadata]>,
+  path: PathBuf,
+  temp_path: PathBuf,
+  writer: Option<BufWriter<File>>,
+  size: u64
+}
+
+impl OpusFrameWriter {
+  pub fn create(key: CacheKey, path: PathBuf, metadata: Arc<[MediaMetadata]>) -> io::Result<Self> {
+    let temp_path = path.with_extension("opus.part");
+    let writer = BufWriter::new(File::create(&temp_path)?);
+
+    Ok(Self {
+      key,
+      metadata,
+      path,
+      temp_path,
+      writer: Some(writer),
+      size: 0
+    })
+  }
+
+  pub fn push(&mut self, packet: &[u8]) -> io::Result<()> {
+    let writer = self.writer.as_mut().unwrap();
+    writer.write_all(&(packet.len() as u16).to_le_bytes())?;
+    writer.write_all(packet)?;
+    self.size += 2 + packet.len() as u64;
+    Ok(())
+  }
+
+  pub fn finish(mut self, cache: &MediaCache) -> io::Result<()> {
+    let writer = self.writer.as_mut().unwrap();
+    writer.flush()?;
+    writer.get_ref().sync_data()?;
+    fs::rename(&self.temp_path, &self.path)?;
+
+    self.writer = None;
+    cache.commit_opus(self.key, self.path.clone(), self.size, self.metadata.clone());
+    Ok(())
+  }
+}
+
+impl Drop for OpusFrameWriter {
+  fn drop(&mut self) {
+    // Not finished, the recording is incomplete
+    if self.writer.take().is_some() {
+      _ = fs::remove_file(&self.temp_path);
+    }
+  }
+}
+
+/// Plays Opus frames stored by an [`OpusFrameWriter`] straight from the page cache.
+pub struct CachedOpusProvider {
+  map: Mmap,
+  /// Offset and length of every packet in `map`.
+  packets: Vec<(usize, usize)>,
+  next: usize
+}
+
+impl CachedOpusProvider {
+  pub fn open(path: &Path) -> Result<Self> {
+    let file = File::open(path)?;
+    let map = unsafe { Mmap::map(&file)? };
+
+    let mut packets = Vec::with_capacity(map.len() / 256);
+    let mut offset = 0;
+    while offset < map.len() {
+      let header = map.get(offset..offset + 2).context("truncated Opus frame header")?;
+      let length = u16::from_le_bytes([header[0], header[1]]) as usize;
+      if length > MAX_OPUS_PACKET_SIZE || offset + 2 + length > map.len() {
+        return Err(anyhow!("invalid Opus frame at {}", offset));
+      }
+
+      packets.push((offset + 2, length));
+      offset += 2 + length;
+    }
+
+    Ok(Self {
+      map,
+      packets,
+      next: 0
+    })
+  }
+}
+
+impl PacketProvider for CachedOpusProvider {
+  fn get_packet(&mut self, out: &mut [u8]) -> usize {
+    let Some(&(offset, length)) = self.packets.get(self.next) else {
+      return 0;
+    };
+
+    self.next += 1;
+    out[..length].copy_from_slice(&self.map[offset..offset + length]);
+    length
+  }
+
+  fn duration(&self) -> Option<Duration> {
+    Some(CHUNK_DURATION * self.packets.len() as u32)
+  }
+
+  fn seek(&mut self, position: Duration, _mode: SeekMode) -> Result<Duration> {
+    self.next = ((position.as_millis() / CHUNK_DURATION.as_millis()) as usize).min(self.packets.len());
+    Ok(CHUNK_DURATION * self.next as u32)
+  }
+}
+
+/// Encodes a decoded track into Opus frames, sending and recording them at the same time.
+///
+/// The connection's encoder is bypassed, so the first play costs one encode as before
+/// and replays of the recording cost none.
+pub struct OpusRecorder {
+  inner: Box<dyn SampleProvider>,
+  /// Only accessed through `&mut self`, the [`Mutex`] just makes the encoder [`Sync`].
+  encoder: Mutex<Encoder>,
+  writer: Option<OpusFrameWriter>,
+  frame: Vec<f32>,
+  fill: usize,
+  decoded: Vec<f32>,
+  decoded_range: Range<usize>,
+  ended: bool
+}
+
+impl OpusRecorder {
+  pub fn new(inner: Box<dyn SampleProvider>, writer: OpusFrameWriter) -> Result<Self> {
+    let mut encoder = Encoder::new(SAMPLE_RATE as u32, Channels::Stereo, Application::Audio)?;
+    encoder.set_bitrate(Bitrate::Bits(record_bitrate()))?;
+
+    Ok(Self {
+      inner,
+      encoder: Mutex::new(encoder),
+      writer: Some(writer),
+      frame: vec![0.0; FRAME_SAMPLES],
+      fill: 0,
+      decoded: vec![0.0; FRAME_SAMPLES * 6],
+      decoded_range: 0..0,
+      ended: false
+    })
+  }
+
+  /// Fills `frame`, returns `false` if the track ended with nothing left to encode.
+  fn fill_frame(&mut self) -> bool {
+    while self.fill < FRAME_SAMPLES {
+      if self.decoded_range.is_empty() {
+        let size = self.inner.get_samples(&mut self.decoded);
+        if size == 0 {
+          self.ended = true;
+          if self.fill == 0 {
+            return false;
+          }
+
+          self.frame[self.fill..].fill(0.0);
+          self.fill = FRAME_SAMPLES;
+          break;
+        }
+        self.decoded_range = 0..size;
+      }
+
+      let count = (FRAME_SAMPLES - self.fill).min(self.decoded_range.len());
+      let start = self.decoded_range.start;
+      self.frame[self.fill..self.fill + count].copy_from_slice(&self.decoded[start..start + count]);
+      self.fill += count;
+      self.decoded_range.start += count;
+    }
+
+    self.fill = 0;
+    true
+  }
+
+  fn finish_recording(&mut self) {
+    if let Some(writer) = self.writer.take() {
+      if let Err(error) = writer.finish(MediaCache::global()) {
+        warn!("failed to store Opus frames: {}", error);
+      }
+    }
+  }
+}
+
+impl PacketProvider for OpusRecorder {
+  fn get_packet(&mut self, out: &mut [u8]) -> usize {
+    if self.ended || !self.fill_frame() {
+      self.finish_recording();
+      return 0;
+    }
+
+    let size = match self.encoder.get_mut().unwrap().encode_float(&self.frame, out) {
+      Ok(size) => size,
+      Err(error) => {
+        warn!("failed to encode Opus frame: {}", error);
+        self.writer = None;
+        return 0;
+      }
+    };
+
+    if let Some(writer) = self.writer.as_mut() {
+      if let Err(error) = writer.push(&out[..size]) {
+        warn!("failed to record Opus frame: {}", error);
+        self.writer = None;
+      }
+    }
+    size
+  }
+
+  fn buffer_hint(&self) -> Option<Duration> {
+    self.inner.buffer_hint()
+  }
+
+  fn poll_ready(&self, waker: &Waker) -> bool {
+    self.ended || self.decoded_range.len() >= FRAME_SAMPLES || self.inner.poll_ready(waker)
+  }
+
+  fn stalls(&self) -> u64 {
+    self.inner.stalls()
+  }
+
+  fn duration(&self) -> Option<Duration> {
+    self.inner.duration()
+  }
+
+  fn seek(&mut self, position: Duration, mode: SeekMode) -> Result<Duration> {
+    if self.writer.take().is_some() {
+      debug!("seeked while recording, dropping the recording");
+    }
+
+    self.fill = 0;
+    self.decoded_range = 0..0;
+    self.encoder.get_mut().unwrap().reset_state()?;
+    self.inner.seek(position, mode)
+  }
+}
@@ -0,0 +1,368 @@
+use std::{
+  fs::{self, OpenOptions},
+  io::{self, Read, Seek, SeekFrom},
+  mem,
+  path::{Path, PathBuf},
+  sync::{atomic::{AtomicU64, Ordering}, Arc, Condvar, Mutex},
+  task::Waker
+};
+use anyhow::Result;
+use memmap2::MmapMut;
+use symphonia::core::io::MediaSource;
+use tokio::io::{AsyncReadExt, AsyncSeekExt};
+use tracing::{debug, warn};
+
+use crate::providers::async_adapter::{AsyncMediaSource, InputReadiness, READY_BYTES};
+
+pub const SEGMENT_SIZE: u64 = 1024 * 1024;
+
+/// A reader further ahead of the fetch than this makes the fetch restart at the reader.
+const RESTART_DISTANCE: u64 = 2 * SEGMENT_SIZE;
+/// Number of consecutive failed reads after which a fetch gives up.
+const MAX_FETCH_FAILURES: usize = 3;
+
+struct SegmentState {
+  /// Number of bytes filled from the start of each segment.
+  filled: Vec<u64>,
+  /// Offset the fetch is currently writing at.
+  cursor: u64,
+  restart_at: Option<u64>,
+  failed: bool,
+  /// Readers waiting through [`InputReadiness`], woken by every write.
+  wakers: Vec<Waker>
+}
+
+/// A sparse, memory-mapped file filled segment by segment by one fetch.
+pub struct SegmentFile {
+  path: PathBuf,
+  length: u64,
+  mime_type: Option<String>,
+  _map: MmapMut,
+  data: *mut u8,
+  state: Mutex<SegmentState>,
+  ready: Condvar
+}
+
+// Bytes are only written past `filled` of their segment, readers only read below it.
+unsafe impl Send for SegmentFile {}
+unsafe impl Sync for SegmentFile {}
+
+impl SegmentFile {
+  pub fn create(path: PathBuf, length: u64, mime_type: Option<String>) -> Result<Self> {
+    // Never truncate a file a previous reader still has mapped
+    _ = fs::remove_file(&path);
+    let file = OpenOptions::new().read(true).write(true).create_new(true).open(&path)?;
+    file.set_len(length)?;
+
+    let mut map = unsafe { MmapMut::map_mut(&file)? };
+    let data = map.as_mut_ptr();
+    let segments = ((length + SEGMENT_SIZE - 1) / SEGMENT_SIZE) as usize;
+
+    Ok(Self {
+      path,
+      length,
+      mime_type,
+      _map: map,
+      data,
+      state: Mutex::new(SegmentState {
+        filled: vec![0; segments],
+        cursor: 0,
+        restart_at: None,
+        failed: false,
+        wakers: Vec::new()
+      }),
+      ready: Condvar::new()
+    })
+  }
+
+  pub fn path(&self) -> &Path {
+    &self.path
+  }
+
+  pub fn len(&self) -> u64 {
+    self.length
+  }
+
+  pub fn mime_type(&self) -> Option<&str> {
+    self.mime_type.as_deref()
+  }
+
+  pub fn is_failed(&self) -> bool {
+    self.state.lock().unwrap().failed
+  }
+
+  fn segment_length(&self, segment: usize) -> u64 {
+    (self.length - segment as u64 * SEGMENT_SIZE).min(SEGMENT_SIZE)
+  }
+
+  /// Returns the first offset at or after `offset`'s segment that is not filled yet.
+  fn next_missing(&self, state: &SegmentState, offset: u64) -> Option<u64> {
+    let first = (offset / SEGMENT_SIZE) as usize;
+    (first..state.filled.len())
+      .find(|&segment| state.filled[segment] < self.segment_length(segment))
+      .map(|segment| segment as u64 * SEGMENT_SIZE + state.filled[segment])
+  }
+
+  /// Returns number of filled bytes starting at `offset`, up to the end of its segment.
+  fn available(&self, state: &SegmentState, offset: u64) -> u64 {
+    let segment = (offset / SEGMENT_SIZE) as usize;
+    let filled_end = segment as u64 * SEGMENT_SIZE + state.filled[segment];
+    filled_end.saturating_sub(offset)
+  }
+
+  /// Appends fetched bytes at `offset`, which must be where the fetch left off, returns the end offset.
+  fn write(&self, mut offset: u64, mut data: &[u8]) -> u64 {
+    while !data.is_empty() && offset < self.length {
+      let segment = (offset / SEGMENT_SIZE) as usize;
+      let segment_end = segment as u64 * SEGMENT_SIZE + self.segment_length(segment);
+      let count = (segment_end - offset).min(data.len() as u64) as usize;
+
+      unsafe {
+        std::ptr::copy_nonoverlapping(data.as_ptr(), self.data.add(offset as usize), count);
+      }
+
+      let mut state = self.state.lock().unwrap();
+      state.filled[segment] = state.filled[segment].max(offset + count as u64 - segment as u64 * SEGMENT_SIZE);
+      state.cursor = offset + count as u64;
+      let wakers = mem::take(&mut state.wakers);
+      drop(state);
+      self.ready.notify_all();
+      wakers.into_iter().for_each(Waker::wake);
+
+      offset += count as u64;
+      data = &data[count..];
+    }
+
+    offset
+  }
+
+  /// Returns `true` if the byte at `offset` was already fetched, e.g. after a restart.
+  fn is_filled(&self, offset: u64) -> bool {
+    offset < self.length && self.available(&self.state.lock().unwrap(), offset) > 0
+  }
+
+  /// Makes the fetch restart at `offset` if a reader waits there and the fetch would not get there soon.
+  fn request(&self, state: &mut SegmentState, offset: u64) {
+    let ahead = offset < state.cursor || offset - state.cursor > RESTART_DISTANCE;
+    if ahead && state.restart_at.is_none() {
+      state.restart_at = Some(offset);
+    }
+  }
+
+  /// Returns `true` if `count` bytes from `offset` are filled, or everything from it to the end.
+  fn has_filled(&self, state: &SegmentState, mut offset: u64, count: u64) -> bool {
+    let end = offset.saturating_add(count).min(self.length);
+    while offset < end {
+      let available = self.available(state, offset);
+      if available == 0 {
+        return false;
+      }
+      offset += available;
+    }
+    true
+  }
+
+  fn fail(&self) {
+    let mut state = self.state.lock().unwrap();
+    state.failed = true;
+    let wakers = mem::take(&mut state.wakers);
+    drop(state);
+    self.ready.notify_all();
+    wakers.into_iter().for_each(Waker::wake);
+  }
+}
+
+/// Fills `file` from `stream`, seeking it to skip filled segments or to jump to a reader waiting far ahead.
+pub(super) async fn run_fetch(file: Arc<SegmentFile>, mut stream: Box<dyn AsyncMediaSource>) {
+  let mut buffer = vec![0u8; 64 * 1024];
+  let mut offset = 0;
+  let mut failures = 0;
+
+  loop {
+    let restart = loop {
+      if let Some(restart_at) = file.state.lock().unwrap().restart_at.take() {
+        break Some(restart_at);
+      }
+
+      let read = match stream.read(&mut buffer).await {
+        Ok(0) => break None,
+        Ok(read) => read,
+        Err(error) => {
+          warn!("media cache fetch failed at {}: {}", offset, error);
+          failures += 1;
+          if failures >= MAX_FETCH_FAILURES {
+            file.fail();
+            return;
+          }
+
+          match stream.try_resume(offset).await {
+            Ok(resumed) => stream = resumed,
+            Err(error) => {
+              warn!("media cache fetch failed to resume at {}: {:?}", offset, error);
+              file.fail();
+              return;
+            }
+          }
+          continue;
+        }
+      };
+      failures = 0;
+
+      offset = file.write(offset, &buffer[..read]);
+      if file.is_filled(offset) {
+        break Some(offset);
+      }
+
+      // Only the fetch still holds the file, it was replaced in the cache index
+      if Arc::strong_count(&file) == 1 {
+        debug!("media cache fetch of {:?} abandoned", file.path());
+        return;
+      }
+    };
+
+    let next = {
+      let state = file.state.lock().unwrap();
+      restart
+        .and_then(|it| file.next_missing(&state, it))
+        .or_else(|| file.next_missing(&state, 0))
+    };
+    let Some(next) = next else {
+      debug!("media cache fetch of {:?} finished", file.path());
+      return;
+    };
+
+    offset = next;
+    file.state.lock().unwrap().cursor = offset;
+    if let Err(error) = stream.seek(SeekFrom::Start(offset)).await {
+      warn!("media cache fetch failed to seek to {}: {}", offset, error);
+      file.fail();
+      return;
+    }
+  }
+}
+
+/// [`InputReadiness`] of a [`CachedStream`], ready once [`READY_BYTES`] past its position are fetched.
+struct CachedReadiness {
+  file: Arc<SegmentFile>,
+  /// Mirror of [`CachedStream::position`].
+  position: AtomicU64
+}
+
+impl InputReadiness for CachedReadiness {
+  fn poll_ready(&self, waker: &Waker) -> bool {
+    let mut state = self.file.state.lock().unwrap();
+    let position = self.position.load(Ordering::Relaxed);
+    if state.failed || position >= self.file.length || self.file.has_filled(&state, position, READY_BYTES) {
+      return true;
+    }
+    if self.file.available(&state, position) == 0 {
+      self.file.request(&mut state, position);
+    }
+
+    if !state.wakers.iter().any(|it| it.will_wake(waker)) {
+      state.wakers.push(waker.clone());
+    }
+    false
+  }
+}
+
+/// Reader of a [`SegmentFile`], blocks until the bytes it needs are fetched.
+pub struct CachedStream {
+  file: Arc<SegmentFile>,
+  position: u64,
+  stalls: Arc<AtomicU64>,
+  readiness: Arc<CachedReadiness>
+}
+
+impl CachedStream {
+  pub fn new(file: Arc<SegmentFile>) -> Self {
+    Self {
+      readiness: Arc::new(CachedReadiness {
+        file: file.clone(),
+        position: AtomicU64::new(0)
+      }),
+      file,
+      position: 0,
+      stalls: Default::default()
+    }
+  }
+
+  /// Returns a handle telling whether the bytes after the position are fetched, see [`InputReadiness`].
+  pub fn readiness(&self) -> Arc<dyn InputReadiness> {
+    self.readiness.clone()
+  }
+
+  fn set_position(&mut self, position: u64) {
+    self.position = position;
+    self.readiness.position.store(position, Ordering::Relaxed);
+  }
+
+  pub fn mime_type(&self) -> Option<&str> {
+    self.file.mime_type()
+  }
+
+  /// Returns a counter of reads that had to wait for the fetch.
+  pub fn stalls(&self) -> Arc<AtomicU64> {
+    self.stalls.clone()
+  }
+}
+
+impl Read for CachedStream {
+  fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+    if self.position >= self.file.length || buf.is_empty() {
+      return Ok(0);
+    }
+
+    let file = &self.file;
+    let mut state = file.state.lock().unwrap();
+    let mut stalled = false;
+    let available = loop {
+      let available = file.available(&state, self.position);
+      if available > 0 {
+        break available;
+      }
+      if state.failed {
+        return Err(io::Error::new(io::ErrorKind::Other, "media cache fetch failed"));
+      }
+
+      file.request(&mut state, self.position);
+      if !stalled {
+        stalled = true;
+        self.stalls.fetch_add(1, Ordering::Relaxed);
+      }
+      state = file.ready.wait(state).unwrap();
+    };
+    drop(state);
+
+    let count = available.min(buf.len() as u64) as usize;
+    unsafe {
+      std::ptr::copy_nonoverlapping(file.data.add(self.position as usize), buf.as_mut_ptr(), count);
+    }
+    self.set_position(self.position + count as u64);
+
+    Ok(count)
+  }
+}
+
+impl Seek for CachedStream {
+  fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+    let target = match pos {
+      SeekFrom::Start(offset) => Some(offset),
+      SeekFrom::Current(delta) => self.position.checked_add_signed(delta),
+      SeekFrom::End(delta) => self.file.length.checked_add_signed(delta)
+    }.ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "invalid seek position"))?;
+
+    self.set_position(target);
+    Ok(target)
+  }
+}
+
+impl MediaSource for CachedStream {
+  fn is_seekable(&self) -> bool {
+    true
+  }
+
+  fn byte_len(&self) -> Option<u64> {
+    Some(self.file.length)
+  }
+}
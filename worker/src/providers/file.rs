@@ -1,12 +1,25 @@
-use std::{fs::File, path::{PathBuf, Path}};
+use std::{
+  fs::File,
+  io::{self, Read, Seek, SeekFrom},
+  path::{PathBuf, Path},
+  time::{SystemTime, UNIX_EPOCH}
+};
 use anyhow::Result;
 use async_trait::async_trait;
-use symphonia::core::probe::Hint;
-use voice::provider::SampleProvider;
+use memmap2::{Advice, Mmap};
+use symphonia::core::{io::MediaSource, probe::Hint};
+use tracing::debug;
+use voice::provider::AudioSource;
 
-use crate::voice::SymphoniaSampleProvider;
+use crate::{
+  providers::cache::CacheKey,
+  voice::{loudness::LoudnessNormalizer, probe_metadata, probe_source, ProbedSource, SourceBuffering}
+};
 
-use super::{MediaProvider, MediaMetadata};
+use super::{MediaProvider, MediaMetadata, MetadataCache};
+
+/// Size of each range the kernel is asked to read ahead, a multiple of every page size.
+const READAHEAD: usize = 2 << 20;
 
 #[derive(Debug)]
 pub struct FileMediaProvider {
@@ -19,22 +32,313 @@ impl FileMediaProvider {
       path: path.as_ref().to_owned()
     }
   }
-}
 
-#[async_trait]
-impl MediaProvider for FileMediaProvider {
-  async fn get_sample_provider(&self) -> Result<Box<dyn SampleProvider>> {
-    let file = File::open(self.path.clone())?;
+  /// Returns the key of the file's current contents, a replaced or rewritten file gets a new key.
+  async fn cache_key(&self) -> Result<CacheKey> {
+    let metadata = tokio::fs::metadata(&self.path).await?;
+    let modified = metadata.modified().ok()
+      .and_then(|it| it.duration_since(UNIX_EPOCH).ok())
+      .unwrap_or_default();
+    Ok(CacheKey::from_url(&format!("file:{}:{}:{}", self.path.display(), metadata.len(), modified.as_nanos())))
+  }
+
+  fn hint(path: &Path) -> Hint {
     let mut hint = Hint::new();
-    if let Some(extension) = self.path.extension().and_then(|it| it.to_str()) {
+    if let Some(extension) = path.extension().and_then(|it| it.to_str()) {
       hint.with_extension(extension);
     }
+    hint
+  }
+
+  /// Probes the file for playback on a blocking thread, the probe reads from disk.
+  async fn probe(&self, key: CacheKey) -> Result<ProbedSource> {
+    let path = self.path.clone();
+    let probed = tokio::task::spawn_blocking(move || {
+      probe_source(open_file(&path)?, Self::hint(&path), SourceBuffering::default())
+    }).await??;
 
-    Ok(Box::new(SymphoniaSampleProvider::new_from_source(Box::new(file), hint)?))
+    MetadataCache::global().insert(key, probed.metadata.clone());
+    Ok(probed)
+  }
+}
+
+#[async_trait]
+impl MediaProvider for FileMediaProvider {
+  async fn get_audio_source(&self) -> Result<AudioSource> {
+    let key = self.cache_key().await?;
+    Ok(match self.probe(key).await?.source {
+      AudioSource::Pcm(provider) => AudioSource::Pcm(Box::new(LoudnessNormalizer::new(provider, key))),
+      source => source
+    })
   }
 
   async fn get_metadata(&self) -> Result<Vec<MediaMetadata>> {
-    // TODO: Implement the logic to extract metadata from the file
-    Ok(vec![])
+    let key = self.cache_key().await?;
+    let mut metadata = match MetadataCache::global().get(key) {
+      Some(metadata) => metadata.to_vec(),
+      None => {
+        // Reopening a file is cheap, so only the container is probed here and playback probes again
+        let path = self.path.clone();
+        let metadata = tokio::task::spawn_blocking(move || {
+          probe_metadata(open_file(&path)?, Self::hint(&path))
+        }).await??;
+        MetadataCache::global().insert(key, metadata.clone());
+        metadata
+      }
+    };
+    metadata.extend(MetadataCache::global().loudness(key).map(MediaMetadata::Loudness));
+    Ok(metadata)
+  }
+}
+
+/// Opens `path` for decoding, mapped unless it is on a network filesystem.
+pub fn open_file(path: &Path) -> Result<Box<dyn MediaSource>> {
+  let file = File::open(path)?;
+  if is_network_filesystem(&file) {
+    debug!("{:?} is on a network filesystem, reading it without a mapping", path);
+    advise_sequential(&file);
+    return Ok(Box::new(file));
+  }
+  Ok(Box::new(MappedFile::new(file, path)?))
+}
+
+/// Returns `true` if `file` is on NFS, SMB or FUSE, where a mapped page can fail to load at any time.
+#[cfg(target_os = "linux")]
+fn is_network_filesystem(file: &File) -> bool {
+  use std::os::unix::io::AsRawFd;
+
+  const NFS: u32 = 0x6969;
+  const SMB: u32 = 0x517b;
+  const CIFS: u32 = 0xff534d42;
+  const SMB2: u32 = 0xfe534d42;
+  const FUSE: u32 = 0x65735546;
+
+  let mut stat = unsafe { std::mem::zeroed::<libc::statfs>() };
+  if unsafe { libc::fstatfs(file.as_raw_fd(), &mut stat) } != 0 {
+    // Unknown, buffered reads are always safe
+    return true;
+  }
+  matches!(stat.f_type as u32, NFS | SMB | CIFS | SMB2 | FUSE)
+}
+
+#[cfg(not(target_os = "linux"))]
+fn is_network_filesystem(_file: &File) -> bool {
+  false
+}
+
+#[cfg(target_os = "linux")]
+fn advise_sequential(file: &File) {
+  use std::os::unix::io::AsRawFd;
+
+  unsafe { libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_SEQUENTIAL) };
+}
+
+#[cfg(not(target_os = "linux"))]
+fn advise_sequential(_file: &File) {}
+
+/// Local file read through a shared mapping, so guilds playing the same file share its page cache.
+///
+/// The kernel is told the file is read sequentially and asked to page in the next [`READAHEAD`] bytes
+/// while the decoder is still in the current range, so a slow disk rarely blocks the decode thread.
+/// Size and modification time are checked before each range, a changed file fails the read.
+pub struct MappedFile {
+  file: File,
+  map: Mmap,
+  modified: Option<SystemTime>,
+  position: usize,
+  /// End of the range requested with [`Advice::WillNeed`], always a multiple of [`READAHEAD`].
+  advised: usize
+}
+
+impl MappedFile {
+  /// Maps `file`, see [`open_file`] for files that may be on a network filesystem.
+  pub fn new(file: File, path: &Path) -> Result<Self> {
+    let modified = file.metadata()?.modified().ok();
+    // SAFETY: the mapping is read-only, but the file can still be truncated by another process.
+    // Touching a page past the new end raises SIGBUS, which is why files are checked before every
+    // readahead range and network filesystems, where any I/O error does the same, are not mapped.
+    let map = unsafe { Mmap::map(&file)? };
+    if let Err(error) = map.advise(Advice::Sequential) {
+      debug!("failed to advise sequential access to {:?}: {}", path, error);
+    }
+
+    let mut me = Self {
+      file,
+      map,
+      modified,
+      position: 0,
+      advised: 0
+    };
+    me.read_ahead()?;
+    Ok(me)
+  }
+
+  /// Fails if the file was truncated or rewritten since it was mapped.
+  fn check_unchanged(&self) -> io::Result<()> {
+    let metadata = self.file.metadata()?;
+    if metadata.len() != self.map.len() as u64 || metadata.modified().ok() != self.modified {
+      return Err(io::Error::new(io::ErrorKind::Other, "file changed while being read"));
+    }
+    Ok(())
+  }
+
+  /// Keeps the range after the one being read requested.
+  fn read_ahead(&mut self) -> io::Result<()> {
+    while self.advised < self.map.len() && self.position + READAHEAD >= self.advised {
+      self.check_unchanged()?;
+
+      let length = READAHEAD.min(self.map.len() - self.advised);
+      if let Err(error) = self.map.advise_range(Advice::WillNeed, self.advised, length) {
+        debug!("failed to request readahead: {}", error);
+        self.advised = self.map.len();
+        return Ok(());
+      }
+      self.advised += length;
+    }
+    Ok(())
+  }
+}
+
+impl Read for MappedFile {
+  fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+    let data = self.map.get(self.position..).unwrap_or_default();
+    let count = data.len().min(buf.len());
+    buf[..count].copy_from_slice(&data[..count]);
+    self.position += count;
+
+    self.read_ahead()?;
+    Ok(count)
+  }
+}
+
+impl Seek for MappedFile {
+  fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+    let target = match pos {
+      SeekFrom::Start(offset) => Some(offset),
+      SeekFrom::Current(delta) => (self.position as u64).checked_add_signed(delta),
+      SeekFrom::End(delta) => (self.map.len() as u64).checked_add_signed(delta)
+    }.ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "invalid seek position"))?;
+
+    self.position = usize::try_from(target).map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "invalid seek position"))?;
+    // Continue requesting from the new position if it is outside of the requested ranges
+    if self.position >= self.advised || self.position + READAHEAD * 2 < self.advised {
+      self.advised = self.position - self.position % READAHEAD;
+    }
+    self.read_ahead()?;
+    Ok(target)
+  }
+}
+
+impl MediaSource for MappedFile {
+  fn is_seekable(&self) -> bool {
+    true
+  }
+
+  fn byte_len(&self) -> Option<u64> {
+    Some(self.map.len() as u64)
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use std::{env, fs, process};
+  use super::*;
+
+  fn test_file(name: &str, length: usize) -> (PathBuf, Vec<u8>) {
+    let path = env::temp_dir().join(format!("mosaik-file-test-{}-{}", process::id(), name));
+    let data = (0..length).map(|it| (it * 31 % 251) as u8).collect::<Vec<_>>();
+    fs::write(&path, &data).unwrap();
+    (path, data)
+  }
+
+  fn map(path: &Path) -> MappedFile {
+    MappedFile::new(File::open(path).unwrap(), path).unwrap()
+  }
+
+  #[test]
+  fn reads_whole_file_across_readahead_ranges() {
+    let (path, data) = test_file("read", READAHEAD * 2 + 1000);
+    let mut file = map(&path);
+    assert_eq!(file.byte_len(), Some(data.len() as u64));
+    assert_eq!(file.advised, READAHEAD * 2);
+
+    let mut read = Vec::new();
+    let mut buffer = [0; 100_000];
+    loop {
+      let count = file.read(&mut buffer).unwrap();
+      if count == 0 {
+        break;
+      }
+      read.extend_from_slice(&buffer[..count]);
+    }
+    assert!(read == data);
+    assert_eq!(file.advised, data.len());
+
+    fs::remove_file(path).unwrap();
+  }
+
+  #[test]
+  fn seeks_from_every_origin() {
+    let (path, data) = test_file("seek", READAHEAD * 3);
+    let mut file = map(&path);
+    let mut buffer = [0; 16];
+
+    assert_eq!(file.seek(SeekFrom::Start(READAHEAD as u64 * 2 + 5)).unwrap(), READAHEAD as u64 * 2 + 5);
+    file.read_exact(&mut buffer).unwrap();
+    assert_eq!(buffer, data[READAHEAD * 2 + 5..][..16]);
+    assert_eq!(file.advised, data.len());
+
+    assert_eq!(file.seek(SeekFrom::Current(-32)).unwrap(), READAHEAD as u64 * 2 - 11);
+    file.read_exact(&mut buffer).unwrap();
+    assert_eq!(buffer, data[READAHEAD * 2 - 11..][..16]);
+
+    assert_eq!(file.seek(SeekFrom::End(-16)).unwrap(), data.len() as u64 - 16);
+    file.read_exact(&mut buffer).unwrap();
+    assert_eq!(buffer, data[data.len() - 16..]);
+
+    // Going back far restarts the readahead at the target range
+    file.seek(SeekFrom::Start(10)).unwrap();
+    assert_eq!(file.advised, READAHEAD * 2);
+
+    assert!(file.seek(SeekFrom::Current(-11)).is_err());
+    assert_eq!(file.seek(SeekFrom::End(100)).unwrap(), data.len() as u64 + 100);
+    assert_eq!(file.read(&mut buffer).unwrap(), 0);
+
+    fs::remove_file(path).unwrap();
+  }
+
+  #[test]
+  fn truncated_file_fails_before_unmapped_pages_are_read() {
+    let (path, data) = test_file("truncate", READAHEAD * 3);
+    let mut file = map(&path);
+    fs::OpenOptions::new().write(true).open(&path).unwrap().set_len(READAHEAD as u64 * 2).unwrap();
+
+    // Ranges requested before the truncation are still read, the next one is refused
+    let mut read = Vec::new();
+    let mut buffer = [0; 64 * 1024];
+    let error = loop {
+      match file.read(&mut buffer) {
+        Ok(count) => read.extend_from_slice(&buffer[..count]),
+        Err(error) => break error
+      }
+    };
+    assert_eq!(error.kind(), io::ErrorKind::Other);
+    assert!(read.len() < READAHEAD * 2);
+    assert!(read == data[..read.len()]);
+
+    assert!(file.seek(SeekFrom::Start(READAHEAD as u64 * 2 + 5)).is_err());
+    fs::remove_file(path).unwrap();
+  }
+
+  #[test]
+  fn open_file_reads_local_file() {
+    let (path, data) = test_file("open", 1000);
+    let mut file = open_file(&path).unwrap();
+    assert_eq!(file.byte_len(), Some(1000));
+
+    let mut read = Vec::new();
+    file.read_to_end(&mut read).unwrap();
+    assert_eq!(read, data);
+    fs::remove_file(path).unwrap();
   }
 }
@@ -0,0 +1,195 @@
+use std::{
+  collections::HashMap,
+  env,
+  error::Error,
+  fmt::{Debug, Formatter},
+  net::SocketAddr,
+  sync::{Arc, Mutex},
+  time::{Duration, Instant}
+};
+use anyhow::{Result, Context};
+use reqwest::{
+  dns::{Addrs, Name, Resolve, Resolving},
+  Client,
+  Url
+};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
+use tracing::debug;
+
+use super::ParallelOptions;
+
+#[derive(Debug, Clone)]
+pub struct MediaHttpOptions {
+  /// Maximum number of requests to a single host waiting for a response at once.
+  ///
+  /// Streams only count while their request is in flight, an open stream being read does not.
+  pub max_requests_per_host: usize,
+  /// How long a request waits for a free slot of [`MediaHttpOptions::max_requests_per_host`].
+  pub acquire_timeout: Duration,
+  /// Maximum number of idle connections kept open per host.
+  pub max_idle_per_host: usize,
+  pub idle_timeout: Duration,
+  pub connect_timeout: Duration,
+  /// How long resolved addresses are reused before resolving again.
+  pub dns_ttl: Duration,
+  /// Fetch large sources as parallel range requests if set.
+  pub parallel: Option<ParallelOptions>
+}
+
+impl Default for MediaHttpOptions {
+  fn default() -> Self {
+    Self {
+      max_requests_per_host: 16,
+      acquire_timeout: Duration::from_secs(10),
+      max_idle_per_host: 8,
+      idle_timeout: Duration::from_secs(90),
+      connect_timeout: Duration::from_secs(10),
+      dns_ttl: Duration::from_secs(300),
+      parallel: None
+    }
+  }
+}
+
+impl MediaHttpOptions {
+  /// Returns the default options, overridden by `MOSAIK_HTTP_MAX_REQUESTS_PER_HOST`
+  /// (or the older `MOSAIK_HTTP_MAX_STREAMS_PER_HOST`) and `MOSAIK_HTTP_ACQUIRE_TIMEOUT_SECS`.
+  ///
+  /// Parallel range requests are enabled by `MOSAIK_HTTP_PARALLEL_CONNECTIONS`, and their
+  /// read-ahead window is set by `MOSAIK_HTTP_READ_AHEAD_MB`.
+  pub fn from_env() -> Self {
+    let mut options = Self::default();
+    let max_requests = env::var("MOSAIK_HTTP_MAX_REQUESTS_PER_HOST")
+      .or_else(|_| env::var("MOSAIK_HTTP_MAX_STREAMS_PER_HOST"))
+      .ok()
+      .and_then(|it| it.parse::<usize>().ok());
+    if let Some(max) = max_requests {
+      options.max_requests_per_host = max.max(1);
+    }
+    if let Some(timeout) = env::var("MOSAIK_HTTP_ACQUIRE_TIMEOUT_SECS").ok().and_then(|it| it.parse().ok()) {
+      options.acquire_timeout = Duration::from_secs(timeout);
+    }
+
+    if let Some(connections) = env::var("MOSAIK_HTTP_PARALLEL_CONNECTIONS").ok().and_then(|it| it.parse::<usize>().ok()) {
+      let mut parallel = ParallelOptions {
+        max_connections: connections.max(1),
+        ..Default::default()
+      };
+      if let Some(read_ahead) = env::var("MOSAIK_HTTP_READ_AHEAD_MB").ok().and_then(|it| it.parse::<u64>().ok()) {
+        parallel.read_ahead = read_ahead * 1024 * 1024;
+      }
+      options.parallel = Some(parallel);
+    }
+    options
+  }
+}
+
+/// Resolver that keeps resolved addresses for [`MediaHttpOptions::dns_ttl`].
+struct CachingResolver {
+  ttl: Duration,
+  entries: Arc<Mutex<HashMap<String, (Instant, Vec<SocketAddr>)>>>
+}
+
+impl Resolve for CachingResolver {
+  fn resolve(&self, name: Name) -> Resolving {
+    let host = name.as_str().to_owned();
+    if let Some((resolved_at, addrs)) = self.entries.lock().unwrap().get(&host) {
+      if resolved_at.elapsed() < self.ttl {
+        let addrs: Addrs = Box::new(addrs.clone().into_iter());
+        return Box::pin(async move { Ok::<_, Box<dyn Error + Send + Sync>>(addrs) });
+      }
+    }
+
+    let entries = self.entries.clone();
+    Box::pin(async move {
+      // The port is replaced by the connector
+      let addrs = tokio::net::lookup_host((host.as_str(), 0)).await?.collect::<Vec<_>>();
+      debug!("resolved {} to {:?}", host, addrs);
+      entries.lock().unwrap().insert(host, (Instant::now(), addrs.clone()));
+
+      let addrs: Addrs = Box::new(addrs.into_iter());
+      Ok::<_, Box<dyn Error + Send + Sync>>(addrs)
+    })
+  }
+}
+
+struct ClientRef {
+  client: Client,
+  options: MediaHttpOptions,
+  hosts: Mutex<HashMap<String, Arc<Semaphore>>>
+}
+
+/// HTTP client shared by every media request, so connections, TLS sessions and
+/// resolved addresses are reused between tracks and reconnects.
+///
+/// HTTP/2 is negotiated with ALPN where the origin supports it.
+#[derive(Clone)]
+pub struct MediaHttpClient {
+  inner: Arc<ClientRef>
+}
+
+impl MediaHttpClient {
+  pub fn new(options: MediaHttpOptions) -> Result<Self> {
+    let resolver = CachingResolver {
+      ttl: options.dns_ttl,
+      entries: Default::default()
+    };
+
+    let client = Client::builder()
+      .pool_max_idle_per_host(options.max_idle_per_host)
+      .pool_idle_timeout(options.idle_timeout)
+      .connect_timeout(options.connect_timeout)
+      .tcp_keepalive(Duration::from_secs(60))
+      .tcp_nodelay(true)
+      .http2_adaptive_window(true)
+      .dns_resolver(Arc::new(resolver))
+      .build()
+      .context("failed to create HTTP client")?;
+
+    Ok(Self {
+      inner: Arc::new(ClientRef {
+        client,
+        options,
+        hosts: Default::default()
+      })
+    })
+  }
+
+  pub fn client(&self) -> &Client {
+    &self.inner.client
+  }
+
+  pub fn options(&self) -> &MediaHttpOptions {
+    &self.inner.options
+  }
+
+  /// Waits until a new request to the host of `url` is allowed, failing after [`MediaHttpOptions::acquire_timeout`].
+  ///
+  /// The permit should only be held until the response arrives.
+  pub async fn acquire(&self, url: &str) -> Result<OwnedSemaphorePermit> {
+    let host = Url::parse(url)
+      .ok()
+      .and_then(|it| it.host_str().map(|host| host.to_owned()))
+      .unwrap_or_default();
+
+    let semaphore = self.inner.hosts
+      .lock()
+      .unwrap()
+      .entry(host.clone())
+      .or_insert_with(|| Arc::new(Semaphore::new(self.inner.options.max_requests_per_host)))
+      .clone();
+
+    let permit = tokio::time::timeout(self.inner.options.acquire_timeout, semaphore.acquire_owned())
+      .await
+      .with_context(|| format!("too many requests to {} in flight", host))?;
+    // The semaphore is never closed
+    Ok(permit.unwrap())
+  }
+}
+
+impl Debug for MediaHttpClient {
+  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
+    formatter.debug_struct("MediaHttpClient")
+      .field("options", &self.inner.options)
+      .finish()
+  }
+}
@@ -1,53 +1,196 @@
-use anyhow::Result;
+use std::{
+  fmt::{Debug, Formatter},
+  sync::Mutex,
+  time::Duration
+};
+use anyhow::{Result, anyhow};
 use async_trait::async_trait;
-use reqwest::Client;
-use symphonia::core::probe::Hint;
+use symphonia::core::{io::MediaSource, probe::Hint};
 use tokio::sync::oneshot;
-use tracing::info;
+use tracing::{debug, info};
 
-use voice::provider::SampleProvider;
+use voice::provider::AudioSource;
 use crate::{
-  voice::SymphoniaSampleProvider,
-  providers::{MediaMetadata, MediaProvider}
+  voice::{loudness::LoudnessNormalizer, probe_metadata, probe_source, ProbedSource, SourceBuffering},
+  providers::{
+    async_adapter::AsyncAdapterStream,
+    cache::{CacheKey, CacheLookup, MediaCache, OpusRecorder},
+    MediaMetadata,
+    MediaProvider,
+    MetadataCache
+  }
 };
 use self::request::HttpRequest;
 
 pub mod request;
+mod client;
+mod parallel;
+
+pub use client::*;
+pub use parallel::*;
+
+/// Jitter buffer depth requested for HTTP sources, network reads stall far more often than disk reads.
+const HTTP_BUFFER_HINT: Duration = Duration::from_millis(500);
+
+fn mime_hint(mime_type: Option<&str>) -> Hint {
+  let mut hint = Hint::default();
+  if let Some(mime_type) = mime_type {
+    hint.mime_type(mime_type);
+  }
+  hint
+}
 
-#[derive(Debug)]
 pub struct SeekableHttpMediaProvider {
-  request: String
+  client: MediaHttpClient,
+  request: String,
+  /// Source opened by [`MediaProvider::get_metadata`] that cannot be reopened cheaply, taken by the next play.
+  opened: Mutex<Option<ProbedSource>>
+}
+
+/// Input opened by [`SeekableHttpMediaProvider::open`].
+struct OpenedInput {
+  input: Box<dyn MediaSource>,
+  hint: Hint,
+  buffering: SourceBuffering,
+  /// The bytes are kept by the media cache, so opening the source again does not fetch it again.
+  cached: bool
 }
 
 impl SeekableHttpMediaProvider {
-  pub fn new(request: String) -> Self {
+  pub fn new(client: MediaHttpClient, request: String) -> Self {
     Self {
-      request
+      client,
+      request,
+      opened: Mutex::new(None)
     }
   }
-}
 
-#[async_trait]
-impl MediaProvider for SeekableHttpMediaProvider {
-  async fn get_sample_provider(&self) -> Result<Box<dyn SampleProvider>> {
-    let client = Client::new();
-    let mut request = HttpRequest::new(client, self.request.clone());
-    let stream = request.create_async().await.unwrap();
+  /// Opens the source, through the media cache if it is cacheable.
+  async fn open(&self, key: CacheKey) -> Result<OpenedInput> {
+    let cache = MediaCache::global();
+    let (input, hint, stalls, readiness, cached): (Box<dyn MediaSource>, _, _, _, _) = match cache.open_or_reserve(key).await {
+      CacheLookup::Hit(stream) => {
+        let hint = mime_hint(stream.mime_type());
+        let (stalls, readiness) = (stream.stalls(), stream.readiness());
+        (Box::new(stream), hint, stalls, readiness, true)
+      },
+      CacheLookup::Miss(reservation) => {
+        let mut request = HttpRequest::new(self.client.clone(), self.request.clone())
+          .with_parallel(self.client.options().parallel.clone());
+        let (stream, hint) = request.create_stream(None).await.map_err(|error| anyhow!("{:?}", error))?;
+
+        let cacheable = stream.content_length().filter(|&it| it > 0 && stream.supports_ranges());
+        let mime_type = stream.mime_type().map(|it| it.to_owned());
+        let source = request.into_source(stream);
+
+        match cacheable {
+          Some(length) => {
+            let stream = reservation.fill(source, length, mime_type)?;
+            let (stalls, readiness) = (stream.stalls(), stream.readiness());
+            (Box::new(stream), hint.unwrap_or_default(), stalls, readiness, true)
+          },
+          None => {
+            let stream = AsyncAdapterStream::new(source, 64 * 1024);
+            let (stalls, readiness) = (stream.stalls(), stream.readiness());
+            (Box::new(stream), hint.unwrap_or_default(), stalls, readiness, false)
+          }
+        }
+      }
+    };
 
+    Ok(OpenedInput {
+      input,
+      hint,
+      buffering: SourceBuffering {
+        hint: Some(HTTP_BUFFER_HINT),
+        stalls: Some(stalls),
+        readiness: Some(readiness)
+      },
+      cached
+    })
+  }
+
+  /// Probes `opened` for playback on a blocking thread, reads wait for the network.
+  async fn probe(&self, key: CacheKey, opened: OpenedInput) -> Result<ProbedSource> {
+    let OpenedInput { input, hint, buffering, .. } = opened;
     let (tx, rx) = oneshot::channel();
     tokio::task::spawn_blocking(move || {
       info!("waiting for sample provider...");
-      tx.send(SymphoniaSampleProvider::new_from_source(
-        stream.input,
-        stream.hint.unwrap_or_default()
-      ).unwrap()).unwrap();
+      _ = tx.send(probe_source(input, hint, buffering));
     });
 
-    Ok(Box::new(rx.await?))
+    let probed = rx.await??;
+    MetadataCache::global().insert(key, probed.metadata.clone());
+    Ok(probed)
+  }
+}
+
+impl Debug for SeekableHttpMediaProvider {
+  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
+    formatter.debug_struct("SeekableHttpMediaProvider")
+      .field("client", &self.client)
+      .field("request", &self.request)
+      .finish()
+  }
+}
+
+#[async_trait]
+impl MediaProvider for SeekableHttpMediaProvider {
+  async fn get_audio_source(&self) -> Result<AudioSource> {
+    let cache = MediaCache::global();
+    let key = CacheKey::from_url(&self.request);
+    if let Some((provider, metadata)) = cache.open_opus(key) {
+      debug!("playing cached Opus frames of {}", key);
+      MetadataCache::global().insert(key, metadata.to_vec());
+      return Ok(AudioSource::Opus(Box::new(provider)));
+    }
+
+    let opened = self.opened.lock().unwrap().take();
+    let probed = match opened {
+      Some(probed) => probed,
+      None => {
+        let opened = self.open(key).await?;
+        self.probe(key, opened).await?
+      }
+    };
+
+    match probed.source {
+      AudioSource::Pcm(provider) => {
+        let provider = LoudnessNormalizer::new(provider, key);
+        // Recorded frames are replayed as is, so only normalized plays are recorded
+        let writer = provider.is_normalized().then(|| cache.record_opus(key, probed.metadata)).flatten();
+        match writer {
+          Some(writer) => Ok(AudioSource::Opus(Box::new(OpusRecorder::new(Box::new(provider), writer)?))),
+          None => Ok(AudioSource::Pcm(Box::new(provider)))
+        }
+      },
+      source => Ok(source)
+    }
   }
 
   async fn get_metadata(&self) -> Result<Vec<MediaMetadata>> {
-    // TODO: Implement the logic to extract metadata from the file
-    Ok(vec![])
+    let key = CacheKey::from_url(&self.request);
+    let cached = MetadataCache::global().get(key).or_else(|| MediaCache::global().opus_metadata(key));
+    let mut metadata = match cached {
+      Some(metadata) => metadata.to_vec(),
+      None => {
+        let opened = self.open(key).await?;
+        if opened.cached {
+          // Bytes read by the probe stay in the media cache, playback opens the source again for free
+          let OpenedInput { input, hint, .. } = opened;
+          let metadata = tokio::task::spawn_blocking(move || probe_metadata(input, hint)).await??;
+          MetadataCache::global().insert(key, metadata.clone());
+          metadata
+        } else {
+          // Reopening would fetch the source again, keep it for the next play instead
+          let probed = self.probe(key, opened).await?;
+          let metadata = probed.metadata.clone();
+          *self.opened.lock().unwrap() = Some(probed);
+          metadata
+        }
+      }
+    };
+    metadata.extend(MetadataCache::global().loudness(key).map(MediaMetadata::Loudness));
+    Ok(metadata)
   }
 }
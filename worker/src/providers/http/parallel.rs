@@ -0,0 +1,181 @@
+use std::{
+  collections::VecDeque,
+  future::Future,
+  io::{Error as IoError, ErrorKind as IoErrorKind, Result as IoResult, SeekFrom},
+  pin::Pin,
+  task::{Context, Poll}
+};
+use async_trait::async_trait;
+use tokio::{
+  io::{AsyncRead, AsyncSeek, ReadBuf},
+  task::JoinHandle
+};
+
+use crate::providers::async_adapter::{AsyncMediaSource, AudioStreamError};
+use super::request::{HttpRequest, stream_error};
+
+#[derive(Debug, Clone)]
+pub struct ParallelOptions {
+  /// Size of a single range request.
+  pub chunk_size: u64,
+  /// Number of bytes fetched ahead of the read cursor.
+  pub read_ahead: u64,
+  /// Maximum number of concurrent range requests per source.
+  pub max_connections: usize,
+  /// Sources shorter than this are fetched with a single request.
+  pub min_length: u64
+}
+
+impl Default for ParallelOptions {
+  fn default() -> Self {
+    Self {
+      chunk_size: 1024 * 1024,
+      read_ahead: 8 * 1024 * 1024,
+      max_connections: 4,
+      min_length: 32 * 1024 * 1024
+    }
+  }
+}
+
+type Chunk = JoinHandle<Result<Vec<u8>, AudioStreamError>>;
+
+/// Fetches a source as several range requests in parallel ahead of the read cursor,
+/// yielding the bytes in order.
+pub struct ParallelHttpStream {
+  request: HttpRequest,
+  options: ParallelOptions,
+  length: u64,
+  /// Offset of the next byte read.
+  position: u64,
+  /// Offset the next range request starts at.
+  scheduled: u64,
+  /// Range requests in flight, in order of their offsets.
+  chunks: VecDeque<Chunk>,
+  /// Fetched chunk the reader is in and the offset into it.
+  current: Option<(Vec<u8>, usize)>
+}
+
+impl ParallelHttpStream {
+  pub fn new(request: HttpRequest, length: u64, options: ParallelOptions) -> Self {
+    Self::new_at(request, length, options, 0)
+  }
+
+  fn new_at(request: HttpRequest, length: u64, options: ParallelOptions, position: u64) -> Self {
+    Self {
+      request,
+      options,
+      length,
+      position,
+      scheduled: position,
+      chunks: VecDeque::new(),
+      current: None
+    }
+  }
+
+  fn schedule(&mut self) {
+    let window_end = (self.position + self.options.read_ahead.max(self.options.chunk_size)).min(self.length);
+    while self.chunks.len() < self.options.max_connections && self.scheduled < window_end {
+      let start = self.scheduled;
+      let end = (start + self.options.chunk_size).min(self.length);
+      self.scheduled = end;
+
+      let request = self.request.clone();
+      self.chunks.push_back(tokio::spawn(async move { request.fetch_range(start, end).await }));
+    }
+  }
+
+  fn reset(&mut self, position: u64) {
+    for chunk in self.chunks.drain(..) {
+      chunk.abort();
+    }
+    self.current = None;
+    self.position = position;
+    self.scheduled = position;
+  }
+}
+
+impl Drop for ParallelHttpStream {
+  fn drop(&mut self) {
+    for chunk in &self.chunks {
+      chunk.abort();
+    }
+  }
+}
+
+impl AsyncRead for ParallelHttpStream {
+  fn poll_read(
+    self: Pin<&mut Self>,
+    cx: &mut Context<'_>,
+    buf: &mut ReadBuf<'_>
+  ) -> Poll<IoResult<()>> {
+    let this = self.get_mut();
+
+    loop {
+      if let Some((data, offset)) = &mut this.current {
+        if *offset < data.len() {
+          let count = (data.len() - *offset).min(buf.remaining());
+          buf.put_slice(&data[*offset..*offset + count]);
+          *offset += count;
+          this.position += count as u64;
+          return Poll::Ready(Ok(()));
+        }
+        this.current = None;
+      }
+
+      if this.position >= this.length {
+        return Poll::Ready(Ok(()));
+      }
+
+      this.schedule();
+      let chunk = this.chunks.front_mut().unwrap();
+      let result = match Pin::new(chunk).poll(cx) {
+        Poll::Ready(result) => result,
+        Poll::Pending => return Poll::Pending
+      };
+      this.chunks.pop_front();
+
+      let data = result
+        .map_err(|error| IoError::new(IoErrorKind::Other, error))?
+        .map_err(stream_error)?;
+      this.current = Some((data, 0));
+    }
+  }
+}
+
+impl AsyncSeek for ParallelHttpStream {
+  fn start_seek(self: Pin<&mut Self>, position: SeekFrom) -> IoResult<()> {
+    let this = self.get_mut();
+    let target = match position {
+      SeekFrom::Start(offset) => Some(offset),
+      SeekFrom::Current(delta) => this.position.checked_add_signed(delta),
+      SeekFrom::End(delta) => this.length.checked_add_signed(delta)
+    }.ok_or(IoError::new(IoErrorKind::InvalidInput, "invalid seek position"))?;
+
+    if target != this.position {
+      this.reset(target);
+    }
+    Ok(())
+  }
+
+  fn poll_complete(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<IoResult<u64>> {
+    Poll::Ready(Ok(self.position))
+  }
+}
+
+#[async_trait]
+impl AsyncMediaSource for ParallelHttpStream {
+  fn is_seekable(&self) -> bool {
+    true
+  }
+
+  async fn byte_len(&self) -> Option<u64> {
+    Some(self.length)
+  }
+
+  async fn try_resume(
+    &mut self,
+    offset: u64
+  ) -> Result<Box<dyn AsyncMediaSource>, AudioStreamError> {
+    Ok(Box::new(Self::new_at(self.request.clone(), self.length, self.options.clone(), offset)))
+  }
+}
@@ -6,11 +6,13 @@ use futures_util::TryStreamExt;
 use pin_project::pin_project;
 use reqwest::{
   header::{HeaderMap, ACCEPT_RANGES, CONTENT_LENGTH, CONTENT_TYPE, RANGE, RETRY_AFTER},
-  Client,
+  StatusCode,
 };
 use std::{
+  future::Future,
   io::{Error as IoError, ErrorKind as IoErrorKind, Result as IoResult, SeekFrom},
   pin::Pin,
+  sync::{atomic::AtomicU64, Arc, Mutex},
   task::{Context, Poll},
   time::Duration,
 };
@@ -22,6 +24,7 @@ use tokio::io::{AsyncRead, AsyncSeek, ReadBuf};
 use tokio_util::io::StreamReader;
 
 use crate::providers::async_adapter::{AsyncAdapterStream, AsyncMediaSource, AudioStreamError};
+use super::{MediaHttpClient, ParallelHttpStream, ParallelOptions};
 
 /// An unread byte stream for an audio file.
 pub struct AudioStream<T: Send> {
@@ -31,14 +34,16 @@ pub struct AudioStream<T: Send> {
   /// audio container's header.
   pub input: T,
   /// Extension and MIME type information which may help guide format selection.
-  pub hint: Option<Hint>
+  pub hint: Option<Hint>,
+  /// Counter of reads that had to wait for data, see [`AsyncAdapterStream::stalls`].
+  pub stalls: Option<Arc<AtomicU64>>
 }
 
 /// A lazily instantiated HTTP request.
 #[derive(Clone, Debug)]
 pub struct HttpRequest {
-  /// A reqwest client instance used to send the HTTP GET request.
-  pub client: Client,
+  /// The shared client used to send the HTTP GET request.
+  pub client: MediaHttpClient,
   /// The target URL of the required resource.
   pub request: String,
   /// HTTP header fields to add to any created requests.
@@ -48,36 +53,91 @@ pub struct HttpRequest {
   /// This is only needed for certain domains who expect to see a value like
   /// `range: bytes=0-1023` instead of the simpler `range: bytes=0-` (such as
   /// Youtube).
-  pub content_length: Option<u64>
+  pub content_length: Option<u64>,
+  /// Fetch ranges of the source in parallel if set, see [`HttpRequest::into_source`].
+  pub parallel: Option<ParallelOptions>
 }
 
 impl HttpRequest {
   #[must_use]
   /// Create a lazy HTTP request.
-  pub fn new(client: Client, request: String) -> Self {
+  pub fn new(client: MediaHttpClient, request: String) -> Self {
     Self::new_with_headers(client, request, HeaderMap::default())
   }
 
   #[must_use]
   /// Create a lazy HTTP request.
-  pub fn new_with_headers(client: Client, request: String, headers: HeaderMap) -> Self {
+  pub fn new_with_headers(client: MediaHttpClient, request: String, headers: HeaderMap) -> Self {
     HttpRequest {
       client,
       request,
       headers,
-      content_length: None
+      content_length: None,
+      parallel: None
     }
   }
 
+  #[must_use]
+  pub fn with_parallel(mut self, options: Option<ParallelOptions>) -> Self {
+    self.parallel = options;
+    self
+  }
+
+  /// Returns a source continuing `stream`, fetching it in parallel ranges if enabled
+  /// and the server reports the length and accepts ranges.
+  pub fn into_source(self, stream: HttpStream) -> Box<dyn AsyncMediaSource> {
+    let length = stream.content_length().filter(|_| stream.supports_ranges() && stream.position == 0);
+    match (self.parallel.clone(), length) {
+      (Some(options), Some(length)) if length >= options.min_length => {
+        // The response is dropped unread, every chunk is its own range request
+        Box::new(ParallelHttpStream::new(self, length, options))
+      },
+      _ => Box::new(stream)
+    }
+  }
+
+  /// Fetches `start..end` of the source into memory.
+  pub async fn fetch_range(&self, start: u64, end: u64) -> Result<Vec<u8>, AudioStreamError> {
+    // The body is read by the same request, so the permit covers it too
+    let _permit = self.client.acquire(&self.request).await.map_err(|e| AudioStreamError::Fail(e.into()))?;
+    let mut resp = self.client.client()
+      .get(&self.request)
+      .headers(self.headers.clone())
+      .header(RANGE, format!("bytes={}-{}", start, end - 1))
+      .send()
+      .await
+      .map_err(|e| AudioStreamError::Fail(Box::new(e)))?;
+
+    if resp.status() != StatusCode::PARTIAL_CONTENT {
+      let msg: Box<dyn std::error::Error + Send + Sync + 'static> =
+        format!("Range request was not honoured, status {}.", resp.status()).into();
+      return Err(AudioStreamError::Fail(msg));
+    }
+
+    let mut data = Vec::with_capacity((end - start) as usize);
+    while let Some(chunk) = resp.chunk().await.map_err(|e| AudioStreamError::Fail(Box::new(e)))? {
+      data.extend_from_slice(&chunk);
+    }
+
+    if data.len() as u64 != end - start {
+      let msg: Box<dyn std::error::Error + Send + Sync + 'static> =
+        format!("Range request returned {} bytes, expected {}.", data.len(), end - start).into();
+      return Err(AudioStreamError::Fail(msg));
+    }
+    Ok(data)
+  }
+
   pub async fn create_async(
     &mut self
   ) -> Result<AudioStream<Box<dyn MediaSource>>, AudioStreamError> {
     self.create_stream(None).await.map(|(input, hint)| {
-      let stream = AsyncAdapterStream::new(Box::new(input), 64 * 1024);
+      let stream = AsyncAdapterStream::new(self.clone().into_source(input), 64 * 1024);
+      let stalls = stream.stalls();
 
       AudioStream {
         input: Box::new(stream) as Box<dyn MediaSource>,
-        hint
+        hint,
+        stalls: Some(stalls)
       }
     })
   }
@@ -86,7 +146,7 @@ impl HttpRequest {
     &mut self,
     offset: Option<u64>
   ) -> Result<(HttpStream, Option<Hint>), AudioStreamError> {
-    let mut resp = self.client.get(&self.request).headers(self.headers.clone());
+    let mut resp = self.client.client().get(&self.request).headers(self.headers.clone());
 
     match (offset, self.content_length) {
       (Some(offset), None) => {
@@ -101,10 +161,18 @@ impl HttpRequest {
       _ => {}
     }
 
+    let permit = self.client.acquire(&self.request).await.map_err(|e| AudioStreamError::Fail(e.into()))?;
     let resp = resp
       .send()
       .await
       .map_err(|e| AudioStreamError::Fail(Box::new(e)))?;
+    drop(permit);
+
+    if offset.unwrap_or(0) > 0 && resp.status() != StatusCode::PARTIAL_CONTENT {
+      let msg: Box<dyn std::error::Error + Send + Sync + 'static> =
+        format!("Range request was not honoured, status {}.", resp.status()).into();
+      return Err(AudioStreamError::Fail(msg));
+    }
 
     if let Some(t) = resp.headers().get(RETRY_AFTER) {
       t.to_str()
@@ -124,14 +192,16 @@ impl HttpRequest {
     } else {
       let headers = resp.headers();
 
-      let hint = headers
+      let mime_type = headers
         .get(CONTENT_TYPE)
         .and_then(|val| val.to_str().ok())
-        .map(|val| {
-          let mut out = Hint::default();
-          out.mime_type(val);
-          out
-        });
+        .map(|val| val.to_owned());
+
+      let hint = mime_type.as_deref().map(|val| {
+        let mut out = Hint::default();
+        out.mime_type(val);
+        out
+      });
 
       let len = headers
         .get(CONTENT_LENGTH)
@@ -157,7 +227,10 @@ impl HttpRequest {
       let input = HttpStream {
         stream,
         len,
-        resume
+        resume,
+        mime_type,
+        position: offset.unwrap_or(0),
+        seek: Mutex::new(None)
       };
 
       Ok((input, hint))
@@ -165,12 +238,44 @@ impl HttpRequest {
   }
 }
 
+type PendingSeek = Pin<Box<dyn Future<Output = Result<(HttpStream, Option<Hint>), AudioStreamError>> + Send>>;
+
 #[pin_project]
 pub struct HttpStream {
   #[pin]
   stream: Box<dyn AsyncRead + Send + Sync + Unpin>,
   len: Option<u64>,
-  resume: Option<HttpRequest>
+  resume: Option<HttpRequest>,
+  mime_type: Option<String>,
+  /// Offset of the next byte read from `stream`.
+  position: u64,
+  /// Ranged request started by [`AsyncSeek::start_seek`] and its target offset.
+  /// Only ever accessed through `&mut self`, the [`Mutex`] just makes the future [`Sync`].
+  seek: Mutex<Option<(u64, PendingSeek)>>
+}
+
+impl HttpStream {
+  /// Returns length of the response body, only the remaining part for range requests.
+  pub fn content_length(&self) -> Option<u64> {
+    self.len
+  }
+
+  /// Returns `true` if the server accepts byte range requests.
+  pub fn supports_ranges(&self) -> bool {
+    self.resume.is_some()
+  }
+
+  pub fn mime_type(&self) -> Option<&str> {
+    self.mime_type.as_deref()
+  }
+}
+
+pub(super) fn stream_error(error: AudioStreamError) -> IoError {
+  match error {
+    AudioStreamError::Fail(error) => IoError::new(IoErrorKind::Other, error),
+    AudioStreamError::RetryIn(after) => IoError::new(IoErrorKind::Other, format!("retry seek in {after:?}")),
+    AudioStreamError::Unsupported => IoErrorKind::Unsupported.into()
+  }
 }
 
 impl AsyncRead for HttpStream {
@@ -179,24 +284,64 @@ impl AsyncRead for HttpStream {
     cx: &mut Context<'_>,
     buf: &mut ReadBuf<'_>
   ) -> Poll<IoResult<()>> {
-    AsyncRead::poll_read(self.project().stream, cx, buf)
+    let this = self.project();
+    let before = buf.filled().len();
+    let result = AsyncRead::poll_read(this.stream, cx, buf);
+    if let Poll::Ready(Ok(())) = result {
+      *this.position += (buf.filled().len() - before) as u64;
+    }
+    result
   }
 }
 
 impl AsyncSeek for HttpStream {
-  fn start_seek(self: Pin<&mut Self>, _position: SeekFrom) -> IoResult<()> {
-    Err(IoErrorKind::Unsupported.into())
+  /// Seeks by reconnecting with a `Range` request starting at the target offset.
+  fn start_seek(self: Pin<&mut Self>, position: SeekFrom) -> IoResult<()> {
+    let this = self.get_mut();
+    let mut request = this.resume.clone().ok_or(IoError::from(IoErrorKind::Unsupported))?;
+
+    let target = match position {
+      SeekFrom::Start(offset) => Some(offset),
+      SeekFrom::Current(delta) => this.position.checked_add_signed(delta),
+      SeekFrom::End(delta) => this.len.and_then(|len| len.checked_add_signed(delta))
+    }.ok_or(IoError::new(IoErrorKind::InvalidInput, "invalid seek position"))?;
+
+    let seek = this.seek.get_mut().unwrap();
+    if target == this.position {
+      *seek = None;
+      return Ok(());
+    }
+
+    *seek = Some((target, Box::pin(async move { request.create_stream(Some(target)).await })));
+    Ok(())
   }
 
-  fn poll_complete(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<IoResult<u64>> {
-    unreachable!()
+  fn poll_complete(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<IoResult<u64>> {
+    let this = self.get_mut();
+    let Some((target, pending)) = this.seek.get_mut().unwrap().as_mut() else {
+      return Poll::Ready(Ok(this.position));
+    };
+
+    let result = match pending.as_mut().poll(cx) {
+      Poll::Ready(result) => result,
+      Poll::Pending => return Poll::Pending
+    };
+    let target = *target;
+    *this.seek.get_mut().unwrap() = None;
+
+    // Keep the original length, the ranged response only reports the remaining part
+    let (stream, _) = result.map_err(stream_error)?;
+    this.stream = stream.stream;
+    this.position = target;
+    Poll::Ready(Ok(target))
   }
 }
 
 #[async_trait]
 impl AsyncMediaSource for HttpStream {
+  /// Seekable if the server accepts byte range requests.
   fn is_seekable(&self) -> bool {
-    false
+    self.resume.is_some()
   }
 
   async fn byte_len(&self) -> Option<u64> {
@@ -207,7 +352,7 @@ impl AsyncMediaSource for HttpStream {
     &mut self,
     offset: u64
   ) -> Result<Box<dyn AsyncMediaSource>, AudioStreamError> {
-    if let Some(resume) = &mut self.resume {
+    if let Some(mut resume) = self.resume.clone() {
       resume
         .create_stream(Some(offset))
         .await
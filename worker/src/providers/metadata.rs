@@ -1,11 +1,176 @@
-use std::time::Duration;
+use std::{
+  collections::{BTreeMap, HashMap},
+  env,
+  sync::{Arc, Mutex, OnceLock},
+  time::Duration
+};
 
-#[derive(Debug)]
+use crate::voice::loudness::Loudness;
+use super::cache::CacheKey;
+
+/// Default number of sources [`MetadataCache`] keeps metadata of.
+pub const DEFAULT_METADATA_CACHE_SIZE: usize = 4096;
+
+#[derive(Debug, Clone)]
 pub enum MediaMetadata {
   Id(String),
   Title(String),
   Thumbnail(String),
   Description(String),
   Duration(Duration),
-  ViewCount(u64)
+  ViewCount(u64),
+  Loudness(Loudness)
+}
+
+struct MetadataEntry {
+  /// Metadata read by the probe, `None` if only the loudness is known.
+  metadata: Option<Arc<[MediaMetadata]>>,
+  loudness: Option<Loudness>,
+  last_used: u64
+}
+
+#[derive(Default)]
+struct MetadataIndex {
+  entries: HashMap<CacheKey, MetadataEntry>,
+  /// Keys by last use, oldest first.
+  order: BTreeMap<u64, CacheKey>,
+  tick: u64
+}
+
+impl MetadataIndex {
+  /// Marks the entry of `key` as used and returns it.
+  fn touch(&mut self, key: CacheKey) -> Option<&mut MetadataEntry> {
+    self.tick += 1;
+    let tick = self.tick;
+
+    let entry = self.entries.get_mut(&key)?;
+    let previous = std::mem::replace(&mut entry.last_used, tick);
+    self.order.remove(&previous);
+    self.order.insert(tick, key);
+    Some(entry)
+  }
+
+  /// Updates the entry of `key`, creating it and evicting the least recently used ones if needed.
+  fn update(&mut self, key: CacheKey, capacity: usize, update: impl FnOnce(&mut MetadataEntry)) {
+    if let Some(entry) = self.touch(key) {
+      update(entry);
+      return;
+    }
+
+    let mut entry = MetadataEntry {
+      metadata: None,
+      loudness: None,
+      last_used: self.tick
+    };
+    update(&mut entry);
+    self.entries.insert(key, entry);
+    self.order.insert(self.tick, key);
+
+    while self.entries.len() > capacity {
+      let Some((_, victim)) = self.order.pop_first() else {
+        break;
+      };
+      self.entries.remove(&victim);
+    }
+  }
+}
+
+/// Bounded LRU of metadata read while probing sources and loudness measured while playing them,
+/// so replies and queue listings never probe again.
+pub struct MetadataCache {
+  capacity: usize,
+  index: Mutex<MetadataIndex>
+}
+
+impl MetadataCache {
+  pub fn new(capacity: usize) -> Self {
+    Self {
+      capacity: capacity.max(1),
+      index: Default::default()
+    }
+  }
+
+  /// Returns the shared cache, sized by `MOSAIK_METADATA_CACHE_SIZE`.
+  pub fn global() -> &'static MetadataCache {
+    static CACHE: OnceLock<MetadataCache> = OnceLock::new();
+    CACHE.get_or_init(|| {
+      let capacity = env::var("MOSAIK_METADATA_CACHE_SIZE")
+        .ok()
+        .and_then(|it| it.parse().ok())
+        .unwrap_or(DEFAULT_METADATA_CACHE_SIZE);
+      MetadataCache::new(capacity)
+    })
+  }
+
+  pub fn get(&self, key: CacheKey) -> Option<Arc<[MediaMetadata]>> {
+    self.index.lock().unwrap().touch(key)?.metadata.clone()
+  }
+
+  pub fn insert(&self, key: CacheKey, metadata: Vec<MediaMetadata>) {
+    self.index.lock().unwrap().update(key, self.capacity, |entry| entry.metadata = Some(metadata.into()));
+  }
+
+  /// Returns loudness measured by a [`LoudnessNormalizer`](crate::voice::loudness::LoudnessNormalizer).
+  pub fn loudness(&self, key: CacheKey) -> Option<Loudness> {
+    self.index.lock().unwrap().touch(key)?.loudness
+  }
+
+  pub fn set_loudness(&self, key: CacheKey, loudness: Loudness) {
+    self.index.lock().unwrap().update(key, self.capacity, |entry| entry.loudness = Some(loudness));
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  fn key(index: usize) -> CacheKey {
+    CacheKey::from_url(&format!("https://example.com/{}", index))
+  }
+
+  fn title(cache: &MetadataCache, key: CacheKey) -> Option<String> {
+    cache.get(key)?.iter().find_map(|it| match it {
+      MediaMetadata::Title(title) => Some(title.clone()),
+      _ => None
+    })
+  }
+
+  #[test]
+  fn evicts_least_recently_used() {
+    let cache = MetadataCache::new(2);
+    cache.insert(key(0), vec![MediaMetadata::Title("0".to_owned())]);
+    cache.insert(key(1), vec![MediaMetadata::Title("1".to_owned())]);
+    assert!(cache.get(key(0)).is_some());
+
+    cache.insert(key(2), vec![MediaMetadata::Title("2".to_owned())]);
+    assert_eq!(title(&cache, key(0)).as_deref(), Some("0"));
+    assert!(cache.get(key(1)).is_none());
+    assert_eq!(title(&cache, key(2)).as_deref(), Some("2"));
+  }
+
+  #[test]
+  fn insert_replaces_metadata() {
+    let cache = MetadataCache::new(2);
+    cache.insert(key(0), vec![MediaMetadata::Title("old".to_owned())]);
+    cache.insert(key(0), vec![MediaMetadata::Title("new".to_owned())]);
+    cache.insert(key(1), Vec::new());
+
+    assert_eq!(title(&cache, key(0)).as_deref(), Some("new"));
+    assert!(cache.get(key(1)).is_some());
+  }
+
+  #[test]
+  fn loudness_shares_the_entry() {
+    let cache = MetadataCache::new(1);
+    let loudness = Loudness { integrated: -20.0, peak: 0.5 };
+    cache.set_loudness(key(0), loudness);
+    assert!(cache.get(key(0)).is_none());
+
+    cache.insert(key(0), Vec::new());
+    assert_eq!(cache.loudness(key(0)), Some(loudness));
+
+    cache.set_loudness(key(1), loudness);
+    assert!(cache.get(key(0)).is_none());
+    assert_eq!(cache.loudness(key(0)), None);
+  }
 }
@@ -2,19 +2,30 @@ mod metadata;
 mod file;
 mod http;
 pub mod async_adapter;
+pub mod cache;
 
 pub use metadata::*;
 pub use file::*;
 pub use http::*;
 
-use std::fmt::Debug;
-use anyhow::Result;
+use std::{fmt::Debug, path::Path, sync::Arc};
+use anyhow::{Result, Context, anyhow};
 use async_trait::async_trait;
 
-use voice::provider::SampleProvider;
+use voice::provider::AudioSource;
 
 #[async_trait]
 pub trait MediaProvider: Sync + Send + Debug {
-  async fn get_sample_provider(&self) -> Result<Box<dyn SampleProvider>>;
+  async fn get_audio_source(&self) -> Result<AudioSource>;
   async fn get_metadata(&self) -> Result<Vec<MediaMetadata>>;
 }
+
+/// Creates a provider from a `provider:input` source string, e.g. `file:/music/track.flac`.
+pub fn from_source(client: &MediaHttpClient, source: &str) -> Result<Arc<dyn MediaProvider>> {
+  let (provider, input) = source.split_once(':').context("invalid source")?;
+  Ok(match provider {
+    "file" => Arc::new(FileMediaProvider::new(Path::new(input))),
+    "http_seek" => Arc::new(SeekableHttpMediaProvider::new(client.clone(), input.to_owned())),
+    _ => return Err(anyhow!("media provider {} is not implemented", provider))
+  })
+}
@@ -0,0 +1,171 @@
+use std::{sync::Arc, time::Duration};
+use anyhow::{Result, Context, anyhow};
+use futures_util::StreamExt;
+use twilight_gateway::{Event, EventType};
+use twilight_model::{id::{Id, marker::{GuildMarker, ChannelMarker}}, gateway::payload::outgoing::UpdateVoiceState};
+use tracing::debug;
+use voice::provider::SeekMode;
+
+use utils::sharded_map::ShardedMap;
+
+use crate::{
+  State,
+  cluster::{control::Control, rpc::{PlayResult, Request, Response, VoiceSession}},
+  player::actor::PlayerHandle,
+  providers::{self, MediaHttpClient}
+};
+
+/// Players of this process, driven by the commands of a standalone bot or by the control plane on a worker node.
+#[derive(Clone)]
+pub struct LocalSessions {
+  players: Arc<ShardedMap<Id<GuildMarker>, PlayerHandle>>,
+  media_http: MediaHttpClient
+}
+
+impl LocalSessions {
+  pub fn new(media_http: MediaHttpClient) -> Self {
+    Self {
+      players: Default::default(),
+      media_http
+    }
+  }
+
+  pub fn is_connected(&self, guild_id: Id<GuildMarker>) -> bool {
+    self.players.contains_key(&guild_id)
+  }
+
+  pub async fn connect(&self, guild_id: Id<GuildMarker>, session: VoiceSession) -> Result<()> {
+    let player = self.players.get_or_insert_with(guild_id, || PlayerHandle::spawn(guild_id));
+    if let Err(error) = player.connect(session).await {
+      self.players.remove(&guild_id);
+      return Err(error);
+    }
+    Ok(())
+  }
+
+  /// Queues `source` in the player of `guild_id`, playing it right away if nothing is playing.
+  pub async fn play(&self, guild_id: Id<GuildMarker>, source: &str) -> Result<PlayResult> {
+    let provider = providers::from_source(&self.media_http, source)?;
+    let player = self.players.get(&guild_id).context("player is not connected")?;
+    let queued = player.enqueue(provider.clone()).await?;
+
+    let metadata = provider.get_metadata().await?;
+    Ok(PlayResult {
+      queued,
+      provider: format!("{:?}", provider),
+      metadata: metadata.iter().map(|it| format!("{:?}", it)).collect()
+    })
+  }
+
+  /// Returns `false` if the guild has no player.
+  pub async fn seek(&self, guild_id: Id<GuildMarker>, position: Duration, mode: SeekMode) -> Result<bool> {
+    match self.players.get(&guild_id) {
+      Some(player) => {
+        player.seek(position, mode).await?;
+        Ok(true)
+      },
+      None => Ok(false)
+    }
+  }
+
+  /// Returns guilds that have a player.
+  pub fn guilds(&self) -> Vec<Id<GuildMarker>> {
+    self.players.keys()
+  }
+
+  /// Returns number of players currently playing.
+  pub fn streams(&self) -> usize {
+    self.players.values().iter().filter(|it| it.is_playing()).count()
+  }
+}
+
+/// Where voice sessions of this process run.
+pub enum VoiceSessions {
+  Local(LocalSessions),
+  /// On worker nodes of the cluster, see [`crate::cluster`].
+  Remote(Arc<Control>)
+}
+
+impl VoiceSessions {
+  /// Queues `source` in `guild_id`, joining `channel_id` first if the guild has no voice session yet.
+  pub async fn play(&self, state: &State, guild_id: Id<GuildMarker>, channel_id: Id<ChannelMarker>, source: String) -> Result<PlayResult> {
+    match self {
+      VoiceSessions::Local(local) => {
+        if !local.is_connected(guild_id) {
+          local.connect(guild_id, voice_session(state, guild_id, channel_id).await?).await?;
+        }
+        local.play(guild_id, &source).await
+      },
+      VoiceSessions::Remote(control) => {
+        let node = control.connect(guild_id, voice_session(state, guild_id, channel_id)).await?;
+
+        match control.call(node, Request::Play { guild_id: guild_id.get(), source }).await? {
+          Response::Played(result) => Ok(result),
+          other => Err(anyhow!("unexpected response {:?}", other))
+        }
+      }
+    }
+  }
+
+  /// Returns `false` if the guild has no voice session.
+  pub async fn seek(&self, guild_id: Id<GuildMarker>, position: Duration, mode: SeekMode) -> Result<bool> {
+    match self {
+      VoiceSessions::Local(local) => local.seek(guild_id, position, mode).await,
+      VoiceSessions::Remote(control) => {
+        let Some(node) = control.placement(guild_id) else {
+          return Ok(false);
+        };
+        let request = Request::Seek {
+          guild_id: guild_id.get(),
+          position_ms: u64::try_from(position.as_millis())?,
+          accurate: mode == SeekMode::Accurate
+        };
+        match control.call(node, request).await? {
+          Response::Seeked(seeked) => Ok(seeked),
+          other => Err(anyhow!("unexpected response {:?}", other))
+        }
+      }
+    }
+  }
+}
+
+/// Joins `channel_id` through the gateway shard of `guild_id` and waits for the voice server to be assigned.
+pub async fn voice_session(state: &State, guild_id: Id<GuildMarker>, channel_id: Id<ChannelMarker>) -> Result<VoiceSession> {
+  state.shard_sender(guild_id)?.command(&UpdateVoiceState::new(guild_id, channel_id, true, false))?;
+
+  let mut voice_state = None;
+  let mut voice_server = None;
+
+  let mut stream = state.standby.wait_for_stream(guild_id, |event: &Event| match event.kind() {
+    EventType::VoiceStateUpdate => true,
+    EventType::VoiceServerUpdate => true,
+    _ => false
+  });
+
+  while let Some(event) = stream.next().await {
+    match event {
+      Event::VoiceStateUpdate(vs) => voice_state = Some(vs),
+      Event::VoiceServerUpdate(vs) => voice_server = Some(vs),
+      _ => {}
+    }
+
+    if voice_state.is_some() && voice_server.is_some() {
+      break;
+    }
+  };
+  let voice_state = voice_state.context("no voice state")?;
+  let voice_server = voice_server.context("no voice server")?;
+  debug!(?voice_state, ?voice_server, "got connection info");
+
+  let user = state.cache.current_user().context("no current user")?;
+  let channel = state.cache.channel(channel_id).context("no channel cached")?;
+
+  Ok(VoiceSession {
+    user_id: user.id.get(),
+    channel_id: channel_id.get(),
+    bitrate: channel.bitrate,
+    endpoint: voice_server.endpoint.context("no voice endpoint")?.to_owned(),
+    token: voice_server.token.to_owned(),
+    session_id: voice_state.session_id.to_owned()
+  })
+}
@@ -0,0 +1,90 @@
+use std::f32::consts::FRAC_1_SQRT_2;
+use symphonia::core::audio::Channels;
+
+/// Left and right gains of a source channel when downmixing to stereo.
+fn stereo_gains(channel: Channels) -> (f32, f32) {
+  match channel {
+    Channels::FRONT_LEFT | Channels::FRONT_LEFT_CENTRE | Channels::FRONT_LEFT_WIDE | Channels::FRONT_LEFT_HIGH | Channels::TOP_FRONT_LEFT => (1.0, 0.0),
+    Channels::FRONT_RIGHT | Channels::FRONT_RIGHT_CENTRE | Channels::FRONT_RIGHT_WIDE | Channels::FRONT_RIGHT_HIGH | Channels::TOP_FRONT_RIGHT => (0.0, 1.0),
+    Channels::SIDE_LEFT | Channels::REAR_LEFT | Channels::REAR_LEFT_CENTRE | Channels::TOP_REAR_LEFT => (FRAC_1_SQRT_2, 0.0),
+    Channels::SIDE_RIGHT | Channels::REAR_RIGHT | Channels::REAR_RIGHT_CENTRE | Channels::TOP_REAR_RIGHT => (0.0, FRAC_1_SQRT_2),
+    // Low frequency effects are left out of stereo downmixes
+    Channels::LFE1 | Channels::LFE2 => (0.0, 0.0),
+    // Centre channels and anything not known to be on one side are split equally
+    _ => (FRAC_1_SQRT_2, FRAC_1_SQRT_2)
+  }
+}
+
+enum Layout {
+  Mono,
+  Stereo,
+  /// Left and right gains per source channel, in planar order.
+  Downmix(Vec<(f32, f32)>)
+}
+
+/// Maps decoded channels to stereo before any further processing,
+/// so later stages always work on exactly 2 channels.
+pub struct ChannelMapper {
+  layout: Layout,
+  left: Vec<f32>,
+  right: Vec<f32>
+}
+
+impl ChannelMapper {
+  pub fn new(channels: Channels) -> Self {
+    let layout = match channels.count() {
+      1 => Layout::Mono,
+      2 => Layout::Stereo,
+      _ => {
+        let mut gains = channels.iter().map(stereo_gains).collect::<Vec<_>>();
+
+        // Keep the loudest possible sum at full scale instead of clipping
+        let left = gains.iter().map(|it| it.0).sum::<f32>().max(1.0);
+        let right = gains.iter().map(|it| it.1).sum::<f32>().max(1.0);
+        for gain in &mut gains {
+          gain.0 /= left;
+          gain.1 /= right;
+        }
+        Layout::Downmix(gains)
+      }
+    };
+
+    Self {
+      layout,
+      left: Vec::new(),
+      right: Vec::new()
+    }
+  }
+
+  /// Returns left and right channels of `frames` frames of `planar`.
+  ///
+  /// Stereo is passed through and mono is duplicated without copying.
+  pub fn map<'a>(&'a mut self, planar: &[&'a [f32]], frames: usize) -> [&'a [f32]; 2] {
+    match &self.layout {
+      Layout::Mono => [&planar[0][..frames], &planar[0][..frames]],
+      Layout::Stereo => [&planar[0][..frames], &planar[1][..frames]],
+      Layout::Downmix(gains) => {
+        self.left.clear();
+        self.left.resize(frames, 0.0);
+        self.right.clear();
+        self.right.resize(frames, 0.0);
+
+        for (samples, &(left_gain, right_gain)) in planar.iter().zip(gains) {
+          let samples = &samples[..frames];
+          if left_gain != 0.0 {
+            for (out, sample) in self.left.iter_mut().zip(samples) {
+              *out += sample * left_gain;
+            }
+          }
+          if right_gain != 0.0 {
+            for (out, sample) in self.right.iter_mut().zip(samples) {
+              *out += sample * right_gain;
+            }
+          }
+        }
+
+        [&self.left, &self.right]
+      }
+    }
+  }
+}
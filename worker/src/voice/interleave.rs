@@ -0,0 +1,191 @@
+use std::ops::Deref;
+
+/// Maximum number of channels with a specialized kernel, also the inline capacity of [`Planes`].
+pub const MAX_CHANNELS: usize = 8;
+
+/// Channel slices returned by [`split_planar`], stored inline for up to [`MAX_CHANNELS`] channels.
+pub enum Planes<'a> {
+  Inline([&'a [f32]; MAX_CHANNELS], usize),
+  Heap(Vec<&'a [f32]>)
+}
+
+impl<'a> Deref for Planes<'a> {
+  type Target = [&'a [f32]];
+
+  fn deref(&self) -> &Self::Target {
+    match self {
+      Planes::Inline(planes, channels) => &planes[..*channels],
+      Planes::Heap(planes) => planes
+    }
+  }
+}
+
+/// Splits planar samples into one slice per channel, allocating only for more than [`MAX_CHANNELS`] channels.
+pub fn split_planar(input: &[f32], channels: usize) -> Planes<'_> {
+  assert!(channels > 0, "no channels");
+
+  let frames = input.len() / channels;
+  let plane = |channel: usize| &input[channel * frames..(channel + 1) * frames];
+  if channels <= MAX_CHANNELS {
+    let mut planes: [&[f32]; MAX_CHANNELS] = [&[]; MAX_CHANNELS];
+    for (channel, slice) in planes.iter_mut().take(channels).enumerate() {
+      *slice = plane(channel);
+    }
+    Planes::Inline(planes, channels)
+  } else {
+    // Layouts such as 7.1.4, rare enough to not have a kernel either
+    Planes::Heap((0..channels).map(plane).collect())
+  }
+}
+
+/// Interleaves `frames` frames of `planar`, starting at frame `start`, into `out`.
+///
+/// Returns number of samples written.
+pub fn interleave<V: AsRef<[f32]>>(planar: &[V], start: usize, frames: usize, out: &mut [f32]) -> usize {
+  let channels = planar.len();
+  let out = &mut out[..frames * channels];
+
+  match channels {
+    1 => out.copy_from_slice(&planar[0].as_ref()[start..start + frames]),
+    2 => interleave_stereo(&planar[0].as_ref()[start..start + frames], &planar[1].as_ref()[start..start + frames], out),
+    3 => interleave_n::<3, V>(planar, start, frames, out),
+    4 => interleave_n::<4, V>(planar, start, frames, out),
+    5 => interleave_n::<5, V>(planar, start, frames, out),
+    6 => interleave_n::<6, V>(planar, start, frames, out),
+    7 => interleave_n::<7, V>(planar, start, frames, out),
+    8 => interleave_n::<8, V>(planar, start, frames, out),
+    _ => {
+      for (frame, samples) in out.chunks_exact_mut(channels).enumerate() {
+        for (channel, sample) in samples.iter_mut().enumerate() {
+          *sample = planar[channel].as_ref()[start + frame];
+        }
+      }
+    }
+  }
+
+  frames * channels
+}
+
+fn interleave_n<const N: usize, V: AsRef<[f32]>>(planar: &[V], start: usize, frames: usize, out: &mut [f32]) {
+  let planes: [&[f32]; N] = std::array::from_fn(|channel| &planar[channel].as_ref()[start..start + frames]);
+  for (frame, samples) in out.chunks_exact_mut(N).enumerate() {
+    for channel in 0..N {
+      samples[channel] = planes[channel][frame];
+    }
+  }
+}
+
+fn interleave_stereo(left: &[f32], right: &[f32], out: &mut [f32]) {
+  let frames = left.len();
+  assert!(right.len() == frames && out.len() == frames * 2);
+
+  let vectorized = interleave_stereo_simd(left, right, out);
+  for frame in vectorized..frames {
+    out[frame * 2] = left[frame];
+    out[frame * 2 + 1] = right[frame];
+  }
+}
+
+/// Returns number of frames interleaved, the scalar tail is left to the caller.
+#[cfg(target_arch = "x86_64")]
+fn interleave_stereo_simd(left: &[f32], right: &[f32], out: &mut [f32]) -> usize {
+  use std::arch::x86_64::{_mm_loadu_ps, _mm_storeu_ps, _mm_unpackhi_ps, _mm_unpacklo_ps};
+
+  let frames = left.len() / 4 * 4;
+  // SSE2 is part of the x86_64 baseline, bounds are checked by the caller
+  unsafe {
+    for frame in (0..frames).step_by(4) {
+      let l = _mm_loadu_ps(left.as_ptr().add(frame));
+      let r = _mm_loadu_ps(right.as_ptr().add(frame));
+      _mm_storeu_ps(out.as_mut_ptr().add(frame * 2), _mm_unpacklo_ps(l, r));
+      _mm_storeu_ps(out.as_mut_ptr().add(frame * 2 + 4), _mm_unpackhi_ps(l, r));
+    }
+  }
+  frames
+}
+
+#[cfg(target_arch = "aarch64")]
+fn interleave_stereo_simd(left: &[f32], right: &[f32], out: &mut [f32]) -> usize {
+  use std::arch::aarch64::{float32x4x2_t, vld1q_f32, vst2q_f32};
+
+  let frames = left.len() / 4 * 4;
+  // NEON is part of the aarch64 baseline, bounds are checked by the caller
+  unsafe {
+    for frame in (0..frames).step_by(4) {
+      let samples = float32x4x2_t(vld1q_f32(left.as_ptr().add(frame)), vld1q_f32(right.as_ptr().add(frame)));
+      vst2q_f32(out.as_mut_ptr().add(frame * 2), samples);
+    }
+  }
+  frames
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+fn interleave_stereo_simd(_left: &[f32], _right: &[f32], _out: &mut [f32]) -> usize {
+  0
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  /// Planes with a distinct value for every sample.
+  fn planes(channels: usize, frames: usize) -> Vec<Vec<f32>> {
+    (0..channels).map(|channel| (0..frames).map(|frame| (channel * 10_000 + frame) as f32).collect()).collect()
+  }
+
+  fn reference(planar: &[Vec<f32>], start: usize, frames: usize) -> Vec<f32> {
+    (start..start + frames).flat_map(|frame| planar.iter().map(move |plane| plane[frame])).collect()
+  }
+
+  #[test]
+  fn stereo_simd_matches_scalar_tail() {
+    // Odd counts leave a scalar tail after the vectorized part
+    for frames in (0..=17).chain([1023]) {
+      let planar = planes(2, frames);
+      let mut out = vec![f32::NAN; frames * 2];
+      interleave_stereo(&planar[0], &planar[1], &mut out);
+      assert_eq!(out, reference(&planar, 0, frames), "{} frames", frames);
+
+      let mut out = vec![f32::NAN; frames * 2];
+      let vectorized = interleave_stereo_simd(&planar[0], &planar[1], &mut out);
+      assert!(vectorized <= frames && frames - vectorized < 4);
+      assert_eq!(out[..vectorized * 2], reference(&planar, 0, vectorized)[..]);
+    }
+  }
+
+  #[test]
+  fn every_channel_count_matches_reference() {
+    // 9 and 10 channels take the generic path
+    for channels in 1..=10 {
+      for (start, frames) in [(0, 1), (3, 7), (5, 960), (1, 1023)] {
+        let planar = planes(channels, start + frames + 2);
+        let mut out = vec![f32::NAN; frames * channels + 3];
+        assert_eq!(interleave(&planar, start, frames, &mut out), frames * channels);
+        assert_eq!(out[..frames * channels], reference(&planar, start, frames)[..], "{} channels, {} frames", channels, frames);
+        assert!(out[frames * channels..].iter().all(|it| it.is_nan()));
+      }
+    }
+  }
+
+  #[test]
+  fn planar_input_is_split_per_channel() {
+    let input = (0..12).map(|it| it as f32).collect::<Vec<_>>();
+    let planes = split_planar(&input, 3);
+    assert!(matches!(planes, Planes::Inline(..)));
+    assert_eq!(planes[..], [&input[0..4], &input[4..8], &input[8..12]]);
+  }
+
+  #[test]
+  fn many_channels_are_split_on_the_heap() {
+    let input = (0..24).map(|it| it as f32).collect::<Vec<_>>();
+    let planes = split_planar(&input, 12);
+    assert!(matches!(planes, Planes::Heap(_)));
+    assert_eq!(planes.len(), 12);
+    assert!(planes.iter().enumerate().all(|(channel, plane)| *plane == &input[channel * 2..channel * 2 + 2]));
+
+    let planar = planes.iter().map(|it| it.to_vec()).collect::<Vec<_>>();
+    let mut out = vec![0.0; 24];
+    assert_eq!(interleave(&planes, 0, 2, &mut out), 24);
+    assert_eq!(out, reference(&planar, 0, 2));
+  }
+}
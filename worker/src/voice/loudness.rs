@@ -0,0 +1,308 @@
+use std::{env, sync::OnceLock, task::Waker, time::Duration};
+use anyhow::Result;
+use tracing::debug;
+
+use voice::{
+  constants::{CHANNEL_COUNT, SAMPLE_RATE},
+  dsp::{peak, scale},
+  provider::{SampleProvider, SeekMode}
+};
+use crate::providers::{cache::CacheKey, MetadataCache};
+
+/// Loudness tracks are normalized to, in LUFS.
+pub const DEFAULT_LOUDNESS_TARGET: f32 = -14.0;
+/// Quiet tracks are raised by at most this many dB, below that they are mostly noise floor.
+const MAX_BOOST: f32 = 10.0;
+
+/// Frames in one 100 ms gating step, 4 consecutive steps make up a 400 ms block.
+const STEP_FRAMES: usize = SAMPLE_RATE / 10;
+const BLOCK_STEPS: usize = 4;
+const ABSOLUTE_GATE: f64 = -70.0;
+const RELATIVE_GATE: f64 = 10.0;
+
+/// Returns the target set by `MOSAIK_LOUDNESS_TARGET`, [`DEFAULT_LOUDNESS_TARGET`] by default.
+pub fn loudness_target() -> f32 {
+  static TARGET: OnceLock<f32> = OnceLock::new();
+  *TARGET.get_or_init(|| {
+    env::var("MOSAIK_LOUDNESS_TARGET")
+      .ok()
+      .and_then(|it| it.parse().ok())
+      .unwrap_or(DEFAULT_LOUDNESS_TARGET)
+  })
+}
+
+/// Measured loudness of a track.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Loudness {
+  /// Integrated loudness as defined by EBU R128, in LUFS.
+  pub integrated: f32,
+  /// Sample peak, linear.
+  pub peak: f32
+}
+
+impl Loudness {
+  /// Returns the linear gain bringing the track to `target`, boosts are limited so the peak does not clip.
+  pub fn gain(&self, target: f32) -> f32 {
+    let gain = 10f32.powf((target - self.integrated).min(MAX_BOOST) / 20.0);
+    if gain > 1.0 && self.peak > 0.0 {
+      gain.min((1.0 / self.peak).max(1.0))
+    } else {
+      gain
+    }
+  }
+}
+
+/// Biquad in transposed direct form II, `a` excludes the leading `1`.
+#[derive(Debug, Clone, Copy)]
+struct Biquad {
+  b: [f64; 3],
+  a: [f64; 2],
+  state: [f64; 2]
+}
+
+impl Biquad {
+  const fn new(b: [f64; 3], a: [f64; 2]) -> Self {
+    Self {
+      b,
+      a,
+      state: [0.0; 2]
+    }
+  }
+
+  fn process(&mut self, input: f64) -> f64 {
+    let output = self.b[0] * input + self.state[0];
+    self.state[0] = self.b[1] * input - self.a[0] * output + self.state[1];
+    self.state[1] = self.b[2] * input - self.a[1] * output;
+    output
+  }
+}
+
+/// K-weighting filter of ITU-R BS.1770 at 48 kHz: a high shelf modeling the head, followed by a high-pass.
+const K_WEIGHTING: [Biquad; 2] = [
+  Biquad::new([1.53512485958697, -2.69169618940638, 1.19839281085285], [-1.69065929318241, 0.73248077421585]),
+  Biquad::new([1.0, -2.0, 1.0], [-1.99004745483398, 0.99007225036621])
+];
+
+fn power_to_lufs(power: f64) -> f64 {
+  -0.691 + 10.0 * power.log10()
+}
+
+fn mean(values: &[f64]) -> f64 {
+  values.iter().sum::<f64>() / values.len() as f64
+}
+
+/// Integrated loudness meter for interleaved stereo at 48 kHz, see ITU-R BS.1770.
+pub struct LoudnessMeter {
+  filters: [[Biquad; 2]; CHANNEL_COUNT],
+  /// Sum of squared K-weighted samples of all channels in the current step.
+  sum: f64,
+  frames: usize,
+  /// Mean square of every completed step.
+  steps: Vec<f64>,
+  peak: f32
+}
+
+impl LoudnessMeter {
+  pub fn new() -> Self {
+    Self {
+      filters: [K_WEIGHTING; CHANNEL_COUNT],
+      sum: 0.0,
+      frames: 0,
+      steps: Vec::new(),
+      peak: 0.0
+    }
+  }
+
+  pub fn push(&mut self, samples: &[f32]) {
+    self.peak = self.peak.max(peak(samples));
+    for frame in samples.chunks_exact(CHANNEL_COUNT) {
+      for (filters, &sample) in self.filters.iter_mut().zip(frame) {
+        let weighted = filters.iter_mut().fold(sample as f64, |it, filter| filter.process(it));
+        self.sum += weighted * weighted;
+      }
+
+      self.frames += 1;
+      if self.frames == STEP_FRAMES {
+        self.steps.push(self.sum / STEP_FRAMES as f64);
+        self.sum = 0.0;
+        self.frames = 0;
+      }
+    }
+  }
+
+  /// Returns loudness of everything pushed, `None` if it is shorter than one block or silent.
+  pub fn finish(&self) -> Option<Loudness> {
+    let blocks = self.steps
+      .windows(BLOCK_STEPS)
+      .map(|it| it.iter().sum::<f64>() / BLOCK_STEPS as f64)
+      .filter(|&it| power_to_lufs(it) > ABSOLUTE_GATE)
+      .collect::<Vec<_>>();
+    if blocks.is_empty() {
+      return None;
+    }
+
+    let threshold = power_to_lufs(mean(&blocks)) - RELATIVE_GATE;
+    let gated = blocks.into_iter().filter(|&it| power_to_lufs(it) > threshold).collect::<Vec<_>>();
+    Some(Loudness {
+      integrated: power_to_lufs(mean(&gated)) as f32,
+      peak: self.peak
+    })
+  }
+}
+
+impl Default for LoudnessMeter {
+  fn default() -> Self {
+    Self::new()
+  }
+}
+
+/// Normalizes a decoded track to [`loudness_target`].
+///
+/// A track not measured yet plays at its own level while being measured, the result is stored
+/// in the [`MetadataCache`] once it is played to the end. Later plays only scale each sample.
+pub struct LoudnessNormalizer {
+  inner: Box<dyn SampleProvider>,
+  gain: Option<f32>,
+  meter: Option<(CacheKey, LoudnessMeter)>
+}
+
+impl LoudnessNormalizer {
+  pub fn new(inner: Box<dyn SampleProvider>, key: CacheKey) -> Self {
+    match MetadataCache::global().loudness(key) {
+      Some(loudness) => {
+        let gain = loudness.gain(loudness_target());
+        debug!("normalizing {} from {:.1} LUFS with gain {:.2}", key, loudness.integrated, gain);
+        Self {
+          inner,
+          gain: Some(gain),
+          meter: None
+        }
+      },
+      None => Self {
+        inner,
+        gain: None,
+        meter: Some((key, LoudnessMeter::new()))
+      }
+    }
+  }
+
+  /// Returns `true` if the gain is known, otherwise the track is being measured.
+  pub fn is_normalized(&self) -> bool {
+    self.gain.is_some()
+  }
+
+  fn finish_measurement(&mut self) {
+    let Some((key, meter)) = self.meter.take() else {
+      return;
+    };
+
+    match meter.finish() {
+      Some(loudness) => {
+        debug!("measured {} at {:.1} LUFS, peak {:.2}", key, loudness.integrated, loudness.peak);
+        MetadataCache::global().set_loudness(key, loudness);
+      },
+      None => debug!("{} is too short or silent to measure", key)
+    }
+  }
+}
+
+impl SampleProvider for LoudnessNormalizer {
+  fn get_samples(&mut self, samples: &mut [f32]) -> usize {
+    let size = self.inner.get_samples(samples);
+    if let Some(gain) = self.gain {
+      scale(&mut samples[..size], gain);
+    }
+
+    if size == 0 {
+      self.finish_measurement();
+    } else if let Some((_, meter)) = self.meter.as_mut() {
+      meter.push(&samples[..size]);
+    }
+    size
+  }
+
+  fn buffer_hint(&self) -> Option<Duration> {
+    self.inner.buffer_hint()
+  }
+
+  fn poll_ready(&self, waker: &Waker) -> bool {
+    self.inner.poll_ready(waker)
+  }
+
+  fn stalls(&self) -> u64 {
+    self.inner.stalls()
+  }
+
+  fn duration(&self) -> Option<Duration> {
+    self.inner.duration()
+  }
+
+  fn seek(&mut self, position: Duration, mode: SeekMode) -> Result<Duration> {
+    if self.meter.take().is_some() {
+      debug!("seeked while measuring loudness, dropping the measurement");
+    }
+    self.inner.seek(position, mode)
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use voice::frame_queue::FRAME_SAMPLES;
+  use super::*;
+
+  /// Returns `seconds` of a stereo 1 kHz sine with `amplitude` on both channels.
+  fn sine(amplitude: f32, seconds: usize) -> Vec<f32> {
+    (0..SAMPLE_RATE * seconds)
+      .flat_map(|it| {
+        let sample = (it as f32 * 1000.0 * std::f32::consts::TAU / SAMPLE_RATE as f32).sin() * amplitude;
+        [sample; CHANNEL_COUNT]
+      })
+      .collect()
+  }
+
+  fn measure(samples: &[f32]) -> Option<Loudness> {
+    let mut meter = LoudnessMeter::new();
+    // Packet sized pushes, steps span several of them
+    for chunk in samples.chunks(FRAME_SAMPLES) {
+      meter.push(chunk);
+    }
+    meter.finish()
+  }
+
+  #[test]
+  fn sine_at_reference_level() {
+    // EBU Tech 3341 case 1: a stereo 1 kHz sine at -23 dBFS per channel is -23 LUFS
+    let loudness = measure(&sine(10f32.powf(-23.0 / 20.0), 20)).unwrap();
+    assert!((loudness.integrated + 23.0).abs() < 0.1, "measured {} LUFS", loudness.integrated);
+    assert!((loudness.peak - 10f32.powf(-23.0 / 20.0)).abs() < 1e-3);
+  }
+
+  #[test]
+  fn quiet_part_is_gated() {
+    // EBU Tech 3341 case 3: -36, -23 and -36 dBFS for 10, 60 and 10 seconds are -23 LUFS
+    let mut samples = sine(10f32.powf(-36.0 / 20.0), 10);
+    samples.extend(sine(10f32.powf(-23.0 / 20.0), 60));
+    samples.extend(sine(10f32.powf(-36.0 / 20.0), 10));
+
+    let loudness = measure(&samples).unwrap();
+    assert!((loudness.integrated + 23.0).abs() < 0.1, "measured {} LUFS", loudness.integrated);
+  }
+
+  #[test]
+  fn silence_and_short_input_are_not_measured() {
+    assert_eq!(measure(&vec![0.0; SAMPLE_RATE * CHANNEL_COUNT * 2]), None);
+    assert_eq!(measure(&sine(0.5, 1)[..SAMPLE_RATE / 4 * CHANNEL_COUNT]), None);
+  }
+
+  #[test]
+  fn gain_is_limited_by_peak() {
+    let quiet = Loudness { integrated: -20.0, peak: 0.9 };
+    assert!((quiet.gain(-14.0) - 1.0 / 0.9).abs() < 1e-6);
+
+    let loud = Loudness { integrated: -8.0, peak: 1.0 };
+    assert!((loud.gain(-14.0) - 10f32.powf(-6.0 / 20.0)).abs() < 1e-6);
+
+    let silent = Loudness { integrated: -60.0, peak: 0.01 };
+    assert!((silent.gain(-14.0) - 10f32.powf(MAX_BOOST / 20.0)).abs() < 1e-4);
+  }
+}
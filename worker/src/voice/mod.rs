@@ -1,79 +1,281 @@
+mod passthrough;
+pub mod channels;
+pub mod interleave;
+pub mod resample;
+pub mod loudness;
+
+pub use passthrough::*;
+
 use std::fmt::{Debug, Formatter};
 use std::io;
-use anyhow::Result;
-use rubato::{Resampler, FftFixedIn};
+use std::sync::{atomic::{AtomicU64, Ordering}, Arc};
+use std::task::Waker;
+use std::time::{Duration, Instant};
+use anyhow::{Result, Context};
 use symphonia::core::{
-  formats::{FormatReader, FormatOptions},
-  codecs::{Decoder, CODEC_TYPE_NULL, DecoderOptions},
+  formats::{FormatReader, FormatOptions, SeekMode as FormatSeekMode, SeekTo},
+  codecs::{CodecParameters, Decoder, CODEC_TYPE_NULL, CODEC_TYPE_OPUS, DecoderOptions},
   probe::{ProbeResult, Hint},
   audio::{SampleBuffer, SignalSpec},
-  meta::MetadataOptions,
-  io::{MediaSourceStream, MediaSource}
+  meta::{MetadataOptions, MetadataRevision, StandardTagKey},
+  io::{MediaSourceStream, MediaSource},
+  units::{Time, TimeBase}
 };
 use tracing::field::debug;
-use tracing::{debug, error, info};
+use tracing::{debug, info, warn};
+
+use crate::{metrics::PipelineMetrics, providers::{async_adapter::InputReadiness, MediaMetadata}};
+use self::{
+  channels::ChannelMapper,
+  interleave::{interleave, split_planar},
+  resample::{ResampleStage, ResamplerQuality}
+};
+
+use voice::{constants::{CHANNEL_COUNT, SAMPLE_RATE}, frame_queue::FRAME_SAMPLES, provider::{AudioSource, SampleProvider, SeekMode}};
+
+/// Buffering properties of the input a provider reads from, reported to the voice jitter buffer.
+#[derive(Clone, Default)]
+pub struct SourceBuffering {
+  /// Preferred jitter buffer depth.
+  pub hint: Option<Duration>,
+  /// Number of times reading the input had to wait for data.
+  pub stalls: Option<Arc<AtomicU64>>,
+  /// Whether reading the input would block, inputs without one never do.
+  pub readiness: Option<Arc<dyn InputReadiness>>
+}
+
+impl SourceBuffering {
+  pub fn stalls(&self) -> u64 {
+    self.stalls.as_ref().map_or(0, |it| it.load(Ordering::Relaxed))
+  }
+
+  pub fn poll_ready(&self, waker: &Waker) -> bool {
+    self.readiness.as_ref().map_or(true, |it| it.poll_ready(waker))
+  }
+}
+
+impl Debug for SourceBuffering {
+  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
+    formatter.debug_struct("SourceBuffering")
+      .field("hint", &self.hint)
+      .field("stalls", &self.stalls())
+      .finish()
+  }
+}
+
+pub(crate) fn track_time_base(params: &CodecParameters) -> Option<TimeBase> {
+  params.time_base.or_else(|| params.sample_rate.map(|rate| TimeBase::new(1, rate)))
+}
+
+pub(crate) fn ts_to_duration(time_base: TimeBase, ts: u64) -> Duration {
+  let time = time_base.calc_time(ts);
+  Duration::from_secs(time.seconds) + Duration::from_secs_f64(time.frac)
+}
+
+/// Returns duration of a track as reported by its container.
+pub fn track_duration(params: &CodecParameters) -> Option<Duration> {
+  Some(ts_to_duration(track_time_base(params)?, params.n_frames?))
+}
+
+/// Seeks `format` to `position` in the track, returns the timestamps actually seeked to and requested.
+pub fn seek_track(format: &mut dyn FormatReader, track_id: u32, position: Duration, mode: SeekMode) -> Result<(u64, u64)> {
+  let mode = match mode {
+    SeekMode::Coarse => FormatSeekMode::Coarse,
+    SeekMode::Accurate => FormatSeekMode::Accurate
+  };
+  let time = Time::new(position.as_secs(), position.subsec_nanos() as f64 / 1_000_000_000.0);
+
+  let seeked = format.seek(mode, SeekTo::Time { time, track_id: Some(track_id) })?;
+  Ok((seeked.actual_ts, seeked.required_ts))
+}
 
-use voice::provider::SampleProvider;
+/// Audio source opened by [`probe_source`], along with the metadata its probe read.
+pub struct ProbedSource {
+  pub source: AudioSource,
+  pub metadata: Vec<MediaMetadata>
+}
+
+/// See [`probe_source`].
+pub fn open_source(source: Box<dyn MediaSource>, hint: Hint, buffering: SourceBuffering) -> Result<AudioSource> {
+  Ok(probe_source(source, hint, buffering)?.source)
+}
+
+/// Probes `source` once and picks the cheapest playback path for its codec.
+///
+/// Opus tracks are demuxed only and their packets are sent as is,
+/// everything else is decoded by [`SymphoniaSampleProvider`].
+pub fn probe_source(source: Box<dyn MediaSource>, hint: Hint, buffering: SourceBuffering) -> Result<ProbedSource> {
+  let (probed, track_id, metadata) = probe_format(source, hint)?;
+  let track = probed.format.tracks().iter().find(|it| it.id == track_id).unwrap();
+
+  if track.codec_params.codec == CODEC_TYPE_OPUS {
+    debug!("using Opus passthrough for track {}", track_id);
+    return Ok(ProbedSource {
+      source: AudioSource::Opus(Box::new(OpusPacketProvider::new(probed.format, track_id).with_buffering(buffering))),
+      metadata
+    });
+  }
+
+  let mut provider = SymphoniaSampleProvider::new(probed)?.with_buffering(buffering);
+  provider.warm_up();
+  Ok(ProbedSource {
+    source: AudioSource::Pcm(Box::new(provider)),
+    metadata
+  })
+}
+
+/// Probes the container of `source` for its metadata only, no decoder is created and no packet is read.
+pub fn probe_metadata(source: Box<dyn MediaSource>, hint: Hint) -> Result<Vec<MediaMetadata>> {
+  Ok(probe_format(source, hint)?.2)
+}
+
+/// Returns the probed container, the track to play and the metadata read by the probe.
+fn probe_format(source: Box<dyn MediaSource>, hint: Hint) -> Result<(ProbeResult, u32, Vec<MediaMetadata>)> {
+  let stream = MediaSourceStream::new(source, Default::default());
+  let started = Instant::now();
+  let mut probed = symphonia::default::get_probe()
+    .format(&hint, stream, &FormatOptions::default(), &MetadataOptions::default())?;
+  PipelineMetrics::global().probe.observe(started.elapsed());
+
+  let mut metadata = read_tags(&mut probed);
+  let track = probed.format
+    .tracks()
+    .iter()
+    .find(|it| it.codec_params.codec != CODEC_TYPE_NULL)
+    .context("no supported audio tracks")?;
+  metadata.extend(track_duration(&track.codec_params).map(MediaMetadata::Duration));
+
+  let track_id = track.id;
+  Ok((probed, track_id, metadata))
+}
+
+/// Returns title and description read by the probe, tags preceding the container (e.g. ID3) take precedence.
+fn read_tags(probed: &mut ProbeResult) -> Vec<MediaMetadata> {
+  let mut title = None;
+  let mut description = None;
+  let mut read = |revision: &MetadataRevision| {
+    for tag in revision.tags() {
+      match tag.std_key {
+        Some(StandardTagKey::TrackTitle) => title.get_or_insert_with(|| tag.value.to_string()),
+        Some(StandardTagKey::Description | StandardTagKey::Comment) => description.get_or_insert_with(|| tag.value.to_string()),
+        _ => continue
+      };
+    }
+  };
+
+  if let Some(revision) = probed.metadata.get().as_ref().and_then(|it| it.current()) {
+    read(revision);
+  }
+  if let Some(revision) = probed.format.metadata().current() {
+    read(revision);
+  }
+
+  title.map(MediaMetadata::Title).into_iter().chain(description.map(MediaMetadata::Description)).collect()
+}
 
 pub struct SymphoniaSampleProvider {
   format: Box<dyn FormatReader>,
   track_id: u32,
   decoder: Box<dyn Decoder>,
-  resampler: Option<FftFixedIn<f32>>,
+  /// Created on the first packet, maps decoded channels to stereo.
+  channels: Option<ChannelMapper>,
+  /// Created with the decoder if the track is not at 48 kHz, replaced on the first packet if the decoded rate differs.
+  resampler: Option<ResampleStage>,
   spec: Option<SignalSpec>,
   sample_buf: Option<SampleBuffer<f32>>,
-  resample_out: Option<Vec<Vec<f32>>>,
-  resample_interleaved_out: Option<Vec<f32>>
+  buffering: SourceBuffering,
+  duration: Option<Duration>,
+  time_base: Option<TimeBase>,
+  pending: PendingSamples
 }
 
-impl Debug for SymphoniaSampleProvider {
-  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
-    formatter.debug_struct("SymphoniaSampleProvider")
-      .finish()
-  }
+/// Interleaved samples on their way to the caller's buffer.
+#[derive(Default)]
+struct PendingSamples {
+  /// Samples per channel (at 48 kHz) to drop after an accurate seek.
+  skip_frames: usize,
+  /// Samples decoded but not yet returned, either by [`SymphoniaSampleProvider::warm_up`]
+  /// or because a packet did not fit into the output.
+  samples: Vec<f32>,
+  offset: usize
 }
 
-fn planar1d_to_planar2d<T>(input: &[T], channels: usize) -> Vec<&[T]> {
-  let chunk_size = input.len() / channels;
-  let mut result = Vec::with_capacity(channels);
-  for channel in 0..channels {
-    let start = channel * chunk_size;
-    let end = start + chunk_size;
-    result.push(&input[start..end]);
+impl PendingSamples {
+  fn is_empty(&self) -> bool {
+    self.offset >= self.samples.len()
   }
 
-  result
-}
+  fn clear(&mut self) {
+    self.samples.clear();
+    self.offset = 0;
+  }
+
+  fn read(&mut self, out: &mut [f32]) -> usize {
+    let count = (self.samples.len() - self.offset).min(out.len());
+    out[..count].copy_from_slice(&self.samples[self.offset..self.offset + count]);
+    self.offset += count;
+    count
+  }
 
-fn planar_to_interleave<T, F>(input: &[F], output: &mut [T], frames: usize) -> usize where T: Copy + Default, F: AsRef<[T]> {
-  let channels = input.len();
+  /// Interleaves `frames` frames of `planar` straight into `out`, dropping frames skipped by an accurate seek.
+  /// Frames that do not fit are queued.
+  ///
+  /// Returns number of samples written to `out`.
+  fn emit<V: AsRef<[f32]>>(&mut self, planar: &[V], frames: usize, out: &mut [f32]) -> usize {
+    let channels = planar.len();
+    let skip = self.skip_frames.min(frames);
+    self.skip_frames -= skip;
+
+    let available = frames - skip;
+    // Anything already queued goes out first
+    let fit = if self.is_empty() { available.min(out.len() / channels) } else { 0 };
+    let written = interleave(planar, skip, fit, out);
+
+    let rest = available - fit;
+    if rest > 0 {
+      if self.is_empty() {
+        self.clear();
+      }
 
-  for frame in 0..frames {
-    for channel in 0..channels {
-      let samples = input[channel].as_ref();
-      output[frame * channels + channel] = samples[frame];
+      let start = self.samples.len();
+      self.samples.resize(start + rest * channels, 0.0);
+      interleave(planar, skip + fit, rest, &mut self.samples[start..]);
     }
+    written
   }
-  channels * frames
 }
 
-fn vectors_to_slices<T>(vectors: &[Vec<T>]) -> Vec<&[T]> {
-  vectors.iter().map(Vec::as_slice).collect()
+/// Returns a resampler from `rate` to 48 kHz, `None` if the rate is already 48 kHz.
+fn create_resampler(rate: usize) -> Result<Option<ResampleStage>> {
+  if rate == SAMPLE_RATE {
+    return Ok(None);
+  }
+  ResampleStage::new(ResamplerQuality::configured(), rate, CHANNEL_COUNT)
+    .map(Some)
+    .with_context(|| format!("failed to create resampler from {} Hz", rate))
+}
+
+impl Debug for SymphoniaSampleProvider {
+  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
+    formatter.debug_struct("SymphoniaSampleProvider")
+      .finish()
+  }
 }
 
 impl SymphoniaSampleProvider {
   /// Creates new [`SymphoniaSampleProvider`] from [`MediaSource`] and [`Hint`]
   pub fn new_from_source(source: Box<dyn MediaSource>, hint: Hint) -> Result<Self> {
     let stream = MediaSourceStream::new(source, Default::default());
+    let started = Instant::now();
     let probed = symphonia::default::get_probe()
-      .format(&hint, stream, &FormatOptions::default(), &MetadataOptions::default())
-      .expect("unsupported format");
+      .format(&hint, stream, &FormatOptions::default(), &MetadataOptions::default())?;
+    PipelineMetrics::global().probe.observe(started.elapsed());
 
-    Ok(SymphoniaSampleProvider::new(probed))
+    SymphoniaSampleProvider::new(probed)
   }
 
   /// Creates new [`SymphoniaSampleProvider`] from [`ProbeResult`]
-  pub fn new(probed: ProbeResult) -> Self {
+  pub fn new(probed: ProbeResult) -> Result<Self> {
     let format = probed.format;
 
     // Find the first audio track with a known (decodeable) codec.
@@ -81,69 +283,167 @@ impl SymphoniaSampleProvider {
       .tracks()
       .iter()
       .find(|it| it.codec_params.codec != CODEC_TYPE_NULL)
-      .expect("no supported audio tracks");
+      .context("no supported audio tracks")?;
 
     let track_id = track.id;
+    let duration = track_duration(&track.codec_params);
+    let time_base = track_time_base(&track.codec_params);
 
     let decoder = symphonia::default::get_codecs()
-      .make(&track.codec_params, &DecoderOptions::default())
-      .expect("unsupported codec");
+      .make(&track.codec_params, &DecoderOptions::default())?;
+    let resampler = match track.codec_params.sample_rate {
+      Some(rate) => create_resampler(rate as usize)?,
+      None => None
+    };
 
-    SymphoniaSampleProvider {
+    Ok(SymphoniaSampleProvider {
       format,
       track_id,
       decoder,
-      resampler: None,
+      channels: None,
+      resampler,
       spec: None,
       sample_buf: None,
-      resample_out: None,
-      resample_interleaved_out: None
-    }
+      buffering: SourceBuffering::default(),
+      duration,
+      time_base,
+      pending: PendingSamples::default()
+    })
   }
 
-  fn process_samples(&mut self) -> Result<&[f32]> {
-    let input = self.sample_buf.as_ref().unwrap().samples();
-    let output = self.resample_interleaved_out.as_mut().unwrap();
-
-    // debug!("Input zeroes: {}", input.iter().filter(|&n| n.abs() < 0.00001).count());
-
-    let spec = self.spec.as_ref().unwrap();
+  /// Decodes the first packet ahead of time, so the decoder and resampler are already
+  /// set up when playback reaches this provider.
+  pub fn warm_up(&mut self) {
+    // Same size as the reads done by the voice connection, one packet always fits
+    let mut samples = vec![0f32; FRAME_SAMPLES * 6];
+    let size = self.get_samples(&mut samples);
+    samples.truncate(size);
+    samples.extend_from_slice(&self.pending.samples[self.pending.offset..]);
+
+    self.pending.samples = samples;
+    self.pending.offset = 0;
+  }
 
-    let resampler = self.resampler.as_mut().unwrap();
-    let resample_out = self.resample_out.as_mut().unwrap();
+  pub fn with_buffering(mut self, buffering: SourceBuffering) -> Self {
+    self.buffering = buffering;
+    self
+  }
 
-    let frames_in = planar1d_to_planar2d(input, spec.channels.count());
-    let (planar, planar_size) = if spec.rate != 48000 {
-      let missing = resampler.input_frames_next() - input.len() / spec.channels.count();
-      if missing > 0 {
-        // TODO(Assasans): Wait from next packet?
-        error!("missing {} samples", missing);
-        return Ok(&output[0..0]);
-      }
+  /// Maps the decoded packet to stereo, resamples it and interleaves it straight into `out`.
+  ///
+  /// Returns number of samples written to `out`.
+  fn process_samples(&mut self, out: &mut [f32]) -> usize {
+    let metrics = PipelineMetrics::global();
+    let started = Instant::now();
 
-      let out_size = resampler.output_frames_next();
-      resampler.process_into_buffer(&frames_in, resample_out, None).unwrap();
-      // debug!("Resampled {} -> {} samples", input.len(), out_size * spec.channels.count());
-      (vectors_to_slices(resample_out), out_size)
-    } else {
+    let input = self.sample_buf.as_ref().unwrap().samples();
+    let channels = self.spec.as_ref().unwrap().channels.count();
+    let planes = split_planar(input, channels);
+    let frames = input.len() / channels;
+
+    // Downmixing first, so the resampler only ever processes 2 channels
+    let stereo = self.channels.as_mut().unwrap().map(&planes, frames);
+
+    let mut interleaving = Duration::ZERO;
+    let written = match self.resampler.as_mut() {
+      Some(resampler) => {
+        resampler.push(&stereo[..], 0, frames);
+
+        // Input short of a full chunk stays buffered until the next packet
+        let mut written = 0;
+        while let Some(frames) = resampler.process() {
+          let emitting = Instant::now();
+          written += self.pending.emit(resampler.output(), frames, &mut out[written..]);
+          interleaving += emitting.elapsed();
+        }
+        written
+      },
       // Native sample rate, no need to resample
-      (frames_in, input.len() / spec.channels.count())
+      None => {
+        let emitting = Instant::now();
+        let written = self.pending.emit(&stereo[..], frames, out);
+        interleaving += emitting.elapsed();
+        written
+      }
     };
-    let interleaved_size = planar_to_interleave(&planar, output, planar_size);
 
-    // debug!("Output zeroes: {}", output.iter().filter(|&n| n.abs() < 0.00001).count());
+    metrics.resample.observe(started.elapsed().saturating_sub(interleaving));
+    metrics.interleave.observe(interleaving);
+    written
+  }
 
-    Ok(&output[..interleaved_size])
+  /// Returns the tail of the input still buffered by the resampler at the end of the track.
+  fn flush(&mut self, out: &mut [f32]) -> usize {
+    let Some(resampler) = self.resampler.as_mut() else {
+      return 0;
+    };
+
+    while let Some(frames) = resampler.flush() {
+      let written = self.pending.emit(resampler.output(), frames, out);
+      if written > 0 {
+        return written;
+      }
+      if !self.pending.is_empty() {
+        return self.pending.read(out);
+      }
+    }
+    0
   }
 }
 
 impl SampleProvider for SymphoniaSampleProvider {
+  fn buffer_hint(&self) -> Option<Duration> {
+    self.buffering.hint
+  }
+
+  fn poll_ready(&self, waker: &Waker) -> bool {
+    !self.pending.is_empty() || self.buffering.poll_ready(waker)
+  }
+
+  fn stalls(&self) -> u64 {
+    self.buffering.stalls()
+  }
+
+  fn duration(&self) -> Option<Duration> {
+    self.duration
+  }
+
+  fn seek(&mut self, position: Duration, mode: SeekMode) -> Result<Duration> {
+    let time_base = self.time_base.context("track has no time base")?;
+    let (actual_ts, required_ts) = seek_track(self.format.as_mut(), self.track_id, position, mode)?;
+
+    // Decoder state and buffered samples belong to the old position
+    self.decoder.reset();
+    self.sample_buf = None;
+    if let Some(resampler) = self.resampler.as_mut() {
+      resampler.reset()?;
+    }
+    self.pending.clear();
+
+    let actual = ts_to_duration(time_base, actual_ts);
+    let required = ts_to_duration(time_base, required_ts);
+    self.pending.skip_frames = match mode {
+      SeekMode::Accurate => (required.saturating_sub(actual).as_micros() * SAMPLE_RATE as u128 / 1_000_000) as usize,
+      SeekMode::Coarse => 0
+    };
+    debug!("seeked to {:?}, dropping {} frames", actual, self.pending.skip_frames);
+
+    Ok(match mode {
+      SeekMode::Accurate => required,
+      SeekMode::Coarse => actual
+    })
+  }
+
   fn get_samples(&mut self, out: &mut [f32]) -> usize {
+    if !self.pending.is_empty() {
+      return self.pending.read(out);
+    }
+
     loop {
       let packet = match self.format.next_packet() {
         Ok(packet) => packet,
         Err(symphonia::core::errors::Error::IoError(error)) if error.kind() == io::ErrorKind::UnexpectedEof => {
-          return 0;
+          return self.flush(out);
         },
         Err(symphonia::core::errors::Error::ResetRequired) => {
           // The track list has been changed. Re-examine it and create a new set of decoders,
@@ -172,7 +472,10 @@ impl SampleProvider for SymphoniaSampleProvider {
       }
 
       // Decode the packet into audio samples.
-      match self.decoder.decode(&packet) {
+      let decoding = Instant::now();
+      let decoded = self.decoder.decode(&packet);
+      PipelineMetrics::global().decode.observe(decoding.elapsed());
+      match decoded {
         Ok(buffer) => {
           // If this is the *first* decoded packet, create a sample buffer matching the
           // decoded audio buffer format.
@@ -180,17 +483,21 @@ impl SampleProvider for SymphoniaSampleProvider {
             let spec = *buffer.spec();
             let duration = buffer.capacity() as u64;
 
+            // Codec parameters may not know the rate, or get it wrong
+            let rate = spec.rate as usize;
+            if self.resampler.as_ref().map_or(SAMPLE_RATE, ResampleStage::rate) != rate {
+              match create_resampler(rate) {
+                Ok(resampler) => self.resampler = resampler,
+                Err(error) => {
+                  warn!("cannot resample track {} from {} Hz: {:?}", self.track_id, rate, error);
+                  return 0;
+                }
+              }
+            }
+
             self.sample_buf = Some(SampleBuffer::<f32>::new(duration, spec));
             self.spec = Some(spec);
-            let resampler = self.resampler.insert(FftFixedIn::<f32>::new(
-              spec.rate as usize,
-              48000,
-              buffer.capacity(),
-              2,
-              spec.channels.count()
-            ).unwrap());
-            self.resample_out = Some(resampler.output_buffer_allocate());
-            self.resample_interleaved_out = Some(vec![0f32; resampler.output_frames_max() * spec.channels.count()]);
+            self.channels = Some(ChannelMapper::new(spec.channels));
           }
 
           // Copy the decoded audio buffer into the sample buffer in an interleaved format.
@@ -200,10 +507,15 @@ impl SampleProvider for SymphoniaSampleProvider {
 
             // println!("Decoded {} samples", sample_count);
 
-            let output = self.process_samples().unwrap();
-
-            out[..output.len()].copy_from_slice(&output);
-            return output.len();
+            let length = self.process_samples(out);
+            if length > 0 {
+              return length;
+            }
+            if !self.pending.is_empty() {
+              return self.pending.read(out);
+            }
+            // Buffered by the resampler or dropped entirely by an accurate seek
+            continue;
           }
         }
         Err(symphonia::core::errors::Error::IoError(_)) => {
@@ -0,0 +1,265 @@
+use std::collections::VecDeque;
+use std::fmt::{Debug, Formatter};
+use std::io;
+use std::sync::Mutex;
+use std::task::Waker;
+use std::time::Duration;
+use anyhow::{Result, Context};
+use opus::{Application, Bitrate, Channels, Decoder, Encoder, Repacketizer};
+use symphonia::core::{formats::FormatReader, units::TimeBase};
+use tracing::{debug, error, warn};
+
+use voice::{
+  constants::{CHANNEL_COUNT, MAX_OPUS_PACKET_SIZE, SAMPLE_RATE, TIMESTAMP_STEP},
+  frame_queue::FRAME_SAMPLES,
+  provider::{PacketProvider, SeekMode}
+};
+use crate::providers::cache::record_bitrate;
+use super::{SourceBuffering, seek_track, track_duration, track_time_base, ts_to_duration};
+
+/// Longest Opus packet, 120 ms, in samples per channel.
+const MAX_PACKET_SAMPLES: usize = SAMPLE_RATE * 120 / 1000;
+
+/// Turns packets with frames other than 20 ms into 20 ms ones by decoding and encoding them again.
+struct Transcoder {
+  decoder: Decoder,
+  encoder: Encoder,
+  /// Decoded samples not encoded yet, less than one frame between packets.
+  pcm: Vec<f32>
+}
+
+impl Transcoder {
+  fn new() -> Result<Self> {
+    let mut encoder = Encoder::new(SAMPLE_RATE as u32, Channels::Stereo, Application::Audio)?;
+    encoder.set_bitrate(Bitrate::Bits(record_bitrate()))?;
+
+    Ok(Self {
+      decoder: Decoder::new(SAMPLE_RATE as u32, Channels::Stereo)?,
+      encoder,
+      pcm: Vec::with_capacity((MAX_PACKET_SAMPLES + TIMESTAMP_STEP) * CHANNEL_COUNT)
+    })
+  }
+
+  /// Decodes `packet` and queues every complete 20 ms frame into `out`.
+  fn push(&mut self, packet: &[u8], out: &mut VecDeque<Vec<u8>>) -> Result<()> {
+    let start = self.pcm.len();
+    self.pcm.resize(start + MAX_PACKET_SAMPLES * CHANNEL_COUNT, 0.0);
+    let samples = self.decoder.decode_float(packet, &mut self.pcm[start..], false);
+    self.pcm.truncate(start + samples.as_ref().map_or(0, |it| it * CHANNEL_COUNT));
+    samples?;
+
+    self.encode(out)
+  }
+
+  /// Pads the remaining samples with silence to a whole frame and queues it into `out`.
+  fn finish(&mut self, out: &mut VecDeque<Vec<u8>>) -> Result<()> {
+    if !self.pcm.is_empty() {
+      self.pcm.resize(FRAME_SAMPLES, 0.0);
+    }
+    self.encode(out)
+  }
+
+  fn encode(&mut self, out: &mut VecDeque<Vec<u8>>) -> Result<()> {
+    let mut consumed = 0;
+    while self.pcm.len() - consumed >= FRAME_SAMPLES {
+      let mut packet = vec![0; MAX_OPUS_PACKET_SIZE];
+      let size = self.encoder.encode_float(&self.pcm[consumed..consumed + FRAME_SAMPLES], &mut packet)?;
+      packet.truncate(size);
+      out.push_back(packet);
+      consumed += FRAME_SAMPLES;
+    }
+
+    self.pcm.drain(..consumed);
+    Ok(())
+  }
+}
+
+/// Demux-only provider for Opus tracks, container packets are sent without decoding.
+pub struct OpusPacketProvider {
+  format: Box<dyn FormatReader>,
+  track_id: u32,
+  duration: Option<Duration>,
+  time_base: Option<TimeBase>,
+  /// Packets ending before this timestamp are dropped after an accurate seek.
+  skip_until: Option<u64>,
+  /// 20 ms packets split out of a longer one or transcoded, sent before reading further.
+  pending: VecDeque<Vec<u8>>,
+  /// Set once a packet with frames other than 20 ms is read, every following packet of the
+  /// track goes through it so decoded samples stay in order.
+  /// Only accessed through `&mut self`, the [`Mutex`] just makes the codec state [`Sync`].
+  transcoder: Option<Mutex<Transcoder>>,
+  buffering: SourceBuffering
+}
+
+impl Debug for OpusPacketProvider {
+  fn fmt(&self, formatter: &mut Formatter<'_>) -> std::fmt::Result {
+    formatter.debug_struct("OpusPacketProvider")
+      .field("track_id", &self.track_id)
+      .finish()
+  }
+}
+
+impl OpusPacketProvider {
+  pub fn new(format: Box<dyn FormatReader>, track_id: u32) -> Self {
+    let params = format
+      .tracks()
+      .iter()
+      .find(|it| it.id == track_id)
+      .map(|it| it.codec_params.clone());
+    let duration = params.as_ref().and_then(track_duration);
+    let time_base = params.as_ref().and_then(track_time_base);
+
+    Self {
+      format,
+      track_id,
+      duration,
+      time_base,
+      skip_until: None,
+      pending: VecDeque::new(),
+      transcoder: None,
+      buffering: SourceBuffering::default()
+    }
+  }
+
+  pub fn with_buffering(mut self, buffering: SourceBuffering) -> Self {
+    self.buffering = buffering;
+    self
+  }
+
+  /// Queues `data` into [`OpusPacketProvider::pending`] as 20 ms packets.
+  ///
+  /// Packets of several 20 ms frames are split without decoding, any other frame duration is transcoded.
+  fn repacketize(&mut self, data: &[u8]) -> Result<()> {
+    if self.transcoder.is_none() {
+      let frames = opus::packet::get_nb_frames(data)?;
+      if opus::packet::get_samples_per_frame(data, SAMPLE_RATE as u32)? == TIMESTAMP_STEP {
+        let mut repacketizer = Repacketizer::new()?;
+        let mut state = repacketizer.begin();
+        state.cat(data)?;
+        for index in 0..frames {
+          let mut packet = vec![0; MAX_OPUS_PACKET_SIZE];
+          let size = state.emit_range(index, index + 1, &mut packet)?;
+          packet.truncate(size);
+          self.pending.push_back(packet);
+        }
+        return Ok(());
+      }
+
+      debug!("transcoding Opus track with {} samples per packet", opus::packet::get_nb_samples(data, SAMPLE_RATE as u32)?);
+      self.transcoder = Some(Mutex::new(Transcoder::new()?));
+    }
+
+    self.transcoder.as_mut().unwrap().get_mut().unwrap().push(data, &mut self.pending)
+  }
+
+  /// Queues what is left of a transcoded track, returns `false` if there is nothing more to send.
+  fn finish(&mut self) -> bool {
+    if let Some(transcoder) = self.transcoder.take() {
+      if let Err(error) = transcoder.into_inner().unwrap().finish(&mut self.pending) {
+        warn!("failed to encode the end of Opus track: {:?}", error);
+      }
+    }
+    !self.pending.is_empty()
+  }
+}
+
+impl PacketProvider for OpusPacketProvider {
+  fn buffer_hint(&self) -> Option<Duration> {
+    self.buffering.hint
+  }
+
+  fn poll_ready(&self, waker: &Waker) -> bool {
+    !self.pending.is_empty() || self.buffering.poll_ready(waker)
+  }
+
+  fn stalls(&self) -> u64 {
+    self.buffering.stalls()
+  }
+
+  fn duration(&self) -> Option<Duration> {
+    self.duration
+  }
+
+  fn seek(&mut self, position: Duration, mode: SeekMode) -> Result<Duration> {
+    let time_base = self.time_base.context("track has no time base")?;
+    let (actual_ts, required_ts) = seek_track(self.format.as_mut(), self.track_id, position, mode)?;
+    debug!("seeked Opus track to {:?}", ts_to_duration(time_base, actual_ts));
+    self.pending.clear();
+    self.transcoder = None;
+
+    Ok(match mode {
+      SeekMode::Accurate => {
+        self.skip_until = Some(required_ts);
+        ts_to_duration(time_base, required_ts)
+      },
+      SeekMode::Coarse => {
+        self.skip_until = None;
+        ts_to_duration(time_base, actual_ts)
+      }
+    })
+  }
+
+  fn get_packet(&mut self, out: &mut [u8]) -> usize {
+    loop {
+      if let Some(packet) = self.pending.pop_front() {
+        if packet.len() > out.len() {
+          warn!("skipping Opus packet of {} bytes", packet.len());
+          continue;
+        }
+
+        out[..packet.len()].copy_from_slice(&packet);
+        return packet.len();
+      }
+
+      let packet = match self.format.next_packet() {
+        Ok(packet) => packet,
+        Err(symphonia::core::errors::Error::IoError(error)) if error.kind() == io::ErrorKind::UnexpectedEof => {
+          if self.finish() {
+            continue;
+          }
+          return 0;
+        },
+        Err(error) => {
+          error!("failed to read Opus packet: {}", error);
+          if self.finish() {
+            continue;
+          }
+          return 0;
+        }
+      };
+
+      while !self.format.metadata().is_latest() {
+        self.format.metadata().pop();
+      }
+
+      if packet.track_id() != self.track_id {
+        continue;
+      }
+
+      if let Some(skip_until) = self.skip_until {
+        if packet.ts() + packet.dur() <= skip_until {
+          continue;
+        }
+        self.skip_until = None;
+      }
+
+      let data = packet.buf();
+      let passthrough = self.transcoder.is_none()
+        && matches!(opus::packet::get_nb_samples(data, SAMPLE_RATE as u32), Ok(samples) if samples == TIMESTAMP_STEP);
+      if !passthrough {
+        if let Err(error) = self.repacketize(data) {
+          warn!("skipping invalid Opus packet: {}", error);
+        }
+        continue;
+      }
+
+      if data.len() > out.len() {
+        warn!("skipping Opus packet of {} bytes", data.len());
+        continue;
+      }
+
+      out[..data.len()].copy_from_slice(data);
+      return data.len();
+    }
+  }
+}
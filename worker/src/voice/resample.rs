@@ -0,0 +1,297 @@
+use std::{env, sync::OnceLock};
+use anyhow::{Result, anyhow};
+use rubato::{
+  FftFixedIn,
+  Resampler,
+  SincFixedIn,
+  SincInterpolationParameters,
+  SincInterpolationType,
+  WindowFunction
+};
+use tracing::warn;
+
+use voice::constants::SAMPLE_RATE;
+use crate::metrics::PipelineMetrics;
+use super::interleave::MAX_CHANNELS;
+
+/// Input chunk size the FFT and sinc resamplers are sized around, in frames.
+const CHUNK_FRAMES: usize = 1024;
+
+/// Resampling quality and CPU cost tradeoff.
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub enum ResamplerQuality {
+  /// Synchronous FFT resampling, high quality and cheap for common rate ratios.
+  Fft,
+  /// Asynchronous sinc interpolation, the highest quality and the most expensive.
+  Sinc,
+  /// Linear interpolation, audible aliasing but almost free.
+  Linear
+}
+
+impl ResamplerQuality {
+  /// Returns the quality set by `MOSAIK_RESAMPLER` (`fft`, `sinc` or `linear`), [`ResamplerQuality::Fft`] by default.
+  pub fn configured() -> Self {
+    static QUALITY: OnceLock<ResamplerQuality> = OnceLock::new();
+    *QUALITY.get_or_init(|| match env::var("MOSAIK_RESAMPLER").as_deref() {
+      Ok("sinc") => ResamplerQuality::Sinc,
+      Ok("linear") => ResamplerQuality::Linear,
+      Ok("fft") | Err(_) => ResamplerQuality::Fft,
+      Ok(other) => {
+        warn!("unknown resampler {}, using fft", other);
+        ResamplerQuality::Fft
+      }
+    })
+  }
+}
+
+/// Linear interpolation between neighbouring input frames.
+struct LinearResampler {
+  /// Input frames per output frame.
+  step: f64,
+  /// Position of the next output frame, relative to the first buffered input frame.
+  position: f64
+}
+
+enum Kernel {
+  Fft(FftFixedIn<f32>),
+  Sinc(SincFixedIn<f32>),
+  Linear(LinearResampler)
+}
+
+fn gcd(a: usize, b: usize) -> usize {
+  if b == 0 { a } else { gcd(b, a % b) }
+}
+
+/// Streaming resampler to [`SAMPLE_RATE`] that buffers input frames across packets,
+/// so packets of any size are accepted and none are dropped.
+pub struct ResampleStage {
+  quality: ResamplerQuality,
+  rate: usize,
+  kernel: Kernel,
+  /// Buffered input frames per channel.
+  input: Vec<Vec<f32>>,
+  output: Vec<Vec<f32>>,
+  ratio: f64,
+  /// Input frames pushed and output frames produced since the last reset, used to trim the flushed tail.
+  frames_in: u64,
+  frames_out: u64
+}
+
+impl ResampleStage {
+  pub fn new(quality: ResamplerQuality, rate: usize, channels: usize) -> Result<Self> {
+    let ratio = SAMPLE_RATE as f64 / rate as f64;
+
+    // Whole multiples of the reduced input rate give the FFT resampler exact, small FFT sizes,
+    // e.g. 8 * 147 frames for 44.1 kHz
+    let unit = rate / gcd(rate, SAMPLE_RATE);
+    let chunk = if unit <= CHUNK_FRAMES {
+      ((CHUNK_FRAMES + unit / 2) / unit).max(1) * unit
+    } else {
+      CHUNK_FRAMES
+    };
+
+    let kernel = match quality {
+      ResamplerQuality::Fft => Kernel::Fft(
+        FftFixedIn::new(rate, SAMPLE_RATE, chunk, 2, channels).map_err(|error| anyhow!("{}", error))?
+      ),
+      ResamplerQuality::Sinc => {
+        let parameters = SincInterpolationParameters {
+          sinc_len: 128,
+          f_cutoff: 0.95,
+          interpolation: SincInterpolationType::Linear,
+          oversampling_factor: 128,
+          window: WindowFunction::BlackmanHarris2
+        };
+        Kernel::Sinc(SincFixedIn::new(ratio, 1.0, parameters, chunk, channels).map_err(|error| anyhow!("{}", error))?)
+      },
+      ResamplerQuality::Linear => Kernel::Linear(LinearResampler {
+        step: 1.0 / ratio,
+        position: 0.0
+      })
+    };
+
+    let output = match &kernel {
+      Kernel::Fft(resampler) => resampler.output_buffer_allocate(),
+      Kernel::Sinc(resampler) => resampler.output_buffer_allocate(),
+      Kernel::Linear(_) => vec![Vec::with_capacity((chunk as f64 * ratio) as usize + 1); channels]
+    };
+
+    Ok(Self {
+      quality,
+      rate,
+      kernel,
+      input: vec![Vec::with_capacity(chunk * 2); channels],
+      output,
+      ratio,
+      frames_in: 0,
+      frames_out: 0
+    })
+  }
+
+  /// Input sample rate.
+  pub fn rate(&self) -> usize {
+    self.rate
+  }
+
+  /// Drops buffered input and kernel state, e.g. after a seek.
+  pub fn reset(&mut self) -> Result<()> {
+    *self = Self::new(self.quality, self.rate, self.input.len())?;
+    Ok(())
+  }
+
+  pub fn push<V: AsRef<[f32]>>(&mut self, planar: &[V], start: usize, frames: usize) {
+    for (buffer, samples) in self.input.iter_mut().zip(planar) {
+      buffer.extend_from_slice(&samples.as_ref()[start..start + frames]);
+    }
+    self.frames_in += frames as u64;
+  }
+
+  /// Resamples one chunk of buffered input, returns number of frames in [`ResampleStage::output`].
+  ///
+  /// Returns `None` if not enough input is buffered yet.
+  pub fn process(&mut self) -> Option<usize> {
+    let buffered = self.input[0].len();
+    let frames = match &mut self.kernel {
+      Kernel::Fft(resampler) => Self::process_chunk(resampler, &mut self.input, &mut self.output)?,
+      Kernel::Sinc(resampler) => Self::process_chunk(resampler, &mut self.input, &mut self.output)?,
+      Kernel::Linear(resampler) => {
+        if buffered < 2 {
+          return None;
+        }
+
+        for output in &mut self.output {
+          output.clear();
+        }
+        while resampler.position + 1.0 < buffered as f64 {
+          let index = resampler.position as usize;
+          let fraction = (resampler.position - index as f64) as f32;
+          for (output, input) in self.output.iter_mut().zip(&self.input) {
+            output.push(input[index] + (input[index + 1] - input[index]) * fraction);
+          }
+          resampler.position += resampler.step;
+        }
+
+        let consumed = resampler.position as usize;
+        resampler.position -= consumed as f64;
+        for input in &mut self.input {
+          input.drain(..consumed);
+        }
+
+        let frames = self.output[0].len();
+        if frames == 0 {
+          return None;
+        }
+        frames
+      }
+    };
+
+    self.frames_out += frames as u64;
+    Some(frames)
+  }
+
+  fn process_chunk<R: Resampler<f32>>(resampler: &mut R, input: &mut [Vec<f32>], output: &mut [Vec<f32>]) -> Option<usize> {
+    let needed = resampler.input_frames_next();
+    if input[0].len() < needed {
+      return None;
+    }
+
+    let frames = resampler.output_frames_next();
+    let chunk: [&[f32]; MAX_CHANNELS] = std::array::from_fn(|channel| input.get(channel).map_or(&[][..], |it| &it[..needed]));
+    let result = resampler.process_into_buffer(&chunk[..input.len()], output, None);
+    for input in input.iter_mut() {
+      input.drain(..needed);
+    }
+
+    match result {
+      Ok(_) => Some(frames),
+      Err(error) => {
+        // The chunk is dropped, the next one is resampled as usual
+        warn!("failed to resample {} frames: {}", needed, error);
+        PipelineMetrics::global().resample_errors.inc();
+        None
+      }
+    }
+  }
+
+  /// Resamples the remaining buffered input padded with silence, returns number of frames in
+  /// [`ResampleStage::output`], trimmed to the length of the input pushed since the last reset.
+  pub fn flush(&mut self) -> Option<usize> {
+    let expected = (self.frames_in as f64 * self.ratio).ceil() as u64;
+    if self.frames_out >= expected {
+      return None;
+    }
+
+    let padding = match &self.kernel {
+      Kernel::Fft(resampler) => resampler.input_frames_next().saturating_sub(self.input[0].len()),
+      Kernel::Sinc(resampler) => resampler.input_frames_next().saturating_sub(self.input[0].len()),
+      Kernel::Linear(_) => 1
+    };
+    for input in &mut self.input {
+      input.resize(input.len() + padding, 0.0);
+    }
+
+    let frames_out = self.frames_out;
+    let frames = self.process()?;
+    Some(frames.min((expected - frames_out) as usize))
+  }
+
+  /// Resampled frames of the last [`ResampleStage::process`] or [`ResampleStage::flush`], per channel.
+  pub fn output(&self) -> &[Vec<f32>] {
+    &self.output
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  /// Resamples `frames` frames of a 440 Hz tone at `rate` in packets of `packet` frames, returns the output of one channel.
+  fn resample(quality: ResamplerQuality, rate: usize, frames: usize, packet: usize) -> Vec<f32> {
+    let mut stage = ResampleStage::new(quality, rate, 2).unwrap();
+    let tone = (0..frames)
+      .map(|it| (it as f32 * 440.0 * std::f32::consts::TAU / rate as f32).sin() * 0.5)
+      .collect::<Vec<_>>();
+
+    let mut output = Vec::new();
+    for start in (0..frames).step_by(packet) {
+      stage.push(&[&tone, &tone], start, packet.min(frames - start));
+      while let Some(frames) = stage.process() {
+        output.extend_from_slice(&stage.output()[0][..frames]);
+      }
+    }
+    while let Some(frames) = stage.flush() {
+      output.extend_from_slice(&stage.output()[0][..frames]);
+    }
+    output
+  }
+
+  #[test]
+  fn output_length_matches_input_duration() {
+    for quality in [ResamplerQuality::Fft, ResamplerQuality::Sinc, ResamplerQuality::Linear] {
+      let output = resample(quality, 44_100, 44_100, 1152);
+      assert!(output.len().abs_diff(SAMPLE_RATE) <= 1, "{:?} produced {} frames", quality, output.len());
+    }
+  }
+
+  #[test]
+  fn tone_keeps_its_level() {
+    for quality in [ResamplerQuality::Fft, ResamplerQuality::Sinc, ResamplerQuality::Linear] {
+      let output = resample(quality, 22_050, 22_050, 576);
+      // Skips the filter delay at both ends
+      let middle = &output[SAMPLE_RATE / 4..SAMPLE_RATE * 3 / 4];
+      let peak = middle.iter().fold(0f32, |peak, it| peak.max(it.abs()));
+      assert!((peak - 0.5).abs() < 0.02, "{:?} peak is {}", quality, peak);
+    }
+  }
+
+  #[test]
+  fn reset_drops_buffered_input() {
+    let mut stage = ResampleStage::new(ResamplerQuality::Fft, 44_100, 2).unwrap();
+    let silence = vec![0f32; 100];
+    stage.push(&[&silence, &silence], 0, 100);
+    stage.reset().unwrap();
+
+    assert_eq!(stage.rate(), 44_100);
+    assert_eq!(stage.flush(), None);
+  }
+}